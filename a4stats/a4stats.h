@@ -1,4 +1,21 @@
 #include "../dbapi2/dbapi2.h"
 
+#include <time.h>
+
+#define A4STATS_MAXFRAGMENTS 64 /* SET fragments per a4_update_user call without allocating */
+
 extern DBAPIConn *a4statsdb;
+extern unsigned long a4stats_updatesinflight;
+
+/* a4stats_db.c */
+void a4stats_update_lines(const char *channel, const unsigned int *hours);
+void a4stats_update_user(unsigned long channelid, const char *account, unsigned long accountid, const char *setclause);
+void a4stats_update_relation(unsigned long channelid, const char *first, unsigned long firstid, const char *second, unsigned long secondid, unsigned long score, time_t seen);
 
+/* a4stats_agg.c */
+void a4stats_agg_init(void);
+void a4stats_agg_fini(void);
+void a4stats_agg_flush(void);
+void a4stats_agg_addline(const char *channel, int hour);
+void a4stats_agg_updateuser(unsigned long channelid, const char *account, unsigned long accountid, int count, const char **fragments);
+void a4stats_agg_updaterelation(unsigned long channelid, const char *first, unsigned long firstid, const char *second, unsigned long secondid);
@@ -0,0 +1,667 @@
+/*
+ * a4stats aggregation layer
+ *
+ * The Lua script reports every line, user and relation event individually.
+ * Rather than issuing one or more queries per event we keep counters in
+ * memory and write them out every flushinterval seconds (or when the memory
+ * budget is exceeded) as one statement per channel, user and relation,
+ * wrapped in a transaction.
+ */
+
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include "../core/error.h"
+#include "../core/config.h"
+#include "../core/schedule.h"
+#include "../control/control.h"
+#include "../lib/array.h"
+#include "../lib/irc_string.h"
+#include "a4stats.h"
+
+#define A4STATS_AGG_HASHSIZE 4096
+#define A4STATS_AGG_COLUMNLEN 32
+#define A4STATS_AGG_MAXSETLEN 3072
+#define A4STATS_AGG_DEFAULT_INTERVAL "60"
+#define A4STATS_AGG_DEFAULT_MAXBYTES "4194304"
+
+typedef struct a4stats_aggchannel {
+  char *name;
+  unsigned int hours[24];
+  struct a4stats_aggchannel *next;
+} a4stats_aggchannel;
+
+typedef struct a4stats_aggcounter {
+  char column[A4STATS_AGG_COLUMNLEN];
+  long delta;
+} a4stats_aggcounter;
+
+typedef struct a4stats_aggassign {
+  char column[A4STATS_AGG_COLUMNLEN];
+  char *fragment;
+} a4stats_aggassign;
+
+typedef struct a4stats_agguser {
+  unsigned long channelid;
+  unsigned long accountid;
+  char *account;
+  array counters;
+  array assigns;
+  struct a4stats_agguser *next;
+} a4stats_agguser;
+
+typedef struct a4stats_aggrelation {
+  unsigned long channelid;
+  char *first;
+  unsigned long firstid;
+  char *second;
+  unsigned long secondid;
+  unsigned long score;
+  time_t seen;
+  struct a4stats_aggrelation *next;
+} a4stats_aggrelation;
+
+static a4stats_aggchannel *aggchannels[A4STATS_AGG_HASHSIZE];
+static a4stats_agguser *aggusers[A4STATS_AGG_HASHSIZE];
+static a4stats_aggrelation *aggrelations[A4STATS_AGG_HASHSIZE];
+
+static int aggflushinterval;
+static size_t aggmaxbytes;
+static int aggflushpending;
+
+static struct {
+  unsigned long channels;
+  unsigned long users;
+  unsigned long relations;
+  size_t bytes;
+} aggpending;
+
+static struct {
+  unsigned long events;
+  unsigned long statements;
+  unsigned long bypassed;
+  unsigned long flushes;
+  unsigned long budgetflushes;
+  unsigned long laststatements;
+  time_t lastflush;
+} aggstats;
+
+static void a4stats_agg_sched_flush(void *arg);
+
+static unsigned int a4stats_agg_userhash(unsigned long channelid, const char *account, unsigned long accountid) {
+  if (accountid)
+    return (channelid * 31 + accountid) % A4STATS_AGG_HASHSIZE;
+
+  return (channelid * 31 + irc_crc32(account)) % A4STATS_AGG_HASHSIZE;
+}
+
+static unsigned int a4stats_agg_relationhash(unsigned long channelid, const char *first, unsigned long firstid, const char *second, unsigned long secondid) {
+  return (channelid * 31 + irc_crc32(first) * 7 + irc_crc32(second) + firstid + secondid) % A4STATS_AGG_HASHSIZE;
+}
+
+static void a4stats_agg_checkbudget(void) {
+  if (aggpending.bytes < aggmaxbytes || aggflushpending)
+    return;
+
+  /* Don't flush from inside the script's call, it may have its own
+   * transaction open. */
+  aggflushpending = 1;
+  aggstats.budgetflushes++;
+  scheduleoneshot(time(NULL), a4stats_agg_sched_flush, NULL);
+}
+
+void a4stats_agg_addline(const char *channel, int hour) {
+  a4stats_aggchannel *ac;
+  unsigned int bucket = irc_crc32i(channel) % A4STATS_AGG_HASHSIZE;
+
+  aggstats.events++;
+
+  for (ac = aggchannels[bucket]; ac; ac = ac->next)
+    if (ircd_strcmp(ac->name, channel) == 0)
+      break;
+
+  if (!ac) {
+    ac = calloc(1, sizeof(a4stats_aggchannel));
+    ac->name = strdup(channel);
+    ac->next = aggchannels[bucket];
+    aggchannels[bucket] = ac;
+
+    aggpending.channels++;
+    aggpending.bytes += sizeof(a4stats_aggchannel) + strlen(channel) + 1;
+  }
+
+  ac->hours[hour]++;
+
+  a4stats_agg_checkbudget();
+}
+
+/* Parses "column = column + N" (or - N). */
+static int a4stats_agg_parsecounter(const char *fragment, char *column, long *delta) {
+  const char *pos = fragment, *start;
+  size_t len;
+  int negative = 0;
+
+  while (isspace(*pos))
+    pos++;
+
+  for (start = pos; isalnum(*pos) || *pos == '_'; pos++)
+    ;
+
+  len = pos - start;
+  if (len == 0 || len >= A4STATS_AGG_COLUMNLEN)
+    return 0;
+
+  memcpy(column, start, len);
+  column[len] = '\0';
+
+  while (isspace(*pos))
+    pos++;
+
+  if (*pos++ != '=')
+    return 0;
+
+  while (isspace(*pos))
+    pos++;
+
+  if (strncmp(pos, column, len) != 0 || isalnum(pos[len]) || pos[len] == '_')
+    return 0;
+
+  pos += len;
+
+  while (isspace(*pos))
+    pos++;
+
+  if (*pos == '-')
+    negative = 1;
+  else if (*pos != '+')
+    return 0;
+
+  pos++;
+
+  while (isspace(*pos))
+    pos++;
+
+  if (!isdigit(*pos))
+    return 0;
+
+  *delta = strtol(pos, (char **)&pos, 10);
+
+  while (isspace(*pos))
+    pos++;
+
+  if (*pos)
+    return 0;
+
+  if (negative)
+    *delta = -*delta;
+
+  return 1;
+}
+
+/* Parses "column = <literal>", where literal is a number, NULL or a quoted
+ * string. Only those can be collapsed into the most recent assignment. */
+static int a4stats_agg_parseassign(const char *fragment, char *column) {
+  const char *pos = fragment, *start;
+  size_t len;
+
+  while (isspace(*pos))
+    pos++;
+
+  for (start = pos; isalnum(*pos) || *pos == '_'; pos++)
+    ;
+
+  len = pos - start;
+  if (len == 0 || len >= A4STATS_AGG_COLUMNLEN)
+    return 0;
+
+  memcpy(column, start, len);
+  column[len] = '\0';
+
+  while (isspace(*pos))
+    pos++;
+
+  if (*pos++ != '=')
+    return 0;
+
+  while (isspace(*pos))
+    pos++;
+
+  if (strncmp(pos, "NULL", 4) == 0 || strncmp(pos, "null", 4) == 0) {
+    pos += 4;
+  } else if (*pos == '-' || isdigit(*pos)) {
+    for (pos++; isdigit(*pos); pos++)
+      ;
+  } else {
+    if (*pos == 'E' || *pos == 'e')
+      pos++;
+
+    if (*pos++ != '\'')
+      return 0;
+
+    for (;;) {
+      if (*pos == '\0')
+        return 0;
+
+      if (*pos == '\\' && pos[1]) {
+        pos += 2;
+      } else if (*pos == '\'') {
+        if (pos[1] != '\'')
+          break;
+        pos += 2;
+      } else
+        pos++;
+    }
+
+    pos++;
+  }
+
+  while (isspace(*pos))
+    pos++;
+
+  return *pos == '\0';
+}
+
+/* Adds delta to a queued "column = <literal>". A NULL stays NULL; strings
+ * can't be folded. */
+static int a4stats_agg_foldassign(a4stats_aggassign *assign, long delta) {
+  const char *pos = strchr(assign->fragment, '=') + 1;
+  char fragment[A4STATS_AGG_COLUMNLEN + 32];
+  long value;
+
+  while (isspace(*pos))
+    pos++;
+
+  if (strncmp(pos, "NULL", 4) == 0 || strncmp(pos, "null", 4) == 0)
+    return 1;
+
+  if (*pos != '-' && !isdigit(*pos))
+    return 0;
+
+  value = strtol(pos, NULL, 10);
+  snprintf(fragment, sizeof(fragment), "%s = %ld", assign->column, value + delta);
+
+  aggpending.bytes -= strlen(assign->fragment) + 1;
+  free(assign->fragment);
+  assign->fragment = strdup(fragment);
+  aggpending.bytes += strlen(assign->fragment) + 1;
+
+  return 1;
+}
+
+/* What finduser and updateuser charged to aggpending.bytes for this user. */
+static size_t a4stats_agg_userbytes(a4stats_agguser *au) {
+  a4stats_aggassign *assigns = au->assigns.content;
+  size_t bytes = sizeof(a4stats_agguser) + strlen(au->account) + 1;
+  int i;
+
+  bytes += au->counters.cursi * sizeof(a4stats_aggcounter);
+
+  for (i = 0; i < au->assigns.cursi; i++)
+    bytes += sizeof(a4stats_aggassign) + strlen(assigns[i].fragment) + 1;
+
+  return bytes;
+}
+
+static void a4stats_agg_freeuser(a4stats_agguser *au) {
+  int i;
+
+  for (i = 0; i < au->assigns.cursi; i++)
+    free(((a4stats_aggassign *)au->assigns.content)[i].fragment);
+
+  array_free(&au->counters);
+  array_free(&au->assigns);
+  free(au->account);
+  free(au);
+}
+
+static void a4stats_agg_flushuser(a4stats_agguser *au) {
+  char setclause[A4STATS_AGG_MAXSETLEN + 512];
+  a4stats_aggcounter *counters = au->counters.content;
+  a4stats_aggassign *assigns = au->assigns.content;
+  size_t len = 0;
+  int i;
+
+  setclause[0] = '\0';
+
+  for (i = 0; i < au->counters.cursi; i++) {
+    if (counters[i].delta == 0)
+      continue;
+
+    len += snprintf(setclause + len, sizeof(setclause) - len, "%s%s = %s %c %ld", len ? ", " : "",
+                    counters[i].column, counters[i].column, counters[i].delta < 0 ? '-' : '+',
+                    counters[i].delta < 0 ? -counters[i].delta : counters[i].delta);
+  }
+
+  for (i = 0; i < au->assigns.cursi; i++) {
+    if (len > 0 && len + strlen(assigns[i].fragment) + 2 > A4STATS_AGG_MAXSETLEN) {
+      a4stats_update_user(au->channelid, au->account, au->accountid, setclause);
+      aggstats.laststatements++;
+      len = 0;
+      setclause[0] = '\0';
+    }
+
+    len += snprintf(setclause + len, sizeof(setclause) - len, "%s%s", len ? ", " : "", assigns[i].fragment);
+  }
+
+  if (len > 0) {
+    a4stats_update_user(au->channelid, au->account, au->accountid, setclause);
+    aggstats.laststatements++;
+  }
+}
+
+static a4stats_agguser *a4stats_agg_finduser(unsigned long channelid, const char *account, unsigned long accountid, int create) {
+  a4stats_agguser *au;
+  unsigned int bucket = a4stats_agg_userhash(channelid, account, accountid);
+
+  for (au = aggusers[bucket]; au; au = au->next)
+    if (au->channelid == channelid && au->accountid == accountid && (accountid || strcmp(au->account, account) == 0))
+      return au;
+
+  if (!create)
+    return NULL;
+
+  au = malloc(sizeof(a4stats_agguser));
+  au->channelid = channelid;
+  au->accountid = accountid;
+  au->account = strdup(account);
+  array_init(&au->counters, sizeof(a4stats_aggcounter));
+  array_setlim1(&au->counters, 8);
+  array_setlim2(&au->counters, 8);
+  array_init(&au->assigns, sizeof(a4stats_aggassign));
+  array_setlim1(&au->assigns, 4);
+  array_setlim2(&au->assigns, 4);
+  au->next = aggusers[bucket];
+  aggusers[bucket] = au;
+
+  aggpending.users++;
+  aggpending.bytes += sizeof(a4stats_agguser) + strlen(account) + 1;
+
+  return au;
+}
+
+static void a4stats_agg_removeuser(a4stats_agguser *au) {
+  a4stats_agguser **pnext;
+
+  for (pnext = &aggusers[a4stats_agg_userhash(au->channelid, au->account, au->accountid)]; *pnext; pnext = &((*pnext)->next)) {
+    if (*pnext == au) {
+      *pnext = au->next;
+      break;
+    }
+  }
+
+  aggpending.users--;
+  aggpending.bytes -= a4stats_agg_userbytes(au);
+  a4stats_agg_freeuser(au);
+}
+
+void a4stats_agg_updateuser(unsigned long channelid, const char *account, unsigned long accountid, int count, const char **fragments) {
+  char column[A4STATS_AGG_COLUMNLEN], setclause[A4STATS_AGG_MAXSETLEN + 512];
+  a4stats_agguser *au;
+  a4stats_aggcounter *counter;
+  a4stats_aggassign *assign;
+  long delta;
+  int i, j, slot;
+  size_t len;
+
+  aggstats.events++;
+
+  for (i = 0; i < count; i++)
+    if (!a4stats_agg_parsecounter(fragments[i], column, &delta) && !a4stats_agg_parseassign(fragments[i], column))
+      break;
+
+  if (i < count) {
+    /* Something we can't merge (e.g. an expression referring to other
+     * columns): write out what we have for this user and run the update
+     * as-is so the order of updates is preserved. */
+    au = a4stats_agg_finduser(channelid, account, accountid, 0);
+    if (au) {
+      a4stats_agg_flushuser(au);
+      a4stats_agg_removeuser(au);
+    }
+
+    setclause[0] = '\0';
+    for (i = 0, len = 0; i < count; i++)
+      len += snprintf(setclause + len, sizeof(setclause) - len, "%s%s", i ? ", " : "", fragments[i]);
+
+    a4stats_update_user(channelid, account, accountid, setclause);
+    aggstats.bypassed++;
+    return;
+  }
+
+  au = a4stats_agg_finduser(channelid, account, accountid, 1);
+
+  for (i = 0; i < count; i++) {
+    if (a4stats_agg_parsecounter(fragments[i], column, &delta)) {
+      /* "x = 5" then "x = x + 1" is "x = 6"; SET can't name x twice */
+      assign = au->assigns.content;
+
+      for (j = 0; j < au->assigns.cursi; j++)
+        if (strcmp(assign[j].column, column) == 0)
+          break;
+
+      if (j < au->assigns.cursi) {
+        if (a4stats_agg_foldassign(&assign[j], delta))
+          continue;
+
+        /* the assignment has to happen first */
+        a4stats_agg_flushuser(au);
+        a4stats_agg_removeuser(au);
+        au = a4stats_agg_finduser(channelid, account, accountid, 1);
+      }
+
+      counter = au->counters.content;
+
+      for (j = 0; j < au->counters.cursi; j++)
+        if (strcmp(counter[j].column, column) == 0)
+          break;
+
+      if (j == au->counters.cursi) {
+        slot = array_getfreeslot(&au->counters);
+        counter = &((a4stats_aggcounter *)au->counters.content)[slot];
+        strcpy(counter->column, column);
+        counter->delta = 0;
+        aggpending.bytes += sizeof(a4stats_aggcounter);
+      } else
+        counter = &counter[j];
+
+      counter->delta += delta;
+    } else {
+      a4stats_agg_parseassign(fragments[i], column);
+
+      /* an assignment replaces whatever the counter would have added */
+      counter = au->counters.content;
+
+      for (j = 0; j < au->counters.cursi; j++) {
+        if (strcmp(counter[j].column, column) == 0) {
+          array_delslot(&au->counters, j);
+          aggpending.bytes -= sizeof(a4stats_aggcounter);
+          break;
+        }
+      }
+
+      assign = au->assigns.content;
+
+      for (j = 0; j < au->assigns.cursi; j++)
+        if (strcmp(assign[j].column, column) == 0)
+          break;
+
+      if (j == au->assigns.cursi) {
+        slot = array_getfreeslot(&au->assigns);
+        assign = &((a4stats_aggassign *)au->assigns.content)[slot];
+        strcpy(assign->column, column);
+        aggpending.bytes += sizeof(a4stats_aggassign);
+      } else {
+        assign = &assign[j];
+        aggpending.bytes -= strlen(assign->fragment) + 1;
+        free(assign->fragment);
+      }
+
+      assign->fragment = strdup(fragments[i]);
+      aggpending.bytes += strlen(assign->fragment) + 1;
+    }
+  }
+
+  a4stats_agg_checkbudget();
+}
+
+void a4stats_agg_updaterelation(unsigned long channelid, const char *first, unsigned long firstid, const char *second, unsigned long secondid) {
+  a4stats_aggrelation *ar;
+  unsigned int bucket = a4stats_agg_relationhash(channelid, first, firstid, second, secondid);
+
+  aggstats.events++;
+
+  for (ar = aggrelations[bucket]; ar; ar = ar->next)
+    if (ar->channelid == channelid && ar->firstid == firstid && ar->secondid == secondid &&
+        strcmp(ar->first, first) == 0 && strcmp(ar->second, second) == 0)
+      break;
+
+  if (!ar) {
+    ar = malloc(sizeof(a4stats_aggrelation));
+    ar->channelid = channelid;
+    ar->first = strdup(first);
+    ar->firstid = firstid;
+    ar->second = strdup(second);
+    ar->secondid = secondid;
+    ar->score = 0;
+    ar->next = aggrelations[bucket];
+    aggrelations[bucket] = ar;
+
+    aggpending.relations++;
+    aggpending.bytes += sizeof(a4stats_aggrelation) + strlen(first) + strlen(second) + 2;
+  }
+
+  ar->score++;
+  ar->seen = time(NULL);
+
+  a4stats_agg_checkbudget();
+}
+
+void a4stats_agg_flush(void) {
+  a4stats_aggchannel *ac, *nac;
+  a4stats_agguser *au, *nau;
+  a4stats_aggrelation *ar, *nar;
+  int i;
+
+  aggflushpending = 0;
+
+  if (!aggpending.channels && !aggpending.users && !aggpending.relations)
+    return;
+
+  if (!a4statsdb) {
+    Error("a4stats", ERR_WARNING, "Discarding %lu pending channel, %lu user and %lu relation updates: no database.",
+          aggpending.channels, aggpending.users, aggpending.relations);
+  } else {
+    aggstats.laststatements = 0;
+    a4statsdb->query(a4statsdb, NULL, NULL, "BEGIN TRANSACTION", "");
+  }
+
+  for (i = 0; i < A4STATS_AGG_HASHSIZE; i++) {
+    for (ac = aggchannels[i]; ac; ac = nac) {
+      nac = ac->next;
+
+      if (a4statsdb) {
+        a4stats_update_lines(ac->name, ac->hours);
+        aggstats.laststatements++;
+      }
+
+      free(ac->name);
+      free(ac);
+    }
+
+    aggchannels[i] = NULL;
+
+    for (au = aggusers[i]; au; au = nau) {
+      nau = au->next;
+
+      if (a4statsdb)
+        a4stats_agg_flushuser(au);
+
+      a4stats_agg_freeuser(au);
+    }
+
+    aggusers[i] = NULL;
+
+    for (ar = aggrelations[i]; ar; ar = nar) {
+      nar = ar->next;
+
+      if (a4statsdb) {
+        a4stats_update_relation(ar->channelid, ar->first, ar->firstid, ar->second, ar->secondid, ar->score, ar->seen);
+        aggstats.laststatements++;
+      }
+
+      free(ar->first);
+      free(ar->second);
+      free(ar);
+    }
+
+    aggrelations[i] = NULL;
+  }
+
+  if (a4statsdb) {
+    a4statsdb->query(a4statsdb, NULL, NULL, "COMMIT TRANSACTION", "");
+    aggstats.statements += aggstats.laststatements;
+  }
+
+  memset(&aggpending, 0, sizeof(aggpending));
+
+  aggstats.flushes++;
+  aggstats.lastflush = time(NULL);
+}
+
+static void a4stats_agg_sched_flush(void *arg) {
+  a4stats_agg_flush();
+}
+
+static int a4stats_agg_cmdstats(void *source, int cargc, char **cargv) {
+  nick *sender = source;
+
+  if (cargc > 0 && strcmp(cargv[0], "flush") == 0) {
+    a4stats_agg_flush();
+    controlreply(sender, "Flushed.");
+  }
+
+  controlreply(sender, "Pending       : %lu channels, %lu users, %lu relations (%lu/%lu bytes)",
+               aggpending.channels, aggpending.users, aggpending.relations,
+               (unsigned long)aggpending.bytes, (unsigned long)aggmaxbytes);
+  controlreply(sender, "Events        : %lu aggregated, %lu passed through", aggstats.events - aggstats.bypassed, aggstats.bypassed);
+  controlreply(sender, "Flushes       : %lu (%lu over budget), every %d seconds", aggstats.flushes, aggstats.budgetflushes, aggflushinterval);
+  controlreply(sender, "Statements    : %lu total, %lu in last flush", aggstats.statements, aggstats.laststatements);
+  controlreply(sender, "Updates queued: %lu", a4stats_updatesinflight);
+
+  if (aggstats.lastflush)
+    controlreply(sender, "Last flush    : %ld seconds ago", (long)(time(NULL) - aggstats.lastflush));
+
+  controlreply(sender, "Done.");
+
+  return CMD_OK;
+}
+
+void a4stats_agg_init(void) {
+  sstring *temp;
+
+  temp = getcopyconfigitem("a4stats", "flushinterval", A4STATS_AGG_DEFAULT_INTERVAL, 10);
+  aggflushinterval = atoi(temp->content);
+  freesstring(temp);
+
+  if (aggflushinterval < 1)
+    aggflushinterval = atoi(A4STATS_AGG_DEFAULT_INTERVAL);
+
+  temp = getcopyconfigitem("a4stats", "maxpendingbytes", A4STATS_AGG_DEFAULT_MAXBYTES, 20);
+  aggmaxbytes = strtoul(temp->content, NULL, 10);
+  freesstring(temp);
+
+  schedulerecurring(time(NULL) + aggflushinterval, 0, aggflushinterval, a4stats_agg_sched_flush, NULL);
+
+  registercontrolhelpcmd("a4statsqueue", NO_DEVELOPER, 1, &a4stats_agg_cmdstats,
+    "Usage: a4statsqueue ?flush?\nShows the a4stats aggregation backlog, optionally flushing it first.");
+}
+
+void a4stats_agg_fini(void) {
+  deregistercontrolcmd("a4statsqueue", &a4stats_agg_cmdstats);
+  deleteallschedules(a4stats_agg_sched_flush);
+
+  a4stats_agg_flush();
+}
@@ -1,4 +1,7 @@
+#define _POSIX_C_SOURCE 200809L
+
 #include <stdio.h>
+#include <string.h>
 #include <stdarg.h>
 #include "../lib/version.h"
 #include "../dbapi2/dbapi2.h"
@@ -8,6 +11,7 @@
 #include "../control/control.h"
 #include "../irc/irc.h"
 #include "../lua/lua.h"
+#include "a4stats.h"
 
 #define CLEANUP_KEEP 10 /* keep this many topics and kicks per channel around */
 #define CLEANUP_INTERVAL 86400 /* db cleanup interval (in seconds) */
@@ -162,6 +166,8 @@ typedef struct user_update_info {
   unsigned long accountid;
 } user_update_info;
 
+unsigned long a4stats_updatesinflight;
+
 static void a4stats_update_user_cb(const struct DBAPIResult *result, void *uarg) {
   user_update_info *uui = uarg;
 
@@ -177,6 +183,7 @@ static void a4stats_update_user_cb(const struct DBAPIResult *result, void *uarg)
       free(uui->update);
       free(uui->account);
       free(uui);
+      a4stats_updatesinflight--;
       goto a4_uuc_return;
     }
 
@@ -188,12 +195,28 @@ a4_uuc_return:
     result->clear(result);
 }
 
+void a4stats_update_user(unsigned long channelid, const char *account, unsigned long accountid, const char *setclause) {
+  char query[4096];
+  user_update_info *uui;
+
+  snprintf(query, sizeof(query), "UPDATE ? SET %s WHERE channelid = ? AND (accountid != 0 AND accountid = ? OR accountid = 0 AND account = ?)", setclause);
+
+  uui = malloc(sizeof(*uui));
+  uui->stage = 0;
+  uui->update = strdup(query);
+  uui->channelid = channelid;
+  uui->account = strdup(account);
+  uui->accountid = accountid;
+
+  a4stats_updatesinflight++;
+  a4stats_update_user_cb(NULL, uui);
+}
+
 static int a4stats_lua_update_user(lua_State *ps) {
   const char *account;
   unsigned long channelid, accountid;
-  char query[4096];
-  int first = 1;
-  user_update_info *uui;
+  const char *stackfragments[A4STATS_MAXFRAGMENTS], **fragments = stackfragments, **grown;
+  int count = 0, size = A4STATS_MAXFRAGMENTS;
 
   if (!lua_isnumber(ps, 1) || !lua_isstring(ps, 2) || !lua_isnumber(ps, 3))
     LUA_RETURN(ps, LUA_FAIL);
@@ -202,36 +225,39 @@ static int a4stats_lua_update_user(lua_State *ps) {
   account = lua_tostring(ps, 2);
   accountid = lua_tonumber(ps, 3);
 
-  strcpy(query, "UPDATE ? SET ");
-
   lua_pushvalue(ps, 4);
   lua_pushnil(ps);
 
+  /* the strings stay referenced by the table until we pop it */
   while (lua_next(ps, -2)) {
-    const char *value = lua_tostring(ps, -1);
+    if (count == size) {
+      grown = malloc(size * 2 * sizeof(const char *));
+      if (!grown) {
+        if (fragments != stackfragments)
+          free(fragments);
+        lua_pop(ps, 3);
+        LUA_RETURN(ps, LUA_FAIL);
+      }
 
-    if (first)
-      first = 0;
-    else
-      strcat(query, ", ");
+      memcpy(grown, fragments, size * sizeof(const char *));
+      if (fragments != stackfragments)
+        free(fragments);
+      fragments = grown;
+      size *= 2;
+    }
 
-    strcat(query, value);
+    fragments[count++] = lua_tostring(ps, -1);
 
     lua_pop(ps, 1);
   }
 
-  lua_pop(ps, 1);
-
-  strcat(query, " WHERE channelid = ? AND (accountid != 0 AND accountid = ? OR accountid = 0 AND account = ?)");
+  if (count > 0)
+    a4stats_agg_updateuser(channelid, account, accountid, count, fragments);
 
-  uui = malloc(sizeof(*uui));
-  uui->stage = 0;
-  uui->update = strdup(query);
-  uui->channelid = channelid;
-  uui->account = strdup(account);
-  uui->accountid = accountid;
+  if (fragments != stackfragments)
+    free(fragments);
 
-  a4stats_update_user_cb(NULL, uui);
+  lua_pop(ps, 1);
 
   LUA_RETURN(ps, LUA_OK);
 }
@@ -239,6 +265,8 @@ static int a4stats_lua_update_user(lua_State *ps) {
 typedef struct relation_update_info {
   int stage;
   unsigned long channelid;
+  unsigned long score;
+  time_t seen;
   char *first;
   unsigned long firstid;
   char *second;
@@ -251,13 +279,13 @@ static void a4stats_update_relation_cb(const struct DBAPIResult *result, void *u
   rui->stage++;
 
   if (rui->stage == 1) {
-    a4statsdb->query(a4statsdb, a4stats_update_relation_cb, rui, "UPDATE ? SET score = score + 1, seen = ? "
+    a4statsdb->query(a4statsdb, a4stats_update_relation_cb, rui, "UPDATE ? SET score = score + ?, seen = ? "
       "WHERE channelid = ? AND first = ? AND firstid = ? AND second = ? AND secondid = ?",
-      "TtUsUsU", "relations", time(NULL), rui->channelid, rui->first, rui->firstid, rui->second, rui->secondid);
+      "TUtUsUsU", "relations", rui->score, rui->seen, rui->channelid, rui->first, rui->firstid, rui->second, rui->secondid);
     goto a4_urc_return;
   } else if (rui->stage == 2 && result && result->affected == 0) {
-    a4statsdb->query(a4statsdb, a4stats_update_relation_cb, rui, "INSERT INTO ? (channelid, first, firstid, second, secondid, seen) VALUES (?, ?, ?, ?, ?, ?)",
-      "TUsUsUt", "relations", rui->channelid, rui->first, rui->firstid, rui->second, rui->secondid, time(NULL));
+    a4statsdb->query(a4statsdb, a4stats_update_relation_cb, rui, "INSERT INTO ? (channelid, first, firstid, second, secondid, seen, score) VALUES (?, ?, ?, ?, ?, ?, ?)",
+      "TUsUsUtU", "relations", rui->channelid, rui->first, rui->firstid, rui->second, rui->secondid, rui->seen, rui->score);
     goto a4_urc_return;
   }
 
@@ -267,16 +295,33 @@ static void a4stats_update_relation_cb(const struct DBAPIResult *result, void *u
   free(rui->first);
   free(rui->second);
   free(rui);
+  a4stats_updatesinflight--;
 
 a4_urc_return:
   if (result)
     result->clear(result);
 }
 
+void a4stats_update_relation(unsigned long channelid, const char *first, unsigned long firstid, const char *second, unsigned long secondid, unsigned long score, time_t seen) {
+  relation_update_info *rui;
+
+  rui = malloc(sizeof(*rui));
+  rui->stage = 0;
+  rui->channelid = channelid;
+  rui->score = score;
+  rui->seen = seen;
+  rui->first = strdup(first);
+  rui->firstid = firstid;
+  rui->second = strdup(second);
+  rui->secondid = secondid;
+
+  a4stats_updatesinflight++;
+  a4stats_update_relation_cb(NULL, rui);
+}
+
 static int a4stats_lua_update_relation(lua_State *ps) {
   const char *user1, *user2;
   unsigned long channelid, user1id, user2id;
-  relation_update_info *rui;
 
   if (!lua_isnumber(ps, 1) || !lua_isstring(ps, 2) || !lua_isnumber(ps, 3) || !lua_isstring(ps, 4) || !lua_isnumber(ps, 5))
     LUA_RETURN(ps, LUA_FAIL);
@@ -287,29 +332,38 @@ static int a4stats_lua_update_relation(lua_State *ps) {
   user2 = lua_tostring(ps, 4);
   user2id = lua_tonumber(ps, 5);
 
-  rui = malloc(sizeof(*rui));
-  rui->stage = 0;
-  rui->channelid = channelid;
+  if (user1id < user2id || (user1id == user2id && strcmp(user1, user2) <= 0))
+    a4stats_agg_updaterelation(channelid, user1, user1id, user2, user2id);
+  else
+    a4stats_agg_updaterelation(channelid, user2, user2id, user1, user1id);
+
+  LUA_RETURN(ps, LUA_OK);
+}
+
+void a4stats_update_lines(const char *channel, const unsigned int *hours) {
+  char query[1024];
+  int hour, first = 1;
+  size_t len;
+
+  len = snprintf(query, sizeof(query), "UPDATE ? SET ");
+
+  for (hour = 0; hour < 24; hour++) {
+    if (!hours[hour])
+      continue;
 
-  if (user1id < user2id || (user1id == user2id && strcmp(user1, user2) <= 0)) {
-    rui->first = strdup(user1);
-    rui->firstid = user1id;
-    rui->second = strdup(user2);
-    rui->secondid = user2id;
-  } else {
-    rui->first = strdup(user2);
-    rui->firstid = user2id;
-    rui->second = strdup(user1);
-    rui->secondid = user1id;
+    len += snprintf(query + len, sizeof(query) - len, "%sh%d = h%d + %u", first ? "" : ", ", hour, hour, hours[hour]);
+    first = 0;
   }
 
-  a4stats_update_relation_cb(NULL, rui);
+  if (first)
+    return;
 
-  LUA_RETURN(ps, LUA_OK);
+  snprintf(query + len, sizeof(query) - len, " WHERE " A4STATS_DB_EQ_NOCASE("name", "?"));
+
+  a4statsdb->squery(a4statsdb, query, "Ts", "channels", channel);
 }
 
 static int a4stats_lua_add_line(lua_State *ps) {
-  char query[256];
   const char *channel;
   int hour;
 
@@ -319,9 +373,10 @@ static int a4stats_lua_add_line(lua_State *ps) {
   channel = lua_tostring(ps, 1);
   hour = lua_tonumber(ps, 2);
 
-  snprintf(query, sizeof(query), "UPDATE ? SET h%d = h%d + 1 WHERE " A4STATS_DB_EQ_NOCASE("name", "?"), hour, hour);
+  if (hour < 0 || hour > 23)
+    LUA_RETURN(ps, LUA_FAIL);
 
-  a4statsdb->squery(a4statsdb, query, "Ts", "channels", channel);
+  a4stats_agg_addline(channel, hour);
 
   LUA_RETURN(ps, LUA_OK);
 }
@@ -583,6 +638,7 @@ void _init(void) {
   void *args[2];
 
   a4stats_connectdb();
+  a4stats_agg_init();
 
   registerhook(HOOK_LUA_LOADSCRIPT, a4stats_hook_loadscript);
   registerhook(HOOK_LUA_UNLOADSCRIPT, a4stats_hook_unloadscript);
@@ -599,6 +655,7 @@ void _fini(void) {
   lua_list *l;
 
   deleteschedule(NULL, a4stats_cleanupdb, NULL);
+  a4stats_agg_fini();
   a4stats_closedb();
 
   for (l = lua_head; l;l = l->next) {
@@ -0,0 +1,58 @@
+## AUTOMATICALLY GENERATED -- EDIT build.mk.in INSTEAD
+
+ifndef INCPATH
+INCPATH=../
+endif
+
+CONFIGURED=1
+CFLAGS=
+LEX=flex
+MFLAGS=
+
+ifeq (${HOOKS_NEW},1)
+HOOK_ENGINE=new
+else
+HOOK_ENGINE=old
+endif
+
+ifndef BUILDID
+BUILDID := "$(shell (git describe --long --dirty --all --abbrev=10 || echo "unknown"))"
+endif
+MFLAGS+=BUILDID='${BUILDID}'
+
+default: all
+
+.SUFFIXES: .so .y .l
+
+-include $(wildcard .deps/*.d)
+
+.c.o:
+	@if [ ! -d .deps ]; then mkdir .deps || true; fi
+	$(CC) $(CFLAGS) -MMD -MF .deps/$(subst .o,.d,$@) -fPIC -c -o $@ $<
+
+.o.so:
+	$(CC) -nostartfiles -Wl,--export-dynamic -shared -o $@ $^ $(LDFLAGS)
+
+.y.c:	;
+
+.l.c:	;
+
+CFLAGS+=-I. -I.. -DBUILDID='${BUILDID}'
+CFLAGS+=-Wall -g -finline-functions -funroll-loops -Werror=format-security
+EXECFLAGS=
+
+ifndef NOC99
+CFLAGS+=-std=c99
+endif
+LIBDL=-ldl
+CFLAGS+=-Wno-format-y2k
+LIBPGSQL=-L/usr/lib/x86_64-linux-gnu -lpq
+INCPGSQL=-I/usr/include/postgresql
+LIBZ=-L/usr/lib/x86_64-linux-gnu -lz
+INCZ=-I/usr/include
+LIBDBAPI=$(LIBPGSQL)
+INCDBAPI=$(INCPGSQL)
+XSB_ENGINE=pre
+EVENT_ENGINE=poll
+DIRS=lib core irc parser server nick miscreply testmod channel localuser control proxyscan nickrate chanstats carrot horse tutorbot fsck pqsql geoip clonehistogram versionscan chanfix settime helpmod2 splitlist qabot lameisp chandump authext chanindex bans chanprofile ticketauth nsmstats patricia sqlite usercount patricianick patriciasearch xsb authdump dbapi2 auth trusts clonearmy glines fakeq numerictracker signontracker invalidbans whowas jupe fakeusers raw nickwatch patrol facepalm rbl snapshot replay
+WORKSPACES=.
@@ -12,6 +12,7 @@
 #include "../core/nsmalloc.h"
 
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 
 MODULE_VERSION("");
@@ -56,10 +57,13 @@ void _init() {
   /* Set up our hooks */
   registerhook(HOOK_NICK_NEWNICK,&addordelnick);
   registerhook(HOOK_NICK_LOSTNICK,&addordelnick);
+  registerhook(HOOK_NICK_LOSTBATCH,&dellostnicks);
   registerhook(HOOK_CORE_STATSREQUEST,&channelstats);
   registerhook(HOOK_IRC_SENDBURSTBURSTS,&sendchanburst);
   registerhook(HOOK_NICK_WHOISCHANNELS,&handlewhoischannels);
   
+  registerbatchflush(&channel_flushburst);
+
   registerserverhandler("B",&handleburstmsg,7);
   registerserverhandler("J",&handlejoinmsg,2);
   registerserverhandler("C",&handlecreatemsg,2);
@@ -77,6 +81,8 @@ void _fini() {
   struct chanindex *cip, *ncip;
   nick *np;
 
+  deregisterbatchflush(&channel_flushburst);
+
   deregisterserverhandler("B",&handleburstmsg);
   deregisterserverhandler("J",&handlejoinmsg);
   deregisterserverhandler("C",&handlecreatemsg);
@@ -89,6 +95,7 @@ void _fini() {
   
   deregisterhook(HOOK_NICK_NEWNICK,&addordelnick);
   deregisterhook(HOOK_NICK_LOSTNICK,&addordelnick);
+  deregisterhook(HOOK_NICK_LOSTBATCH,&dellostnicks);
   deregisterhook(HOOK_CORE_STATSREQUEST,&channelstats);
   deregisterhook(HOOK_IRC_SENDBURSTBURSTS,&sendchanburst);
   deregisterhook(HOOK_NICK_WHOISCHANNELS,&handlewhoischannels);
@@ -173,6 +180,7 @@ void delnickfromchannel(channel *cp, long numeric, int updateuser) {
     *lp=nouser;
     if (--cp->users->totalusers==0) {
       /* We're deleting the channel; flag it here */
+      channel_burstlost(cp);
       triggerhook(HOOK_CHANNEL_LOSTCHANNEL,cp);
       delchannel(cp);
     }    
@@ -313,11 +321,16 @@ void addordelnick(int hooknum, void *arg) {
     case HOOK_NICK_NEWNICK:
       np->channels=(array *)malloc(sizeof(array));
       array_init(np->channels,sizeof(channel **));
-      array_setlim1(np->channels,10);
-      array_setlim2(np->channels,15);
+      array_setlim1(np->channels,4);
+      array_setlim2(np->channels,4);
+      array_setinline(np->channels);
+      array_setpooled(np->channels);
       break;
       
     case HOOK_NICK_LOSTNICK:
+      if (nicksplitting)
+        break; /* already done with the batch */
+
       ch=(channel **)(np->channels->content);
       for(i=0;i<np->channels->cursi;i++) {
         delnickfromchannel(ch[i],np->numeric,0);
@@ -328,6 +341,91 @@ void addordelnick(int hooknum, void *arg) {
   }
 }
 
+typedef struct lostmember {
+  channel *cp;
+  nick *np;
+} lostmember;
+
+static int comparelostmember(const void *a, const void *b) {
+  const lostmember *ma=a, *mb=b;
+
+  if (ma->cp==mb->cp)
+    return 0;
+
+  return ((unsigned long)ma->cp<(unsigned long)mb->cp)?-1:1;
+}
+
+/*
+ * A server's users are leaving all at once: take them out a channel at a
+ * time rather than a user at a time, so a channel emptied by the split is
+ * only deleted once everyone has gone, then drop their channel arrays.
+ */
+
+void dellostnicks(int hooknum, void *arg) {
+  nickbatch *batch=(nickbatch *)arg;
+  lostmember *members;
+  unsigned long *lp;
+  channel **ch, *cp;
+  void *args[2];
+  nick *np;
+  int i, j, count=0;
+
+  for (i=0;i<batch->count;i++)
+    if (batch->nicks[i])
+      count+=batch->nicks[i]->channels->cursi;
+
+  if (count && !(members=(lostmember *)malloc(count*sizeof(lostmember)))) {
+    /* do it the slow way */
+    for (i=0;i<batch->count;i++)
+      if (batch->nicks[i])
+        addordelnick(HOOK_NICK_LOSTNICK,batch->nicks[i]);
+    return;
+  }
+
+  for (i=count=0;i<batch->count;i++) {
+    if (!(np=batch->nicks[i]))
+      continue;
+
+    ch=(channel **)(np->channels->content);
+    for (j=0;j<np->channels->cursi;j++) {
+      members[count].cp=ch[j];
+      members[count++].np=np;
+    }
+
+    array_free(np->channels);
+    free(np->channels);
+    np->channels=NULL;
+  }
+
+  if (!count)
+    return;
+
+  qsort(members,count,sizeof(lostmember),comparelostmember);
+
+  for (i=0;i<count;i=j) {
+    cp=members[i].cp;
+    args[0]=(void *)cp;
+
+    for (j=i;j<count && members[j].cp==cp;j++) {
+      if ((lp=getnumerichandlefromchanhash(cp->users,members[j].np->numeric))==NULL)
+        continue;
+
+      args[1]=(void *)members[j].np;
+      triggerhook(HOOK_CHANNEL_LOSTNICK,args);
+      *lp=nouser;
+      cp->users->totalusers--;
+    }
+
+    if (cp->users->totalusers==0) {
+      channel_burstlost(cp);
+      triggerhook(HOOK_CHANNEL_LOSTCHANNEL,cp);
+      delchannel(cp);
+    }
+  }
+
+  free(members);
+}
+
 /*
  * Spam our local burst on connect..
  */
@@ -124,6 +124,23 @@ typedef struct channel {
   chanuserhash   *users;
 } channel;
 
+/* As with nicks (see nick.h), channels from a bursting server are handed
+ * out in batches: HOOK_CHANNEL_BURSTBATCH with the whole batch, then the
+ * usual NEWCHANNEL/BURST hooks for each entry with chanburstreplay set, and
+ * the same rules apply to the batch hook.
+ * There's an entry per B line, so a channel split over several lines
+ * appears more than once; isnew is set on its first.  Channels which go
+ * away while the batch is being handed out are replaced by NULL. */
+#define CHANBURSTBATCH 1024
+
+typedef struct chanbatch {
+  channel **channels;
+  char *isnew;
+  int count;
+} chanbatch;
+
+extern int chanburstreplay;
+
 extern unsigned long nouser;
 extern const flag cmodeflags[];
 
@@ -136,6 +153,7 @@ channel *findchannel(char *name);
 void addchanneltohash(channel *cp);
 void removechannelfromhash(channel *cp);
 void addordelnick(int hooknum, void *arg);
+void dellostnicks(int hooknum, void *arg);
 void onconnect(int hooknum, void *arg);
 unsigned int countuniquehosts(channel *cp);
 void clean_key(char *s);
@@ -150,6 +168,8 @@ int handletopicmsg(void *source, int cargc, char **cargv);
 int handlemodemsg(void *source, int cargc, char **cargv);
 int handleclearmodemsg(void *source, int cargc, char **cargv);
 void handlewhoischannels(int hooknum, void *arg);
+void channel_flushburst(void);
+void channel_burstlost(channel *cp);
 
 /* functions from chanuserhash.c */
 void rehashchannel(channel *cp);
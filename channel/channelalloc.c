@@ -3,12 +3,42 @@
 #include "channel.h"
 #include "../core/nsmalloc.h"
 
+/* Channels come from slabs, as nicks do; a free channel's first word
+ * links it into the free list. */
+#define CHANSLAB 512
+
+typedef union freechannel {
+  channel chan;
+  union freechannel *next;
+} freechannel;
+
+static freechannel *freechans;
+
 channel *newchan() {
-  return nsmalloc(POOL_CHANNEL, sizeof(channel));
+  freechannel *fcp;
+  int i;
+
+  if (!freechans) {
+    fcp=nsmalloc(POOL_CHANNEL, CHANSLAB * sizeof(freechannel));
+    if (!fcp)
+      return NULL;
+
+    for (i=0;i<CHANSLAB;i++) {
+      fcp[i].next=freechans;
+      freechans=&fcp[i];
+    }
+  }
+
+  fcp=freechans;
+  freechans=fcp->next;
+  return &fcp->chan;
 }
 
 void freechan(channel *cp) {
-  nsfree(POOL_CHANNEL, cp);
+  freechannel *fcp=(freechannel *)cp;
+
+  fcp->next=freechans;
+  freechans=fcp;
 }
 
 chanuserhash *newchanuserhash(int hashsize) {
@@ -13,6 +13,69 @@
 #include "../lib/base64.h"
 #include "../lib/strlfunc.h"
 
+static channel *burstchans[CHANBURSTBATCH];
+static char burstnew[CHANBURSTBATCH];
+static int burstcount, burstflushing;
+int chanburstreplay;
+
+void channel_flushburst(void) {
+  chanbatch batch;
+  int i;
+
+  if (!burstcount || burstflushing)
+    return;
+
+  burstflushing=1;
+
+  batch.channels=burstchans;
+  batch.isnew=burstnew;
+  batch.count=burstcount;
+  triggerhook(HOOK_CHANNEL_BURSTBATCH,&batch);
+
+  chanburstreplay=1;
+  for (i=0;i<burstcount;i++) {
+    if (!burstchans[i])
+      continue;
+    if (burstnew[i])
+      triggerhook(HOOK_CHANNEL_NEWCHANNEL,burstchans[i]);
+    /* the NEWCHANNEL hooks might have emptied it */
+    if (burstchans[i])
+      triggerhook(HOOK_CHANNEL_BURST,burstchans[i]);
+  }
+  chanburstreplay=0;
+
+  burstcount=0;
+  burstflushing=0;
+}
+
+/* Called before a channel is lost: outside of a flush the batch is handed
+ * out first, during one the channel's entries are blanked. */
+void channel_burstlost(channel *cp) {
+  int i;
+
+  if (!burstcount)
+    return;
+
+  if (!burstflushing) {
+    channel_flushburst();
+    return;
+  }
+
+  for (i=0;i<burstcount;i++)
+    if (burstchans[i]==cp)
+      burstchans[i]=NULL;
+}
+
+static void burstchannel(channel *cp, int isnew) {
+  burstchans[burstcount]=cp;
+  burstnew[burstcount]=isnew;
+  burstcount++;
+  irc_deferbatch();
+
+  if (burstcount==CHANBURSTBATCH)
+    channel_flushburst();
+}
+
 int handleburstmsg(void *source, int cargc, char **cargv) {
   channel *cp;
   time_t timestamp;
@@ -191,12 +254,23 @@ int handleburstmsg(void *source, int cargc, char **cargv) {
   if (cp->users->totalusers==0) {
     /* Oh dear, the channel is now empty.  Perhaps one of those 
      * charming empty burst messages you get sometimes.. */
+    if (!isnewchan && burstcount) {
+      /* it may still be waiting to be announced; whatever the hooks do
+       * to it, it's still empty afterwards if it's there at all */
+      channel_flushburst();
+      if ((cp=findchannel(cargv[0]))==NULL)
+        return CMD_OK;
+    }
     if (!isnewchan) {
       /* I really don't think this can happen, can it..? */
       /* Only send the LOSTCHANNEL if the channel existed before */
       triggerhook(HOOK_CHANNEL_LOSTCHANNEL,cp);
     }
     delchannel(cp);
+  } else if (serverlist[numerictolong(source,2)].linkstate==LS_LINKING ||
+             serverlist[numerictolong(source,2)].linkstate==LS_PLINKING) {
+    /* Part of a burst: the hooks go out with the rest of the batch */
+    burstchannel(cp,isnewchan);
   } else {
     /* If this is a new channel, we do the NEWCHANNEL hook also */
     if (isnewchan) {
@@ -262,7 +336,6 @@ int handlejoinmsg(void *source, int cargc, char **cargv) {
         delnickfromchannel(ch[i],np->numeric,0);
       }
       array_free(np->channels);
-      array_init(np->channels,sizeof(channel *));
     } else {
       /* It's an actual channel join */
       newchan=0;
@@ -1,2 +1,2 @@
-CFLAGS+=$(INCDBAPI) $(INCPCRE)
-LDFLAGS+=$(LIBDBAPI) $(LIBPCRE)
+CFLAGS+=$(INCDBAPI) $(INCPCRE) $(INCZ)
+LDFLAGS+=$(LIBDBAPI) $(LIBPCRE) $(LIBZ)
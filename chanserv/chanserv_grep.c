@@ -1,51 +1,88 @@
+#define _POSIX_C_SOURCE 200809L
 
 #include "chanserv.h"
+#include "chanservlogstore.h"
 #include "../core/events.h"
+#include "../core/error.h"
 #include "../lib/irc_string.h"
 #include <pcre.h>
 #include <sys/poll.h>
 #include <sys/types.h>
-#include <sys/stat.h>
-#include <fcntl.h>
+#include <sys/wait.h>
+#include <signal.h>
+#include <errno.h>
 #include <unistd.h>
 #include <string.h>
 #include <stdio.h>
-#include <unistd.h>
+#include <stdlib.h>
 #include "../lib/version.h"
 
 MODULE_VERSION(QVERSION)
 
-#define CSG_BUFSIZE    1024
-#define CSG_MAXSTARTPOINT    30
-
-pcre           *csg_curpat;        /* Compiled pattern from pcre */
-int             csg_curfile;       /* Which logfile is being searched */
-unsigned long   csg_curnum;        /* What numeric is doing a search */
-int             csg_matches;       /* How many lines have been returned so far */
-int             csg_maxmatches=0;  /* How many matches are allowed */
-int		csg_direction;     /* Log direction (0 = forward, 1 = reverse) */
-int		csg_bytesread;
-
-char            csg_readbuf[CSG_BUFSIZE];  /* Buffer */
-int             csg_bytesleft;     /* How much valid data there is in the buffer */
+#define CSG_BUFSIZE        4096
+#define CSG_MAXSTARTPOINT  30
+#define CSG_MAXMATCHES     500
+#define CSG_WORKERS        4    /* processes per search */
+#define CSG_MAXJOBS        4    /* concurrent searches */
+#define CSG_PENDING        0    /* pseudo-day for the block not yet flushed */
+
+/* A search is split across up to CSG_WORKERS forked processes, each taking
+ * a contiguous run of segments and writing matching lines down a pipe.
+ * Output from the worker holding the earliest part of the run is streamed
+ * straight to the user; later workers' output is held back until all
+ * earlier workers have finished, so results arrive in the same order a
+ * single sequential scan would produce. */
+typedef struct csg_worker {
+  pid_t pid;
+  int fd;
+  int done;
+  char readbuf[CSG_BUFSIZE];
+  int bytesleft;
+  char *held;
+  size_t heldlen, heldsize;
+} csg_worker;
+
+typedef struct csg_filter {
+  int count;
+  uint32_t hash[2];
+} csg_filter;
+
+typedef struct csg_query {
+  pcre *pat;
+  csg_filter account;
+  csg_filter channel;
+  time_t since;            /* 0 for all history */
+} csg_query;
+
+typedef struct csg_job {
+  unsigned long numeric;
+  csg_query query;
+  int matches;
+  int nworkers;
+  int current;
+  csg_worker workers[CSG_WORKERS];
+  struct csg_job *next;
+} csg_job;
+
+static csg_job *csg_jobs;
 
 void csg_handleevents(int fd, short revents);
 int csg_dogrep(void *source, int cargc, char **cargv);
 int csg_dorgrep(void *source, int cargc, char **cargv);
-int csg_execgrep(nick *sender, char *pattern);
-
-#if !defined(pread)
-extern ssize_t pread(int fd, void *buf, size_t count, off_t offset);
-#endif
+int csg_execgrep(nick *sender, char *args, int direction, time_t since);
+static void csg_freejob(csg_job *job);
 
 void _init() {
-  chanservaddcommand("grep",   QCMD_OPER, 1, csg_dogrep,   "Searches the logs.","Usage: GREP <regex>\nSearches the logs.  The current logfile will be specified first, followed by\nall older logfiles found.  This will shuffle the order of results slightly.  Where:\nregex  - regular expression to search for.\nNote: For a case insensitive search, prepend (?i) to the regex.");
-  chanservaddcommand("rgrep",  QCMD_OPER, 2, csg_dorgrep,  "Searches the logs in reverse order.","Usage: RGREP <days> <regex>\nSearches the logs.  The oldest specified log will be specified first meaning\nthat all events returned will be in strict chronological order. Where:\ndays  - number of days of history to search\nregex - regex to search for\nNote: For a case insensitive search, prepend (?i) to the regex.");
+  chanservaddcommand("grep",   QCMD_OPER, 1, csg_dogrep,   "Searches the logs.","Usage: GREP [-a <account>] [-c <#channel>] [-d <days>] <regex>\nSearches the logs.  The most recent log entries will be specified first, followed by\nolder days.  This will shuffle the order of results slightly.  Where:\naccount - only return entries mentioning this account.\nchannel - only return entries mentioning this channel.\ndays    - only search this many days of history.\nregex   - regular expression to search for.\nNote: For a case insensitive search, prepend (?i) to the regex.");
+  chanservaddcommand("rgrep",  QCMD_OPER, 2, csg_dorgrep,  "Searches the logs in reverse order.","Usage: RGREP <days> [-a <account>] [-c <#channel>] <regex>\nSearches the logs.  The oldest specified log will be specified first meaning\nthat all events returned will be in strict chronological order. Where:\ndays    - number of days of history to search\naccount - only return entries mentioning this account.\nchannel - only return entries mentioning this channel.\nregex   - regex to search for\nNote: For a case insensitive search, prepend (?i) to the regex.");
 }
 
 void _fini() {
   chanservremovecommand("grep", csg_dogrep);
   chanservremovecommand("rgrep", csg_dorgrep);
+
+  while (csg_jobs)
+    csg_freejob(csg_jobs);
 }
 
 int csg_dogrep(void *source, int cargc, char **cargv) {
@@ -60,13 +97,10 @@ int csg_dogrep(void *source, int cargc, char **cargv) {
     return CMD_ERROR;
   }
 
-  csg_curfile=0;
-  csg_direction=0;
-
   chanservwallmessage("%s (%s) used GREP %s", sender->nick, rup->username, cargv[0]);
   cs_log(sender, "GREP %s", cargv[0]);
 
-  return csg_execgrep(sender, cargv[0]);
+  return csg_execgrep(sender, cargv[0], 0, 0);
 }
 
 int csg_dorgrep(void *source, int cargc, char **cargv) {
@@ -100,140 +134,455 @@ int csg_dorgrep(void *source, int cargc, char **cargv) {
   chanservwallmessage("%s (%s) used RGREP %s %s", sender->nick, rup->username, cargv[0], cargv[1]);
   cs_log(sender, "RGREP %s %s", cargv[0], cargv[1]);
 
-  csg_curfile=startpoint;
-  csg_direction=1;
-  return csg_execgrep(sender, cargv[1]);
+  return csg_execgrep(sender, cargv[1], 1, time(NULL)-startpoint*86400);
+}
+
+/* Splits the next space separated word off *args. */
+static char *csg_nextword(char **args) {
+  char *word=*args, *p;
+
+  for (p=word;*p && *p!=' ';p++)
+    ;
+
+  if (*p) {
+    *p++='\0';
+    while (*p==' ')
+      p++;
+  }
+
+  *args=p;
+  return word;
+}
+
+/* Parses the leading -a/-c/-d options, leaving *args pointing at the regex. */
+static int csg_parseopts(nick *sender, char **args, csg_query *q, int allowdays) {
+  char *opt, *value, keybuf[ACCOUNTLEN+2];
+  int days;
+
+  while ((*args)[0]=='-' && (*args)[1] && (*args)[2]==' ') {
+    opt=csg_nextword(args);
+    if (!**args) {
+      chanservsendmessage(sender, "Option %s requires a value.", opt);
+      return 0;
+    }
+    value=csg_nextword(args);
+
+    switch (opt[1]) {
+      case 'a':
+        /* accounts appear bare or in the #account form */
+        snprintf(keybuf, sizeof(keybuf), "#%s", (*value=='#')?value+1:value);
+        q->account.count=2;
+        q->account.hash[0]=csls_hashkey(keybuf+1);
+        q->account.hash[1]=csls_hashkey(keybuf);
+        break;
+
+      case 'c':
+        if (*value!='#') {
+          chanservsendmessage(sender, "Invalid channel name %s.", value);
+          return 0;
+        }
+        q->channel.count=1;
+        q->channel.hash[0]=csls_hashkey(value);
+        break;
+
+      case 'd':
+        if (!allowdays || !protectedatoi(value, &days) || days<0) {
+          chanservsendmessage(sender, "Invalid number of days %s.", value);
+          return 0;
+        }
+        q->since=time(NULL)-days*86400;
+        break;
+
+      default:
+        chanservsendmessage(sender, "Unknown option %s.", opt);
+        return 0;
+    }
+  }
+
+  if (!**args) {
+    chanservsendmessage(sender, "No search pattern given.");
+    return 0;
+  }
+
+  return 1;
+}
+
+static int csg_blockmatches(const csg_filter *f, const csls_block *bp) {
+  int i;
+
+  if (!f->count)
+    return 1;
+
+  for (i=0;i<f->count;i++)
+    if (csls_blockhaskey(bp, f->hash[i]))
+      return 1;
+
+  return 0;
+}
+
+static int csg_linematches(const csg_filter *f, const char *line) {
+  int i;
+
+  if (!f->count)
+    return 1;
+
+  for (i=0;i<f->count;i++)
+    if (csls_linehaskey(line, f->hash[i]))
+      return 1;
+
+  return 0;
+}
+
+/* Worker side: buffered writes down the pipe. */
+static char csg_outbuf[CSG_BUFSIZE];
+static int csg_outlen;
+
+static void csg_outflush(int fd) {
+  char *p=csg_outbuf;
+  ssize_t res;
+
+  while (csg_outlen>0) {
+    res=write(fd, p, csg_outlen);
+    if (res<0 && errno==EINTR)
+      continue;
+    if (res<=0)
+      _exit(1);
+    p+=res;
+    csg_outlen-=res;
+  }
+}
+
+/* Greps a NUL terminated run of log lines, returns the number of matches
+ * still allowed. */
+static int csg_greptext(csg_query *q, char *text, int remaining, int fd) {
+  char *line, *eol;
+  int len;
+
+  for (line=text;*line && remaining>0;line=eol) {
+    for (eol=line;*eol && *eol!='\n';eol++)
+      ;
+    len=eol-line;
+    if (*eol)
+      *eol++='\0';
+
+    if (!len || !csg_linematches(&q->account, line) || !csg_linematches(&q->channel, line))
+      continue;
+
+    if (pcre_exec(q->pat, NULL, line, len, 0, 0, NULL, 0)<0)
+      continue;
+
+    if (len>=CSG_BUFSIZE-1)
+      len=CSG_BUFSIZE-2;
+    if (csg_outlen+len+1>CSG_BUFSIZE)
+      csg_outflush(fd);
+    memcpy(csg_outbuf+csg_outlen, line, len);
+    csg_outlen+=len;
+    csg_outbuf[csg_outlen++]='\n';
+    remaining--;
+  }
+
+  return remaining;
+}
+
+static void csg_runworker(csg_query *q, unsigned int *days, int ndays, int fd) {
+  int i, remaining=CSG_MAXMATCHES;
+  unsigned int b;
+  csls_segment *sp;
+  csls_block *bp;
+  const char *pending;
+  unsigned int pendinglen;
+  char *text;
+
+  csg_outlen=0;
+
+  for (i=0;i<ndays && remaining>0;i++) {
+    if (days[i]==CSG_PENDING) {
+      csls_pending(&pending, &pendinglen);
+      if (!pendinglen)
+        continue;
+      text=malloc(pendinglen+1);
+      memcpy(text, pending, pendinglen);
+      text[pendinglen]='\0';
+      remaining=csg_greptext(q, text, remaining, fd);
+      free(text);
+      continue;
+    }
+
+    if (!(sp=csls_opensegment(days[i])))
+      continue;
+
+    for (b=0;b<sp->nblocks && remaining>0;b++) {
+      bp=&sp->blocks[b];
+      if (q->since && bp->lastts<q->since)
+        continue;
+      if (!csg_blockmatches(&q->account, bp) || !csg_blockmatches(&q->channel, bp))
+        continue;
+      if (!(text=csls_readblock(sp, b)))
+        continue;
+      remaining=csg_greptext(q, text, remaining, fd);
+      free(text);
+    }
+
+    csls_freesegment(sp);
+  }
+
+  csg_outflush(fd);
+  _exit(0);
 }
 
-int csg_execgrep(nick *sender, char *pattern) {
+int csg_execgrep(nick *sender, char *args, int direction, time_t since) {
   const char *errptr;
-  int erroffset;
-  int fd;
-  char filename[50];
+  int erroffset, njobs, total, i, w, chunk, start, fds[2];
+  unsigned int *days, ndays, *order;
+  csg_query query;
+  csg_job *job;
+  char *pattern;
+  pid_t pid;
+
+  for (job=csg_jobs,njobs=0;job;job=job->next,njobs++) {
+    if (job->numeric==sender->numeric) {
+      chanservsendmessage(sender, "You already have a search running - wait for it to finish.");
+      return CMD_ERROR;
+    }
+  }
 
-  if (csg_maxmatches>0) {
+  if (njobs>=CSG_MAXJOBS) {
     chanservsendmessage(sender, "Sorry, the grepper is currently busy - try later.");
     return CMD_ERROR;
   }
 
-  if (!(csg_curpat=pcre_compile(pattern, 0, &errptr, &erroffset, NULL))) {
+  memset(&query, 0, sizeof(query));
+  query.since=since;
+  if (!csg_parseopts(sender, &args, &query, !direction))
+    return CMD_ERROR;
+  pattern=args;
+
+  if (!(query.pat=pcre_compile(pattern, 0, &errptr, &erroffset, NULL))) {
     chanservsendmessage(sender, "Error in pattern at character %d: %s",erroffset,errptr);
     return CMD_ERROR;
   }
 
-  if (csg_direction==0 || csg_curfile==0) {
-    if ((fd=open("chanservlog",O_RDONLY))<0) {
-      chanservsendmessage(sender, "Unable to open logfile.");
-      free(csg_curpat);    
-      return CMD_ERROR;
+  /* Work out the segments to search: newest first for GREP, oldest first
+   * for RGREP, with the unflushed lines counting as the newest segment. */
+  days=csls_listsegments(&ndays);
+  order=malloc((ndays+1)*sizeof(unsigned int));
+  total=0;
+
+  if (!direction)
+    order[total++]=CSG_PENDING;
+  for (i=0;i<(int)ndays;i++) {
+    unsigned int day=days[direction?i:(ndays-1-i)];
+    if (query.since && day<csls_day(query.since))
+      continue;
+    order[total++]=day;
+  }
+  if (direction)
+    order[total++]=CSG_PENDING;
+  free(days);
+
+  job=calloc(1, sizeof(csg_job));
+  job->numeric=sender->numeric;
+  job->query=query;
+  job->nworkers=(total<CSG_WORKERS)?total:CSG_WORKERS;
+  for (w=0;w<CSG_WORKERS;w++) {
+    job->workers[w].fd=-1;
+    job->workers[w].done=(w>=job->nworkers);
+  }
+  job->next=csg_jobs;
+  csg_jobs=job;
+
+  chunk=(total+job->nworkers-1)/job->nworkers;
+  for (w=0,start=0;w<job->nworkers;w++,start+=chunk) {
+    if (pipe(fds)) {
+      Error("chanserv_grep", ERR_WARNING, "Unable to create pipe: %s", strerror(errno));
+      break;
     }
-  } else {
-    sprintf(filename,"chanservlog.%d",csg_curfile);
-    if ((fd=open(filename,O_RDONLY))<0) {
-      chanservsendmessage(sender, "Unable to open logfile.");
-      free(csg_curpat);    
-      return CMD_ERROR;
+
+    if ((pid=fork())<0) {
+      Error("chanserv_grep", ERR_WARNING, "Unable to fork search worker: %s", strerror(errno));
+      close(fds[0]);
+      close(fds[1]);
+      break;
+    }
+
+    if (pid==0) {
+      close(fds[0]);
+      csg_runworker(&query, order+start, (start+chunk>total)?(total-start):chunk, fds[1]);
     }
+
+    close(fds[1]);
+    job->workers[w].pid=pid;
+    job->workers[w].fd=fds[0];
+    registerhandler(fds[0], POLLIN, csg_handleevents);
   }
 
-  /* Initialise stuff for the match */
-  csg_maxmatches=500;
-  csg_matches=0;
-  csg_curnum=sender->numeric;
-  csg_bytesleft=0;
-  csg_bytesread=0;
+  free(order);
+
+  if (w<job->nworkers) {
+    chanservsendmessage(sender, "Unable to start search.");
+    csg_freejob(job);
+    return CMD_ERROR;
+  }
 
-  registerhandler(fd, POLLIN, csg_handleevents);
   chanservsendmessage(sender, "Started grep for %s...",pattern);
 
   return CMD_OK;
 }
 
+static void csg_freejob(csg_job *job) {
+  csg_job **jh;
+  csg_worker *wp;
+  int w;
+
+  for (w=0;w<CSG_WORKERS;w++) {
+    wp=&job->workers[w];
+    if (wp->fd>=0)
+      deregisterhandler(wp->fd, 1);
+    if (wp->pid>0) {
+      kill(wp->pid, SIGKILL);
+      waitpid(wp->pid, NULL, 0);
+    }
+    free(wp->held);
+  }
+
+  for (jh=&csg_jobs;*jh;jh=&((*jh)->next)) {
+    if (*jh==job) {
+      *jh=job->next;
+      break;
+    }
+  }
+
+  pcre_free(job->query.pat);
+  free(job);
+}
+
+/* Sends a line to the user; returns 0 if that finished the job. */
+static int csg_deliver(csg_job *job, nick *np, const char *line) {
+  chanservsendmessage(np, "%s", line);
+
+  if (++job->matches >= CSG_MAXMATCHES) {
+    chanservstdmessage(np, QM_TRUNCATED, CSG_MAXMATCHES);
+    chanservstdmessage(np, QM_ENDOFLIST);
+    csg_freejob(job);
+    return 0;
+  }
+
+  return 1;
+}
+
+static int csg_line(csg_job *job, nick *np, int w, const char *line, int len) {
+  csg_worker *wp=&job->workers[w];
+
+  if (w==job->current)
+    return csg_deliver(job, np, line);
+
+  if (wp->heldlen+len+1>wp->heldsize) {
+    wp->heldsize=(wp->heldlen+len+1)*2;
+    wp->held=realloc(wp->held, wp->heldsize);
+  }
+  memcpy(wp->held+wp->heldlen, line, len+1);
+  wp->heldlen+=len+1;
+
+  return 1;
+}
+
+/* Moves on past finished workers, releasing whatever the next one held. */
+static void csg_advance(csg_job *job, nick *np) {
+  csg_worker *wp;
+  size_t pos;
+
+  while (job->workers[job->current].done) {
+    if (++job->current>=job->nworkers) {
+      chanservstdmessage(np, QM_ENDOFLIST);
+      csg_freejob(job);
+      return;
+    }
+
+    wp=&job->workers[job->current];
+    for (pos=0;pos<wp->heldlen;pos+=strlen(wp->held+pos)+1)
+      if (!csg_deliver(job, np, wp->held+pos))
+        return;
+
+    free(wp->held);
+    wp->held=NULL;
+    wp->heldlen=wp->heldsize=0;
+  }
+}
+
 void csg_handleevents(int fd, short revents) {
-  int res;
-  nick *np=getnickbynumeric(csg_curnum);
+  csg_job *job;
+  csg_worker *wp=NULL;
+  nick *np;
   char *chp, *linestart;
-  char filename[50];
-  off_t pos;
+  int w=0, res;
+
+  for (job=csg_jobs;job;job=job->next) {
+    for (w=0;w<job->nworkers;w++)
+      if (job->workers[w].fd==fd)
+        break;
+    if (w<job->nworkers) {
+      wp=&job->workers[w];
+      break;
+    }
+  }
 
-  /* If the target user has vanished, drop everything */
-  if (!np) {
+  if (!wp) {
     deregisterhandler(fd, 1);
-    free(csg_curpat);
-    csg_maxmatches=0;
     return;
   }
 
-retry:
-  res=read(fd, csg_readbuf+csg_bytesleft, CSG_BUFSIZE-csg_bytesleft);
-  
+  /* If the target user has vanished, drop everything */
+  if (!(np=getnickbynumeric(job->numeric))) {
+    csg_freejob(job);
+    return;
+  }
+
+  res=read(fd, wp->readbuf+wp->bytesleft, CSG_BUFSIZE-1-wp->bytesleft);
+
+  if (res<0 && errno==EINTR)
+    return;
+
   if (res<=0) {
-/*    chanservsendmessage(np, "Closing file: res=%d, errno=%d(%s), bytes read=%d",res,errno,sys_errlist[errno],csg_bytesread); */
-    /* End of file (or error) */
+    /* Worker finished */
     deregisterhandler(fd, 1);
-    if (csg_direction==0) {
-      sprintf(filename,"chanservlog.%d",++csg_curfile);
-    } else {
-      csg_curfile--;
-      if (csg_curfile<0) {
-        chanservstdmessage(np, QM_ENDOFLIST);
-        free(csg_curpat);
-        csg_maxmatches=0;
+    wp->fd=-1;
+    waitpid(wp->pid, NULL, 0);
+    wp->pid=0;
+    wp->done=1;
+
+    if (wp->bytesleft) {
+      wp->readbuf[wp->bytesleft]='\0';
+      wp->bytesleft=0;
+      if (!csg_line(job, np, w, wp->readbuf, strlen(wp->readbuf)))
         return;
-      } else if (csg_curfile==0) {
-        sprintf(filename,"chanservlog");
-      } else {
-        sprintf(filename,"chanservlog.%d",csg_curfile);
-      }
-    }
-    if ((fd=open(filename,O_RDONLY))>=0) {
-      /* Found the next file */
-      registerhandler(fd, POLLIN, csg_handleevents);
-    } else {
-      chanservstdmessage(np, QM_ENDOFLIST);
-      free(csg_curpat);
-      csg_maxmatches=0;
     }
 
+    if (w==job->current)
+      csg_advance(job, np);
+
     return;
   }
 
-  csg_bytesread+=res;
-
-  linestart=chp=csg_readbuf;
-  csg_bytesleft+=res;
-  
-  while (csg_bytesleft) {
-    csg_bytesleft--;
-    if (*chp=='\r' || *chp=='\n' || *chp=='\0') {
-      if (linestart==chp) {
-	linestart=(++chp);
-      } else {
-	*chp++='\0';
-	if (!pcre_exec(csg_curpat, NULL, linestart, strlen(linestart), 0, 0, NULL, 0)) {
-	  chanservsendmessage(np, "%s", linestart);
-	  if (++csg_matches >= csg_maxmatches) {
-	    chanservstdmessage(np, QM_TRUNCATED, csg_maxmatches);
-	    chanservstdmessage(np, QM_ENDOFLIST);
-	    free(csg_curpat);
-	    deregisterhandler(fd, 1);
-	    csg_maxmatches=0;
-	  } 
-	}
-	linestart=chp;
-      }
-    } else {
-      chp++;
-    }
+  wp->bytesleft+=res;
+  linestart=wp->readbuf;
+
+  for (chp=wp->readbuf;chp<wp->readbuf+wp->bytesleft;chp++) {
+    if (*chp!='\n')
+      continue;
+
+    *chp='\0';
+    if (chp>linestart && !csg_line(job, np, w, linestart, chp-linestart))
+      return;
+    linestart=chp+1;
+  }
+
+  wp->bytesleft=(wp->readbuf+wp->bytesleft)-linestart;
+  if (wp->bytesleft==CSG_BUFSIZE-1) {
+    /* overlong line, pass it on as it is */
+    wp->readbuf[wp->bytesleft]='\0';
+    wp->bytesleft=0;
+    csg_line(job, np, w, wp->readbuf, CSG_BUFSIZE-1);
+    return;
   }
-  
-  csg_bytesleft=(chp-linestart);
-  memmove(csg_readbuf, linestart, csg_bytesleft);
-  
-  /* BSD hack */
-  pos=lseek(fd, 0, SEEK_CUR);
-  if (!pread(fd, csg_readbuf+csg_bytesleft, 1, pos)) {
-    /* EOF */
-    goto retry;
-  }    
+  memmove(wp->readbuf, linestart, wp->bytesleft);
 }
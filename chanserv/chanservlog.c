@@ -5,6 +5,7 @@
 #include <stdarg.h>
 #include <stdio.h>
 #include "chanserv.h"
+#include "chanservlogstore.h"
 #include "../core/hooks.h"
 #include "../core/error.h"
 
@@ -22,12 +23,14 @@ void cs_usr1handler(int hooknum, void *arg) {
 
 void cs_initlog() {
   logfd=open("chanservlog",O_WRONLY|O_CREAT|O_APPEND,S_IRUSR|S_IWUSR);
+  csls_init();
   registerhook(HOOK_CORE_SIGUSR1, cs_usr1handler);
 }
 
 void cs_closelog() {
   if (logfd>=0)
     close(logfd);
+  csls_close();
   deregisterhook(HOOK_CORE_SIGUSR1, cs_usr1handler);
 }
 
@@ -40,8 +43,6 @@ void cs_log(nick *np, char *event, ... ) {
   int len;
   time_t now;
 
-  if (logfd<0)
-    return; 
 
   va_start(va,event);
   vsnprintf(buf,512,event,va);
@@ -57,5 +58,11 @@ void cs_log(nick *np, char *event, ... ) {
   now=time(NULL);
   strftime(timebuf,sizeof(timebuf),Q9_LOG_FORMAT_TIME, gmtime(&now));
   len=snprintf(buf2,sizeof(buf2),"[%s] %s%s\n",timebuf,userbuf,buf);
-  write(logfd, buf2, len);
+  if (len>=(int)sizeof(buf2))
+    len=sizeof(buf2)-1;
+
+  if (logfd>=0)
+    write(logfd, buf2, len);
+
+  csls_append(now, buf2, len);
 }
@@ -0,0 +1,531 @@
+#define _POSIX_C_SOURCE 200809L
+
+/*
+ * chanservlogstore.c:
+ *  Writes the chanserv log as compressed, day-bucketed segments with a
+ *  per-block index of the accounts and channels each block mentions, and
+ *  provides the readers used by GREP/RGREP.  See chanservlogstore.h for the
+ *  layout.
+ */
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <zlib.h>
+
+#include "chanservlogstore.h"
+#include "../core/error.h"
+#include "../core/schedule.h"
+#include "../lib/irc_string.h"
+
+#define CSLS_MAXKEYSPERLINE 16
+
+typedef struct csls_diskheader {
+  char magic[8];
+  uint32_t nblocks;
+  uint32_t pad;
+} csls_diskheader;
+
+typedef struct csls_diskblock {
+  uint64_t offset;
+  uint32_t clen;
+  uint32_t ulen;
+  uint32_t firstts;
+  uint32_t lastts;
+  uint32_t nkeys;
+  uint32_t pad;
+} csls_diskblock;
+
+/* Writer state: the segment for segday is open for appending at segoffset,
+ * and segblocks mirrors its index file. */
+static int segfd=-1;
+static unsigned int segday;
+static uint64_t segoffset;
+static csls_block *segblocks;
+static unsigned int segnblocks;
+
+/* The block currently being filled. */
+static char *pendbuf;
+static unsigned int pendlen;
+static uint32_t pendfirst, pendlast;
+static uint32_t *pendkeys;
+static unsigned int pendnkeys, pendkeyssize;
+
+static void *flushsched;
+
+static void csls_schedflush(void *arg);
+static void csls_openwriter(unsigned int day);
+static void csls_closewriter();
+
+static void csls_filename(char *buf, size_t len, unsigned int day, const char *suffix) {
+  snprintf(buf, len, "%s/%08u.%s", CSLS_DIR, day, suffix);
+}
+
+static int csls_cmpkey(const void *a, const void *b) {
+  uint32_t ka=*(const uint32_t *)a, kb=*(const uint32_t *)b;
+
+  return (ka<kb)?-1:(ka>kb);
+}
+
+static int csls_cmpday(const void *a, const void *b) {
+  unsigned int da=*(const unsigned int *)a, db=*(const unsigned int *)b;
+
+  return (da<db)?-1:(da>db);
+}
+
+unsigned int csls_day(time_t t) {
+  struct tm *tm=gmtime(&t);
+
+  return (tm->tm_year+1900)*10000+(tm->tm_mon+1)*100+tm->tm_mday;
+}
+
+/* FNV-1a over the lowercased key */
+static uint32_t csls_hashn(const char *key, size_t len) {
+  uint32_t h=2166136261U;
+  size_t i;
+
+  for (i=0;i<len;i++) {
+    h^=(unsigned char)ToLower(key[i]);
+    h*=16777619U;
+  }
+
+  return h;
+}
+
+uint32_t csls_hashkey(const char *key) {
+  return csls_hashn(key, strlen(key));
+}
+
+/* Extracts the index keys from a log line: the actor's account from the
+ * "[auth <account>]" prefix, the word following "username", "auth" or
+ * "user", and anything that starts with '#' (channels and #account
+ * references).  Writer and readers both use this, so block and line
+ * filtering always agree. */
+static int csls_linekeys(const char *line, uint32_t *keys, int maxkeys) {
+  const char *p=line, *tok, *end;
+  size_t len;
+  int nkeys=0, takenext=0;
+
+  while (*p && *p!='\n' && nkeys<maxkeys) {
+    while (*p==' ')
+      p++;
+    if (!*p || *p=='\n')
+      break;
+
+    tok=p;
+    while (*p && *p!=' ' && *p!='\n')
+      p++;
+    len=p-tok;
+
+    /* trim punctuation the log formats put around names */
+    end=tok+len;
+    while (end>tok && strchr(",:;()]>", end[-1]))
+      end--;
+
+    if (takenext) {
+      takenext=0;
+      if (end>tok) {
+        keys[nkeys++]=csls_hashn(tok, end-tok);
+        continue;
+      }
+    }
+
+    if (len>1 && *tok=='#') {
+      if (end-tok>1)
+        keys[nkeys++]=csls_hashn(tok, end-tok);
+    } else if ((len==5 && !strncmp(tok, "[auth", 5)) ||
+               (len==4 && !strncmp(tok, "auth", 4)) ||
+               (len==4 && !strncmp(tok, "user", 4)) ||
+               (len==8 && !strncmp(tok, "username", 8))) {
+      takenext=1;
+    }
+  }
+
+  return nkeys;
+}
+
+int csls_linehaskey(const char *line, uint32_t hash) {
+  uint32_t keys[CSLS_MAXKEYSPERLINE];
+  int i, nkeys;
+
+  nkeys=csls_linekeys(line, keys, CSLS_MAXKEYSPERLINE);
+  for (i=0;i<nkeys;i++)
+    if (keys[i]==hash)
+      return 1;
+
+  return 0;
+}
+
+int csls_blockhaskey(const csls_block *bp, uint32_t hash) {
+  return bsearch(&hash, bp->keys, bp->nkeys, sizeof(uint32_t), csls_cmpkey)!=NULL;
+}
+
+void csls_init() {
+  if (mkdir(CSLS_DIR, S_IRWXU) && errno!=EEXIST)
+    Error("chanserv", ERR_WARNING, "Unable to create log store directory %s: %s", CSLS_DIR, strerror(errno));
+
+  pendbuf=malloc(CSLS_BLOCKSIZE+CSLS_MAXLINE);
+  pendlen=0;
+  pendnkeys=0;
+  pendkeyssize=0;
+  pendkeys=NULL;
+
+  csls_openwriter(csls_day(time(NULL)));
+  flushsched=schedulerecurring(time(NULL)+CSLS_FLUSHINTERVAL, 0, CSLS_FLUSHINTERVAL, csls_schedflush, NULL);
+}
+
+void csls_close() {
+  if (flushsched) {
+    deleteschedule(flushsched, csls_schedflush, NULL);
+    flushsched=NULL;
+  }
+
+  csls_flush();
+  csls_closewriter();
+
+  free(pendbuf);
+  pendbuf=NULL;
+  free(pendkeys);
+  pendkeys=NULL;
+  pendkeyssize=0;
+}
+
+static void csls_schedflush(void *arg) {
+  csls_flush();
+}
+
+/* Reads the index of a segment; returns NULL if there is none. */
+static csls_segment *csls_loadindex(unsigned int day) {
+  char filename[256];
+  csls_diskheader hdr;
+  csls_diskblock db;
+  csls_segment *sp;
+  csls_block *bp;
+  unsigned int i;
+  FILE *fp;
+
+  csls_filename(filename, sizeof(filename), day, "idx");
+  if (!(fp=fopen(filename, "r")))
+    return NULL;
+
+  if (fread(&hdr, sizeof(hdr), 1, fp)!=1 || memcmp(hdr.magic, CSLS_IDXMAGIC, sizeof(hdr.magic))) {
+    Error("chanserv", ERR_WARNING, "Ignoring corrupt log index %s.", filename);
+    fclose(fp);
+    return NULL;
+  }
+
+  sp=malloc(sizeof(csls_segment));
+  sp->day=day;
+  sp->fd=-1;
+  sp->nblocks=0;
+  sp->blocks=calloc(hdr.nblocks?hdr.nblocks:1, sizeof(csls_block));
+
+  for (i=0;i<hdr.nblocks;i++) {
+    if (fread(&db, sizeof(db), 1, fp)!=1 || db.nkeys>CSLS_BLOCKSIZE)
+      break;
+
+    bp=&sp->blocks[i];
+    bp->offset=db.offset;
+    bp->clen=db.clen;
+    bp->ulen=db.ulen;
+    bp->firstts=db.firstts;
+    bp->lastts=db.lastts;
+    bp->nkeys=db.nkeys;
+    bp->keys=malloc((db.nkeys?db.nkeys:1)*sizeof(uint32_t));
+
+    if (fread(bp->keys, sizeof(uint32_t), db.nkeys, fp)!=db.nkeys) {
+      free(bp->keys);
+      break;
+    }
+
+    sp->nblocks++;
+  }
+
+  if (sp->nblocks!=hdr.nblocks)
+    Error("chanserv", ERR_WARNING, "Log index %s truncated after %u of %u blocks.", filename, sp->nblocks, hdr.nblocks);
+
+  fclose(fp);
+  return sp;
+}
+
+csls_segment *csls_opensegment(unsigned int day) {
+  char filename[256];
+  csls_segment *sp;
+
+  if (!(sp=csls_loadindex(day)))
+    return NULL;
+
+  csls_filename(filename, sizeof(filename), day, "seg");
+  if ((sp->fd=open(filename, O_RDONLY))<0) {
+    csls_freesegment(sp);
+    return NULL;
+  }
+
+  return sp;
+}
+
+void csls_freesegment(csls_segment *sp) {
+  unsigned int i;
+
+  for (i=0;i<sp->nblocks;i++)
+    free(sp->blocks[i].keys);
+
+  if (sp->fd>=0)
+    close(sp->fd);
+
+  free(sp->blocks);
+  free(sp);
+}
+
+/* Returns the decompressed, NUL terminated text of a block. */
+char *csls_readblock(csls_segment *sp, unsigned int block) {
+  csls_block *bp;
+  char *cbuf, *ubuf;
+  uLongf destlen;
+
+  if (block>=sp->nblocks || sp->fd<0)
+    return NULL;
+
+  bp=&sp->blocks[block];
+  cbuf=malloc(bp->clen?bp->clen:1);
+  ubuf=malloc(bp->ulen+1);
+
+  if (pread(sp->fd, cbuf, bp->clen, bp->offset)!=(ssize_t)bp->clen) {
+    free(cbuf);
+    free(ubuf);
+    return NULL;
+  }
+
+  destlen=bp->ulen;
+  if (uncompress((Bytef *)ubuf, &destlen, (Bytef *)cbuf, bp->clen)!=Z_OK || destlen!=bp->ulen) {
+    free(cbuf);
+    free(ubuf);
+    return NULL;
+  }
+
+  free(cbuf);
+  ubuf[destlen]='\0';
+  return ubuf;
+}
+
+/* The lines not yet flushed to a segment; these are newer than anything
+ * in the segments. */
+void csls_pending(const char **buf, unsigned int *len) {
+  *buf=pendbuf;
+  *len=pendbuf?pendlen:0;
+}
+
+/* Lists the days for which segments exist, oldest first. */
+unsigned int *csls_listsegments(unsigned int *count) {
+  unsigned int *days=NULL, day, size=0;
+  struct dirent *de;
+  DIR *dp;
+  char tail;
+
+  *count=0;
+  if (!(dp=opendir(CSLS_DIR)))
+    return NULL;
+
+  while ((de=readdir(dp))) {
+    if (strlen(de->d_name)!=12 || strcmp(de->d_name+8, ".seg"))
+      continue;
+
+    if (sscanf(de->d_name, "%8u.se%c", &day, &tail)!=2)
+      continue;
+
+    if (*count==size) {
+      size=size?size*2:32;
+      days=realloc(days, size*sizeof(unsigned int));
+    }
+    days[(*count)++]=day;
+  }
+
+  closedir(dp);
+
+  if (days)
+    qsort(days, *count, sizeof(unsigned int), csls_cmpday);
+
+  return days;
+}
+
+static void csls_writeindex() {
+  char filename[256], tmpname[256];
+  csls_diskheader hdr;
+  csls_diskblock db;
+  unsigned int i;
+  FILE *fp;
+
+  csls_filename(filename, sizeof(filename), segday, "idx");
+  csls_filename(tmpname, sizeof(tmpname), segday, "idx.tmp");
+
+  if (!(fp=fopen(tmpname, "w"))) {
+    Error("chanserv", ERR_WARNING, "Unable to write log index %s: %s", tmpname, strerror(errno));
+    return;
+  }
+
+  memset(&hdr, 0, sizeof(hdr));
+  memcpy(hdr.magic, CSLS_IDXMAGIC, sizeof(hdr.magic));
+  hdr.nblocks=segnblocks;
+  fwrite(&hdr, sizeof(hdr), 1, fp);
+
+  for (i=0;i<segnblocks;i++) {
+    memset(&db, 0, sizeof(db));
+    db.offset=segblocks[i].offset;
+    db.clen=segblocks[i].clen;
+    db.ulen=segblocks[i].ulen;
+    db.firstts=segblocks[i].firstts;
+    db.lastts=segblocks[i].lastts;
+    db.nkeys=segblocks[i].nkeys;
+    fwrite(&db, sizeof(db), 1, fp);
+    fwrite(segblocks[i].keys, sizeof(uint32_t), segblocks[i].nkeys, fp);
+  }
+
+  if (fclose(fp) || rename(tmpname, filename)) {
+    Error("chanserv", ERR_WARNING, "Unable to write log index %s: %s", filename, strerror(errno));
+    unlink(tmpname);
+  }
+}
+
+static void csls_openwriter(unsigned int day) {
+  char filename[256];
+  csls_segment *sp;
+
+  csls_closewriter();
+
+  segday=day;
+  segoffset=0;
+
+  /* Pick up where a previous run left today's segment; anything past the
+   * last indexed block was never indexed and is dropped. */
+  if ((sp=csls_loadindex(day))) {
+    segblocks=sp->blocks;
+    segnblocks=sp->nblocks;
+    if (segnblocks)
+      segoffset=segblocks[segnblocks-1].offset+segblocks[segnblocks-1].clen;
+    free(sp);
+  }
+
+  csls_filename(filename, sizeof(filename), day, "seg");
+  if ((segfd=open(filename, O_WRONLY|O_CREAT, S_IRUSR|S_IWUSR))<0) {
+    Error("chanserv", ERR_WARNING, "Unable to open log segment %s: %s", filename, strerror(errno));
+    return;
+  }
+
+  if (ftruncate(segfd, segoffset))
+    Error("chanserv", ERR_WARNING, "Unable to truncate log segment %s: %s", filename, strerror(errno));
+}
+
+static void csls_closewriter() {
+  unsigned int i;
+
+  if (segfd>=0) {
+    close(segfd);
+    segfd=-1;
+  }
+
+  for (i=0;i<segnblocks;i++)
+    free(segblocks[i].keys);
+  free(segblocks);
+  segblocks=NULL;
+  segnblocks=0;
+}
+
+void csls_flush() {
+  csls_block *bp;
+  uLongf clen;
+  Bytef *cbuf;
+  unsigned int i, n;
+
+  if (!pendlen)
+    return;
+
+  if (segfd<0)
+    goto out;
+
+  clen=compressBound(pendlen);
+  cbuf=malloc(clen);
+
+  if (compress2(cbuf, &clen, (Bytef *)pendbuf, pendlen, CSLS_LEVEL)!=Z_OK) {
+    Error("chanserv", ERR_WARNING, "Unable to compress log block, %u bytes lost from segment %08u.", pendlen, segday);
+    free(cbuf);
+    goto out;
+  }
+
+  if (pwrite(segfd, cbuf, clen, segoffset)!=(ssize_t)clen) {
+    Error("chanserv", ERR_WARNING, "Unable to write log segment %08u: %s", segday, strerror(errno));
+    free(cbuf);
+    goto out;
+  }
+  free(cbuf);
+
+  /* sort and unique the keys */
+  qsort(pendkeys, pendnkeys, sizeof(uint32_t), csls_cmpkey);
+  for (i=0,n=0;i<pendnkeys;i++)
+    if (!n || pendkeys[n-1]!=pendkeys[i])
+      pendkeys[n++]=pendkeys[i];
+
+  segblocks=realloc(segblocks, (segnblocks+1)*sizeof(csls_block));
+  bp=&segblocks[segnblocks++];
+  bp->offset=segoffset;
+  bp->clen=clen;
+  bp->ulen=pendlen;
+  bp->firstts=pendfirst;
+  bp->lastts=pendlast;
+  bp->nkeys=n;
+  bp->keys=malloc((n?n:1)*sizeof(uint32_t));
+  memcpy(bp->keys, pendkeys, n*sizeof(uint32_t));
+
+  segoffset+=clen;
+  csls_writeindex();
+
+out:
+  pendlen=0;
+  pendnkeys=0;
+}
+
+void csls_append(time_t t, const char *line, int len) {
+  uint32_t keys[CSLS_MAXKEYSPERLINE];
+  unsigned int day;
+  int i, nkeys;
+
+  if (!pendbuf || len<=0)
+    return;
+
+  day=csls_day(t);
+  if (day!=segday) {
+    csls_flush();
+    csls_openwriter(day);
+  }
+
+  if (segfd<0)
+    return;
+
+  if (len>CSLS_MAXLINE)
+    len=CSLS_MAXLINE;
+
+  if (!pendlen)
+    pendfirst=t;
+  pendlast=t;
+
+  memcpy(pendbuf+pendlen, line, len);
+  pendlen+=len;
+  if (pendbuf[pendlen-1]!='\n')
+    pendbuf[pendlen-1]='\n';
+
+  nkeys=csls_linekeys(line, keys, CSLS_MAXKEYSPERLINE);
+  if (pendnkeys+nkeys>pendkeyssize) {
+    pendkeyssize=(pendnkeys+nkeys)*2;
+    pendkeys=realloc(pendkeys, pendkeyssize*sizeof(uint32_t));
+  }
+  for (i=0;i<nkeys;i++)
+    pendkeys[pendnkeys++]=keys[i];
+
+  if (pendlen>=CSLS_BLOCKSIZE)
+    csls_flush();
+}
@@ -0,0 +1,59 @@
+#ifndef __CHANSERVLOGSTORE_H
+#define __CHANSERVLOGSTORE_H
+
+#include <stdint.h>
+#include <time.h>
+
+/* Segmented log store.
+ *
+ * Alongside the flat chanservlog every line is appended to a per-day
+ * segment in CSLS_DIR.  A segment (YYYYMMDD.seg) is a sequence of
+ * independently zlib compressed blocks of roughly CSLS_BLOCKSIZE bytes of
+ * log text; its sidecar (YYYYMMDD.idx) records for every block where it
+ * lives, the time range it covers and the sorted hashes of the account and
+ * channel names mentioned in it, so searches can skip blocks without
+ * decompressing them.  The block currently being filled is kept in memory
+ * until it is full, the day rolls over or CSLS_FLUSHINTERVAL expires. */
+
+#define CSLS_DIR           "chanservlog.d"
+#define CSLS_BLOCKSIZE     65536
+#define CSLS_FLUSHINTERVAL 300
+#define CSLS_LEVEL         1
+#define CSLS_IDXMAGIC      "NSCSLI01"
+#define CSLS_MAXLINE       1024
+
+typedef struct csls_block {
+  uint64_t offset;
+  uint32_t clen;
+  uint32_t ulen;
+  uint32_t firstts;
+  uint32_t lastts;
+  uint32_t nkeys;
+  uint32_t *keys;     /* sorted, unique */
+} csls_block;
+
+typedef struct csls_segment {
+  unsigned int day;   /* YYYYMMDD */
+  int fd;             /* segment data, -1 if not open */
+  unsigned int nblocks;
+  csls_block *blocks;
+} csls_segment;
+
+/* chanservlogstore.c */
+void csls_init();
+void csls_close();
+void csls_append(time_t t, const char *line, int len);
+void csls_flush();
+
+unsigned int csls_day(time_t t);
+uint32_t csls_hashkey(const char *key);
+int csls_linehaskey(const char *line, uint32_t hash);
+
+unsigned int *csls_listsegments(unsigned int *count);
+csls_segment *csls_opensegment(unsigned int day);
+void csls_freesegment(csls_segment *sp);
+int csls_blockhaskey(const csls_block *bp, uint32_t hash);
+char *csls_readblock(csls_segment *sp, unsigned int block);
+void csls_pending(const char **buf, unsigned int *len);
+
+#endif
@@ -111,9 +111,8 @@ void chanservuserhandler(nick *target, int message, void **params) {
       }
       cmd=findcommandintree(csctcpcommands, cargv[0]+1, 1);
       if (cmd) {
-	cmd->calls++;
 	rejoinline(cargv[1],cargc-1);
-	cmd->handler((void *)sender, cargc-1, &(cargv[1]));
+	callcommand(cmd, (void *)sender, cargc-1, &(cargv[1]));
       }      
     } else {
       cmd=findcommandintree(cscommands, cargv[0], 1);
@@ -188,14 +187,12 @@ void chanservuserhandler(nick *target, int message, void **params) {
         break;
       }
       
-      cmd->calls++;
-      
       if (cmd->maxparams < (cargc-1)) {
 	rejoinline(cargv[cmd->maxparams],cargc-(cmd->maxparams));
 	cargc=(cmd->maxparams)+1;
       }
       
-      cmd->handler((void *)sender, cargc-1, &(cargv[1]));
+      callcommand(cmd, (void *)sender, cargc-1, &(cargv[1]));
       
       triggerhook(HOOK_CHANSERV_CMD, sender);
     }
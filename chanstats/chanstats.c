@@ -474,6 +474,7 @@ int douserhistogram(void *source, int cargc, char **cargv) {
   int histdata[21];
   int serverdata[21];
   nick *np;
+  nickiter iter;
   nick *sender=(nick *)source;
   int top=0,tot=0,servertot=0,servertop=0;
   int i;
@@ -492,16 +493,14 @@ int douserhistogram(void *source, int cargc, char **cargv) {
     serverdata[i]=0;
   } 
   
-  for (i=0;i<NICKHASHSIZE;i++) {
-    for (np=nicktable[i];np;np=np->next) {
-      if (np->channels->cursi <= 20) {
-        histdata[np->channels->cursi]++;
-        if (theserver>=0 && homeserver(np->numeric)==theserver) {
-          servertop++;
-          serverdata[np->channels->cursi]++;
-        }
-        top++;
+  for (np=firstnick(&iter);np;np=nextnick(&iter)) {
+    if (np->channels->cursi <= 20) {
+      histdata[np->channels->cursi]++;
+      if (theserver>=0 && homeserver(np->numeric)==theserver) {
+        servertop++;
+        serverdata[np->channels->cursi]++;
       }
+      top++;
     }
   }
   
@@ -37,19 +37,18 @@ void histoutput(nick *np, int clonecount, int amount, int total) {
 int ch_chanhistogram(void *source, int cargc, char **cargv) {
   nick *np = (nick *)source;
   nick *np2;
+  nickiter iter;
   int count[MAX_CHANS + 2], j, n, total = 0;
 
   memset(count, 0, sizeof(count));
 
-  for (j=0;j<NICKHASHSIZE;j++) {
-    for(np2=nicktable[j];np2;np2=np2->next) {
-      total++;
-      n = np2->channels->cursi;
-      if(n > MAX_CHANS) {
-        count[MAX_CHANS + 1]++;
-      } else {
-        count[n]++;
-      }
+  for (np2=firstnick(&iter);np2;np2=nextnick(&iter)) {
+    total++;
+    n = np2->channels->cursi;
+    if(n > MAX_CHANS) {
+      count[MAX_CHANS + 1]++;
+    } else {
+      count[n]++;
     }
   }
 
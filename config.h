@@ -0,0 +1,6 @@
+/* AUTOMATICALLY GENERATED -- DO NOT EDIT */
+#define HAVE_SQLITE
+#define HAVE_PGSQL
+#define HAVE_Z
+#define HAVE_DBAPI
+#define USE_DBAPI_PGSQL
@@ -198,7 +198,7 @@ void handlemessages(nick *target, int messagetype, void **args) {
         cargc=(cmd->maxparams)+1;
       }
       
-      (cmd->handler)((void *)sender,cargc-1,&(cargv[1]));
+      callcommand(cmd,(void *)sender,cargc-1,&(cargv[1]));
       break;
       
     case LU_KILLED:
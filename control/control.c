@@ -25,6 +25,7 @@
 #include "control_policy.h"
 
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 #include <stdarg.h>
 
@@ -96,6 +97,7 @@ int controllsmod(void *sender, int cargc, char **cargv);
 int controlrehash(void *sender, int cargc, char **cargv);
 int controlreload(void *sender, int cargc, char **cargv);
 int controlhelpcmd(void *sender, int cargc, char **cargv);
+int controlcmdprofile(void *sender, int cargc, char **cargv);
 void controlnoticeopers(flag_t permissionlevel, flag_t noticelevel, char *format, ...) __attribute__ ((format (printf, 3, 4)));
 void controlnoticeopers(flag_t permissionlevel, flag_t noticelevel, char *format, ...);
 int controlcheckpermitted(flag_t level, nick *user);
@@ -103,6 +105,8 @@ void handlesignal(int hooknum, void *arg);
 void noperserv_oper_detection(int hooknum, void *arg);
 void noperserv_whois_handler(int hooknum, void *arg);
 void noperserv_whois_account_handler(int hooknum, void *arg);
+static void noperserv_wall_init(void);
+static void noperserv_wall_fini(void);
 
 #define HOOK_CONTROL_WHOISREQUEST_AUTHNAME -1
 #define HOOK_CONTROL_WHOISREQUEST_AUTHEDUSER -2
@@ -129,6 +133,9 @@ void _init() {
   registercontrolhelpcmd("showcommands",NO_ACCOUNT,0,&controlshowcommands,"Usage: showcommands\nShows all registered commands.");
   registercontrolhelpcmd("reload",NO_DEVELOPER,1,&controlreload,"Usage: reload <module>\nReloads specified module.");
   registercontrolhelpcmd("help",NO_ANYONE,1,&controlhelpcmd,"Usage: help <command>\nShows help for specified command.");
+  registercontrolhelpcmd("cmdprofile",NO_DEVELOPER,2,&controlcmdprofile,"Usage: cmdprofile <on|off|reset|calls|total|avg|max|name> ?count?\n"
+    "Times every server message and service command handler.  on/off switch timing on or off, reset clears the\n"
+    "timings, and the others list the top ?count? (default 20) commands sorted by that column.");
  
   registerhook(HOOK_CORE_REHASH, &handlesignal);
   registerhook(HOOK_CORE_SIGINT, &handlesignal);
@@ -137,6 +144,8 @@ void _init() {
 
   noperserv_ext = registerauthnameext("noperserv", 1);
 
+  noperserv_wall_init();
+
   scheduleoneshot(time(NULL)+1,&controlconnect,NULL);
 
   init = 1;
@@ -164,6 +173,7 @@ void _fini() {
   deregistercontrolcmd("showcommands",&controlshowcommands);
   deregistercontrolcmd("reload",&controlreload);
   deregistercontrolcmd("help",&controlhelpcmd);
+  deregistercontrolcmd("cmdprofile",&controlcmdprofile);
   
   destroycommandtree(controlcmds);
 
@@ -175,6 +185,8 @@ void _fini() {
   releaseauthnameext(noperserv_ext);
 
   noperserv_cleanup_db();
+
+  noperserv_wall_fini();
 }
 
 void registercontrolhelpcmd(const char *name, int level, int maxparams, CommandHandler handler, char *helpstr) {
@@ -604,6 +616,124 @@ int controllsmod(void *sender, int cargc, char **cargv) {
   return CMD_OK;
 }
 
+static int cmdprofile_calls(const void *a, const void *b) {
+  const CommandProfile *pa=*(const CommandProfile **)a, *pb=*(const CommandProfile **)b;
+
+  return (pa->calls<pb->calls)-(pa->calls>pb->calls);
+}
+
+static int cmdprofile_total(const void *a, const void *b) {
+  const CommandProfile *pa=*(const CommandProfile **)a, *pb=*(const CommandProfile **)b;
+
+  return (pa->totalns<pb->totalns)-(pa->totalns>pb->totalns);
+}
+
+static int cmdprofile_avg(const void *a, const void *b) {
+  const CommandProfile *pa=*(const CommandProfile **)a, *pb=*(const CommandProfile **)b;
+  unsigned long long avga=pa->calls?pa->totalns/pa->calls:0, avgb=pb->calls?pb->totalns/pb->calls:0;
+
+  return (avga<avgb)-(avga>avgb);
+}
+
+static int cmdprofile_max(const void *a, const void *b) {
+  const CommandProfile *pa=*(const CommandProfile **)a, *pb=*(const CommandProfile **)b;
+
+  return (pa->maxns<pb->maxns)-(pa->maxns>pb->maxns);
+}
+
+static int cmdprofile_name(const void *a, const void *b) {
+  const CommandProfile *pa=*(const CommandProfile **)a, *pb=*(const CommandProfile **)b;
+
+  return strcmp(pa->command->command->content,pb->command->command->content);
+}
+
+/* Upper bound (in us) of the histogram bucket holding the given fraction of calls. */
+static unsigned long cmdprofile_percentile(CommandProfile *p, double fraction) {
+  unsigned long seen=0, want=(unsigned long)(p->calls*fraction);
+  int i;
+
+  for (i=0;i<CMDPROFILE_BUCKETS-1;i++) {
+    seen+=p->histogram[i];
+    if (seen>want)
+      break;
+  }
+
+  return 1UL<<i;
+}
+
+int controlcmdprofile(void *sender, int cargc, char **cargv) {
+  nick *np=(nick *)sender;
+  int (*sorter)(const void *, const void *);
+  CommandProfile *p, **list;
+  int i, n, count=20;
+
+  if (cargc<1)
+    return CMD_USAGE;
+
+  if (!ircd_strcmp(cargv[0],"on") || !ircd_strcmp(cargv[0],"off")) {
+    commandprofiling=!ircd_strcmp(cargv[0],"on");
+    controlwall(NO_DEVELOPER,NL_OPERATIONS,"%s switched command profiling %s.",controlid(np),commandprofiling?"on":"off");
+    controlreply(np,"Command profiling is now %s.",commandprofiling?"on":"off");
+    return CMD_OK;
+  }
+
+  if (!ircd_strcmp(cargv[0],"reset")) {
+    resetcommandprofiles();
+    controlreply(np,"Command profiles reset.");
+    return CMD_OK;
+  }
+
+  if (!ircd_strcmp(cargv[0],"calls"))
+    sorter=cmdprofile_calls;
+  else if (!ircd_strcmp(cargv[0],"total"))
+    sorter=cmdprofile_total;
+  else if (!ircd_strcmp(cargv[0],"avg"))
+    sorter=cmdprofile_avg;
+  else if (!ircd_strcmp(cargv[0],"max"))
+    sorter=cmdprofile_max;
+  else if (!ircd_strcmp(cargv[0],"name"))
+    sorter=cmdprofile_name;
+  else
+    return CMD_USAGE;
+
+  if (cargc>1 && (count=atoi(cargv[1]))<1)
+    return CMD_USAGE;
+
+  for (n=0,p=commandprofiles;p;p=p->next)
+    if (p->command && p->calls)
+      n++;
+
+  if (!n) {
+    controlreply(np,"No commands have been profiled%s.",commandprofiling?" yet":" (profiling is off)");
+    return CMD_OK;
+  }
+
+  if (!(list=malloc(n*sizeof(CommandProfile *)))) {
+    controlreply(np,"Out of memory.");
+    return CMD_ERROR;
+  }
+
+  for (i=0,p=commandprofiles;p;p=p->next)
+    if (p->command && p->calls)
+      list[i++]=p;
+
+  qsort(list,n,sizeof(CommandProfile *),sorter);
+
+  controlreply(np,"Profiling is %s.  Times in microseconds; percentiles are histogram bucket upper bounds.",commandprofiling?"on":"off");
+  controlreply(np,"%-20s %-20s %10s %12s %8s %8s %8s %8s","Command","Module","Calls","Total","Avg","Max","p50","p99");
+
+  for (i=0;i<n && i<count;i++) {
+    p=list[i];
+    controlreply(np,"%-20s %-20s %10lu %12llu %8llu %8llu %8lu %8lu",p->command->command->content,modulenamefromaddr((void *)p->command->handler),
+      p->calls,p->totalns/1000,p->totalns/1000/p->calls,p->maxns/1000,cmdprofile_percentile(p,0.5),cmdprofile_percentile(p,0.99));
+  }
+
+  controlreply(np,"End of list (%d of %d profiled commands).",(i<n)?i:n,n);
+  free(list);
+
+  return CMD_OK;
+}
+
 int controlreload(void *sender, int cargc, char **cargv) {
   if (cargc<1)
     return CMD_USAGE;
@@ -759,7 +889,7 @@ void handlemessages(nick *target, int messagetype, void **args) {
         cargc=(cmd->maxparams)+1;
       }
       
-      if((cmd->handler)((void *)sender,cargc-1,&(cargv[1])) == CMD_USAGE)
+      if(callcommand(cmd,(void *)sender,cargc-1,&(cargv[1])) == CMD_USAGE)
         controlhelp(sender, cmd);
 
       break;
@@ -838,14 +968,144 @@ void controlreply(nick *np, char *format, ...) {
   }
 }
 
+/*
+ * Wall subscribers: for each notice flag, the accounts that have it set
+ * and at least one nick online.  Kept up to date as nicks come and go
+ * and whenever an account's flags are saved, so a wall only looks at the
+ * people who will actually get it.
+ */
+static no_autheduser **wallsubs[NO_WALLBITS];
+static unsigned int wallcount[NO_WALLBITS], wallcapacity[NO_WALLBITS];
+static unsigned int wallgeneration;
+
+/* Identical walls in quick succession are sent once, then counted. */
+#define WALL_REPEAT_WINDOW 2
+
+static char lastwall[512];
+static flag_t lastwallperm, lastwalllevel;
+static unsigned int lastwallrepeats;
+static void *lastwallsched;
+
+static void wall_subscribe(int bit, no_autheduser *au) {
+  no_autheduser **newsubs;
+  unsigned int newcapacity;
+
+  if (wallcount[bit] == wallcapacity[bit]) {
+    newcapacity = wallcapacity[bit] ? wallcapacity[bit] * 2 : 16;
+    newsubs = realloc(wallsubs[bit], newcapacity * sizeof(no_autheduser *));
+    if (!newsubs) {
+      Error("noperserv", ERR_ERROR, "Unable to allocate wall subscriber list.");
+      return;
+    }
+
+    wallsubs[bit] = newsubs;
+    wallcapacity[bit] = newcapacity;
+  }
+
+  au->wallindex[bit] = wallcount[bit];
+  wallsubs[bit][wallcount[bit]++] = au;
+  au->wallflags |= 1 << bit;
+}
+
+static void wall_unsubscribe(int bit, no_autheduser *au) {
+  no_autheduser *last = wallsubs[bit][--wallcount[bit]];
+
+  wallsubs[bit][au->wallindex[bit]] = last;
+  last->wallindex[bit] = au->wallindex[bit];
+  au->wallflags &= ~(1 << bit);
+}
+
+static void wall_set(no_autheduser *au, flag_t want) {
+  flag_t changed = au->wallflags ^ want;
+  int bit;
+
+  for (bit = 0; bit < NO_WALLBITS; bit++) {
+    if (!(changed & (1 << bit)))
+      continue;
+
+    if (want & (1 << bit))
+      wall_subscribe(bit, au);
+    else
+      wall_unsubscribe(bit, au);
+  }
+}
+
+/* leaving is a nick that's about to go away, and shouldn't count as online. */
+void noperserv_wall_update(no_autheduser *au, nick *leaving) {
+  flag_t want = 0;
+  nick *np;
+
+  if (!au)
+    return;
+
+  if (!(NOGetAuthLevel(au) & __NO_RELAY)) {
+    for (np = au->authname->nicks; np; np = np->nextbyauthname) {
+      if (np != leaving) {
+        want = NOGetNoticeLevel(au) & ((1 << NO_WALLBITS) - 1);
+        break;
+      }
+    }
+  }
+
+  wall_set(au, want);
+}
+
+void noperserv_wall_remove(no_autheduser *au) {
+  wall_set(au, 0);
+}
+
+static void noperserv_wall_nick(int hooknum, void *arg) {
+  nick *np = arg;
+
+  noperserv_wall_update(NOGetAuthedUser(np), (hooknum == HOOK_NICK_LOSTNICK) ? np : NULL);
+}
+
+static void wall_send(flag_t permissionlevel, flag_t noticelevel, const char *text) {
+  char *flags = printflags(noticelevel, no_noticeflags) + 1;
+  no_autheduser *au;
+  unsigned int i;
+  nick *np;
+  int bit;
+
+  wallgeneration++;
+
+  for (bit = 0; bit < NO_WALLBITS; bit++) {
+    if (!(noticelevel & (1 << bit)))
+      continue;
+
+    for (i = 0; i < wallcount[bit]; i++) {
+      au = wallsubs[bit][i];
+
+      /* subscribed to more than one of the flags */
+      if (au->wallmark == wallgeneration)
+        continue;
+      au->wallmark = wallgeneration;
+
+      for(np=au->authname->nicks;np;np=np->nextbyauthname)
+        if(noperserv_policy_command_permitted(permissionlevel, np))
+          controlreply(np, "$%s$ %s", flags, text);
+    }
+  }
+}
+
+static void wall_flushrepeats(void *arg) {
+  char buf[100];
+
+  lastwallsched = NULL;
+
+  if (lastwallrepeats) {
+    snprintf(buf, sizeof(buf), "(last message repeated %u more time%s)", lastwallrepeats, (lastwallrepeats == 1) ? "" : "s");
+    wall_send(lastwallperm, lastwalllevel, buf);
+  }
+
+  lastwallrepeats = 0;
+  lastwall[0] = '\0';
+}
+
 void controlwall(flag_t permissionlevel, flag_t noticelevel, char *format, ...) {
   char buf[512];
   va_list va;
   char *flags = printflags(noticelevel, no_noticeflags) + 1;
-  int i;
-  authname *anp;
-  no_autheduser *au;
-  nick *np;
 
   va_start(va, format);
   vsnprintf(buf, sizeof(buf), format, va);
@@ -853,17 +1113,53 @@ void controlwall(flag_t permissionlevel, flag_t noticelevel, char *format, ...)
 
   Error("noperserv", ERR_INFO, "$%s$ %s", flags, buf);
 
-  for (i=0;i<AUTHNAMEHASHSIZE;i++) {
-    for (anp=authnametable[i];anp;anp=anp->next) {
-      au = noperserv_get_autheduser(anp);
-      if(!au)
-        continue;
-      if((NOGetNoticeLevel(au) & noticelevel) && !(NOGetAuthLevel(au) & __NO_RELAY)) {
-        for(np=anp->nicks;np;np=np->nextbyauthname)
-          if(noperserv_policy_command_permitted(permissionlevel, np))
-            controlreply(np, "$%s$ %s", flags, buf);
-      }
-    }
+  if (lastwallsched && permissionlevel == lastwallperm && noticelevel == lastwalllevel && !strcmp(buf, lastwall)) {
+    lastwallrepeats++;
+    return;
+  }
+
+  if (lastwallsched) {
+    deleteschedule(lastwallsched, &wall_flushrepeats, NULL);
+    wall_flushrepeats(NULL);
+  }
+
+  wall_send(permissionlevel, noticelevel, buf);
+
+  strcpy(lastwall, buf);
+  lastwallperm = permissionlevel;
+  lastwalllevel = noticelevel;
+  lastwallsched = scheduleoneshot(time(NULL) + WALL_REPEAT_WINDOW, &wall_flushrepeats, NULL);
+}
+
+static void noperserv_wall_init(void) {
+  authname *anp;
+  int i;
+
+  for (i=0;i<AUTHNAMEHASHSIZE;i++)
+    for (anp=authnametable[i];anp;anp=anp->next)
+      noperserv_wall_update(noperserv_get_autheduser(anp), NULL);
+
+  registerhook(HOOK_NICK_NEWNICK, &noperserv_wall_nick);
+  registerhook(HOOK_NICK_ACCOUNT, &noperserv_wall_nick);
+  registerhook(HOOK_NICK_LOSTNICK, &noperserv_wall_nick);
+}
+
+static void noperserv_wall_fini(void) {
+  int bit;
+
+  deregisterhook(HOOK_NICK_NEWNICK, &noperserv_wall_nick);
+  deregisterhook(HOOK_NICK_ACCOUNT, &noperserv_wall_nick);
+  deregisterhook(HOOK_NICK_LOSTNICK, &noperserv_wall_nick);
+
+  if (lastwallsched) {
+    deleteschedule(lastwallsched, &wall_flushrepeats, NULL);
+    lastwallsched = NULL;
+  }
+
+  for (bit = 0; bit < NO_WALLBITS; bit++) {
+    free(wallsubs[bit]);
+    wallsubs[bit] = NULL;
+    wallcount[bit] = wallcapacity[bit] = 0;
   }
 }
 
@@ -43,6 +43,9 @@ void controlhelp(nick *np, Command *cmd);
 void controlnswall(int noticelevel, char *format, ...) __attribute__ ((format (printf, 2, 3)));
 char *controlid(nick *);
 
+void noperserv_wall_update(no_autheduser *au, nick *leaving);
+void noperserv_wall_remove(no_autheduser *au);
+
 /* NEVER USE THE FOLLOWING IN COMMANDS, you'll end up missing bits off and users'll end up being able to gline people */
 #define __NO_ANYONE      0x000
 #define __NO_AUTHED      0x001 /* must be authed with the network, don't know what use this is really */
@@ -16,6 +16,7 @@
 #include "control.h"
 
 #include <stdlib.h>
+#include <string.h>
 
 int db_loaded = 0;
 unsigned long loadedusers = 0;
@@ -66,6 +67,8 @@ void noperserv_load_users(const DBAPIResult *res, void *arg) {
     nu->authlevel = strtoul(res->get(res, 2), NULL, 10);
     nu->noticelevel = strtoul(res->get(res, 3), NULL, 10);
     nu->newuser = 0;
+
+    noperserv_wall_update(nu, NULL);
   }
 
   Error("noperserv", ERR_INFO, "Loaded %lu users", loadedusers);
@@ -116,6 +119,8 @@ no_autheduser *noperserv_new_autheduser(unsigned long userid, char *name) {
   if(!au)
     return NULL;
 
+  memset(au, 0, sizeof(no_autheduser));
+
   au->authname = anp;
 
   loadedusers++;
@@ -140,10 +145,15 @@ void noperserv_update_autheduser(no_autheduser *au) {
   } else {
     nodb->squery(nodb, "UPDATE ? SET flags = ?, noticelevel = ? WHERE userid = ?", "Tuuu", "users", NOGetAuthLevel(au), NOGetNoticeLevel(au), au->authname->userid);
   }
+
+  /* every change to the flags ends up here */
+  noperserv_wall_update(au, NULL);
 }
 
 void noperserv_free_user(no_autheduser *au) {
   authname *anp = au->authname;
+
+  noperserv_wall_remove(au);
   anp->exts[noperserv_ext] = NULL;
   releaseauthname(anp);
   free(au);
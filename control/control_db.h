@@ -5,11 +5,16 @@
 
 typedef unsigned long no_tableid;
 
+#define NO_WALLBITS 16 /* number of NL_ notice flags */
+
 typedef struct no_autheduser {
   unsigned newuser: 1;
   authname *authname;
   flag_t authlevel;
   flag_t noticelevel;
+  flag_t wallflags;                   /* walls we're subscribed to: see noperserv_wall_update */
+  unsigned int wallindex[NO_WALLBITS];
+  unsigned int wallmark;
 } no_autheduser;
 
 int noperserv_load_db(void);
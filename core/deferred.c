@@ -0,0 +1,305 @@
+/* deferred.c */
+
+#include "deferred.h"
+#include "hooks.h"
+#include "config.h"
+#include "error.h"
+#include "nsmalloc.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+
+#define DEFERHASHSIZE 8192
+
+#define deferhash(q, cb, arg) ((unsigned int)((((uintptr_t)(arg)) >> 4) ^ (((uintptr_t)(cb)) >> 2) ^ ((uintptr_t)(q))) % DEFERHASHSIZE)
+
+static deferqueue *queues[DEFER_PRIOS];
+static deferitem *defertable[DEFERHASHSIZE];
+static deferitem *freeitems;
+static deferqueue *runningqueue;
+static int pending;
+
+static void deferredstats(int hooknum, void *arg);
+static void deferredrehash(int hooknum, void *arg);
+
+void initdeferred(void) {
+  registerhook(HOOK_CORE_STATSREQUEST, &deferredstats);
+  registerhook(HOOK_CORE_REHASH, &deferredrehash);
+}
+
+void finideferred(void) {
+  deregisterhook(HOOK_CORE_STATSREQUEST, &deferredstats);
+  deregisterhook(HOOK_CORE_REHASH, &deferredrehash);
+  nsfreeall(POOL_DEFERRED);
+}
+
+static long tvdiff(struct timeval *a, struct timeval *b) {
+  return (a->tv_sec - b->tv_sec) * 1000000L + (a->tv_usec - b->tv_usec);
+}
+
+/* The budget of any queue can be overridden with "<name>=<usec>" in the
+ * [deferred] section. */
+static void setbudget(deferqueue *q) {
+  sstring *ss = getconfigitem("deferred", q->name);
+
+  q->budget = (ss && atoi(ss->content) > 0) ? atoi(ss->content) : q->defaultbudget;
+}
+
+static deferitem *getdeferitem(void) {
+  deferitem *dip;
+
+  if (freeitems) {
+    dip = freeitems;
+    freeitems = dip->next;
+    return dip;
+  }
+
+  return nsmalloc(POOL_DEFERRED, sizeof(deferitem));
+}
+
+static void freedeferitem(deferitem *dip) {
+  dip->next = freeitems;
+  freeitems = dip;
+}
+
+static deferitem **finddeferitem(deferqueue *q, DeferredCallback callback, void *arg) {
+  deferitem **dh;
+
+  for (dh = &defertable[deferhash(q, callback, arg)]; *dh; dh = &(*dh)->hnext)
+    if ((*dh)->queue == q && (*dh)->callback == callback && (*dh)->arg == arg)
+      return dh;
+
+  return NULL;
+}
+
+/* Unlinks an item from its queue and the hash; dh is its hash slot. */
+static void unlinkdeferitem(deferitem **dh) {
+  deferitem *dip = *dh;
+  deferqueue *q = dip->queue;
+
+  *dh = dip->hnext;
+
+  if (dip->prev)
+    dip->prev->next = dip->next;
+  else
+    q->head = dip->next;
+
+  if (dip->next)
+    dip->next->prev = dip->prev;
+  else
+    q->tail = dip->prev;
+
+  q->depth--;
+  pending--;
+}
+
+deferqueue *newdeferqueue(const char *name, int priority, unsigned int budget) {
+  deferqueue *q, **qh;
+
+  if (priority < 0 || priority >= DEFER_PRIOS)
+    priority = DEFER_PRIO_NORMAL;
+
+  q = nscalloc(POOL_DEFERRED, 1, sizeof(deferqueue));
+  strncpy(q->name, name, sizeof(q->name) - 1);
+  q->priority = priority;
+  q->defaultbudget = budget ? budget : DEFER_DEFAULTBUDGET;
+  setbudget(q);
+
+  /* append, so queues of the same priority run in creation order */
+  for (qh = &queues[priority]; *qh; qh = &(*qh)->next)
+    ;
+  *qh = q;
+
+  return q;
+}
+
+/* Drops anything still queued.  Safe to call from one of the queue's own
+ * callbacks: the queue is then freed once the callback returns. */
+void freedeferqueue(deferqueue *q) {
+  deferqueue **qh;
+  deferitem *dip;
+
+  while ((dip = q->head)) {
+    unlinkdeferitem(finddeferitem(q, dip->callback, dip->arg));
+    freedeferitem(dip);
+  }
+
+  for (qh = &queues[q->priority]; *qh; qh = &(*qh)->next) {
+    if (*qh == q) {
+      *qh = q->next;
+      break;
+    }
+  }
+
+  if (q == runningqueue) {
+    q->dead = 1;
+    return;
+  }
+
+  nsfree(POOL_DEFERRED, q);
+}
+
+/* Returns 1 if the work was queued, 0 if it was already pending. */
+int defer(deferqueue *q, DeferredCallback callback, void *arg) {
+  deferitem *dip;
+  unsigned int hash;
+
+  if (finddeferitem(q, callback, arg)) {
+    q->coalesced++;
+    return 0;
+  }
+
+  dip = getdeferitem();
+  dip->callback = callback;
+  dip->arg = arg;
+  dip->queue = q;
+  gettimeofday(&dip->queued, NULL);
+
+  hash = deferhash(q, callback, arg);
+  dip->hnext = defertable[hash];
+  defertable[hash] = dip;
+
+  dip->next = NULL;
+  dip->prev = q->tail;
+  if (q->tail)
+    q->tail->next = dip;
+  else
+    q->head = dip;
+  q->tail = dip;
+
+  q->depth++;
+  q->queued++;
+  pending++;
+
+  return 1;
+}
+
+/* Returns 1 if the work was pending (and now isn't). */
+int canceldeferred(deferqueue *q, DeferredCallback callback, void *arg) {
+  deferitem **dh = finddeferitem(q, callback, arg);
+  deferitem *dip;
+
+  if (!dh)
+    return 0;
+
+  dip = *dh;
+  unlinkdeferitem(dh);
+  freedeferitem(dip);
+  q->cancelled++;
+
+  return 1;
+}
+
+/* Cancels everything queued with this argument, whatever the callback. */
+void canceldeferredarg(deferqueue *q, void *arg) {
+  deferitem *dip, *next;
+
+  for (dip = q->head; dip; dip = next) {
+    next = dip->next;
+    if (dip->arg == arg)
+      canceldeferred(q, dip->callback, arg);
+  }
+}
+
+int deferredpending(void) {
+  return pending;
+}
+
+/* Runs queued work: each queue gets its budget, and always at least one
+ * item, so low priority work can't be starved outright. */
+void rundeferred(void) {
+  struct timeval start, now;
+  deferqueue *q, *next;
+  deferitem *dip;
+  DeferredCallback callback;
+  void *arg;
+  long lag;
+  int i;
+
+  if (!pending)
+    return;
+
+  for (i = 0; i < DEFER_PRIOS; i++) {
+    for (q = queues[i]; q; q = next) {
+      if (!q->head) {
+        next = q->next;
+        continue;
+      }
+
+      runningqueue = q;
+      gettimeofday(&start, NULL);
+      now = start;
+
+      while ((dip = q->head)) {
+        if (tvdiff(&now, &start) >= (long)q->budget) {
+          q->overruns++;
+          break;
+        }
+
+        callback = dip->callback;
+        arg = dip->arg;
+
+        lag = tvdiff(&now, &dip->queued);
+        q->totallag += lag;
+        if (lag > (long)q->maxlag)
+          q->maxlag = lag;
+
+        unlinkdeferitem(finddeferitem(q, callback, arg));
+        freedeferitem(dip);
+        q->run++;
+
+        callback(arg);
+
+        if (q->dead)
+          break;
+
+        gettimeofday(&now, NULL);
+      }
+
+      runningqueue = NULL;
+      next = q->next;
+
+      if (q->dead)
+        nsfree(POOL_DEFERRED, q);
+    }
+  }
+}
+
+static void deferredrehash(int hooknum, void *arg) {
+  deferqueue *q;
+  int i;
+
+  for (i = 0; i < DEFER_PRIOS; i++)
+    for (q = queues[i]; q; q = q->next)
+      setbudget(q);
+}
+
+static void deferredstats(int hooknum, void *arg) {
+  long level = (long)arg;
+  struct timeval now;
+  deferqueue *q;
+  char buf[512];
+  int i;
+
+  if (level <= 5)
+    return;
+
+  gettimeofday(&now, NULL);
+
+  sprintf(buf, "Deferred:%7d items pending", pending);
+  triggerhook(HOOK_CORE_STATSREPLY, (void *)buf);
+
+  for (i = 0; i < DEFER_PRIOS; i++) {
+    for (q = queues[i]; q; q = q->next) {
+      snprintf(buf, sizeof(buf), "Deferred: %-16s prio %d, %6uus budget: %7d pending (oldest %ldms), %9lu run, %7lu coalesced, %7lu cancelled",
+               q->name, q->priority, q->budget, q->depth, q->head ? tvdiff(&now, &q->head->queued) / 1000 : 0,
+               q->run, q->coalesced, q->cancelled);
+      triggerhook(HOOK_CORE_STATSREPLY, (void *)buf);
+
+      snprintf(buf, sizeof(buf), "Deferred: %-16s lag %.2fms average, %.2fms max, %lu iterations out of budget",
+               q->name, q->run ? (double)q->totallag / q->run / 1000.0 : 0.0, q->maxlag / 1000.0, q->overruns);
+      triggerhook(HOOK_CORE_STATSREPLY, (void *)buf);
+    }
+  }
+}
@@ -0,0 +1,67 @@
+/* deferred.h */
+
+#ifndef __DEFERRED_H
+#define __DEFERRED_H
+
+#include <sys/time.h>
+
+/* Deferred work: modules queue non-urgent work (e.g. post-connect checks)
+ * instead of doing it inline in a hook.  The main loop runs queued work
+ * after the scheduler, highest priority first, spending at most each
+ * queue's budget (in microseconds) per loop iteration, so a connect storm
+ * turns into a backlog rather than a stalled main loop.
+ *
+ * Work is identified by (callback, arg); queueing something that's already
+ * pending does nothing.  The queue holds only the pointer, so modules must
+ * cancel work for anything they free (e.g. on HOOK_NICK_LOSTNICK). */
+
+#define DEFER_PRIO_HIGH     0
+#define DEFER_PRIO_NORMAL   1
+#define DEFER_PRIO_LOW      2
+#define DEFER_PRIOS         3
+
+#define DEFER_DEFAULTBUDGET 2000
+
+typedef void (*DeferredCallback)(void *);
+
+typedef struct deferitem {
+  DeferredCallback  callback;
+  void             *arg;
+  struct timeval    queued;
+  struct deferqueue *queue;
+  struct deferitem *next, *prev;   /* queue order */
+  struct deferitem *hnext;         /* coalescing hash chain */
+} deferitem;
+
+typedef struct deferqueue {
+  char              name[32];
+  int               priority;
+  unsigned int      budget;        /* microseconds per loop iteration */
+  unsigned int      defaultbudget;
+  int               dead;
+
+  deferitem        *head, *tail;
+  int               depth;
+
+  unsigned long     queued, coalesced, cancelled, run;
+  unsigned long     overruns;      /* iterations that ran out of budget */
+  unsigned long long totallag;     /* microseconds, over all items run */
+  unsigned long     maxlag;
+
+  struct deferqueue *next;
+} deferqueue;
+
+void initdeferred(void);
+void finideferred(void);
+
+deferqueue *newdeferqueue(const char *name, int priority, unsigned int budget);
+void freedeferqueue(deferqueue *q);
+
+int defer(deferqueue *q, DeferredCallback callback, void *arg);
+int canceldeferred(deferqueue *q, DeferredCallback callback, void *arg);
+void canceldeferredarg(deferqueue *q, void *arg);
+
+int deferredpending(void);
+void rundeferred(void);
+
+#endif
@@ -1,11 +1,14 @@
 /* hooks.c */
 
+#define _POSIX_C_SOURCE 199309L
+
 #include "hooks.h"
 #include <assert.h>
 #include "../core/error.h"
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
+#include <time.h>
 
 #define HF_CONTIGUOUS 0x01
 
@@ -13,6 +16,8 @@ typedef struct Hook {
   HookCallback callback;
   long priority;
   short flags;
+  unsigned long calls;
+  unsigned long long totalns, maxns;
   struct Hook *next;
 } Hook;
 
@@ -26,6 +31,7 @@ static int dirtyhooks[HOOKMAX];
 static int dirtyhookcount;
 
 unsigned int hookqueuelength = 0;
+int hookprofiling = 0;
 
 static void collectgarbage(HookHead *h);
 static void markdirty(int hook);
@@ -58,6 +64,8 @@ int registerpriorityhook(int hooknum, HookCallback callback, long priority) {
   n->priority = priority;
   n->callback = callback;
   n->flags = 0;
+  n->calls = 0;
+  n->totalns = n->maxns = 0;
 
   if(!pred) {
     n->next = h->head;
@@ -91,6 +99,24 @@ int deregisterhook(int hooknum, HookCallback callback) {
   return 1;
 }
   
+/* A deregistered hook isn't freed until the queue is empty, so hp is
+ * still there afterwards even if the callback removed itself. */
+static void profilehook(Hook *hp, int hooknum, void *arg) {
+  struct timespec start, end;
+  unsigned long long ns;
+
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  (hp->callback)(hooknum, arg);
+  clock_gettime(CLOCK_MONOTONIC, &end);
+
+  ns = (end.tv_sec - start.tv_sec) * 1000000000ULL + end.tv_nsec - start.tv_nsec;
+
+  hp->calls++;
+  hp->totalns += ns;
+  if(ns > hp->maxns)
+    hp->maxns = ns;
+}
+
 void triggerhook(int hooknum, void *arg) {
   int i;
   Hook *hp;
@@ -100,8 +126,12 @@ void triggerhook(int hooknum, void *arg) {
     
   hookqueuelength++;
   for(hp=hooks[hooknum].head;hp;hp=hp->next) {
-    if(hp->callback)
-      (hp->callback)(hooknum, arg);
+    if(hp->callback) {
+      if(hookprofiling)
+        profilehook(hp, hooknum, arg);
+      else
+        (hp->callback)(hooknum, arg);
+    }
   }
   hookqueuelength--;
 
@@ -147,3 +177,40 @@ static void collectgarbage(HookHead *h) {
 
   h->dirty = 0;
 }
+
+/* Copies out up to max profiles of callbacks that have been called,
+ * returns how many there are in total. */
+int gethookprofiles(HookProfile *profiles, int max) {
+  int i, count = 0;
+  Hook *hp;
+
+  for(i=0;i<HOOKMAX;i++) {
+    for(hp=hooks[i].head;hp;hp=hp->next) {
+      if(!hp->callback || !hp->calls)
+        continue;
+
+      if(count < max) {
+        profiles[count].hooknum = i;
+        profiles[count].callback = hp->callback;
+        profiles[count].calls = hp->calls;
+        profiles[count].totalns = hp->totalns;
+        profiles[count].maxns = hp->maxns;
+      }
+      count++;
+    }
+  }
+
+  return count;
+}
+
+void resethookprofiles(void) {
+  int i;
+  Hook *hp;
+
+  for(i=0;i<HOOKMAX;i++) {
+    for(hp=hooks[i].head;hp;hp=hp->next) {
+      hp->calls = 0;
+      hp->totalns = hp->maxns = 0;
+    }
+  }
+}
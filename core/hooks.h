@@ -24,6 +24,7 @@
 #define HOOK_IRC_SENDBURSTNICKS    103  /* Located in server.c now to fix burst bug */
 #define HOOK_IRC_SENDBURSTBURSTS   104  /* Located in server.c now to fix burst bug */
 #define HOOK_IRC_PRE_DISCON        105
+#define HOOK_IRC_PINGREPLY         106  /* Argument is long, round trip to our uplink in ms */
 
 #define HOOK_SERVER_NEWSERVER      200  /* Argument is number of new server */
 #define HOOK_SERVER_LOSTSERVER     201  /* Argument is number of lost server */
@@ -44,6 +45,8 @@
 #define HOOK_NICK_MODECHANGE       310  /* Argument is void*[2] (nick *, oldmodes) */
 #define HOOK_NICK_MESSAGE          311  /* Argument is void*[3] (nick *, message, isnotice) */
 #define HOOK_NICK_PRE_LOSTNICK     312  /* Argument is nick* */
+#define HOOK_NICK_BURSTBATCH       313  /* Argument is nickbatch*, see nick.h */
+#define HOOK_NICK_LOSTBATCH        314  /* Argument is nickbatch*, see nick.h */
 
 #define HOOK_CHANNEL_BURST         400  /* Argument is channel pointer */
 #define HOOK_CHANNEL_CREATE        401  /* Argument is void*[2] (channel, nick) */
@@ -64,6 +67,7 @@
 
 #define HOOK_CHANNEL_NEWNICK       415  /* Argument is void*[2] (channel, nick) */
 #define HOOK_CHANNEL_LOSTNICK      416  /* Argument is void*[2] (channel, nick) */
+#define HOOK_CHANNEL_BURSTBATCH    417  /* Argument is chanbatch*, see channel.h */
 
 #define HOOK_CHANSERV_DBLOADED     500 /* No arg */
 /* 501 spare for now */
@@ -108,6 +112,10 @@
 #define HOOK_LUA_LOADSCRIPT        1300 /* Argument is void*[2] (char *, lua_State *) */
 #define HOOK_LUA_UNLOADSCRIPT      1301 /* Argument is lua_State* */
 
+#define HOOK_GLINE_NEWGLINE        1400 /* Argument is gline* */
+#define HOOK_GLINE_MODIFIED        1401 /* Argument is gline* */
+#define HOOK_GLINE_LOSTGLINE       1402 /* Argument is gline*, about to be freed */
+
 #define PRIORITY_DEFAULT           0
 
 #define PRIORITY_MAX               LONG_MIN
@@ -115,12 +123,25 @@
 
 typedef void (*HookCallback)(int, void *);
 
+/* Per callback timings, collected while hookprofiling is set.  Times
+ * include any hooks the callback triggers itself. */
+typedef struct HookProfile {
+  int hooknum;
+  HookCallback callback;
+  unsigned long calls;
+  unsigned long long totalns;
+  unsigned long long maxns;
+} HookProfile;
+
 extern unsigned int hookqueuelength;
+extern int hookprofiling;
 
 void inithooks();
 int registerhook(int hooknum, HookCallback callback);
 int deregisterhook(int hooknum, HookCallback callback);
 void triggerhook(int hooknum, void *arg);
 int registerpriorityhook(int hooknum, HookCallback callback, long priority);
+int gethookprofiles(HookProfile *profiles, int max);
+void resethookprofiles(void);
 
 #endif
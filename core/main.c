@@ -2,6 +2,7 @@
 #include "../lib/valgrind.h"
 #include "events.h"
 #include "schedule.h"
+#include "deferred.h"
 #include "hooks.h"
 #include "modules.h"
 #include "config.h"
@@ -42,6 +43,7 @@ int main(int argc, char **argv) {
   inithooks();
   inithandlers();
   initschedule();
+  initdeferred();
 
   init_logfile();
   
@@ -75,8 +77,10 @@ int main(int argc, char **argv) {
 
   /* Main loop */
   for(;;) {
-    handleevents(10);  
+    /* don't sleep in poll() while there's deferred work waiting */
+    handleevents(deferredpending() ? 0 : 10);
     doscheduledevents(time(NULL));
+    rundeferred();
 
     if (newserv_shutdown_pending) {
       newserv_shutdown();
@@ -89,6 +93,7 @@ int main(int argc, char **argv) {
   freeconfig();
 
   fini_logfile();
+  finideferred();
   finischedule();
   finihandlers();
 
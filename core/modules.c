@@ -3,6 +3,8 @@
  *
  * Provides functions for dealing with dynamic modules.
  */
+
+#define _GNU_SOURCE
  
 #include <stdlib.h>
 #include <dlfcn.h>
@@ -493,3 +495,25 @@ void *ndlsym(char *modulename, char *fn) {
 
   return dlsym(mods[i].handle, fn);
 }
+
+/* Name of the module (or "core") that addr is in, for profiling output.
+ * Returns a static buffer. */
+const char *modulenamefromaddr(void *addr) {
+  static char buf[MODULENAMELEN+1];
+  const char *name, *ext;
+  Dl_info info;
+
+  if (!dladdr(addr, &info) || !info.dli_fname)
+    return "?";
+
+  if ((name=strrchr(info.dli_fname, '/')))
+    name++;
+  else
+    name=info.dli_fname;
+
+  if (!(ext=strstr(name, ".so")))
+    return "core";
+
+  snprintf(buf, sizeof(buf), "%.*s", (int)(ext-name), name);
+  return buf;
+}
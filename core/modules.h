@@ -29,6 +29,7 @@ void reloadmarked(void);
 void safereload(char *themodule);
 void newserv_shutdown();
 void *ndlsym(char *module, char *fn);
+const char *modulenamefromaddr(void *addr);
 
 extern int newserv_shutdown_pending;
 
@@ -2,7 +2,11 @@
 
 #include <stdlib.h>
 #include <string.h>
+#include <stdint.h>
 #include <assert.h>
+#ifdef __GLIBC__
+#include <execinfo.h>
+#endif
 
 #include "nsmalloc.h"
 #define __NSMALLOC_C
@@ -16,10 +20,199 @@
 
 struct nsmpool nsmpools[MAXPOOL];
 
-void *nsmalloc(unsigned int poolid, size_t size) {
+int nsmprofiling;
+size_t nsmsamplesize;  /* sample every allocation at least this big, 0 for none */
+
+/* sites and stacks start at 1, as 0 in a block means it has neither */
+struct nsmsite nsmsites[NSM_MAXSITES];
+unsigned int nsmsitecount = 1;
+struct nsmstack nsmstacks[NSM_MAXSTACKS];
+unsigned int nsmstackcount = 1;
+
+/* open addressing, twice the size of nsmsites so it never gets too full */
+#define NSM_SITEHASH (NSM_MAXSITES * 2)
+static uint16_t nsmsitehash[NSM_SITEHASH];
+
+int nsmsizeclass(size_t size) {
+  size_t limit = 16;
+  int class = 0;
+
+  while (size > limit && class < NSM_SIZECLASSES - 1) {
+    limit <<= 1;
+    class++;
+  }
+
+  return class;
+}
+
+static unsigned int nsmfindsite(unsigned int poolid, void *caller) {
+  unsigned int h = (((uintptr_t)caller >> 2) * 2654435761U + poolid) % NSM_SITEHASH;
+  struct nsmsite *sp;
+
+  for (;; h = (h + 1) % NSM_SITEHASH) {
+    if (!nsmsitehash[h])
+      break;
+
+    sp = &nsmsites[nsmsitehash[h]];
+    if (sp->caller == caller && sp->poolid == poolid)
+      return nsmsitehash[h];
+  }
+
+  /* once it's full, new callsites just aren't charged */
+  if (nsmsitecount == NSM_MAXSITES)
+    return 0;
+
+  sp = &nsmsites[nsmsitecount];
+  memset(sp, 0, sizeof(struct nsmsite));
+  sp->caller = caller;
+  sp->poolid = poolid;
+
+  nsmsitehash[h] = nsmsitecount;
+  return nsmsitecount++;
+}
+
+static unsigned int nsmsamplestack(unsigned int poolid) {
+#ifdef __GLIBC__
+  void *frames[NSM_STACKDEPTH + 2];
+  struct nsmstack *st;
+  unsigned int i;
+  int depth;
+
+  /* skip ourselves and nsmalloc */
+  depth = backtrace(frames, NSM_STACKDEPTH + 2) - 2;
+  if (depth <= 0)
+    return 0;
+
+  /* there aren't many distinct ones, a linear search is fine */
+  for (i = 1; i < nsmstackcount; i++) {
+    st = &nsmstacks[i];
+    if (st->poolid == poolid && st->depth == depth && !memcmp(st->frames, frames + 2, depth * sizeof(void *)))
+      return i;
+  }
+
+  if (nsmstackcount == NSM_MAXSTACKS)
+    return 0;
+
+  st = &nsmstacks[nsmstackcount];
+  memset(st, 0, sizeof(struct nsmstack));
+  memcpy(st->frames, frames + 2, depth * sizeof(void *));
+  st->depth = depth;
+  st->poolid = poolid;
+
+  return nsmstackcount++;
+#else
+  return 0;
+#endif
+}
+
+/* The per pool counters are always kept, sites and stacks only while
+ * profiling. */
+static void nsmaccount(unsigned int poolid, struct nsminfo *nsmp, void *caller) {
+  struct nsmpool *pool = &nsmpools[poolid];
+  struct nsmsite *sp;
+  struct nsmstack *st;
+
+  pool->size+=nsmp->size;
+  pool->count++;
+  pool->allocs++;
+  pool->classallocs[nsmsizeclass(nsmp->size)]++;
+  pool->classlive[nsmsizeclass(nsmp->size)]++;
+
+  if (pool->size > pool->peaksize)
+    pool->peaksize = pool->size;
+  if (pool->count > pool->peakcount)
+    pool->peakcount = pool->count;
+
+  nsmp->site = 0;
+  nsmp->stack = 0;
+
+  if (!nsmprofiling)
+    return;
+
+  if ((nsmp->site = nsmfindsite(poolid, caller))) {
+    sp = &nsmsites[nsmp->site];
+    sp->allocs++;
+    sp->count++;
+    sp->size+=nsmp->size;
+
+    if (sp->size > sp->peaksize)
+      sp->peaksize = sp->size;
+    if (sp->count > sp->peakcount)
+      sp->peakcount = sp->count;
+  }
+
+  if ((nsmsamplesize && nsmp->size >= nsmsamplesize) || (pool->sampleevery && ++pool->samplecount >= pool->sampleevery)) {
+    pool->samplecount = 0;
+
+    if ((nsmp->stack = nsmsamplestack(poolid))) {
+      st = &nsmstacks[nsmp->stack];
+      st->samples++;
+      st->count++;
+      st->size+=nsmp->size;
+    }
+  }
+}
+
+static void nsmunaccount(unsigned int poolid, struct nsminfo *nsmp) {
+  struct nsmpool *pool = &nsmpools[poolid];
+
+  pool->size-=nsmp->size;
+  pool->count--;
+  pool->frees++;
+  pool->classlive[nsmsizeclass(nsmp->size)]--;
+
+  /* see nsmresetprofile() for why these are checked */
+  if (nsmp->site && nsmsites[nsmp->site].count && nsmsites[nsmp->site].size >= nsmp->size) {
+    nsmsites[nsmp->site].frees++;
+    nsmsites[nsmp->site].count--;
+    nsmsites[nsmp->site].size-=nsmp->size;
+  }
+
+  if (nsmp->stack && nsmstacks[nsmp->stack].count && nsmstacks[nsmp->stack].size >= nsmp->size) {
+    nsmstacks[nsmp->stack].count--;
+    nsmstacks[nsmp->stack].size-=nsmp->size;
+  }
+}
+
+/* Realloc leaves a block charged to whoever allocated it. */
+static void nsmresize(unsigned int poolid, struct nsminfo *nsmp, size_t size) {
+  struct nsmpool *pool = &nsmpools[poolid];
+  struct nsmsite *sp;
+
+  pool->classlive[nsmsizeclass(nsmp->size)]--;
+  pool->classlive[nsmsizeclass(size)]++;
+
+  pool->size=pool->size - nsmp->size + size;
+  if (pool->size > pool->peaksize)
+    pool->peaksize = pool->size;
+
+  if (nsmp->site && nsmsites[nsmp->site].count && nsmsites[nsmp->site].size >= nsmp->size) {
+    sp = &nsmsites[nsmp->site];
+    sp->size=sp->size - nsmp->size + size;
+    if (sp->size > sp->peaksize)
+      sp->peaksize = sp->size;
+  }
+
+  if (nsmp->stack && nsmstacks[nsmp->stack].count && nsmstacks[nsmp->stack].size >= nsmp->size)
+    nsmstacks[nsmp->stack].size=nsmstacks[nsmp->stack].size - nsmp->size + size;
+
+  nsmp->size=size;
+}
+
+/* Forgets all sites and stacks.  Blocks allocated before this still
+ * carry their old numbers, and freeing one uncharges whatever has taken
+ * that slot since (if it's got enough charged to it), which can make a
+ * site look a little better than it is until they're all gone. */
+void nsmresetprofile(void) {
+  memset(nsmsitehash, 0, sizeof(nsmsitehash));
+  nsmsitecount = 1;
+  nsmstackcount = 1;
+}
+
+static void *nsmalloc_at(unsigned int poolid, size_t size, void *caller) {
   struct nsminfo *nsmp;
   
-  if (poolid >= MAXPOOL)
+  if (poolid >= MAXPOOL || size > UINT32_MAX)
     return NULL;
   
   /* Allocate enough for the structure and the required data */
@@ -31,8 +224,7 @@ void *nsmalloc(unsigned int poolid, size_t size) {
   VALGRIND_CREATE_MEMPOOL(nsmp, 0, 0);
 
   nsmp->size=size;
-  nsmpools[poolid].size+=size;
-  nsmpools[poolid].count++;
+  nsmaccount(poolid, nsmp, caller);
 
   if (nsmpools[poolid].blocks) {
     nsmpools[poolid].blocks->prev = nsmp;
@@ -49,11 +241,18 @@ void *nsmalloc(unsigned int poolid, size_t size) {
   return (void *)nsmp->data;
 }
 
+void *nsmalloc(unsigned int poolid, size_t size) {
+  return nsmalloc_at(poolid, size, __builtin_return_address(0));
+}
+
 void *nscalloc(unsigned int poolid, size_t nmemb, size_t size) {
   size_t total = nmemb * size;
   void *m;
 
-  m = nsmalloc(poolid, total);
+  if (size && total / size != nmemb)
+    return NULL;
+
+  m = nsmalloc_at(poolid, total, __builtin_return_address(0));
   if(!m)
     return NULL;
 
@@ -77,14 +276,13 @@ void nsfree(unsigned int poolid, void *ptr) {
   if (nsmp->prev) {
     nsmp->prev->next = nsmp->next;
   } else
-    nsmpools[poolid].blocks = NULL;
+    nsmpools[poolid].blocks = nsmp->next;
 
   if (nsmp->next) {
     nsmp->next->prev = nsmp->prev;
   }
 
-  nsmpools[poolid].size-=nsmp->size;
-  nsmpools[poolid].count--;
+  nsmunaccount(poolid, nsmp);
 
   VALGRIND_MEMPOOL_FREE(nsmp, nsmp->data);
 
@@ -98,14 +296,14 @@ void *nsrealloc(unsigned int poolid, void *ptr, size_t size) {
   struct nsminfo *nsmp, *nsmpn;
 
   if (ptr == NULL)
-    return nsmalloc(poolid, size);
+    return nsmalloc_at(poolid, size, __builtin_return_address(0));
 
   if (size == 0) {
     nsfree(poolid, ptr);
     return NULL;
   }
 
-  if (poolid >= MAXPOOL)
+  if (poolid >= MAXPOOL || size > UINT32_MAX)
     return NULL;
 
   /* evil */
@@ -122,8 +320,7 @@ void *nsrealloc(unsigned int poolid, void *ptr, size_t size) {
 
   VALGRIND_MOVE_MEMPOOL(nsmp, nsmpn);
 
-  nsmpools[poolid].size+=size-nsmpn->size;
-  nsmpn->size=size;
+  nsmresize(poolid, nsmpn, size);
 
   if (nsmpn->prev) {
     nsmpn->prev->next=nsmpn;
@@ -147,6 +344,7 @@ void nsfreeall(unsigned int poolid) {
  
   for (nsmp=nsmpools[poolid].blocks;nsmp;nsmp=nnsmp) {
     nnsmp=nsmp->next;
+    nsmunaccount(poolid, nsmp);
     VALGRIND_MEMPOOL_FREE(nsmp, nsmp->data);
 
     VALGRIND_DESTROY_MEMPOOL(nsmp);
@@ -30,17 +30,67 @@ struct nsminfo {
   struct nsminfo *next;
   struct nsminfo *prev;
 
-  size_t size;
+  uint32_t size;
+  uint16_t site;    /* callsite, if allocated while profiling (else 0) */
+  uint16_t stack;   /* sampled stack trace, if it was sampled (else 0) */
   uint64_t redzone;
   char data[];
 };
 
+/* Size classes are powers of two: class n holds blocks of up to 16<<n
+ * bytes, the last one everything bigger. */
+#define NSM_SIZECLASSES 16
+
 struct nsmpool {
   unsigned long count;
   size_t size;
   struct nsminfo *blocks;
+
+  /* these are kept whether or not profiling is on */
+  unsigned long allocs, frees;
+  unsigned long peakcount;
+  size_t peaksize;
+  unsigned long classallocs[NSM_SIZECLASSES];
+  unsigned long classlive[NSM_SIZECLASSES];
+
+  unsigned int sampleevery;  /* sample a stack every this many allocations, 0 for none */
+  unsigned int samplecount;
+};
+
+/* Allocation profiling: while nsmprofiling is set, every allocation is
+ * charged to the code that asked for it, and sampled allocations record
+ * a stack trace too. */
+#define NSM_MAXSITES    4096
+#define NSM_MAXSTACKS   1024
+#define NSM_STACKDEPTH  12
+
+struct nsmsite {
+  void *caller;
+  unsigned int poolid;
+  unsigned long allocs, frees;
+  unsigned long count, peakcount;
+  size_t size, peaksize;
+};
+
+struct nsmstack {
+  void *frames[NSM_STACKDEPTH];
+  int depth;
+  unsigned int poolid;
+  unsigned long samples;     /* allocations sampled here */
+  unsigned long count;       /* ... still allocated */
+  size_t size;
 };
 
+extern int nsmprofiling;
+extern size_t nsmsamplesize;
+extern struct nsmsite nsmsites[NSM_MAXSITES];
+extern unsigned int nsmsitecount;
+extern struct nsmstack nsmstacks[NSM_MAXSTACKS];
+extern unsigned int nsmstackcount;
+
+int nsmsizeclass(size_t size);
+void nsmresetprofile(void);
+
 extern struct nsmpool nsmpools[MAXPOOL];
 
 #endif
@@ -69,7 +119,9 @@ beginpools() {
   pool(SPAMSCAN2),
   pool(ACHIEVEMENTS),
   pool(CHANSTATS),
-  pool(SCHEDULE)
+  pool(SCHEDULE),
+  pool(DEFERRED),
+  pool(ARRAY)
 } endpools()
 
 #undef pool
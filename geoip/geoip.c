@@ -7,56 +7,104 @@
 #include "../core/error.h"
 #include "../core/config.h"
 #include "../core/hooks.h"
+#include "../core/schedule.h"
 #include "../control/control.h"
 #include "../lib/version.h"
+#include "../lib/irc_string.h"
 
+#include <string.h>
 #include <strings.h>
+#include <arpa/inet.h>
 
 #include "libGeoIP/GeoIP.h"
+#include "mmdb.h"
 #include "geoip.h"
 
 MODULE_VERSION("");
 
+/* Users re-tagged per main loop iteration after a (re)load. */
+#define GEOIP_RETAGBATCH 2000
+
 int geoip_totals[COUNTRY_MAX + 1];
 static int geoip_nickext = -1;
+
+/* Exactly one of these is open: a legacy GeoIP.dat, or an mmdb (used when
+ * the configured file name ends in .mmdb). */
 static GeoIP *gi = NULL;
+static mmdb *mdb = NULL;
+static sstring *dbfilename;
+
+/* ISO code -> legacy country id, for mmdb results. */
+static short codetoid[26 * 26];
+
+static int retagbucket = -1;
+static nick *retagnext;
+static void *retagsched;
 
 static void geoip_setupuser(nick *np);
+static int geoip_open(void);
+static void geoip_startretag(void);
+static void geoip_retagstep(void *arg);
 
 static void geoip_new_nick(int hook, void *args);
+static void geoip_burstbatch(int hook, void *args);
 static void geoip_quit(int hook, void *args);
+static void geoip_rename(int hook, void *args);
 static void geoip_whois_handler(int hooknum, void *arg);
+static void geoip_rehash(int hooknum, void *arg);
+static int geoip_doreload(void *source, int cargc, char **cargv);
 
 void _init(void) {
   int i;
   nick *np;
-  sstring *filename;
 
-  filename = getcopyconfigitem("geoip", "db", "GeoIP.dat", 256);
-  gi = GeoIP_open(filename->content, GEOIP_MEMORY_CACHE);
-  freesstring(filename);
+  for(i=0;i<26*26;i++)
+    codetoid[i] = -1;
+  for(i=COUNTRY_MIN;i<COUNTRY_MAX;i++) {
+    const char *code = GeoIP_country_code[i];
+
+    if(code[0] >= 'A' && code[0] <= 'Z' && code[1] >= 'A' && code[1] <= 'Z' && !code[2])
+      codetoid[(code[0] - 'A') * 26 + (code[1] - 'A')] = i;
+  }
+
+  dbfilename = getcopyconfigitem("geoip", "db", "GeoIP.dat", 256);
 
-  if(!gi)
+  if(!geoip_open())
     return;
 
   geoip_nickext = registernickext("geoip");
   if(geoip_nickext == -1)
     return; /* PPA: registerchanext produces an error, however the module should stop loading */
 
+  /* Everyone starts out as unknown (country 0) and is tagged over the next
+   * few loop iterations rather than all at once. */
   memset(geoip_totals, 0, sizeof(geoip_totals));
-
   for(i=0;i<NICKHASHSIZE;i++)
     for(np=nicktable[i];np;np=np->next)
-      geoip_setupuser(np);
+      geoip_totals[COUNTRY_MIN]++;
 
   registerhook(HOOK_NICK_LOSTNICK, &geoip_quit);
   registerhook(HOOK_NICK_NEWNICK, &geoip_new_nick);
+  registerhook(HOOK_NICK_BURSTBATCH, &geoip_burstbatch);
+  registerhook(HOOK_NICK_RENAME, &geoip_rename);
   registerhook(HOOK_CONTROL_WHOISREQUEST, &geoip_whois_handler);
+  registerhook(HOOK_CORE_REHASH, &geoip_rehash);
+
+  registercontrolhelpcmd("geoipreload", NO_OPER, 0, &geoip_doreload, "Usage: geoipreload\nReloads the GeoIP database and re-tags all users.");
+
+  geoip_startretag();
 }
 
 void _fini(void) {
+  if(retagsched)
+    deleteschedule(retagsched, geoip_retagstep, NULL);
+
   if(gi)
     GeoIP_delete(gi);
+  if(mdb)
+    mmdb_close(mdb);
+
+  freesstring(dbfilename);
 
   if(geoip_nickext == -1)
     return;
@@ -64,39 +112,237 @@ void _fini(void) {
   releasenickext(geoip_nickext);
 
   deregisterhook(HOOK_NICK_NEWNICK, &geoip_new_nick);
+  deregisterhook(HOOK_NICK_BURSTBATCH, &geoip_burstbatch);
   deregisterhook(HOOK_NICK_LOSTNICK, &geoip_quit);
+  deregisterhook(HOOK_NICK_RENAME, &geoip_rename);
   deregisterhook(HOOK_CONTROL_WHOISREQUEST, &geoip_whois_handler);
+  deregisterhook(HOOK_CORE_REHASH, &geoip_rehash);
+
+  deregistercontrolcmd("geoipreload", &geoip_doreload);
 }
 
-static void geoip_setupuser(nick *np) {
-  if (!irc_in_addr_is_ipv4(&np->ipaddress)) 
-    return; /* geoip only supports ipv4 */
+static int ismmdb(const char *filename) {
+  size_t len = strlen(filename);
 
-  unsigned int ip = irc_in_addr_v4_to_int(&np->ipaddress);
-  int country = GeoIP_id_by_ipnum(gi, ip);
+  return len > 5 && !strcasecmp(filename + len - 5, ".mmdb");
+}
+
+/* Opens the configured database and swaps it in; the previous one stays in
+ * use if that fails. */
+static int geoip_open(void) {
+  const char *error;
+  GeoIP *newgi;
+  mmdb *newmdb;
+
+  if(ismmdb(dbfilename->content)) {
+    newmdb = mmdb_open(dbfilename->content, &error);
+    if(!newmdb) {
+      Error("geoip", ERR_WARNING, "Unable to load %s: %s", dbfilename->content, error);
+      return 0;
+    }
+
+    if(gi) {
+      GeoIP_delete(gi);
+      gi = NULL;
+    }
+    if(mdb)
+      mmdb_close(mdb);
+    mdb = newmdb;
+  } else {
+    newgi = GeoIP_open(dbfilename->content, GEOIP_MEMORY_CACHE);
+    if(!newgi) {
+      Error("geoip", ERR_WARNING, "Unable to load %s.", dbfilename->content);
+      return 0;
+    }
+
+    if(mdb) {
+      mmdb_close(mdb);
+      mdb = NULL;
+    }
+    if(gi)
+      GeoIP_delete(gi);
+    gi = newgi;
+  }
+
+  return 1;
+}
+
+static int geoip_country(nick *np) {
+  unsigned char addr[16];
+  char code[3];
+  int i, country;
+
+  if(mdb) {
+    if(irc_in_addr_is_ipv4(&np->ipaddress)) {
+      unsigned int ip = irc_in_addr_v4_to_int(&np->ipaddress);
+
+      addr[0] = ip >> 24;
+      addr[1] = ip >> 16;
+      addr[2] = ip >> 8;
+      addr[3] = ip;
+      if(!mmdb_lookup(mdb, addr, 32, code))
+        return COUNTRY_MIN;
+    } else {
+      for(i=0;i<8;i++) {
+        addr[i * 2] = ntohs(np->ipaddress.in6_16[i]) >> 8;
+        addr[i * 2 + 1] = ntohs(np->ipaddress.in6_16[i]) & 0xff;
+      }
+      if(!mmdb_lookup(mdb, addr, 128, code))
+        return COUNTRY_MIN;
+    }
+
+    if(code[0] < 'A' || code[0] > 'Z' || code[1] < 'A' || code[1] > 'Z')
+      return COUNTRY_MIN;
+
+    country = codetoid[(code[0] - 'A') * 26 + (code[1] - 'A')];
+    return (country < 0) ? COUNTRY_MIN : country;
+  }
+
+  if(!gi || !irc_in_addr_is_ipv4(&np->ipaddress))
+    return COUNTRY_MIN; /* legacy databases are ipv4 only */
+
+  country = GeoIP_id_by_ipnum(gi, irc_in_addr_v4_to_int(&np->ipaddress));
   if((country < COUNTRY_MIN) || (country > COUNTRY_MAX))
+    return COUNTRY_MIN;
+
+  return country;
+}
+
+static void geoip_setupuser(nick *np) {
+  int country = geoip_country(np);
+
+  geoip_totals[country]++;
+  np->exts[geoip_nickext] = (void *)(long)country;
+}
+
+/* Looks a user up again, moving them between totals if they've changed. */
+static void geoip_retaguser(nick *np) {
+  int old = (int)((long)np->exts[geoip_nickext]), country;
+
+  country = geoip_country(np);
+  if(country == old)
     return;
 
+  if((old >= COUNTRY_MIN) && (old <= COUNTRY_MAX))
+    geoip_totals[old]--;
+
   geoip_totals[country]++;
   np->exts[geoip_nickext] = (void *)(long)country;
 }
 
+static void geoip_startretag(void) {
+  retagbucket = 0;
+  retagnext = nicktable[0];
+
+  if(!retagsched)
+    retagsched = scheduleoneshot(time(NULL), geoip_retagstep, NULL);
+}
+
+static void geoip_retagstep(void *arg) {
+  int done = 0;
+
+  retagsched = NULL;
+
+  while(retagbucket < NICKHASHSIZE && done < GEOIP_RETAGBATCH) {
+    if(!retagnext) {
+      if(++retagbucket < NICKHASHSIZE)
+        retagnext = nicktable[retagbucket];
+      continue;
+    }
+
+    geoip_retaguser(retagnext);
+    retagnext = retagnext->next;
+    done++;
+  }
+
+  if(retagbucket < NICKHASHSIZE) {
+    retagsched = scheduleoneshot(time(NULL), geoip_retagstep, NULL);
+  } else {
+    retagbucket = -1;
+    Error("geoip", ERR_INFO, "Finished tagging users from %s.", dbfilename->content);
+  }
+}
+
+static void geoip_reload(nick *np) {
+  if(mdb && ismmdb(dbfilename->content) && mmdb_unchanged(mdb, dbfilename->content)) {
+    if(np)
+      controlreply(np, "Database unchanged.");
+    return;
+  }
+
+  if(!geoip_open()) {
+    if(np)
+      controlreply(np, "Unable to load %s, keeping the current database.", dbfilename->content);
+    return;
+  }
+
+  geoip_startretag();
+
+  if(np)
+    controlreply(np, "Database reloaded, re-tagging users.");
+}
+
+static int geoip_doreload(void *source, int cargc, char **cargv) {
+  geoip_reload(source);
+
+  return CMD_OK;
+}
+
+static void geoip_rehash(int hooknum, void *arg) {
+  geoip_reload(NULL);
+}
+
 static void geoip_new_nick(int hook, void *args) {
+  if(nickburstreplay)
+    return; /* already done with the batch */
+
   geoip_setupuser((nick *)args);
 }
 
+static void geoip_burstbatch(int hook, void *args) {
+  nickbatch *batch = args;
+  int i;
+
+  for(i=0;i<batch->count;i++)
+    if(batch->nicks[i])
+      geoip_setupuser(batch->nicks[i]);
+}
+
 static void geoip_quit(int hook, void *args) {
   int item;
   nick *np = (nick *)args;
 
+  /* don't leave the re-tag cursor on a user that's going away */
+  if(np == retagnext)
+    retagnext = np->next;
+
   item = (int)((long)np->exts[geoip_nickext]);
-  
+
   if((item < COUNTRY_MIN) || (item > COUNTRY_MAX))
     return;
 
   geoip_totals[item]--;
 }
 
+static void geoip_rename(int hook, void *args) {
+  nick *np = ((void **)args)[0];
+
+  if(retagbucket < 0)
+    return;
+
+  /* a rename moves the user to another hash chain: tag them now and
+   * restart the current chain, re-tagging is harmless */
+  if(np == retagnext) {
+    geoip_retaguser(np);
+    retagnext = nicktable[retagbucket];
+    return;
+  }
+
+  /* the new chain may be one we've done already (or the head of this one) */
+  if(irc_crc32i(np->nick) % NICKHASHSIZE <= retagbucket)
+    geoip_retaguser(np);
+}
+
 static void geoip_whois_handler(int hooknum, void *arg) {
   int item;
   char message[512];
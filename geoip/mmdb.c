@@ -0,0 +1,378 @@
+/*
+  MaxMind DB reader for the geoip module.
+*/
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "mmdb.h"
+
+#define MMDB_MARKER "\xab\xcd\xefMaxMind.com"
+#define MMDB_MARKERLEN 14
+#define MMDB_METAMAX (128 * 1024)
+#define MMDB_MAXDEPTH 32
+
+#define MMDB_POINTER 1
+#define MMDB_UTF8 2
+#define MMDB_DOUBLE 3
+#define MMDB_BYTES 4
+#define MMDB_UINT16 5
+#define MMDB_UINT32 6
+#define MMDB_MAP 7
+#define MMDB_INT32 8
+#define MMDB_UINT64 9
+#define MMDB_UINT128 10
+#define MMDB_ARRAY 11
+#define MMDB_CONTAINER 12
+#define MMDB_ENDMARKER 13
+#define MMDB_BOOLEAN 14
+#define MMDB_FLOAT 15
+
+/* A section of the file the decoder works within: the data section, or the
+ * metadata. */
+typedef struct mmdb_section {
+  const unsigned char *base;
+  size_t len;
+} mmdb_section;
+
+typedef struct mmdb_field {
+  int type;
+  uint32_t size;      /* length, entry count, or pointer target */
+  size_t payload;     /* offset of the value's bytes */
+} mmdb_field;
+
+/* Decodes the control byte(s) at off; returns the offset after them or 0
+ * on error (no valid field starts at offset 0 and ends there). */
+static size_t mmdb_decodectrl(const mmdb_section *s, size_t off, mmdb_field *f) {
+  const unsigned char *p;
+  unsigned int ctrl, ss;
+  uint32_t size;
+
+  if(off >= s->len)
+    return 0;
+
+  p = s->base;
+  ctrl = p[off++];
+  f->type = ctrl >> 5;
+
+  if(f->type == MMDB_POINTER) {
+    ss = (ctrl >> 3) & 3;
+    if(off + ss + 1 > s->len)
+      return 0;
+
+    switch(ss) {
+      case 0:
+        f->size = ((ctrl & 7) << 8) | p[off];
+        break;
+      case 1:
+        f->size = (((ctrl & 7) << 16) | (p[off] << 8) | p[off + 1]) + 2048;
+        break;
+      case 2:
+        f->size = (((ctrl & 7) << 24) | (p[off] << 16) | (p[off + 1] << 8) | p[off + 2]) + 526336;
+        break;
+      default:
+        f->size = ((uint32_t)p[off] << 24) | (p[off + 1] << 16) | (p[off + 2] << 8) | p[off + 3];
+        break;
+    }
+
+    f->payload = off;
+    return off + ss + 1;
+  }
+
+  if(f->type == 0) {
+    if(off >= s->len)
+      return 0;
+    f->type = 7 + p[off++];
+    if(f->type <= MMDB_MAP || f->type > MMDB_FLOAT)
+      return 0;
+  }
+
+  size = ctrl & 0x1f;
+  if(size == 29) {
+    if(off + 1 > s->len)
+      return 0;
+    size = 29 + p[off];
+    off += 1;
+  } else if(size == 30) {
+    if(off + 2 > s->len)
+      return 0;
+    size = 285 + ((p[off] << 8) | p[off + 1]);
+    off += 2;
+  } else if(size == 31) {
+    if(off + 3 > s->len)
+      return 0;
+    size = 65821 + ((p[off] << 16) | (p[off + 1] << 8) | p[off + 2]);
+    off += 3;
+  }
+
+  f->size = size;
+  f->payload = off;
+  return off;
+}
+
+/* Returns the offset just past the value at off, without following pointers. */
+static size_t mmdb_skip(const mmdb_section *s, size_t off, int depth) {
+  mmdb_field f;
+  uint32_t i;
+
+  if(depth > MMDB_MAXDEPTH || !(off = mmdb_decodectrl(s, off, &f)))
+    return 0;
+
+  switch(f.type) {
+    case MMDB_POINTER:
+    case MMDB_BOOLEAN:
+    case MMDB_CONTAINER:
+    case MMDB_ENDMARKER:
+      return off;
+    case MMDB_DOUBLE:
+      off += 8;
+      break;
+    case MMDB_FLOAT:
+      off += 4;
+      break;
+    case MMDB_MAP:
+      for(i=0;i<f.size*2;i++)
+        if(!(off = mmdb_skip(s, off, depth + 1)))
+          return 0;
+      return off;
+    case MMDB_ARRAY:
+      for(i=0;i<f.size;i++)
+        if(!(off = mmdb_skip(s, off, depth + 1)))
+          return 0;
+      return off;
+    default:
+      off += f.size;
+      break;
+  }
+
+  return (off <= s->len) ? off : 0;
+}
+
+/* Decodes the field at off, following a pointer if there is one. */
+static int mmdb_resolve(const mmdb_section *s, size_t off, mmdb_field *f) {
+  if(!mmdb_decodectrl(s, off, f))
+    return 0;
+
+  if(f->type == MMDB_POINTER) {
+    if(!mmdb_decodectrl(s, f->size, f) || f->type == MMDB_POINTER)
+      return 0;
+  }
+
+  return 1;
+}
+
+/* Finds key in the map at off; returns the offset of its value, or 0. */
+static size_t mmdb_mapget(const mmdb_section *s, size_t off, const char *key) {
+  mmdb_field map, k;
+  size_t keylen = strlen(key);
+  uint32_t i;
+
+  if(!mmdb_resolve(s, off, &map) || map.type != MMDB_MAP)
+    return 0;
+
+  off = map.payload;
+  for(i=0;i<map.size;i++) {
+    if(!mmdb_resolve(s, off, &k) || k.type != MMDB_UTF8)
+      return 0;
+    if(!(off = mmdb_skip(s, off, 0)))
+      return 0;
+
+    if(k.size == keylen && k.payload + keylen <= s->len && !memcmp(s->base + k.payload, key, keylen))
+      return off;
+
+    if(!(off = mmdb_skip(s, off, 0)))
+      return 0;
+  }
+
+  return 0;
+}
+
+static int mmdb_getuint(const mmdb_section *s, size_t off, uint32_t *value) {
+  mmdb_field f;
+  uint32_t i, v = 0;
+
+  if(!mmdb_resolve(s, off, &f))
+    return 0;
+
+  if(f.type != MMDB_UINT16 && f.type != MMDB_UINT32 && f.type != MMDB_UINT64)
+    return 0;
+
+  if(f.size > 4 || f.payload + f.size > s->len)
+    return 0;
+
+  for(i=0;i<f.size;i++)
+    v = (v << 8) | s->base[f.payload + i];
+
+  *value = v;
+  return 1;
+}
+
+static uint32_t mmdb_record(mmdb *db, uint32_t node, int bit) {
+  const unsigned char *p;
+
+  switch(db->recordsize) {
+    case 24:
+      p = db->map + node * 6 + bit * 3;
+      return (p[0] << 16) | (p[1] << 8) | p[2];
+    case 28:
+      p = db->map + node * 7;
+      if(bit)
+        return ((p[3] & 0x0f) << 24) | (p[4] << 16) | (p[5] << 8) | p[6];
+      return ((p[3] & 0xf0) << 20) | (p[0] << 16) | (p[1] << 8) | p[2];
+    default:
+      p = db->map + node * 8 + bit * 4;
+      return ((uint32_t)p[0] << 24) | (p[1] << 16) | (p[2] << 8) | p[3];
+  }
+}
+
+mmdb *mmdb_open(const char *filename, const char **error) {
+  mmdb_section meta;
+  struct stat st;
+  const unsigned char *p, *marker = NULL;
+  size_t searchfrom, treesize;
+  uint32_t value, node;
+  void *map;
+  mmdb *db;
+  int fd, i;
+
+  if((fd = open(filename, O_RDONLY)) < 0) {
+    *error = "unable to open file";
+    return NULL;
+  }
+
+  if(fstat(fd, &st) || st.st_size < MMDB_MARKERLEN) {
+    close(fd);
+    *error = "unable to stat file, or file too small";
+    return NULL;
+  }
+
+  map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+  close(fd);
+  if(map == MAP_FAILED) {
+    *error = "unable to map file";
+    return NULL;
+  }
+
+  db = calloc(1, sizeof(mmdb));
+  db->map = map;
+  db->size = st.st_size;
+  db->dev = st.st_dev;
+  db->ino = st.st_ino;
+  db->mtime = st.st_mtime;
+
+  /* the metadata follows the last marker in the file */
+  searchfrom = (db->size > MMDB_METAMAX) ? db->size - MMDB_METAMAX : 0;
+  for(p=db->map+db->size-MMDB_MARKERLEN;p>=db->map+searchfrom;p--) {
+    if(*p == 0xab && !memcmp(p, MMDB_MARKER, MMDB_MARKERLEN)) {
+      marker = p;
+      break;
+    }
+  }
+
+  if(!marker) {
+    *error = "metadata not found";
+    goto fail;
+  }
+
+  meta.base = marker + MMDB_MARKERLEN;
+  meta.len = db->size - (meta.base - db->map);
+
+  if(!mmdb_getuint(&meta, mmdb_mapget(&meta, 0, "node_count"), &db->nodecount) ||
+     !mmdb_getuint(&meta, mmdb_mapget(&meta, 0, "record_size"), &value)) {
+    *error = "bad metadata";
+    goto fail;
+  }
+  db->recordsize = value;
+
+  if(!mmdb_getuint(&meta, mmdb_mapget(&meta, 0, "ip_version"), &value))
+    value = 6;
+  db->ipversion = value;
+
+  if(db->recordsize != 24 && db->recordsize != 28 && db->recordsize != 32) {
+    *error = "unsupported record size";
+    goto fail;
+  }
+
+  treesize = (size_t)db->nodecount * db->recordsize / 4;
+  if(treesize + 16 > (size_t)(marker - db->map)) {
+    *error = "search tree larger than file";
+    goto fail;
+  }
+
+  db->data = db->map + treesize + 16;
+  db->datasize = marker - db->data;
+
+  /* IPv4 addresses live under ::/96 in an IPv6 tree */
+  node = 0;
+  if(db->ipversion == 6)
+    for(i=0;i<96 && node<db->nodecount;i++)
+      node = mmdb_record(db, node, 0);
+  db->ipv4start = node;
+
+  return db;
+
+fail:
+  munmap((void *)db->map, db->size);
+  free(db);
+  return NULL;
+}
+
+void mmdb_close(mmdb *db) {
+  munmap((void *)db->map, db->size);
+  free(db);
+}
+
+int mmdb_unchanged(mmdb *db, const char *filename) {
+  struct stat st;
+
+  if(stat(filename, &st))
+    return 0;
+
+  return st.st_dev == db->dev && st.st_ino == db->ino && st.st_mtime == db->mtime && (size_t)st.st_size == db->size;
+}
+
+/* Looks up the first bits of addr (32 for IPv4, 128 for IPv6) and copies
+ * the two letter country code into code.  Returns 0 if there isn't one. */
+int mmdb_lookup(mmdb *db, const unsigned char *addr, int bits, char *code) {
+  static const char *paths[] = { "country", "registered_country", NULL };
+  mmdb_section data;
+  mmdb_field f;
+  uint32_t node;
+  size_t off, value;
+  int i;
+
+  if(bits == 128 && db->ipversion != 6)
+    return 0;
+
+  node = (bits == 32) ? db->ipv4start : 0;
+  for(i=0;i<bits && node<db->nodecount;i++)
+    node = mmdb_record(db, node, (addr[i >> 3] >> (7 - (i & 7))) & 1);
+
+  if(node <= db->nodecount)
+    return 0;
+
+  off = node - db->nodecount - 16;
+  data.base = db->data;
+  data.len = db->datasize;
+
+  for(i=0;paths[i];i++) {
+    if(!(value = mmdb_mapget(&data, off, paths[i])))
+      continue;
+    if(!(value = mmdb_mapget(&data, value, "iso_code")))
+      continue;
+    if(!mmdb_resolve(&data, value, &f) || f.type != MMDB_UTF8 || f.size != 2 || f.payload + 2 > data.len)
+      continue;
+
+    code[0] = data.base[f.payload];
+    code[1] = data.base[f.payload + 1];
+    code[2] = '\0';
+    return 1;
+  }
+
+  return 0;
+}
@@ -0,0 +1,37 @@
+#ifndef __GEOIP_MMDB_H
+#define __GEOIP_MMDB_H
+
+#include <stdint.h>
+#include <sys/types.h>
+#include <time.h>
+
+/* Minimal reader for the MaxMind DB (mmdb) format, enough to find the
+ * country of an IPv4 or IPv6 address.  The file is mapped read-only and
+ * every access is bounds checked, so a truncated or corrupt database gives
+ * failed lookups rather than a crash.  Lookups don't modify the database
+ * and need no locking. */
+
+typedef struct mmdb {
+  const unsigned char *map;
+  size_t size;
+
+  dev_t dev;
+  ino_t ino;
+  time_t mtime;
+
+  uint32_t nodecount;
+  int recordsize;
+  int ipversion;
+
+  const unsigned char *data;
+  size_t datasize;
+
+  uint32_t ipv4start;
+} mmdb;
+
+mmdb *mmdb_open(const char *filename, const char **error);
+void mmdb_close(mmdb *db);
+int mmdb_unchanged(mmdb *db, const char *filename);
+int mmdb_lookup(mmdb *db, const unsigned char *addr, int bits, char *code);
+
+#endif
@@ -20,11 +20,15 @@ void _init() {
 
   registerserverhandler("GL", handleglinemsg, 6);
   registerhook(HOOK_CORE_STATSREQUEST, handleglinestats);
+
+  schedulerecurring(time(NULL) + 1, 0, 1, glineindex_expire, NULL);
 }
 
 void _fini() {
   deregisterserverhandler("GL", handleglinemsg);
   deregisterhook(HOOK_CORE_STATSREQUEST, handleglinestats);
+
+  deleteschedule(NULL, glineindex_expire, NULL);
 }
 
 int gline_match_nick(gline *gl, nick *np) {
@@ -66,33 +70,17 @@ int gline_match_channel(gline *gl, channel *cp) {
 }
 
 gline *findgline(const char *mask) {
-  gline *gl, *next;
-  gline *globalgline;
-  time_t curtime = time(0);
+  gline *gl, *globalgline;
 
   globalgline = makegline(mask);
 
   if (!globalgline)
     return NULL; /* gline mask couldn't be processed */
 
- for (gl = glinelist; gl; gl = next) {
-    next = gl->next;
-
-    if (gl->lifetime <= curtime) {
-      removegline(gl);
-      continue;
-    } else if (gl->expire <= curtime) {
-      gl->flags &= ~GLINE_ACTIVE;
-    }
-
-    if (glineequal(globalgline, gl)) {
-      freegline(globalgline);
-      return gl;
-    }
-  }
-
+  gl = glineindex_find(globalgline);
   freegline(globalgline);
-  return 0;
+
+  return gl;
 }
 
 void gline_activate(gline *agline, time_t lastmod, int propagate) {
@@ -107,6 +95,8 @@ void gline_activate(gline *agline, time_t lastmod, int propagate) {
   else
     agline->lastmod = now;
 
+  glinechanged(agline);
+
   if (propagate)
     gline_propagate(agline);
 }
@@ -128,6 +118,8 @@ void gline_deactivate(gline *agline, time_t lastmod, int propagate) {
   else
     agline->lastmod = now;
 
+  glinechanged(agline);
+
   if (propagate)
     gline_propagate(agline);
 }
@@ -403,7 +395,7 @@ gline *glinedup(gline *gl) {
   sgl->lastmod = gl->lastmod;
   sgl->lifetime = gl->lifetime;
 
-  sgl->flags = gl->flags;
+  sgl->flags = gl->flags & ~GLINE_LISTED;
 
   return sgl;
 }
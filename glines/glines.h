@@ -33,6 +33,7 @@
 #define GLINE_DESTROY     64  /* Gline should be destroyed */
 #define GLINE_ACTIVE      128 /* Gline is active */
 #define GLINE_DESTROYED   256 /* Gline is destroyed */
+#define GLINE_LISTED      512 /* Gline is on glinelist */
 
 /**
  * glist flags
@@ -46,8 +47,8 @@
 #define GLIST_INACTIVE 0x80 /* -i */
 
 #define GLSTORE_PATH_PREFIX   "data/glines"
-#define GLSTORE_SAVE_FILES    5
 #define GLSTORE_SAVE_INTERVAL 3600
+#define GLSTORE_COMPACT_SIZE  (4 * 1024 * 1024) /* journal size that triggers an early compaction */
 
 /**
  * Interpret absolute/relative timestamps with same method as snircd
@@ -60,6 +61,19 @@
 
 #define gline_max(a, b) (((a)<(b)) ? (b) : (a))
 
+#define GLINEHASHSIZE 65536
+
+/**
+ * Index kinds; each listed gline is on exactly one kind list.
+ */
+#define GLINE_KIND_HOST     0
+#define GLINE_KIND_IP       1
+#define GLINE_KIND_BADCHAN  2
+#define GLINE_KIND_REALNAME 3
+#define GLINE_KINDS         4
+
+struct glinenode;
+
 typedef struct gline {
   sstring *nick;
   sstring *user;
@@ -78,6 +92,14 @@ typedef struct gline {
   int glinebufid;
 
   struct gline *next;
+
+  /* the rest is only used while the gline is on glinelist */
+  struct gline *prev;
+  struct gline *hnext;            /* glinehash chain */
+  struct gline *knext, *kprev;    /* glinekindlist */
+  struct gline *nnext;            /* glines on the same radix node */
+  struct glinenode *node;
+  unsigned int heapindex;         /* position in the expiry heap, from 1 */
 } gline;
 
 typedef struct glinebuf {
@@ -101,6 +123,8 @@ typedef struct glineinfo {
 } glineinfo;
 
 extern gline *glinelist;
+extern gline *glinekindlist[GLINE_KINDS];
+extern int glinekindcount[GLINE_KINDS];
 extern glinebuf *glinebuflog[MAXGLINELOG];
 extern int glinebuflogoffset;
 
@@ -147,8 +171,19 @@ int glinebufwritelog(glinebuf *gbuf, int propagating);
 /* glines_alloc.c */
 void freegline(gline *);
 gline *newgline();
+void addgline(gline *);
+void glinechanged(gline *);
 void removegline(gline *);
 
+/* glines_index.c */
+void glineindex_add(gline *gl);
+void glineindex_remove(gline *gl);
+void glineindex_update(gline *gl);
+gline *glineindex_find(gline *key);
+void glineindex_covering(const struct irc_in_addr *ip, unsigned char bits, array *result);
+gline *glineindex_nextexpiry(void);
+void glineindex_expire(void *arg);
+
 /* glines_handler.c */
 int handleglinemsg(void *, int, char **);
 void handleglinestats(int hooknum, void *arg);
@@ -1,5 +1,6 @@
 #include <string.h>
 #include "../core/nsmalloc.h"
+#include "../core/hooks.h"
 #include "glines.h"
 
 gline *glinelist;
@@ -25,14 +26,41 @@ void freegline(gline *gl) {
   nsfree(POOL_GLINE, gl);
 }
 
+void addgline(gline *gl) {
+  gl->flags |= GLINE_LISTED;
+  gl->prev = NULL;
+  gl->next = glinelist;
+  if (glinelist)
+    glinelist->prev = gl;
+  glinelist = gl;
+
+  glineindex_add(gl);
+
+  triggerhook(HOOK_GLINE_NEWGLINE, gl);
+}
+
+/* Called after the flags, times, creator or reason of a gline have been
+ * changed; only glines on the global list are announced. */
+void glinechanged(gline *gl) {
+  if (gl->flags & GLINE_LISTED) {
+    glineindex_update(gl);
+    triggerhook(HOOK_GLINE_MODIFIED, gl);
+  }
+}
+
 void removegline(gline *gl) {
-  gline **pnext;
+  if (gl->flags & GLINE_LISTED) {
+    triggerhook(HOOK_GLINE_LOSTGLINE, gl);
+
+    glineindex_remove(gl);
+
+    if (gl->prev)
+      gl->prev->next = gl->next;
+    else
+      glinelist = gl->next;
 
-  for (pnext = &glinelist; *pnext; pnext = &((*pnext)->next)) {
-    if (*pnext == gl) {
-      *pnext = gl->next;
-      break;
-    }
+    if (gl->next)
+      gl->next->prev = gl->prev;
   }
 
   freegline(gl);
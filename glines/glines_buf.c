@@ -98,14 +98,12 @@ char *glinebufaddbynick(glinebuf *gbuf, nick *np, int flags, const char *creator
 }
 
 void glinebufaddbywhowas(glinebuf *gbuf, whowas *ww, int flags, const char *creator, const char *reason, time_t expire, time_t lastmod, time_t lifetime) {
-  nick *np = &ww->nick;
-
   if (flags & GLINE_ALWAYS_NICK) {
     char mask[512];
-    snprintf(mask, sizeof(mask), "%s!*@*", np->nick);
+    snprintf(mask, sizeof(mask), "%s!*@*", ww->nick->content);
     glinebufadd(gbuf, mask, creator, reason, expire, lastmod, lifetime);
   } else {
-    glinebufaddbyip(gbuf, np->ident, &np->ipaddress, 128, flags, creator, reason, expire, lastmod, lifetime);
+    glinebufaddbyip(gbuf, ww->ident->content, &ww->ipaddress, 128, flags, creator, reason, expire, lastmod, lifetime);
   }
 }
 
@@ -115,6 +113,7 @@ void glinebufcounthits(glinebuf *gbuf, int *users, int *channels) {
   chanindex *cip;
   channel *cp;
   nick *np;
+  nickiter iter;
   char uhmask[512];
 
 #if 0 /* Let's just do a new hit check anyway. */
@@ -158,26 +157,24 @@ void glinebufcounthits(glinebuf *gbuf, int *users, int *channels) {
     }
   }
 
-  for (i = 0; i < NICKHASHSIZE; i++) {
-    for (np = nicktable[i]; np; np = np->next) {
-      hit = 0;
+  for (np=firstnick(&iter);np;np=nextnick(&iter)) {
+    hit = 0;
 
-      for (gl = gbuf->glines; gl; gl = gl->next) {
-        if (gline_match_nick(gl, np)) {
-          hit = 1;
-          break;
-        }
+    for (gl = gbuf->glines; gl; gl = gl->next) {
+      if (gline_match_nick(gl, np)) {
+        hit = 1;
+        break;
       }
+    }
 
-      if (hit) {
-        snprintf(uhmask, sizeof(uhmask), "user: %s!%s@%s%s%s r(%s)", np->nick, np->ident, np->host->name->content,
-          (np->auth) ? "/" : "", (np->auth) ? np->authname : "", np->realname->name->content);
+    if (hit) {
+      snprintf(uhmask, sizeof(uhmask), "user: %s!%s@%s%s%s r(%s)", np->nick, np->ident, np->host->name->content,
+        (np->auth) ? "/" : "", (np->auth) ? np->authname : "", np->realname->name->content);
 
-        gbuf->userhits++;
+      gbuf->userhits++;
 
-        slot = array_getfreeslot(&gbuf->hits);
-        ((sstring **)gbuf->hits.content)[slot] = getsstring(uhmask, 512);
-      }
+      slot = array_getfreeslot(&gbuf->hits);
+      ((sstring **)gbuf->hits.content)[slot] = getsstring(uhmask, 512);
     }
   }
 
@@ -347,13 +344,14 @@ int glinebufcommit(glinebuf *gbuf, int propagate) {
 
       freesstring(sgl->reason);
       sgl->reason = getsstring(gl->reason, 512);
+
+      glinechanged(sgl);
 #endif
 
       freegline(gl);
       gl = sgl;
     } else {
-      gl->next = glinelist;
-      glinelist = gl;
+      addgline(gl);
     }
 
     gl->glinebufid = id;
@@ -67,7 +67,7 @@ invalid:
 
 static int glines_cmdblock(void *source, int cargc, char **cargv) {
   nick *sender = source;
-  nick *target, *wnp;
+  nick *target;
   whowas *ww;
   int hits, duration, id;
   int coff, overridesanity, overridelimit, simulate, chase;
@@ -111,10 +111,10 @@ static int glines_cmdblock(void *source, int cargc, char **cargv) {
     ownww = 1;
   }
 
-  wnp = &ww->nick;
-
-  if (sender != target && (IsService(wnp) || IsOper(wnp) || NickOnServiceServer(wnp))) {
-    controlreply(sender, "Target user '%s' is an oper or a service. Not setting G-Lines.", wnp->nick);
+  if (sender != target && (IsService(ww) || IsOper(ww) || NickOnServiceServer(ww))) {
+    controlreply(sender, "Target user '%s' is an oper or a service. Not setting G-Lines.", ww->nick->content);
+    if (ownww)
+      whowas_free(ww);
     return CMD_ERROR;
   }
 
@@ -149,7 +149,7 @@ static int glines_cmdblock(void *source, int cargc, char **cargv) {
   id = glinebufcommit(&gbuf, 1);
 
   controlwall(NO_OPER, NL_GLINES, "%s BLOCK'ed user '%s!%s@%s' for %s with reason '%s' (%d hits)", controlid(sender),
-              wnp->nick, wnp->ident, wnp->host->name->content,
+              ww->nick->content, ww->ident->content, ww->host->content,
               longtoduration(duration, 0), reason, hits);
 
   if (ownww)
@@ -654,35 +654,18 @@ static int glines_cmdtrustungline(void *source, int cargc, char **cargv) {
 
 static int glines_cmdglstats(void *source, int cargc, char **cargv) {
   nick *sender = (nick*)source;
-  gline *gl, *next;
-  time_t curtime = getnettime();
-  int glinecount = 0, hostglinecount = 0, ipglinecount = 0, badchancount = 0, rnglinecount = 0;
-  int deactivecount = 0, activecount = 0;
-
-  for (gl = glinelist; gl; gl = next) {
-    next = gl->next;
-
-    if (gl->lifetime <= curtime) {
-      removegline(gl);
-      continue;
-    } else if (gl->expire <= curtime) {
-      gl->flags &= ~GLINE_ACTIVE;
-    }
+  gline *gl;
+  int glinecount = 0, deactivecount = 0, activecount = 0;
+  int hostglinecount = glinekindcount[GLINE_KIND_HOST], ipglinecount = glinekindcount[GLINE_KIND_IP];
+  int badchancount = glinekindcount[GLINE_KIND_BADCHAN], rnglinecount = glinekindcount[GLINE_KIND_REALNAME];
 
+  for (gl = glinelist; gl; gl = gl->next) {
     if (gl->flags & GLINE_ACTIVE) {
       activecount++;
     } else {
       deactivecount++;
     }
 
-    if (gl->flags & GLINE_IPMASK)
-      ipglinecount++;
-    else if (gl->flags & GLINE_HOSTMASK)
-      hostglinecount++;
-    else if (gl->flags & GLINE_REALNAME)
-      rnglinecount++;
-    else if (gl->flags & GLINE_BADCHAN)
-      badchancount++;
     glinecount++;
   }
 
@@ -701,10 +684,29 @@ static int glines_cmdglstats(void *source, int cargc, char **cargv) {
   return CMD_OK;
 }
 
+static void glist_addgline(array *candidates, gline *gl) {
+  int slot;
+
+  if (!gl)
+    return;
+
+  slot = array_getfreeslot(candidates);
+  ((gline **)candidates->content)[slot] = gl;
+}
+
+static void glist_addkind(array *candidates, int kind) {
+  gline *gl;
+
+  for (gl = glinekindlist[kind]; gl; gl = gl->knext)
+    glist_addgline(candidates, gl);
+}
+
 static int glines_cmdglist(void *source, int cargc, char **cargv) {
   nick *sender = (nick *)source;
-  gline *gl, *next;
-  time_t curtime = time(NULL);
+  gline *gl;
+  array candidates;
+  unsigned int i;
+  time_t curtime = getnettime();
   int flags = 0;
   char *mask;
   int count = 0;
@@ -784,15 +786,40 @@ static int glines_cmdglist(void *source, int cargc, char **cargv) {
     return CMD_ERROR;
   }
 
-  for (gl = glinelist; gl; gl = next) {
-    next = gl->next;
-
-    if (gl->lifetime <= curtime) {
-      removegline(gl);
-      continue;
-    } else if (gl->expire <= curtime) {
-      gl->flags &= ~GLINE_ACTIVE;
+  /* only look at glines that can possibly match */
+  array_init(&candidates, sizeof(gline *));
+
+  if (flags & GLIST_REALNAME) {
+    if (flags & GLIST_EXACT)
+      glist_addgline(&candidates, glineindex_find(searchgl));
+    else
+      glist_addkind(&candidates, GLINE_KIND_REALNAME);
+  } else if (flags & (GLIST_REASON | GLIST_OWNER)) {
+    glist_addkind(&candidates, GLINE_KIND_HOST);
+    glist_addkind(&candidates, GLINE_KIND_IP);
+    glist_addkind(&candidates, GLINE_KIND_BADCHAN);
+  } else if (flags & GLIST_EXACT) {
+    glist_addgline(&candidates, glineindex_find(searchgl));
+  } else if (flags & GLIST_FIND) {
+    /* host glines are compared as strings, even against IPs */
+    if (searchgl->flags & GLINE_BADCHAN) {
+      glist_addkind(&candidates, GLINE_KIND_BADCHAN);
+    } else if (!(searchgl->flags & GLINE_REALNAME)) {
+      glist_addkind(&candidates, GLINE_KIND_HOST);
+
+      if (searchgl->flags & GLINE_IPMASK)
+        glineindex_covering(&searchgl->ip, searchgl->bits, &candidates);
+      else
+        glist_addkind(&candidates, GLINE_KIND_IP);
     }
+  } else {
+    glist_addkind(&candidates, GLINE_KIND_HOST);
+    glist_addkind(&candidates, GLINE_KIND_IP);
+    glist_addkind(&candidates, GLINE_KIND_BADCHAN);
+  }
+
+  for (i = 0; i < candidates.cursi; i++) {
+    gl = ((gline **)candidates.content)[i];
 
     if (!(gl->flags & GLINE_ACTIVE)) {
       if (!(flags & GLIST_INACTIVE)) {
@@ -867,6 +894,9 @@ static int glines_cmdglist(void *source, int cargc, char **cargv) {
     }
   }
 
+  array_free(&candidates);
+  freegline(searchgl);
+
   controlreply(sender, "%s%d G-Line%s found.", (flags & GLIST_COUNT) ? "" : "End of list - ", count, count == 1 ? "" : "s");
 
   return CMD_OK;
@@ -161,6 +161,8 @@ int handleglinemsg(void *source, int cargc, char **cargv) {
         /* Don't send our gline as that might cause loops in case we don't understand the gline properly. */
       } 
 
+      glinechanged(agline);
+
       return CMD_OK;
     } else {
       glinebufinit(&gbuf, 0);
@@ -257,6 +259,8 @@ int handleglinemsg(void *source, int cargc, char **cargv) {
         agline->creator = getsstring(creator, 255);
         freesstring(agline->reason);
         agline->reason = getsstring(reason, 255);
+
+        glinechanged(agline);
       } else {
         Debug("received a gline modification with a lower lastmod");
       }
@@ -274,11 +278,10 @@ int handleglinemsg(void *source, int cargc, char **cargv) {
 void handleglinestats(int hooknum, void *arg) {
   if ((long)arg > 10) {
     char message[100];
-    int glcount = 0;
-    gline *gl;
+    int glcount = 0, i;
 
-    for(gl = glinelist; gl; gl = gl->next)
-      glcount++;
+    for(i = 0; i < GLINE_KINDS; i++)
+      glcount += glinekindcount[i];
 
     snprintf(message, sizeof(message), "G-Lines  :%7d glines", glcount);
     triggerhook(HOOK_CORE_STATSREPLY, message);
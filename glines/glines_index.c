@@ -0,0 +1,403 @@
+/*
+ * Indices over glinelist:
+ *
+ *  - glinehash finds a gline by its canonical mask, which is what
+ *    findgline() (and so every GL message during a burst) needs.
+ *  - a radix tree of IP glines keyed by prefix, so the glines covering
+ *    an address can be found without looking at every other gline.
+ *  - glinekindlist has host, IP, channel and realname glines on separate
+ *    lists so GLIST only looks at the kinds it can match.
+ *  - a min-heap on the next time something happens to a gline (it
+ *    expires, or its lifetime runs out) replaces the expiry checks that
+ *    used to be done while walking the whole list.
+ */
+
+#include <string.h>
+#include "../lib/irc_string.h"
+#include "../core/nsmalloc.h"
+#include "../irc/irc.h"
+#include "glines.h"
+
+typedef struct glinenode {
+  struct irc_in_addr ip;          /* masked to bits */
+  unsigned char bits;
+  gline *glines;                  /* NULL for nodes that only join two others */
+  struct glinenode *parent;
+  struct glinenode *child[2];
+} glinenode;
+
+gline *glinekindlist[GLINE_KINDS];
+int glinekindcount[GLINE_KINDS];
+
+static gline *glinehash[GLINEHASHSIZE];
+static glinenode *glineroot;
+
+static gline **glineheap;         /* 1-based */
+static unsigned int glineheapsize, glineheapcapacity;
+
+static int glinekind(gline *gl) {
+  if (gl->flags & GLINE_BADCHAN)
+    return GLINE_KIND_BADCHAN;
+  else if (gl->flags & GLINE_REALNAME)
+    return GLINE_KIND_REALNAME;
+  else if (gl->flags & GLINE_IPMASK)
+    return GLINE_KIND_IP;
+  else
+    return GLINE_KIND_HOST;
+}
+
+static int ipbit(const struct irc_in_addr *ip, unsigned int bit) {
+  const unsigned char *p = (const unsigned char *)ip->in6_16;
+
+  return (p[bit / 8] >> (7 - bit % 8)) & 1;
+}
+
+static void ipmask(struct irc_in_addr *out, const struct irc_in_addr *ip, unsigned char bits) {
+  unsigned char *p = (unsigned char *)out->in6_16;
+  unsigned int i;
+
+  memcpy(out, ip, sizeof(*out));
+
+  for (i = 0; i < sizeof(*out); i++) {
+    if (bits >= 8) {
+      bits -= 8;
+    } else {
+      p[i] &= (unsigned char)(0xff00 >> bits);
+      bits = 0;
+    }
+  }
+}
+
+/* Number of leading bits a and b have in common, up to max. */
+static unsigned char ipcommon(const struct irc_in_addr *a, const struct irc_in_addr *b, unsigned char max) {
+  unsigned int i;
+
+  for (i = 0; i < max; i++)
+    if (ipbit(a, i) != ipbit(b, i))
+      break;
+
+  return i;
+}
+
+/* Must agree with glineequal(): IP glines are the same whatever the host
+ * bits after the prefix were written as. */
+static unsigned int glinehashvalue(gline *gl) {
+  struct irc_in_addr ip;
+  unsigned long hash;
+  int i;
+
+  if (!(gl->flags & GLINE_IPMASK))
+    return irc_crc32i(glinetostring(gl)) % GLINEHASHSIZE;
+
+  ipmask(&ip, &gl->ip, gl->bits);
+
+  hash = irc_crc32i(gl->nick ? gl->nick->content : "*");
+  hash = hash * 31 + irc_crc32i(gl->user ? gl->user->content : "*");
+
+  for (i = 0; i < 8; i++)
+    hash = hash * 31 + ip.in6_16[i];
+
+  hash = hash * 31 + gl->bits;
+
+  return hash % GLINEHASHSIZE;
+}
+
+gline *glineindex_find(gline *key) {
+  gline *gl;
+
+  for (gl = glinehash[glinehashvalue(key)]; gl; gl = gl->hnext)
+    if (glineequal(key, gl))
+      return gl;
+
+  return NULL;
+}
+
+static glinenode *newglinenode(const struct irc_in_addr *ip, unsigned char bits, glinenode *parent) {
+  glinenode *node = nsmalloc(POOL_GLINE, sizeof(glinenode));
+
+  if (!node)
+    return NULL;
+
+  memset(node, 0, sizeof(glinenode));
+  ipmask(&node->ip, ip, bits);
+  node->bits = bits;
+  node->parent = parent;
+
+  return node;
+}
+
+static void replacechild(glinenode *parent, glinenode *old, glinenode *new) {
+  if (!parent)
+    glineroot = new;
+  else if (parent->child[0] == old)
+    parent->child[0] = new;
+  else
+    parent->child[1] = new;
+
+  if (new)
+    new->parent = parent;
+}
+
+/* Finds or creates the node for exactly ip/bits. */
+static glinenode *glinenode_get(const struct irc_in_addr *ip, unsigned char bits) {
+  glinenode *node, *parent, *new, *glue;
+  unsigned char common;
+  int dir;
+
+  parent = NULL;
+  node = glineroot;
+  dir = 0;
+
+  while (node && node->bits <= bits && ipmask_check(ip, &node->ip, node->bits)) {
+    if (node->bits == bits)
+      return node;
+
+    parent = node;
+    dir = ipbit(ip, node->bits);
+    node = node->child[dir];
+  }
+
+  new = newglinenode(ip, bits, parent);
+
+  if (!new)
+    return NULL;
+
+  if (!node) {
+    if (parent)
+      parent->child[dir] = new;
+    else
+      glineroot = new;
+
+    return new;
+  }
+
+  /* node isn't under ip/bits or doesn't contain it: they split somewhere */
+  common = ipcommon(ip, &node->ip, (node->bits < bits) ? node->bits : bits);
+
+  if (common == bits) {
+    replacechild(parent, node, new);
+    new->child[ipbit(&node->ip, bits)] = node;
+    node->parent = new;
+
+    return new;
+  }
+
+  glue = newglinenode(ip, common, parent);
+
+  if (!glue) {
+    nsfree(POOL_GLINE, new);
+    return NULL;
+  }
+
+  replacechild(parent, node, glue);
+  glue->child[ipbit(&node->ip, common)] = node;
+  node->parent = glue;
+  glue->child[ipbit(ip, common)] = new;
+  new->parent = glue;
+
+  return new;
+}
+
+/* Frees node if it no longer holds glines and isn't needed to join two
+ * others, and the same for its parent. */
+static void glinenode_tidy(glinenode *node) {
+  glinenode *parent, *child;
+
+  while (node && !node->glines && !(node->child[0] && node->child[1])) {
+    parent = node->parent;
+    child = node->child[0] ? node->child[0] : node->child[1];
+
+    replacechild(parent, node, child);
+    nsfree(POOL_GLINE, node);
+
+    node = parent;
+  }
+}
+
+/* Appends every IP gline whose prefix contains ip/bits to result. */
+void glineindex_covering(const struct irc_in_addr *ip, unsigned char bits, array *result) {
+  glinenode *node;
+  gline *gl;
+  int slot;
+
+  for (node = glineroot; node && node->bits <= bits && ipmask_check(ip, &node->ip, node->bits); node = (node->bits < 128) ? node->child[ipbit(ip, node->bits)] : NULL) {
+    for (gl = node->glines; gl; gl = gl->nnext) {
+      slot = array_getfreeslot(result);
+      ((gline **)result->content)[slot] = gl;
+    }
+  }
+}
+
+static time_t glinedeadline(gline *gl) {
+  if ((gl->flags & GLINE_ACTIVE) && gl->expire < gl->lifetime)
+    return gl->expire;
+
+  return gl->lifetime;
+}
+
+static void glineheap_set(unsigned int i, gline *gl) {
+  glineheap[i] = gl;
+  gl->heapindex = i;
+}
+
+static void glineheap_siftup(unsigned int i) {
+  gline *gl = glineheap[i];
+  time_t deadline = glinedeadline(gl);
+
+  while (i > 1 && glinedeadline(glineheap[i / 2]) > deadline) {
+    glineheap_set(i, glineheap[i / 2]);
+    i /= 2;
+  }
+
+  glineheap_set(i, gl);
+}
+
+static void glineheap_siftdown(unsigned int i) {
+  gline *gl = glineheap[i];
+  time_t deadline = glinedeadline(gl);
+  unsigned int child;
+
+  while ((child = i * 2) <= glineheapsize) {
+    if (child < glineheapsize && glinedeadline(glineheap[child + 1]) < glinedeadline(glineheap[child]))
+      child++;
+
+    if (glinedeadline(glineheap[child]) >= deadline)
+      break;
+
+    glineheap_set(i, glineheap[child]);
+    i = child;
+  }
+
+  glineheap_set(i, gl);
+}
+
+static int glineheap_insert(gline *gl) {
+  gline **newheap;
+  unsigned int newcapacity;
+
+  if (glineheapsize + 1 >= glineheapcapacity) {
+    newcapacity = glineheapcapacity ? glineheapcapacity * 2 : 1024;
+    newheap = nsrealloc(POOL_GLINE, glineheap, newcapacity * sizeof(gline *));
+
+    if (!newheap)
+      return 0;
+
+    glineheap = newheap;
+    glineheapcapacity = newcapacity;
+  }
+
+  glineheap_set(++glineheapsize, gl);
+  glineheap_siftup(glineheapsize);
+
+  return 1;
+}
+
+static void glineheap_delete(gline *gl) {
+  unsigned int i = gl->heapindex;
+  gline *last;
+
+  if (!i)
+    return;
+
+  gl->heapindex = 0;
+  last = glineheap[glineheapsize--];
+
+  if (last == gl)
+    return;
+
+  glineheap_set(i, last);
+  glineheap_siftup(i);
+  glineheap_siftdown(last->heapindex);
+}
+
+void glineindex_add(gline *gl) {
+  unsigned int hash = glinehashvalue(gl);
+  int kind = glinekind(gl);
+
+  gl->hnext = glinehash[hash];
+  glinehash[hash] = gl;
+
+  gl->kprev = NULL;
+  gl->knext = glinekindlist[kind];
+  if (gl->knext)
+    gl->knext->kprev = gl;
+  glinekindlist[kind] = gl;
+  glinekindcount[kind]++;
+
+  if (kind == GLINE_KIND_IP) {
+    gl->node = glinenode_get(&gl->ip, gl->bits);
+
+    if (gl->node) {
+      gl->nnext = gl->node->glines;
+      gl->node->glines = gl;
+    }
+  }
+
+  if (!glineheap_insert(gl))
+    Error("glines", ERR_ERROR, "Could not add G-Line to the expiry heap: %s", glinetostring(gl));
+}
+
+void glineindex_remove(gline *gl) {
+  gline **pnext;
+  int kind = glinekind(gl);
+
+  for (pnext = &glinehash[glinehashvalue(gl)]; *pnext; pnext = &((*pnext)->hnext)) {
+    if (*pnext == gl) {
+      *pnext = gl->hnext;
+      break;
+    }
+  }
+
+  if (gl->kprev)
+    gl->kprev->knext = gl->knext;
+  else
+    glinekindlist[kind] = gl->knext;
+
+  if (gl->knext)
+    gl->knext->kprev = gl->kprev;
+
+  glinekindcount[kind]--;
+
+  if (gl->node) {
+    for (pnext = &gl->node->glines; *pnext; pnext = &((*pnext)->nnext)) {
+      if (*pnext == gl) {
+        *pnext = gl->nnext;
+        break;
+      }
+    }
+
+    glinenode_tidy(gl->node);
+    gl->node = NULL;
+  }
+
+  glineheap_delete(gl);
+}
+
+/* The mask of a gline never changes, but its deadline can. */
+void glineindex_update(gline *gl) {
+  if (!gl->heapindex)
+    return;
+
+  glineheap_siftup(gl->heapindex);
+  glineheap_siftdown(gl->heapindex);
+}
+
+gline *glineindex_nextexpiry(void) {
+  return glineheapsize ? glineheap[1] : NULL;
+}
+
+/* Scheduled every second: deactivates glines that have expired and removes
+ * the ones whose lifetime is up. */
+void glineindex_expire(void *arg) {
+  time_t now = getnettime();
+  gline *gl;
+
+  while ((gl = glineindex_nextexpiry()) && glinedeadline(gl) <= now) {
+    if (gl->lifetime <= now) {
+      removegline(gl);
+    } else {
+      gl->flags &= ~GLINE_ACTIVE;
+      glinechanged(gl);
+    }
+  }
+}
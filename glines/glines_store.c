@@ -1,42 +1,554 @@
+/*
+ * G-Lines are stored as a snapshot (GLSTORE_PATH_PREFIX.snapshot) followed
+ * by numbered journals (GLSTORE_PATH_PREFIX.journal.N) of the changes made
+ * since it was written.  Every change to the global list is appended to the
+ * current journal as it happens, through a buffer that's flushed once per
+ * main loop iteration.  Compaction starts a new journal and forks a child
+ * which writes the whole list out as a new snapshot; once that's in place
+ * the journals it covers are deleted.
+ *
+ * Journal and snapshot entries are the same binary records: the complete
+ * state of a gline, or its removal.  Replaying them is idempotent, so after
+ * a crash it doesn't matter whether a journal also made it into the
+ * snapshot, and a torn record at the end of the last journal is just cut
+ * off.
+ */
+
+#define _XOPEN_SOURCE 500
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+#include <stddef.h>
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
 #include "../lib/version.h"
 #include "../core/schedule.h"
+#include "../core/hooks.h"
 #include "../control/control.h"
 #include "glines.h"
 
 MODULE_VERSION("");
 
-static int glstore_savefile(const char *file) {
-  FILE *fp;
+#define GLSTORE_MAGIC     0x31534c47 /* "GLS1" */
+#define GLSTORE_BUFSIZE   65536
+#define GLSTORE_MAXRECORD 2048
+#define GLSTORE_HASHSIZE  65536
+
+#define GLSTORE_SET    1
+#define GLSTORE_DELETE 2
+
+typedef struct glstore_header {
+  uint32_t magic;
+  uint32_t pad;
+  uint64_t nextjournal;   /* first journal not included in this snapshot */
+} glstore_header;
+
+typedef struct glstore_record {
+  uint32_t length;        /* of everything after checksum */
+  uint32_t checksum;
+  uint8_t op;
+  uint8_t active;
+  uint16_t masklen, creatorlen, reasonlen;
+  int64_t expire, lastmod, lifetime;
+  /* followed by the mask, creator and reason, not NUL terminated */
+} glstore_record;
+
+#define GLSTORE_RECORDHEAD offsetof(glstore_record, op)
+
+typedef struct glstore_loaded {
+  char *mask;
   gline *gl;
-  int count;
+  int existing;
+  struct glstore_loaded *next;
+} glstore_loaded;
 
-  fp = fopen(file, "w");
+static int journalfd = -1;
+static uint64_t journalno, oldestjournal;
+static size_t journalsize;
 
-  if (!fp)
+static char writebuf[GLSTORE_BUFSIZE];
+static size_t writelen;
+static void *flushsched;
+
+static pid_t compactpid;
+static uint64_t compactjournal;
+static void *compactsched, *checksched;
+
+static int loading;
+
+static void glstore_flushsched(void *arg);
+static void glstore_checkcompact(void *arg);
+
+static uint32_t glstore_checksum(const char *data, size_t len) {
+  uint32_t hash = 2166136261U;
+  size_t i;
+
+  for (i = 0; i < len; i++) {
+    hash ^= (unsigned char)data[i];
+    hash *= 16777619U;
+  }
+
+  return hash;
+}
+
+static void glstore_path(char *buf, size_t len, const char *suffix, uint64_t n) {
+  if (n)
+    snprintf(buf, len, "%s.%s.%llu", GLSTORE_PATH_PREFIX, suffix, (unsigned long long)n);
+  else
+    snprintf(buf, len, "%s.%s", GLSTORE_PATH_PREFIX, suffix);
+}
+
+/* Encodes a record into buf (GLSTORE_MAXRECORD bytes); returns its size. */
+static size_t glstore_encode(char *buf, int op, gline *gl) {
+  glstore_record r;
+  const char *mask = glinetostring(gl);
+  const char *creator = "", *reason = "";
+  size_t pos;
+
+  memset(&r, 0, sizeof(r));
+  r.op = op;
+
+  if (op == GLSTORE_SET) {
+    creator = gl->creator ? gl->creator->content : "";
+    reason = gl->reason ? gl->reason->content : "";
+    r.active = (gl->flags & GLINE_ACTIVE) ? 1 : 0;
+    r.expire = gl->expire;
+    r.lastmod = gl->lastmod;
+    r.lifetime = gl->lifetime;
+  }
+
+  r.masklen = strlen(mask);
+  r.creatorlen = strlen(creator);
+  r.reasonlen = strlen(reason);
+
+  if (sizeof(r) + r.masklen + r.creatorlen + r.reasonlen > GLSTORE_MAXRECORD)
+    return 0;
+
+  pos = sizeof(r);
+  memcpy(buf + pos, mask, r.masklen);
+  pos += r.masklen;
+  memcpy(buf + pos, creator, r.creatorlen);
+  pos += r.creatorlen;
+  memcpy(buf + pos, reason, r.reasonlen);
+  pos += r.reasonlen;
+
+  r.length = pos - GLSTORE_RECORDHEAD;
+  memcpy(buf, &r, sizeof(r));
+  r.checksum = glstore_checksum(buf + GLSTORE_RECORDHEAD, r.length);
+  memcpy(buf, &r, sizeof(r));
+
+  return pos;
+}
+
+static int glstore_writeall(int fd, const char *buf, size_t len) {
+  ssize_t ret;
+
+  while (len > 0) {
+    ret = write(fd, buf, len);
+
+    if (ret < 0) {
+      if (errno == EINTR)
+        continue;
+
+      return -1;
+    }
+
+    buf += ret;
+    len -= ret;
+  }
+
+  return 0;
+}
+
+static void glstore_flush(void) {
+  if (journalfd < 0 || !writelen)
+    return;
+
+  /* if this fails the records are lost from the journal, but not from
+   * memory: the next snapshot will have them */
+  if (glstore_writeall(journalfd, writebuf, writelen) < 0)
+    Error("glines", ERR_ERROR, "Could not write G-Line journal: %s", strerror(errno));
+
+  writelen = 0;
+}
+
+static void glstore_flushsched(void *arg) {
+  flushsched = NULL;
+  glstore_flush();
+}
+
+static int glstore_compact(void);
+
+static void glstore_compactsched(void *arg) {
+  compactsched = NULL;
+  glstore_compact();
+}
+
+static void glstore_append(int op, gline *gl) {
+  char record[GLSTORE_MAXRECORD];
+  size_t len;
+
+  if (loading || journalfd < 0)
+    return;
+
+  len = glstore_encode(record, op, gl);
+
+  if (!len) {
+    Error("glines", ERR_WARNING, "G-Line too large for the journal: %s", glinetostring(gl));
+    return;
+  }
+
+  if (writelen + len > sizeof(writebuf))
+    glstore_flush();
+
+  memcpy(writebuf + writelen, record, len);
+  writelen += len;
+  journalsize += len;
+
+  if (!flushsched)
+    flushsched = scheduleoneshot(time(NULL), glstore_flushsched, NULL);
+
+  /* not from here: we may be half way through changing the list */
+  if (journalsize > GLSTORE_COMPACT_SIZE && !compactpid && !compactsched)
+    compactsched = scheduleoneshot(time(NULL), glstore_compactsched, NULL);
+}
+
+static void glstore_hooknew(int hooknum, void *arg) {
+  glstore_append(GLSTORE_SET, arg);
+}
+
+static void glstore_hooklost(int hooknum, void *arg) {
+  glstore_append(GLSTORE_DELETE, arg);
+}
+
+static int glstore_openjournal(uint64_t n) {
+  char path[512];
+
+  glstore_path(path, sizeof(path), "journal", n);
+
+  journalfd = open(path, O_WRONLY | O_CREAT | O_APPEND, 0600);
+
+  if (journalfd < 0) {
+    Error("glines", ERR_ERROR, "Could not open G-Line journal %s: %s", path, strerror(errno));
+    return -1;
+  }
+
+  journalno = n;
+  return 0;
+}
+
+/* Writes every gline out as a snapshot that continues with journal
+ * nextjournal.  Runs in the compaction child, or inline if fork fails. */
+static int glstore_writesnapshot(uint64_t nextjournal) {
+  char path[512], tmppath[512], record[GLSTORE_MAXRECORD];
+  static char buf[GLSTORE_BUFSIZE];
+  glstore_header h;
+  size_t len, pos;
+  gline *gl;
+  int fd, count;
+
+  glstore_path(path, sizeof(path), "snapshot", 0);
+  glstore_path(tmppath, sizeof(tmppath), "snapshot.temp", 0);
+
+  fd = open(tmppath, O_WRONLY | O_CREAT | O_TRUNC, 0600);
+
+  if (fd < 0)
     return -1;
 
+  memset(&h, 0, sizeof(h));
+  h.magic = GLSTORE_MAGIC;
+  h.nextjournal = nextjournal;
+  memcpy(buf, &h, sizeof(h));
+  pos = sizeof(h);
+
   count = 0;
 
   for (gl = glinelist; gl; gl = gl->next) {
-    fprintf(fp, "%s %jd,%jd,%jd,%d,%s,%s\n",
-      glinetostring(gl), (intmax_t)gl->expire, (intmax_t)gl->lastmod, (intmax_t)gl->lifetime,
-      (gl->flags & GLINE_ACTIVE) ? 1 : 0,
-      gl->creator->content, gl->reason ? gl->reason->content : "");
+    len = glstore_encode(record, GLSTORE_SET, gl);
+
+    if (!len)
+      continue;
+
+    if (pos + len > sizeof(buf)) {
+      if (glstore_writeall(fd, buf, pos) < 0)
+        goto fail;
+
+      pos = 0;
+    }
+
+    memcpy(buf + pos, record, len);
+    pos += len;
     count++;
   }
 
-  fclose(fp);
+  if (glstore_writeall(fd, buf, pos) < 0 || fsync(fd) < 0)
+    goto fail;
+
+  close(fd);
+
+  if (rename(tmppath, path) < 0) {
+    unlink(tmppath);
+    return -1;
+  }
+
+  return count;
+
+fail:
+  close(fd);
+  unlink(tmppath);
+  return -1;
+}
+
+/* Journals before upto are in the snapshot now. */
+static void glstore_dropjournals(uint64_t upto) {
+  char path[512];
+
+  for (; oldestjournal < upto; oldestjournal++) {
+    glstore_path(path, sizeof(path), "journal", oldestjournal);
+    unlink(path);
+  }
+}
+
+/* Returns the number of glines being written, or -1. */
+static int glstore_compact(void) {
+  gline *gl;
+  int count;
+  pid_t pid;
+
+  if (compactpid || journalfd < 0)
+    return -1;
+
+  glstore_flush();
+  close(journalfd);
+  journalfd = -1;
+
+  if (glstore_openjournal(journalno + 1) < 0) {
+    /* carry on in the old one */
+    glstore_openjournal(journalno);
+    return -1;
+  }
+
+  journalsize = 0;
+
+  count = 0;
+  for (gl = glinelist; gl; gl = gl->next)
+    count++;
+
+  pid = fork();
+
+  if (pid == 0) {
+    _exit((glstore_writesnapshot(journalno) < 0) ? 1 : 0);
+  } else if (pid < 0) {
+    Error("glines", ERR_WARNING, "Could not fork to save G-Lines (%s), saving inline.", strerror(errno));
+
+    if (glstore_writesnapshot(journalno) < 0) {
+      Error("glines", ERR_ERROR, "Could not save G-Line snapshot.");
+      return -1;
+    }
+
+    glstore_dropjournals(journalno);
+    return count;
+  }
+
+  compactpid = pid;
+  compactjournal = journalno;
+  checksched = schedulerecurring(time(NULL) + 1, 0, 1, glstore_checkcompact, NULL);
 
   return count;
 }
 
-static int glstore_loadfile(const char *file) {
+static void glstore_checkcompact(void *arg) {
+  int status;
+  pid_t ret;
+
+  ret = waitpid(compactpid, &status, WNOHANG);
+
+  if (ret == 0)
+    return;
+
+  deleteschedule(checksched, glstore_checkcompact, NULL);
+  checksched = NULL;
+  compactpid = 0;
+
+  if (ret < 0 || !WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+    Error("glines", ERR_ERROR, "Could not save G-Line snapshot, keeping journals.");
+    return;
+  }
+
+  glstore_dropjournals(compactjournal);
+}
+
+static char *glstore_readfile(const char *path, size_t *len) {
+  struct stat st;
+  char *buf;
+  ssize_t ret;
+  size_t pos;
+  int fd;
+
+  fd = open(path, O_RDONLY);
+
+  if (fd < 0)
+    return NULL;
+
+  if (fstat(fd, &st) < 0 || !(buf = malloc(st.st_size + 1))) {
+    close(fd);
+    return NULL;
+  }
+
+  for (pos = 0; pos < (size_t)st.st_size; pos += ret) {
+    ret = read(fd, buf + pos, st.st_size - pos);
+
+    if (ret < 0 && errno == EINTR) {
+      ret = 0;
+      continue;
+    }
+
+    if (ret <= 0)
+      break;
+  }
+
+  close(fd);
+
+  *len = pos;
+  return buf;
+}
+
+static unsigned int glstore_hash(const char *mask) {
+  return glstore_checksum(mask, strlen(mask)) % GLSTORE_HASHSIZE;
+}
+
+static glstore_loaded **glstore_find(glstore_loaded **table, const char *mask) {
+  glstore_loaded **lp;
+
+  for (lp = &table[glstore_hash(mask)]; *lp; lp = &(*lp)->next)
+    if (!strcmp((*lp)->mask, mask))
+      return lp;
+
+  return NULL;
+}
+
+static glstore_loaded *glstore_insert(glstore_loaded **table, const char *mask, gline *gl, int existing) {
+  glstore_loaded *lp = malloc(sizeof(glstore_loaded));
+  unsigned int hash = glstore_hash(mask);
+
+  if (!lp)
+    return NULL;
+
+  lp->mask = malloc(strlen(mask) + 1);
+
+  if (!lp->mask) {
+    free(lp);
+    return NULL;
+  }
+
+  strcpy(lp->mask, mask);
+  lp->gl = gl;
+  lp->existing = existing;
+  lp->next = table[hash];
+  table[hash] = lp;
+
+  return lp;
+}
+
+static void glstore_apply(glstore_loaded **table, const glstore_record *r, const char *mask, const char *creator, const char *reason) {
+  glstore_loaded **lpp, *lp;
+  gline *gl;
+
+  lpp = glstore_find(table, mask);
+  lp = lpp ? *lpp : NULL;
+
+  /* Don't update glines we already had. */
+  if (lp && lp->existing)
+    return;
+
+  if (r->op == GLSTORE_DELETE) {
+    if (lp) {
+      *lpp = lp->next;
+      freegline(lp->gl);
+      free(lp->mask);
+      free(lp);
+    }
+
+    return;
+  }
+
+  if (lp) {
+    gl = lp->gl;
+    freesstring(gl->creator);
+    freesstring(gl->reason);
+  } else {
+    gl = makegline(mask);
+
+    if (!gl)
+      return;
+
+    if (!glstore_insert(table, mask, gl, 0)) {
+      freegline(gl);
+      return;
+    }
+  }
+
+  gl->creator = getsstring(creator, 512);
+  gl->reason = getsstring(reason, 512);
+
+  if (r->active)
+    gl->flags |= GLINE_ACTIVE;
+  else
+    gl->flags &= ~GLINE_ACTIVE;
+
+  gl->expire = r->expire;
+  gl->lastmod = r->lastmod;
+  gl->lifetime = r->lifetime;
+}
+
+/* Applies the records in buf; returns the length of the valid prefix. */
+static size_t glstore_replay(glstore_loaded **table, const char *buf, size_t len) {
+  char mask[512], creator[512], reason[512];
+  glstore_record r;
+  size_t pos = 0;
+  const char *p;
+
+  while (len - pos >= sizeof(r)) {
+    memcpy(&r, buf + pos, sizeof(r));
+
+    if (r.length > len - pos - GLSTORE_RECORDHEAD ||
+        r.length != sizeof(r) - GLSTORE_RECORDHEAD + r.masklen + r.creatorlen + r.reasonlen ||
+        r.masklen >= sizeof(mask) || r.creatorlen >= sizeof(creator) || r.reasonlen >= sizeof(reason) ||
+        (r.op != GLSTORE_SET && r.op != GLSTORE_DELETE) ||
+        glstore_checksum(buf + pos + GLSTORE_RECORDHEAD, r.length) != r.checksum)
+      break;
+
+    p = buf + pos + sizeof(r);
+    memcpy(mask, p, r.masklen);
+    mask[r.masklen] = '\0';
+    p += r.masklen;
+    memcpy(creator, p, r.creatorlen);
+    creator[r.creatorlen] = '\0';
+    p += r.creatorlen;
+    memcpy(reason, p, r.reasonlen);
+    reason[r.reasonlen] = '\0';
+
+    glstore_apply(table, &r, mask, creator, reason);
+
+    pos += GLSTORE_RECORDHEAD + r.length;
+  }
+
+  return pos;
+}
+
+/* The format before journals: one text file, rewritten every hour. */
+static int glstore_loadtext(glstore_loaded **table, const char *file) {
   FILE *fp;
   char mask[512], creator[512], reason[512];
   intmax_t expire, lastmod, lifetime;
+  glstore_record r;
   int active, count;
-  gline *gl;
 
   fp = fopen(file, "r");
 
@@ -51,63 +563,128 @@ static int glstore_loadfile(const char *file) {
 
     count++;
 
-    gl = findgline(mask);
+    memset(&r, 0, sizeof(r));
+    r.op = GLSTORE_SET;
+    r.active = active ? 1 : 0;
+    r.expire = expire;
+    r.lastmod = lastmod;
+    r.lifetime = lifetime;
 
-    if (gl)
-      continue; /* Don't update existing glines. */
+    glstore_apply(table, &r, mask, creator, reason);
+  }
 
-    gl = makegline(mask);
+  fclose(fp);
 
-    if (!gl)
-      continue;
+  return count;
+}
 
-    gl->creator = getsstring(creator, 512);
+/* Loads the snapshot and journals; returns the number of glines added, or
+ * -1 if there was nothing to load.  If given, firstjournal is set to the
+ * first journal not in the snapshot and lastjournal to the last one found,
+ * whose torn tail (if any) has been cut off. */
+static int glstore_loadall(uint64_t *firstjournal, uint64_t *lastjournal) {
+  char path[512];
+  glstore_loaded **table, *lp, *next;
+  glstore_header h;
+  uint64_t n, first;
+  size_t len, valid;
+  char *buf;
+  gline *gl;
+  int i, count, found;
+
+  table = calloc(GLSTORE_HASHSIZE, sizeof(glstore_loaded *));
 
-    gl->flags |= active ? GLINE_ACTIVE : 0;
+  if (!table)
+    return -1;
 
-    gl->reason = getsstring(reason, 512);
-    gl->expire = expire;
-    gl->lastmod = lastmod;
-    gl->lifetime = lifetime;
-    
-    gl->next = glinelist;
-    glinelist = gl;
+  for (gl = glinelist; gl; gl = gl->next)
+    glstore_insert(table, glinetostring(gl), gl, 1);
+
+  found = 0;
+  first = 1;
+
+  glstore_path(path, sizeof(path), "snapshot", 0);
+  buf = glstore_readfile(path, &len);
+
+  if (buf) {
+    if (len >= sizeof(h))
+      memcpy(&h, buf, sizeof(h));
+
+    if (len >= sizeof(h) && h.magic == GLSTORE_MAGIC) {
+      first = h.nextjournal;
+      valid = glstore_replay(table, buf + sizeof(h), len - sizeof(h));
+      if (valid != len - sizeof(h))
+        Error("glines", ERR_WARNING, "G-Line snapshot %s is truncated or corrupt.", path);
+      found = 1;
+    } else {
+      Error("glines", ERR_WARNING, "G-Line snapshot %s has a bad header, ignoring it.", path);
+    }
+
+    free(buf);
   }
 
-  fclose(fp);
+  for (n = first;; n++) {
+    glstore_path(path, sizeof(path), "journal", n);
+    buf = glstore_readfile(path, &len);
 
-  return count;
-}
+    if (!buf)
+      break;
 
-int glstore_save(void) {
-  char path[512], srcfile[512], dstfile[512];
-  int i, count;
+    valid = glstore_replay(table, buf, len);
+    free(buf);
+    found = 1;
+
+    if (valid != len) {
+      Error("glines", ERR_WARNING, "Dropping %zu bytes of torn records from %s.", len - valid, path);
 
-  snprintf(path, sizeof(path), "%s.temp", GLSTORE_PATH_PREFIX);
+      if (lastjournal && truncate(path, valid) < 0)
+        Error("glines", ERR_WARNING, "Could not truncate %s: %s", path, strerror(errno));
+    }
+  }
 
-  count = glstore_savefile(path);
+  if (firstjournal)
+    *firstjournal = first;
 
-  if (count < 0) {
-    Error("glines", ERR_ERROR, "Could not save glines to %s", path);
-    return -1;
+  if (lastjournal)
+    *lastjournal = (n > first) ? n - 1 : first;
+
+  if (!found) {
+    snprintf(path, sizeof(path), "%s.0", GLSTORE_PATH_PREFIX);
+    found = (glstore_loadtext(table, path) >= 0);
   }
 
-  for (i = GLSTORE_SAVE_FILES; i > 0; i--) {
-    snprintf(srcfile, sizeof(srcfile), "%s.%d", GLSTORE_PATH_PREFIX, i - 1);
-    snprintf(dstfile, sizeof(dstfile), "%s.%d", GLSTORE_PATH_PREFIX, i);
-    (void) rename(srcfile, dstfile);
+  /* now add everything that survived to the global list */
+  loading = 1;
+  count = 0;
+
+  for (i = 0; i < GLSTORE_HASHSIZE; i++) {
+    for (lp = table[i]; lp; lp = next) {
+      next = lp->next;
+
+      if (!lp->existing) {
+        addgline(lp->gl);
+        count++;
+      }
+
+      free(lp->mask);
+      free(lp);
+    }
   }
 
-  (void) rename(path, srcfile);
+  loading = 0;
+  free(table);
 
-  return count;
+  return found ? count : -1;
+}
+
+int glstore_save(void) {
+  return glstore_compact();
 }
 
 int glstore_load(void) {
-  char path[512];
-  snprintf(path, sizeof(path), "%s.0", GLSTORE_PATH_PREFIX);
+  glstore_flush();
 
-  return glstore_loadfile(path);
+  return glstore_loadall(NULL, NULL);
 }
 
 static int glines_cmdsaveglines(void *source, int cargc, char **cargv) {
@@ -117,9 +694,9 @@ static int glines_cmdsaveglines(void *source, int cargc, char **cargv) {
   count = glstore_save();
 
   if (count < 0)
-    controlreply(sender, "An error occured while saving G-Lines.");
+    controlreply(sender, "Could not start saving G-Lines (a save may already be in progress).");
   else
-    controlreply(sender, "Saved %d G-Line%s.", count, (count == 1) ? "" : "s");
+    controlreply(sender, "Saving %d G-Line%s.", count, (count == 1) ? "" : "s");
 
   return CMD_OK;
 }
@@ -139,21 +716,70 @@ static int glines_cmdloadglines(void *source, int cargc, char **cargv) {
 }
 
 static void glines_sched_save(void *arg) {
-  glstore_save();
+  /* nothing's changed since the last snapshot */
+  if (!journalsize)
+    return;
+
+  glstore_compact();
 }
 
 void _init() {
+  uint64_t firstjournal, lastjournal;
+  int count;
+
   registercontrolhelpcmd("loadglines", NO_DEVELOPER, 0, glines_cmdloadglines, "Usage: loadglines\nForce load of glines.");
   registercontrolhelpcmd("saveglines", NO_DEVELOPER, 0, glines_cmdsaveglines, "Usage: saveglines\nForce save of glines.");
 
-  schedulerecurring(time(NULL), 0, GLSTORE_SAVE_INTERVAL, &glines_sched_save, NULL);
+  count = glstore_loadall(&firstjournal, &lastjournal);
+
+  oldestjournal = firstjournal;
+  glstore_openjournal(lastjournal);
 
-  glstore_load();
+  registerhook(HOOK_GLINE_NEWGLINE, glstore_hooknew);
+  registerhook(HOOK_GLINE_MODIFIED, glstore_hooknew);
+  registerhook(HOOK_GLINE_LOSTGLINE, glstore_hooklost);
+
+  /* the journals we just read are only in the snapshot once it's been
+   * rewritten, which is also when an old text file gets converted */
+  if (count > 0)
+    compactsched = scheduleoneshot(time(NULL), glstore_compactsched, NULL);
+
+  schedulerecurring(time(NULL) + GLSTORE_SAVE_INTERVAL, 0, GLSTORE_SAVE_INTERVAL, &glines_sched_save, NULL);
 }
 
 void _fini() {
   deregistercontrolcmd("loadglines", glines_cmdloadglines);
   deregistercontrolcmd("saveglines", glines_cmdsaveglines);
 
+  deregisterhook(HOOK_GLINE_NEWGLINE, glstore_hooknew);
+  deregisterhook(HOOK_GLINE_MODIFIED, glstore_hooknew);
+  deregisterhook(HOOK_GLINE_LOSTGLINE, glstore_hooklost);
+
   deleteschedule(NULL, glines_sched_save, NULL);
+
+  if (flushsched)
+    deleteschedule(flushsched, glstore_flushsched, NULL);
+
+  if (compactsched)
+    deleteschedule(compactsched, glstore_compactsched, NULL);
+
+  if (checksched)
+    deleteschedule(checksched, glstore_checkcompact, NULL);
+
+  /* don't leave a compaction behind: it'd never be reaped */
+  if (compactpid) {
+    int status;
+
+    if (waitpid(compactpid, &status, 0) == compactpid && WIFEXITED(status) && WEXITSTATUS(status) == 0)
+      glstore_dropjournals(compactjournal);
+
+    compactpid = 0;
+  }
+
+  glstore_flush();
+
+  if (journalfd >= 0)
+    close(journalfd);
+
+  journalfd = -1;
 }
@@ -1,6 +1,7 @@
 #include <stdlib.h>
 #include <stdio.h> /* for debug */
 #include <string.h>
+#include <ctype.h>
 
 #include "hcensor.h"
 #include "hcommands.h"
@@ -8,6 +9,19 @@
 #include "hgen.h"
 #include "hban.h"
 
+typedef struct hcensor_node_struct
+{
+    unsigned char chr;
+    int child; /* first child, 0 if none */
+    int sibling;
+    int fail;
+    int output; /* first pattern whose literal ends here, -1 if none */
+    int dict; /* closest node on the fail chain with output, 0 if none */
+} hcensor_node;
+
+/* bumped whenever any censor list changes, compiled matchers are rebuilt lazily */
+static unsigned int hcensor_generation = 1;
+
 hcensor *hcensor_get_by_pattern(hcensor *hcens, const char *pat)
 {
     for (;hcens;hcens = hcens->next)
@@ -38,6 +52,199 @@ hcensor *hcensor_check(hcensor *hcens, const char *str)
     return NULL;
 }
 
+static int hcensor_node_child(hcensor_matcher *matcher, int node, unsigned char chr)
+{
+    int child;
+
+    for (child = matcher->nodes[node].child;child;child = matcher->nodes[child].sibling)
+        if (matcher->nodes[child].chr == chr)
+            return child;
+    return 0;
+}
+
+static int hcensor_node_add(hcensor_matcher *matcher, int parent, unsigned char chr)
+{
+    hcensor_node *node;
+
+    if ((matcher->node_count & (matcher->node_count - 1)) == 0)
+        matcher->nodes = realloc(matcher->nodes, sizeof(hcensor_node) * matcher->node_count * 2);
+
+    node = &matcher->nodes[matcher->node_count];
+    node->chr = chr;
+    node->child = 0;
+    node->fail = 0;
+    node->output = -1;
+    node->dict = 0;
+
+    node->sibling = matcher->nodes[parent].child;
+    matcher->nodes[parent].child = matcher->node_count;
+
+    return matcher->node_count++;
+}
+
+/* Longest part of the pattern without wildcards, every match must contain it */
+static const char *hcensor_literal(const char *pattern, int *len)
+{
+    const char *best = pattern;
+    int bestlen = 0, runlen;
+
+    while (*pattern)
+    {
+        for (runlen = 0;pattern[runlen] && pattern[runlen] != '*' && pattern[runlen] != '?';runlen++);
+
+        if (runlen > bestlen)
+        {
+            best = pattern;
+            bestlen = runlen;
+        }
+
+        pattern += runlen;
+        if (*pattern)
+            pattern++;
+    }
+
+    *len = bestlen;
+    return best;
+}
+
+static hcensor_matcher *hcensor_matcher_build(hcensor *hcens)
+{
+    hcensor_matcher *matcher;
+    int i, j, node, child, fail, head, tail, *queue;
+    const char *literal;
+    int len;
+
+    matcher = malloc(sizeof(hcensor_matcher));
+    matcher->list = hcens;
+    matcher->generation = hcensor_generation;
+    matcher->pattern_count = hcensor_count(hcens);
+    matcher->patterns = malloc(sizeof(hcensor*) * (matcher->pattern_count + 1));
+    matcher->pattern_next = malloc(sizeof(int) * (matcher->pattern_count + 1));
+    matcher->candidates = malloc(matcher->pattern_count + 1);
+    matcher->always = malloc(sizeof(int) * (matcher->pattern_count + 1));
+    matcher->always_count = 0;
+
+    /* root */
+    matcher->nodes = malloc(sizeof(hcensor_node));
+    matcher->node_count = 1;
+    memset(matcher->nodes, 0, sizeof(hcensor_node));
+    matcher->nodes[0].output = -1;
+
+    for (i = 0;hcens;hcens = hcens->next, i++)
+    {
+        matcher->patterns[i] = hcens;
+        literal = hcensor_literal(hcens->pattern->content, &len);
+
+        if (len == 0)
+        {
+            matcher->always[matcher->always_count++] = i;
+            matcher->pattern_next[i] = -1;
+            continue;
+        }
+
+        for (node = 0, j = 0;j < len;j++)
+        {
+            unsigned char chr = tolower((unsigned char)literal[j]);
+
+            if ((child = hcensor_node_child(matcher, node, chr)) == 0)
+                child = hcensor_node_add(matcher, node, chr);
+            node = child;
+        }
+
+        matcher->pattern_next[i] = matcher->nodes[node].output;
+        matcher->nodes[node].output = i;
+    }
+
+    /* breadth first pass to set up the fail and dictionary links */
+    queue = malloc(sizeof(int) * matcher->node_count);
+    head = tail = 0;
+
+    for (child = matcher->nodes[0].child;child;child = matcher->nodes[child].sibling)
+        queue[tail++] = child;
+
+    while (head < tail)
+    {
+        node = queue[head++];
+
+        for (child = matcher->nodes[node].child;child;child = matcher->nodes[child].sibling)
+        {
+            unsigned char chr = matcher->nodes[child].chr;
+
+            for (fail = matcher->nodes[node].fail;fail && !hcensor_node_child(matcher, fail, chr);fail = matcher->nodes[fail].fail);
+            fail = hcensor_node_child(matcher, fail, chr);
+
+            matcher->nodes[child].fail = fail;
+            if (matcher->nodes[fail].output != -1)
+                matcher->nodes[child].dict = fail;
+            else
+                matcher->nodes[child].dict = matcher->nodes[fail].dict;
+
+            queue[tail++] = child;
+        }
+    }
+
+    free(queue);
+
+    return matcher;
+}
+
+void hcensor_matcher_free(hcensor_matcher *matcher)
+{
+    if (matcher == NULL)
+        return;
+
+    free(matcher->patterns);
+    free(matcher->pattern_next);
+    free(matcher->candidates);
+    free(matcher->always);
+    free(matcher->nodes);
+    free(matcher);
+}
+
+hcensor *hcensor_check_compiled(hcensor_matcher **cache, hcensor *hcens, const char *str)
+{
+    hcensor_matcher *matcher = *cache;
+    const char *ptr;
+    int i, node, state = 0;
+
+    if (hcens == NULL)
+        return NULL;
+
+    if (matcher == NULL || matcher->list != hcens || matcher->generation != hcensor_generation)
+    {
+        hcensor_matcher_free(matcher);
+        matcher = *cache = hcensor_matcher_build(hcens);
+    }
+
+    memset(matcher->candidates, 0, matcher->pattern_count);
+
+    for (i = 0;i < matcher->always_count;i++)
+        matcher->candidates[matcher->always[i]] = 1;
+
+    for (ptr = str;*ptr;ptr++)
+    {
+        unsigned char chr = tolower((unsigned char)*ptr);
+        int child;
+
+        while (state && !hcensor_node_child(matcher, state, chr))
+            state = matcher->nodes[state].fail;
+        if ((child = hcensor_node_child(matcher, state, chr)))
+            state = child;
+
+        node = (matcher->nodes[state].output != -1)?state:matcher->nodes[state].dict;
+        for (;node;node = matcher->nodes[node].dict)
+            for (i = matcher->nodes[node].output;i != -1;i = matcher->pattern_next[i])
+                matcher->candidates[i] = 1;
+    }
+
+    /* first matching pattern in list order, as hcensor_check */
+    for (i = 0;i < matcher->pattern_count;i++)
+        if (matcher->candidates[i] && strregexp(str, matcher->patterns[i]->pattern->content))
+            return matcher->patterns[i];
+
+    return NULL;
+}
+
 hcensor *hcensor_add(hcensor **hcens, const char *pat, const char *rsn, hcensor_type type)
 {
     hcensor *tmp;
@@ -57,6 +264,7 @@ hcensor *hcensor_add(hcensor **hcens, const char *pat, const char *rsn, hcensor_
         tmp->reason = NULL;
 
     *hcens = tmp;
+    hcensor_generation++;
 
     return tmp;
 }
@@ -71,6 +279,7 @@ hcensor *hcensor_del(hcensor **hcens, hcensor *ptr)
             freesstring((*hcens)->reason);
             free (*hcens);
             *hcens = tmp;
+            hcensor_generation++;
             return NULL;
         }
     return ptr;
@@ -24,9 +24,32 @@ typedef struct hcensor_struct
     struct hcensor_struct *next;
 } hcensor;
 
+/* All censor patterns of a channel compiled into one Aho-Corasick automaton
+ * over the longest literal part of each pattern, so a line is scanned once
+ * and only the patterns whose literal occurs are matched with strregexp */
+typedef struct hcensor_matcher_struct
+{
+    hcensor *list;
+    unsigned int generation;
+
+    int pattern_count;
+    hcensor **patterns; /* in list order */
+    int *pattern_next; /* next pattern with the same literal, -1 terminated */
+    char *candidates;
+
+    int node_count;
+    struct hcensor_node_struct *nodes;
+
+    int always_count; /* patterns without a literal part, always checked */
+    int *always;
+} hcensor_matcher;
+
 hcensor *hcensor_get_by_pattern(hcensor *, const char *);
 hcensor *hcensor_get_by_index(hcensor *, int);
 hcensor *hcensor_check(hcensor *, const char *); /* first matching pattern is returned, NULL if ok */
+/* same as hcensor_check but uses (and rebuilds if needed) the compiled matcher in *cache */
+hcensor *hcensor_check_compiled(hcensor_matcher **, hcensor *, const char *);
+void hcensor_matcher_free(hcensor_matcher *);
 hcensor *hcensor_add(hcensor **, const char*, const char*, hcensor_type);
 hcensor *hcensor_del(hcensor **, hcensor *);
 /* Handle a censor match, if returnvalue is non-zero then the user was removed from channel */
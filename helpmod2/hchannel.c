@@ -44,6 +44,7 @@ hchannel *hchannel_add(const char *cname)
     hchan->jf_control = time(NULL);
     hchan->lc_profile = NULL;
     hchan->censor = NULL;
+    hchan->censor_matcher = NULL;
 
     hchan->htickets = NULL;
     hchan->ticket_message = NULL;
@@ -94,6 +95,7 @@ int hchannel_del(hchannel *hchan)
     tmp = hchan->next;
 
     hcensor_del_all(&(hchan->censor));
+    hcensor_matcher_free(hchan->censor_matcher);
     hterm_del_all(&hchan->channel_hterms);
     htopic_del_all(&hchan->topic);
     hstat_del_channel(hchan);
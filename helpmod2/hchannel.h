@@ -65,6 +65,7 @@ typedef struct hchannel_struct
 
     int jf_control; /* join flood control */
     hcensor *censor; /* censor, keeps the bad words out */
+    hcensor_matcher *censor_matcher; /* compiled from censor on demand */
     int autoqueue; /* H_QUEUE_MAINTAIN value */
     int max_idle; /* automatic idler removal */
     htopic *topic;
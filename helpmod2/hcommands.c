@@ -1,8 +1,11 @@
+#define _POSIX_C_SOURCE 200809L
+
 #include <string.h>
 #include <ctype.h>
 #include <stdio.h>
 #include <assert.h>
 #include <sys/types.h>
+#include <sys/time.h>
 #include <dirent.h>
 
 #include "../lib/strlfunc.h"
@@ -3516,6 +3519,106 @@ static void helpmod_cmd_weekstats (huser *sender, channel* returntype, char* ost
     free(arr.array);
 }
 
+#define HLC_BENCH_MAXLINES 200000
+
+static double helpmod_bench_elapsed(struct timeval *start)
+{
+    struct timeval now;
+    gettimeofday(&now, NULL);
+    return (now.tv_sec - start->tv_sec) * 1000.0 + (now.tv_usec - start->tv_usec) / 1000.0;
+}
+
+/* Replays a channel log through the censor and lamer control of a channel,
+ * without acting on the results. Lines are taken as-is, except that a
+ * leading "<nick> " (optionally preceded by a timestamp) is stripped. */
+static void helpmod_cmd_lcbench (huser *sender, channel* returntype, char* ostr, int argc, char *argv[])
+{
+    hchannel *hchan;
+    hcensor_matcher *matcher = NULL;
+    hlc_line lcl;
+    FILE *in;
+    char buffer[512], **lines, *ptr;
+    int i, round, rounds = 1, count = 0, linear_hits = 0, compiled_hits = 0, lamer_hits = 0;
+    struct timeval start;
+    double linear_ms, compiled_ms, analyse_ms;
+
+    DEFINE_HCHANNEL;
+
+    if (hchan == NULL)
+    {
+        helpmod_reply(sender, returntype, "Cannot run benchmark: Channel not specified or found");
+        return;
+    }
+    if (argc < 1)
+    {
+        helpmod_reply(sender, returntype, "Syntax: lcbench [channel] logfile [rounds]");
+        return;
+    }
+    if (argc > 1 && (!sscanf(argv[1], "%d", &rounds) || rounds < 1 || rounds > 100))
+    {
+        helpmod_reply(sender, returntype, "Cannot run benchmark: Rounds must be between 1 and 100");
+        return;
+    }
+    if ((in = fopen(argv[0], "rt")) == NULL)
+    {
+        helpmod_reply(sender, returntype, "Cannot run benchmark: Can not open file %s", argv[0]);
+        return;
+    }
+
+    lines = malloc(sizeof(char*) * HLC_BENCH_MAXLINES);
+    while (count < HLC_BENCH_MAXLINES && fgets(buffer, sizeof(buffer), in))
+    {
+        buffer[strcspn(buffer, "\r\n")] = '\0';
+
+        ptr = buffer;
+        if ((ptr = strchr(buffer, '<')) != NULL && ptr - buffer < 32 && (ptr = strstr(ptr, "> ")) != NULL)
+            ptr += 2;
+        else
+            ptr = buffer;
+
+        if (*ptr)
+            lines[count++] = strdup(ptr);
+    }
+    fclose(in);
+
+    gettimeofday(&start, NULL);
+    for (round = 0;round < rounds;round++)
+        for (i = 0;i < count;i++)
+            if (hcensor_check(hchan->censor, lines[i]))
+                linear_hits++;
+    linear_ms = helpmod_bench_elapsed(&start);
+
+    gettimeofday(&start, NULL);
+    for (round = 0;round < rounds;round++)
+        for (i = 0;i < count;i++)
+            if (hcensor_check_compiled(&matcher, hchan->censor, lines[i]))
+                compiled_hits++;
+    compiled_ms = helpmod_bench_elapsed(&start);
+
+    gettimeofday(&start, NULL);
+    for (round = 0;round < rounds;round++)
+        for (i = 0;i < count;i++)
+        {
+            hlc_analyse(lines[i], &lcl);
+            if (hchan->lc_profile != NULL &&
+                (lcl.alnum_repeats >= hchan->lc_profile->character_repeat_max_count ||
+                 lcl.symbol_repeats >= hchan->lc_profile->symbol_repeat_max_count ||
+                 lcl.symbol_run >= hchan->lc_profile->symbol_max_count))
+                lamer_hits++;
+        }
+    analyse_ms = helpmod_bench_elapsed(&start);
+
+    helpmod_reply(sender, returntype, "Replayed %d lines %d time(s) against %d censor patterns of channel %s", count, rounds, hcensor_count(hchan->censor), hchannel_get_name(hchan));
+    helpmod_reply(sender, returntype, "Censor, pattern list     : %8.2f ms, %d matches", linear_ms, linear_hits);
+    helpmod_reply(sender, returntype, "Censor, compiled matcher : %8.2f ms, %d matches%s", compiled_ms, compiled_hits, (linear_hits != compiled_hits)?" (MISMATCH)":"");
+    helpmod_reply(sender, returntype, "Lamer control analysis   : %8.2f ms, %d lines with character repeats", analyse_ms, lamer_hits);
+
+    hcensor_matcher_free(matcher);
+    for (i = 0;i < count;i++)
+        free(lines[i]);
+    free(lines);
+}
+
 /* old H stuff */
 void helpmod_cmd_load (huser *sender, channel *returntype, char* arg, int argc, char *argv[])
 {
@@ -3768,6 +3871,7 @@ void hcommands_add(void)
 
     hcommand_add("channel", H_TRIAL, helpmod_cmd_channel, "Gives a list of all channel users");
     hcommand_add("weekstats", H_ADMIN, helpmod_cmd_weekstats, "Gives weekly stats for a channel");
+    hcommand_add("lcbench", H_ADMIN, helpmod_cmd_lcbench, "Replays a channel log through censor and lamer control");
     /*hcommand_add("megod", H_PEON, helpmod_cmd_megod, "Gives you userlevel 4, if you see this in the final version, please kill strutsi");*/
     /*hcommand_add("test", H_PEON, helpmod_cmd_test, "Gives you userlevel 4, if you see this in the final version, please kill strutsi");*/
 }
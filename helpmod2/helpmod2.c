@@ -317,7 +317,7 @@ void helpmod_chan_privmsg(void **args)
 
     if (huser_get_level(sender_huser) < H_FRIEND) /* staff, staff trials and friends are not subject to any control */
     {
-        if ((hchan->flags & H_CENSOR) && (tmp = hcensor_check(hchan->censor, (char*)message)))
+        if ((hchan->flags & H_CENSOR) && (tmp = hcensor_check_compiled(&hchan->censor_matcher, hchan->censor, (char*)message)))
         { /* censor match */
             if (hcensor_match(hchan, sender_huser, tmp))
 		return;
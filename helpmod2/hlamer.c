@@ -98,44 +98,83 @@ static int hlc_violation_handle(hchannel *hchan, huser* husr, int violation)
 
 }
 
-static int hlc_check_caps(hlc_profile *hlc_prof, huser *husr, const char *line)
+void hlc_analyse(const char *line, hlc_line *lcl)
 {
-    int caps = 0;
-    int noncaps = 0;
-    int i;
-    int firstword;
+    unsigned char chr, prev = '\0';
+    int i, run = 0, symbols = 0, spaceseen = 0;
 
-    if (strchr(line, ' '))
-	firstword = strchr(line, ' ') - line;
-    else
-        firstword = 0;
+    memset(lcl, 0, sizeof(hlc_line));
 
-    /* Handle the thing sent with /me */
-    if (!strncmp(line, "\1ACTION", 6 + 1))
-	line+=(6 + 1);
-    else if (firstword && firstword < NICKLEN + 3)
-    {
-	char buffer[NICKLEN + 3];
-	strncpy(buffer, line, firstword);
-	buffer[firstword] = '\0';
-	if (buffer[firstword - 1] == ':')
-	    buffer[firstword - 1] = '\0';
-	if (getnickbynick(buffer))
-            line+=firstword + 1;
-    }
+    lcl->action = !strncmp(line, "\1ACTION", 6 + 1);
 
     for (i = 0;line[i];i++)
     {
-        if (isalpha(line[i]))
+        chr = line[i];
+
+        if (isalpha(chr))
         {
-            if (isupper(line[i]))
-                caps++;
+            if (isupper(chr))
+                lcl->caps++;
             else
-                noncaps++;
+                lcl->noncaps++;
+        }
+        else if (chr == ' ' && !spaceseen)
+        {
+            spaceseen = 1;
+            lcl->firstword = i;
+            lcl->firstword_caps = lcl->caps;
+            lcl->firstword_noncaps = lcl->noncaps;
+        }
+
+        if (chr == prev)
+        {
+            run++;
+            if (isalnum(chr) && run > lcl->alnum_repeats)
+                lcl->alnum_repeats = run;
+            else if (ispunct(chr) && run > lcl->symbol_repeats)
+                lcl->symbol_repeats = run;
+        }
+        else
+        {
+            run = 0;
+            prev = chr;
+        }
+
+        if (ispunct(chr))
+        {
+            if (++symbols > lcl->symbol_run)
+                lcl->symbol_run = symbols;
+        }
+        else
+            symbols = 0;
+    }
+
+    lcl->length = i;
+}
+
+static int hlc_check_caps(hlc_profile *hlc_prof, huser *husr, const char *line, const hlc_line *lcl)
+{
+    int caps = lcl->caps;
+    int noncaps = lcl->noncaps;
+
+    /* Handle the thing sent with /me */
+    if (lcl->action)
+        caps -= 6; /* ACTION */
+    else if (lcl->firstword && lcl->firstword < NICKLEN + 3)
+    {
+        char buffer[NICKLEN + 3];
+        strncpy(buffer, line, lcl->firstword);
+        buffer[lcl->firstword] = '\0';
+        if (buffer[lcl->firstword - 1] == ':')
+            buffer[lcl->firstword - 1] = '\0';
+        if (getnickbynick(buffer))
+        {
+            caps -= lcl->firstword_caps;
+            noncaps -= lcl->firstword_noncaps;
         }
     }
 
-    if ((noncaps + caps) < hlc_prof->caps_min_count)
+    if ((noncaps + caps) < hlc_prof->caps_min_count || (noncaps + caps) == 0)
         return 0;
 
     if (((100 * caps) / (caps + noncaps)) >= hlc_prof->caps_max_percentage) /* violation */
@@ -146,57 +185,36 @@ static int hlc_check_caps(hlc_profile *hlc_prof, huser *husr, const char *line)
         return 0;
 }
 
-static int hlc_check_repeat(hlc_profile *hlc_prof, huser *husr, const char *line)
+static int hlc_check_repeat(hlc_profile *hlc_prof, huser *husr, const char *line, const hlc_line *lcl)
 {
-    if (!strncmp(husr->last_line, line, strlen(husr->last_line)) && (strlen(husr->last_line) >= hlc_prof->repeats_min_length))
+    int last_length = strlen(husr->last_line);
+
+    if (!strncmp(husr->last_line, line, last_length) && (last_length >= hlc_prof->repeats_min_length))
         husr->last_line_repeats++;
-    else if (!strcmp(husr->last_line, line))
+    else if (last_length == lcl->length && !strcmp(husr->last_line, line))
         husr->last_line_repeats++;
     else
         husr->last_line_repeats = 0;
 
     strcpy(husr->last_line, line);
 
-    if (husr->last_line_repeats >= hlc_prof->repeats_max_count && strlen(line) >= hlc_prof->repeats_min_length) /* violation */
+    if (husr->last_line_repeats >= hlc_prof->repeats_max_count && lcl->length >= hlc_prof->repeats_min_length) /* violation */
         return ++husr->lc[HLC_REPEAT];
     else
         return 0;
 }
 
-static int hlc_check_character_repeats(hlc_profile *hlc_prof, huser *husr, const char *line)
+static int hlc_check_character_repeats(hlc_profile *hlc_prof, huser *husr, const hlc_line *lcl)
 {
-    char chr = '\0';
-    int i;
-    int repeats = 0;
-
-    for (i = 0;line[i];i++)
-        if (line[i] == chr)
-        {
-            repeats++;
-            if (repeats >= hlc_prof->character_repeat_max_count && isalnum(chr)) /* violation */
-                return ++husr->lc[HLC_CHARACTER_REPEAT];
-            else if (repeats >= hlc_prof->symbol_repeat_max_count && ispunct(chr)) /* violation */
-                return ++husr->lc[HLC_CHARACTER_REPEAT];
-        }
-        else
-        {
-            repeats = 0;
-            chr = line[i];
-        }
-    for (i=0, repeats = 0; line[i]; i++)
-    {
-        if (ispunct(line[i]))
-            repeats++;
-        else
-            repeats = 0;
+    if (lcl->alnum_repeats >= hlc_prof->character_repeat_max_count ||
+        lcl->symbol_repeats >= hlc_prof->symbol_repeat_max_count ||
+        lcl->symbol_run >= hlc_prof->symbol_max_count) /* violation */
+        return ++husr->lc[HLC_CHARACTER_REPEAT];
 
-        if (repeats >= hlc_prof->symbol_max_count)
-            return ++husr->lc[HLC_CHARACTER_REPEAT];
-    }
     return 0;
 }
 
-static int hlc_check_flood(hlc_profile *hlc_prof, huser *husr, const char *line)
+static int hlc_check_flood(hlc_profile *hlc_prof, huser *husr)
 {
     if (husr->flood_val < time(NULL))
         husr->flood_val = time(NULL);
@@ -212,12 +230,12 @@ static int hlc_check_flood(hlc_profile *hlc_prof, huser *husr, const char *line)
     return 0;
 }
 
-static int hlc_check_spam(hlc_profile *hlc_prof, huser *husr, const char *line)
+static int hlc_check_spam(hlc_profile *hlc_prof, huser *husr, const hlc_line *lcl)
 {
     if (husr->spam_val < (double)time(NULL))
         husr->spam_val = (double)time(NULL);
 
-    husr->spam_val += ((double)(hlc_prof->constant_spam) * (double)strlen(line));
+    husr->spam_val += ((double)(hlc_prof->constant_spam) * (double)lcl->length);
 
     if (((int)(husr->spam_val) - time(NULL)) >= (hlc_prof->tolerance_spam))
     {
@@ -230,22 +248,26 @@ static int hlc_check_spam(hlc_profile *hlc_prof, huser *husr, const char *line)
 /* checks a string for lameness, returns non-zero if lameness is present */
 int hlc_check(hchannel *hchan, huser* husr, const char *line)
 {
+    hlc_line lcl;
+
     if (hchan == NULL || hchan->lc_profile == NULL)
         return 0;
 
-    if (hlc_check_flood(hchan->lc_profile, husr, line))
+    hlc_analyse(line, &lcl);
+
+    if (hlc_check_flood(hchan->lc_profile, husr))
         if (hlc_violation_handle(hchan, husr, HLC_FLOOD))
             return -1;
-    if (hlc_check_spam(hchan->lc_profile, husr, line))
+    if (hlc_check_spam(hchan->lc_profile, husr, &lcl))
         if (hlc_violation_handle(hchan, husr, HLC_SPAM))
 	    return -1;
-    if (hlc_check_caps(hchan->lc_profile, husr, line))
+    if (hlc_check_caps(hchan->lc_profile, husr, line, &lcl))
         if (hlc_violation_handle(hchan, husr, HLC_CAPS))
             return -1;
-    if (hlc_check_repeat(hchan->lc_profile, husr, line))
+    if (hlc_check_repeat(hchan->lc_profile, husr, line, &lcl))
         if (hlc_violation_handle(hchan, husr, HLC_REPEAT))
             return -1;
-    if (hlc_check_character_repeats(hchan->lc_profile, husr, line))
+    if (hlc_check_character_repeats(hchan->lc_profile, husr, &lcl))
         if (hlc_violation_handle(hchan, husr, HLC_CHARACTER_REPEAT))
             return -1;
 
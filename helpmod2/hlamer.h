@@ -54,6 +54,23 @@ typedef struct hlamercontrol_profile_struct
     struct hlamercontrol_profile_struct *next;
 } hlc_profile;
 
+/* Everything lamer control needs to know about a line, computed in one pass */
+typedef struct hlc_line_struct
+{
+    int length;
+
+    int caps;
+    int noncaps;
+    int action; /* line starts with \1ACTION */
+    int firstword; /* offset of the first space, 0 if none */
+    int firstword_caps; /* caps and noncaps before firstword */
+    int firstword_noncaps;
+
+    int alnum_repeats; /* longest run of a single alphanumeric character, minus one */
+    int symbol_repeats; /* same for punctuation */
+    int symbol_run; /* longest run of any punctuation */
+} hlc_line;
+
 extern hlc_profile *hlc_profiles;
 /* just adds a profile, does NOT set any values */
 hlc_profile* hlc_add(const char *);
@@ -63,6 +80,7 @@ hlc_profile *hlc_get(const char *);
 
 /* checks a string for lameness, returns non-zero if lameness is present and the user is kicked */
 int hlc_check(struct hchannel_struct*, struct huser_struct*, const char *);
+void hlc_analyse(const char *, hlc_line *);
 
 /* Returns the component name for the given component */
 const char *hlc_get_cname(hlc_component);
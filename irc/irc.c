@@ -17,6 +17,7 @@
 #include "../lib/irc_string.h"
 #include "../lib/strlfunc.h"
 #include <sys/poll.h>
+#include <sys/time.h>
 #include <sys/types.h>
 #include <sys/socket.h>
 #include <netdb.h>
@@ -34,6 +35,7 @@ MODULE_VERSION("");
 #define MAX_SERVERARGS       20
 #define MIN_NUMERIC          100
 #define MAX_NUMERIC          999
+#define MAXBATCHFLUSH        10
 
 void irc_connect(void *arg);
 void ircstats(int hooknum, void *arg);
@@ -56,11 +58,68 @@ long mylongnum;
 time_t starttime;
 time_t timeoffset;
 int awaitingping;
+static struct timeval pingsent;
 int connected;
 
 static int hubnum, hubcount, previouslyconnected = 0;
 static sstring **hublist;
 
+/* Handlers which hold back their hooks during a burst call irc_deferbatch(),
+ * and the flush callbacks are then run before the next line with a
+ * different command and at the end of each read. */
+static BatchFlushCallback batchflush[MAXBATCHFLUSH];
+static int batchflushcount;
+static Command *currentcommand, *batchcommand;
+static int batchpending;
+
+/* [irc] capture: every line from the uplink with the time it arrived, in
+ * the format replay/replaydriver reads back. */
+static FILE *capturefile;
+static sstring *capturename;
+
+static void capture_open(void) {
+  sstring *name=getconfigitem("irc","capture");
+
+  if (capturename && name && !strcmp(capturename->content,name->content))
+    return;
+
+  if (capturefile) {
+    Error("irc",ERR_INFO,"Closing capture file %s.",capturename->content);
+    fclose(capturefile);
+    capturefile=NULL;
+  }
+
+  freesstring(capturename);
+  capturename=NULL;
+
+  if (!name || !*name->content)
+    return;
+
+  if (!(capturefile=fopen(name->content,"a"))) {
+    Error("irc",ERR_WARNING,"Unable to open capture file %s: %s",name->content,strerror(errno));
+    return;
+  }
+
+  capturename=getsstring(name->content,strlen(name->content));
+  Error("irc",ERR_INFO,"Capturing server traffic to %s.",capturename->content);
+}
+
+static void capture_close(void) {
+  if (capturefile)
+    fclose(capturefile);
+
+  capturefile=NULL;
+  freesstring(capturename);
+  capturename=NULL;
+}
+
+static void capture_line(const char *line) {
+  struct timeval tv;
+
+  gettimeofday(&tv,NULL);
+  fprintf(capturefile,"%ld.%06ld %s\n",(long)tv.tv_sec,(long)tv.tv_usec,line);
+}
+
 void _init() {
   servercommands=newcommandtree();
   starttime=time(NULL);
@@ -75,6 +134,7 @@ void _init() {
   mylongnum=numerictolong(mynumeric->content,2);
 
   checkhubconfig();
+  capture_open();
 
   /* Schedule a connection to the IRC server */
   scheduleoneshot(time(NULL),&irc_connect,NULL);
@@ -108,6 +168,8 @@ void _fini() {
   freesstring(mynumeric);
   freesstring(myserver);
 
+  capture_close();
+
   destroycommandtree(servercommands);
 }
 
@@ -246,6 +308,7 @@ void checkhubconfig(void) {
 
 void ircrehash(int hookhum, void *arg) {
   checkhubconfig();
+  capture_open();
 }
 
 void irc_connect(void *arg) {  
@@ -295,6 +358,9 @@ void irc_connect(void *arg) {
   }
   */
 
+  if (capturefile)
+    fprintf(capturefile,"# connect %ld %s %s\n",(long)time(NULL),myserver->content,mynumeric->content);
+
   irc_send("PASS :%s",conpass);
 
   mydesc=getcopyconfigitem("irc","serverdescription","newserv 0.01",100);
@@ -356,7 +422,10 @@ void irc_disconnected(int async) {
     deregisterhandler(serverfd,1);
   }
   serverfd=-1;
+  if (capturefile)
+    fflush(capturefile);
   if (connected) {
+    irc_flushbatches();
     connected=0;
     triggerhook(HOOK_IRC_PRE_DISCON,NULL);
     triggerhook(HOOK_IRC_DISCON,NULL);
@@ -445,6 +514,8 @@ void handledata(int fd, short events) {
     memmove(inbuf, nextline, bytesleft);
     nextline=inbuf;
   }    
+
+  irc_flushbatches();
 }
   
 /* 
@@ -495,6 +566,9 @@ int parseline() {
   
   linesreceived++;
 
+  if (capturefile)
+    capture_line(currentline);
+
   /* Split it up */
   cargc=splitline(currentline,cargv,MAX_SERVERARGS,1);
   
@@ -511,19 +585,19 @@ int parseline() {
       /* No handler, return. */
       return 0;
     }
+    irc_flushbatches();
     for (;c!=NULL;c=c->next) {
-      c->calls++;
-      if (((c->handler)("INIT",cargc-1,&cargv[1]))==CMD_LAST)
+      if (callcommand(c,"INIT",cargc-1,&cargv[1])==CMD_LAST)
         return 0;
     }  
   } else {
     if (cargv[1][0]>='0' && cargv[1][0]<='9') {
       /* It's a numeric! */
       long numeric = strtol(cargv[1], NULL, 0);
+      irc_flushbatches();
       if((numeric >= MIN_NUMERIC) && (numeric <= MAX_NUMERIC)) {
         for(c=numericcommands[numeric];c;c=c->next) {
-          c->calls++;
-          if (((c->handler)((void *)numeric,cargc,cargv))==CMD_LAST)
+          if (callcommand(c,(void *)numeric,cargc,cargv)==CMD_LAST)
             return 0;
         }
       }
@@ -532,16 +606,61 @@ int parseline() {
         /* We don't have a handler for this command */
         return 0;
       }
+      if (batchpending && c!=batchcommand)
+        irc_flushbatches();
+      currentcommand=c;
       for (;c!=NULL;c=c->next) {
-        c->calls++;
-        if (((c->handler)(cargv[0],cargc-2,cargv+2))==CMD_LAST)
-          return 0;
+        if (callcommand(c,cargv[0],cargc-2,cargv+2)==CMD_LAST)
+          break;
       }
+      currentcommand=NULL;
     }
   }  
   return 0;
 }
 
+int registerbatchflush(BatchFlushCallback callback) {
+  if (batchflushcount>=MAXBATCHFLUSH)
+    return 1;
+
+  batchflush[batchflushcount++]=callback;
+  return 0;
+}
+
+int deregisterbatchflush(BatchFlushCallback callback) {
+  int i;
+
+  for (i=0;i<batchflushcount;i++) {
+    if (batchflush[i]==callback) {
+      memmove(&batchflush[i], &batchflush[i+1], (batchflushcount-i-1)*sizeof(BatchFlushCallback));
+      batchflushcount--;
+      return 0;
+    }
+  }
+
+  return 1;
+}
+
+/* Called by a server handler which has held work back: it'll be flushed
+ * before anything other than the same command is processed. */
+void irc_deferbatch(void) {
+  batchcommand=currentcommand;
+  batchpending=1;
+}
+
+void irc_flushbatches(void) {
+  int i;
+
+  if (!batchpending)
+    return;
+
+  batchpending=0;
+  batchcommand=NULL;
+
+  for (i=0;i<batchflushcount;i++)
+    (batchflush[i])();
+}
+
 int registerserverhandler(const char *command, CommandHandler handler, int maxparams) {
   if ((addcommandtotree(servercommands,command,0,maxparams,handler))==NULL)
     return 1;
@@ -638,6 +757,7 @@ void sendping(void *arg) {
       irc_disconnected(0);
     } else {
       awaitingping=1;
+      gettimeofday(&pingsent, NULL);
       irc_send("%s G :%s",mynumeric->content,myserver->content);
     }
   } else {
@@ -653,7 +773,17 @@ void sendping(void *arg) {
 }
 
 int handlepingreply(void *sender, int cargc, char **cargv) {
-  awaitingping=0;
+  struct timeval now;
+  long rtt;
+
+  if (awaitingping) {
+    gettimeofday(&now, NULL);
+    rtt=(now.tv_sec-pingsent.tv_sec)*1000+(now.tv_usec-pingsent.tv_usec)/1000;
+    awaitingping=0;
+
+    triggerhook(HOOK_IRC_PINGREPLY,(void *)rtt);
+  }
+
   return CMD_OK;
 }
 
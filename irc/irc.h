@@ -18,6 +18,8 @@ extern sstring *myserver;
 extern long mylongnum;
 extern time_t starttime;
 
+typedef void (*BatchFlushCallback)(void);
+
 /* Functions from irc.c */
 void irc_connect(void *arg);
 void irc_disconnected(int async);
@@ -28,6 +30,10 @@ int registerserverhandler(const char *command, CommandHandler handler, int maxpa
 int deregisterserverhandler(const char *command, CommandHandler handler);
 int registernumerichandler(const int numeric, CommandHandler handler, int maxparams);
 int deregisternumerichandler(const int numeric, CommandHandler handler);
+int registerbatchflush(BatchFlushCallback callback);
+int deregisterbatchflush(BatchFlushCallback callback);
+void irc_deferbatch(void);
+void irc_flushbatches(void);
 char *getmynumeric();
 time_t getnettime();
 void setnettime(time_t newtime);
@@ -4,6 +4,7 @@
 #include "../lib/irc_string.h"
 #include "../localuser/localuserchannel.h"
 #include "../lib/version.h"
+#include "../core/deferred.h"
 
 MODULE_VERSION("");
 
@@ -13,12 +14,16 @@ MODULE_VERSION("");
 static char *li_isps[] = {"*.t-dialin.net", NULL};
 
 void li_nick(int hooknum, void *arg);
+void li_lostnick(int hooknum, void *arg);
+void li_check(void *arg);
 void li_killyoungest(nick *np);
 int li_stats(void *source, int cargc, char **cargv);
 
 int li_victims = 0;
 int li_ispscount;
 
+static deferqueue *li_queue;
+
 void _init() {
   host *hp;
   int i, j;
@@ -39,16 +44,32 @@ void _init() {
               li_killyoungest(hp->nicks);
             } while (hp->clonecount > LI_CLONEMAX);
             
+  li_queue = newdeferqueue("lameisp", DEFER_PRIO_LOW, 0);
+
   registercontrolhelpcmd("victims", NO_OPER, 0, li_stats, "Usage: victims\nShows the amount of clients victimised by lameisp.");
   registerhook(HOOK_NICK_NEWNICK, &li_nick);
+  registerhook(HOOK_NICK_LOSTNICK, &li_lostnick);
 }
 
 void _fini () {
   deregisterhook(HOOK_NICK_NEWNICK, &li_nick);
+  deregisterhook(HOOK_NICK_LOSTNICK, &li_lostnick);
   deregistercontrolcmd("victims", li_stats);
+
+  freedeferqueue(li_queue);
 }
 
+/* Checked from the deferred queue, so a clone flood doesn't hold up the
+ * rest of the main loop. */
 void li_nick(int hooknum, void *arg) {
+  defer(li_queue, li_check, arg);
+}
+
+void li_lostnick(int hooknum, void *arg) {
+  canceldeferred(li_queue, li_check, arg);
+}
+
+void li_check(void *arg) {
   nick *np=(nick *)arg;
   int i;
   if (np->host->clonecount > LI_CLONEMAX)
@@ -2,11 +2,18 @@
   unencumbered array.c
   dynamic UNORDERED array (yes this got me...)
 
-  will grow by allocchunksize (by default 100) when full and
-  new space is requested.
+  will grow when full and new space is requested: by doubling, but at
+  least by allocchunksize (by default 100), or with ARRAY_GROW_LINEAR
+  by exactly allocchunksize.
 
-  will shrink by freechunksize (by default 150) if that many
-  items are not occupied at the end.
+  will shrink when more than freechunksize (by default 150) items are
+  not occupied at the end, and for geometric growth only once it's down
+  to a quarter full.
+
+  arrays which are never copied can keep a few items inside the array
+  itself (array_setinline()), and can take their storage from power of
+  two sized POOL_ARRAY blocks which are recycled between arrays instead
+  of going back to malloc (array_setpooled()).
 
   clean written from the function prototypes.
 */
@@ -15,9 +22,22 @@
 #include <stdlib.h>
 #include <string.h>
 #include "../core/error.h"
+#include "../core/nsmalloc.h"
 
 #include "array.h"
 
+#define ARRAY_POOLMINSHIFT 4      /* 16 bytes */
+#define ARRAY_POOLMAXSHIFT 12     /* 4k, bigger blocks go straight to nsmalloc */
+#define ARRAY_POOLCLASSES  (ARRAY_POOLMAXSHIFT - ARRAY_POOLMINSHIFT + 1)
+#define ARRAY_POOLKEEP     65536  /* free blocks kept per class */
+
+typedef struct arrayblock {
+  struct arrayblock *next;
+} arrayblock;
+
+static arrayblock *arrayfreeblocks[ARRAY_POOLCLASSES];
+static unsigned int arrayfreecount[ARRAY_POOLCLASSES];
+
 void array_init(array *a, unsigned int itemsize) {
   a->content = NULL;
   a->cursi = 0; /* count */
@@ -28,23 +48,162 @@ void array_init(array *a, unsigned int itemsize) {
   /* allochunksize MUST be <= freechunksize */
   a->allocchunksize = 100;
   a->freechunksize = 150;
+
+  a->growth = ARRAY_GROW_GEOMETRIC;
+  a->flags = 0;
+}
+
+static int array_isinline(array *a) {
+  return a->content == (void *)a->inlinebuf.bytes;
 }
 
-/* should be called free_and_reinit really */
+static unsigned int array_inlinecapacity(array *a) {
+  return (a->flags & ARRAY_INLINE) ? ARRAY_INLINESIZE / a->itemsize : 0;
+}
+
+/* smallest class that holds size bytes, or -1 if it's too big for one */
+static int array_poolclass(size_t size) {
+  int shift;
+
+  for (shift = ARRAY_POOLMINSHIFT; shift <= ARRAY_POOLMAXSHIFT; shift++)
+    if (size <= ((size_t)1 << shift))
+      return shift - ARRAY_POOLMINSHIFT;
+
+  return -1;
+}
+
+/* Rounds *capacity up to fill whatever block it gets. */
+static void *array_poolalloc(array *a, unsigned int *capacity) {
+  int class = array_poolclass((size_t)*capacity * a->itemsize);
+  arrayblock *b;
+
+  if (class == -1)
+    return nsmalloc(POOL_ARRAY, (size_t)*capacity * a->itemsize);
+
+  *capacity = ((size_t)1 << (class + ARRAY_POOLMINSHIFT)) / a->itemsize;
+
+  if ((b = arrayfreeblocks[class])) {
+    arrayfreeblocks[class] = b->next;
+    arrayfreecount[class]--;
+    return b;
+  }
+
+  return nsmalloc(POOL_ARRAY, (size_t)1 << (class + ARRAY_POOLMINSHIFT));
+}
+
+static void array_poolfree(array *a, void *content, unsigned int capacity) {
+  int class = array_poolclass((size_t)capacity * a->itemsize);
+  arrayblock *b = content;
+
+  if (class == -1 || arrayfreecount[class] >= ARRAY_POOLKEEP) {
+    nsfree(POOL_ARRAY, content);
+    return;
+  }
+
+  b->next = arrayfreeblocks[class];
+  arrayfreeblocks[class] = b;
+  arrayfreecount[class]++;
+}
+
+static void array_release(array *a) {
+  if (!a->content || array_isinline(a))
+    return;
+
+  if (a->flags & ARRAY_POOLED)
+    array_poolfree(a, a->content, a->capacity);
+  else
+    free(a->content);
+}
+
+/* Moves the contents to storage for capacity items, which must hold cursi.
+ * Returns 0 if that couldn't be allocated, leaving the array as it was. */
+static int array_resize(array *a, unsigned int capacity) {
+  unsigned int inlinecapacity = array_inlinecapacity(a);
+  void *newcontent;
+
+  if (capacity <= inlinecapacity) {
+    if (!array_isinline(a)) {
+      if (a->cursi)
+        memcpy(a->inlinebuf.bytes, a->content, a->cursi * a->itemsize);
+      array_release(a);
+      a->content = a->inlinebuf.bytes;
+      a->capacity = inlinecapacity;
+    }
+    return 1;
+  }
+
+  if (a->flags & ARRAY_POOLED) {
+    if (!(newcontent = array_poolalloc(a, &capacity)))
+      return 0;
+  } else if (!a->content || array_isinline(a)) {
+    if (!(newcontent = malloc(capacity * a->itemsize)))
+      return 0;
+  } else {
+    /* realloc copies for us */
+    if (!(newcontent = realloc(a->content, capacity * a->itemsize)))
+      return 0;
+
+    a->content = newcontent;
+    a->capacity = capacity;
+    return 1;
+  }
+
+  if (a->cursi)
+    memcpy(newcontent, a->content, a->cursi * a->itemsize);
+
+  array_release(a);
+  a->content = newcontent;
+  a->capacity = capacity;
+
+  return 1;
+}
+
+/* should be called free_and_reinit really, keeps the limits and flags */
 void array_free(array *a) {
-  free(a->content);
+  array_release(a);
+
+  a->cursi = 0;
+  a->content = NULL;
+  a->capacity = 0;
 
-  array_init(a, a->itemsize);
+  if (array_inlinecapacity(a)) {
+    a->content = a->inlinebuf.bytes;
+    a->capacity = array_inlinecapacity(a);
+  }
+}
+
+/* Only for arrays nobody copies by value (content points into the array)
+ * and only while they're empty. */
+void array_setinline(array *a) {
+  if (a->content)
+    return;
+
+  a->flags |= ARRAY_INLINE;
+
+  if (array_inlinecapacity(a)) {
+    a->content = a->inlinebuf.bytes;
+    a->capacity = array_inlinecapacity(a);
+  }
+}
+
+/* Only while empty, as the storage it has already didn't come from the pool. */
+void array_setpooled(array *a) {
+  if (a->content && !array_isinline(a))
+    return;
+
+  a->flags |= ARRAY_POOLED;
 }
 
 int array_getfreeslot(array *a) {
-  if(a->cursi + 1 >= a->capacity) {
-    a->capacity += a->allocchunksize;
+  unsigned int capacity;
 
-    /* we can be evil and use the same pointer as we're gonna exit if we fail */
-    a->content = realloc(a->content, a->capacity * a->itemsize);
+  if(a->cursi >= a->capacity) {
+    if(a->growth == ARRAY_GROW_LINEAR || a->capacity < a->allocchunksize)
+      capacity = a->capacity + a->allocchunksize;
+    else
+      capacity = a->capacity * 2;
 
-    if(!a->content)
+    if(capacity <= a->capacity || !array_resize(a, capacity))
        Error("array", ERR_STOP, "Array resize failed.");
   }
 
@@ -52,28 +211,33 @@ int array_getfreeslot(array *a) {
 }
 
 void array_delslot(array *a, unsigned int index) {
+  unsigned int capacity;
+
   /* if we're not deleting the end item then swap the last item into the deleted items space */
   /* unordered so we can do this, and we can also use memcpy */
   if(--a->cursi != index)
     memcpy((char *)a->content + index * a->itemsize, (char *)a->content + a->cursi * a->itemsize, a->itemsize);
 
-  if(a->cursi + a->freechunksize < a->capacity) {
+  if(a->cursi + a->freechunksize >= a->capacity)
+    return;
 
-    a->capacity = a->cursi + a->allocchunksize;
+  if(a->growth == ARRAY_GROW_LINEAR) {
+    capacity = a->cursi + a->allocchunksize;
+  } else {
+    /* only once it's down to a quarter, so an array hovering around a
+       power of two doesn't get resized back and forth */
+    if(a->cursi > a->capacity / 4)
+      return;
 
-    if(a->capacity == 0) {
-      free(a->content);
+    capacity = a->cursi * 2;
+  }
 
-      a->content = NULL;
-    } else {
-      void *newp = realloc(a->content, a->capacity * a->itemsize);
+  if(capacity == 0 && !array_inlinecapacity(a)) {
+    array_release(a);
 
-      if(!newp) {
-        Error("array", ERR_WARNING, "Unable to shrink array!");
-      } else {
-        a->content = newp;
-      }
-    }
+    a->content = NULL;
+    a->capacity = 0;
+  } else if(!array_resize(a, capacity)) {
+    Error("array", ERR_WARNING, "Unable to shrink array!");
   }
 }
-
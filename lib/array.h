@@ -4,6 +4,15 @@
 
 #define _ARRAY_H
 
+/* room for three pointers, enough for most users' channel lists */
+#define ARRAY_INLINESIZE (sizeof(void *) * 3)
+
+#define ARRAY_GROW_GEOMETRIC 0 /* double, but by at least allocchunksize */
+#define ARRAY_GROW_LINEAR    1 /* by allocchunksize */
+
+#define ARRAY_INLINE 0x01      /* small contents live in inlinebuf, see array_setinline() */
+#define ARRAY_POOLED 0x02      /* contents come from size classed POOL_ARRAY blocks */
+
 typedef struct array {
   void *content; /* must be called this */
   unsigned int cursi; /* must be called this */
@@ -11,14 +20,25 @@ typedef struct array {
   unsigned int itemsize;
   unsigned short allocchunksize;
   unsigned short freechunksize;
+  unsigned char growth;
+  unsigned char flags;
+  union {
+    void *p;
+    long l;
+    double d;
+    char bytes[ARRAY_INLINESIZE];
+  } inlinebuf;
 } array;
 
 void array_init(array *a, unsigned int itemsize);
 void array_free(array *a);
 int array_getfreeslot(array *a);
 void array_delslot(array *a, unsigned int index);
+void array_setinline(array *a);
+void array_setpooled(array *a);
 
 #define array_setlim1(a, size) (a)->allocchunksize = size;
 #define array_setlim2(a, size) (a)->freechunksize = size;
+#define array_setgrowth(a, policy) (a)->growth = policy;
 
 #endif /* _ARRAY_H */
@@ -0,0 +1,180 @@
+/*
+  Replays join/part churn on per-nick channel arrays the way channel.c
+  uses them, once for each way of setting them up, and prints the time
+  taken and how much memory the arrays hold outside their headers.
+
+  make -C lib arraybench && lib/arraybench [nicks] [operations]
+*/
+
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <string.h>
+#include <time.h>
+
+#include "array.h"
+#include "../core/error.h"
+#include "../core/nsmalloc.h"
+
+#define DEFAULTNICKS 200000
+#define DEFAULTOPS   5000000
+#define MAXCHANS     20
+
+typedef struct setup {
+  const char *name;
+  unsigned short lim1, lim2;
+  unsigned char growth;
+  int inline_, pooled;
+} setup;
+
+static const setup setups[] = {
+  { "linear 10/15 (old)",      10, 15, ARRAY_GROW_LINEAR,    0, 0 },
+  { "geometric 4/4",            4,  4, ARRAY_GROW_GEOMETRIC, 0, 0 },
+  { "geometric 4/4 inline",     4,  4, ARRAY_GROW_GEOMETRIC, 1, 0 },
+  { "geometric 4/4 inline+pool", 4, 4, ARRAY_GROW_GEOMETRIC, 1, 1 },
+};
+
+/* nsmalloc.o wants this, nothing should actually go wrong */
+void Error(char *source, int severity, char *reason, ...) {
+  va_list va;
+
+  va_start(va, reason);
+  fprintf(stderr, "%s: ", source);
+  vfprintf(stderr, reason, va);
+  fputc('\n', stderr);
+  va_end(va);
+
+  if (severity >= ERR_STOP)
+    exit(1);
+}
+
+static double now(void) {
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* xorshift, so every setup sees exactly the same churn */
+static unsigned int rnd(unsigned int *state) {
+  unsigned int x = *state;
+
+  x ^= x << 13;
+  x ^= x >> 17;
+  x ^= x << 5;
+  return *state = x;
+}
+
+/* most users are on one to three channels, a few on lots */
+static int targetchans(unsigned int *state) {
+  unsigned int r = rnd(state) % 100;
+
+  if (r < 55)
+    return 1;
+  if (r < 75)
+    return 2;
+  if (r < 85)
+    return 3;
+
+  return 4 + rnd(state) % (MAXCHANS - 3);
+}
+
+static array *newnick(const setup *s) {
+  array *a = malloc(sizeof(array));
+
+  array_init(a, sizeof(void *));
+  array_setlim1(a, s->lim1);
+  array_setlim2(a, s->lim2);
+  array_setgrowth(a, s->growth);
+  if (s->inline_)
+    array_setinline(a);
+  if (s->pooled)
+    array_setpooled(a);
+
+  return a;
+}
+
+static void join(array *a, unsigned int *state) {
+  int i = array_getfreeslot(a);
+
+  ((void **)a->content)[i] = (void *)(unsigned long)(rnd(state) | 1);
+}
+
+static void run(const setup *s, unsigned int nicks, unsigned int ops) {
+  array **chans = malloc(sizeof(array *) * nicks);
+  unsigned char *target = malloc(nicks);
+  unsigned int state = 12345, i, j, n, outofline = 0;
+  unsigned long bytes = 0;
+  double start;
+
+  start = now();
+
+  for (i = 0; i < nicks; i++) {
+    chans[i] = newnick(s);
+    target[i] = targetchans(&state);
+
+    for (j = 0; j < target[i]; j++)
+      join(chans[i], &state);
+  }
+
+  for (i = 0; i < ops; i++) {
+    n = rnd(&state) % nicks;
+
+    if (i % 32 == 0) {
+      /* quit and reconnect */
+      array_free(chans[n]);
+      free(chans[n]);
+      chans[n] = newnick(s);
+      target[n] = targetchans(&state);
+
+      for (j = 0; j < target[n]; j++)
+        join(chans[n], &state);
+    } else if (chans[n]->cursi && (chans[n]->cursi >= target[n] || rnd(&state) % 2)) {
+      array_delslot(chans[n], rnd(&state) % chans[n]->cursi);
+    } else {
+      join(chans[n], &state);
+    }
+  }
+
+  for (i = 0; i < nicks; i++) {
+    if (chans[i]->content && chans[i]->content != (void *)chans[i]->inlinebuf.bytes) {
+      outofline++;
+      bytes += chans[i]->capacity * chans[i]->itemsize;
+    }
+  }
+
+  printf("  %-28s %7.3f s %9u arrays with storage %10lu bytes\n", s->name, now() - start, outofline, bytes);
+
+  for (i = 0; i < nicks; i++) {
+    array_free(chans[i]);
+    free(chans[i]);
+  }
+
+  free(chans);
+  free(target);
+}
+
+int main(int argc, char **argv) {
+  unsigned int nicks = DEFAULTNICKS, ops = DEFAULTOPS, i;
+
+  if (argc > 1)
+    nicks = atoi(argv[1]);
+  if (argc > 2)
+    ops = atoi(argv[2]);
+
+  if (!nicks) {
+    fprintf(stderr, "Usage: %s [nicks] [operations]\n", argv[0]);
+    return 1;
+  }
+
+  nsinit();
+
+  printf("%u nicks, %u joins/parts/reconnects, %u byte arrays:\n", nicks, ops, (unsigned int)sizeof(array));
+
+  for (i = 0; i < sizeof(setups) / sizeof(setups[0]); i++)
+    run(&setups[i], nicks, ops);
+
+  return 0;
+}
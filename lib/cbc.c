@@ -3,8 +3,10 @@
 
 #include "cbc.h"
 #include "rijndael.h"
+#include "cryptoaccel.h"
 
 rijndaelcbc *rijndaelcbc_init(unsigned char *key, int keybits, unsigned char *iv, int decrypt) {
+  int i;
   rijndaelcbc *ret = (rijndaelcbc *)malloc(sizeof(rijndaelcbc) + RKLENGTH(keybits) * sizeof(unsigned long));
   if(!ret)
     return NULL;
@@ -17,6 +19,17 @@ rijndaelcbc *rijndaelcbc_init(unsigned char *key, int keybits, unsigned char *iv
     ret->nrounds = rijndaelSetupEncrypt(ret->rk, key, keybits);
   }
 
+  /* the hardware wants the same schedule, as bytes */
+  ret->accel = cryptoaccel_aes();
+  if(ret->accel) {
+    for(i=0;i<(ret->nrounds + 1) * 4;i++) {
+      ret->accelrk[i * 4] = ret->rk[i] >> 24;
+      ret->accelrk[i * 4 + 1] = ret->rk[i] >> 16;
+      ret->accelrk[i * 4 + 2] = ret->rk[i] >> 8;
+      ret->accelrk[i * 4 + 3] = ret->rk[i];
+    }
+  }
+
   return ret;
 }
 
@@ -27,6 +40,12 @@ void rijndaelcbc_free(rijndaelcbc *c) {
 unsigned char *rijndaelcbc_encrypt(rijndaelcbc *c, unsigned char *ptblock) {
   int i;
   unsigned char *p = c->prevblock, *p2 = c->scratch;
+
+  if(c->accel) {
+    cryptoaccel_aes_cbc_encrypt(c->accelrk, c->nrounds, c->prevblock, ptblock, c->prevblock, 1);
+    return c->prevblock;
+  }
+
   for(i=0;i<16;i++)
     *p2++ = *p++ ^ *ptblock++;
 
@@ -38,6 +57,11 @@ unsigned char *rijndaelcbc_decrypt(rijndaelcbc *c, unsigned char *ctblock) {
   int i;
   unsigned char *p = c->prevblock, *p2 = c->scratch;
 
+  if(c->accel) {
+    cryptoaccel_aes_cbc_decrypt(c->accelrk, c->nrounds, c->prevblock, ctblock, c->scratch, 1);
+    return c->scratch;
+  }
+
   rijndaelDecrypt(c->rk, c->nrounds, ctblock, c->scratch);
 
   for(i=0;i<16;i++)
@@ -47,3 +71,23 @@ unsigned char *rijndaelcbc_decrypt(rijndaelcbc *c, unsigned char *ctblock) {
   return c->scratch;
 }
 
+/* in and out may be the same buffer. */
+void rijndaelcbc_encrypt_blocks(rijndaelcbc *c, unsigned char *in, unsigned char *out, size_t nblocks) {
+  if(c->accel) {
+    cryptoaccel_aes_cbc_encrypt(c->accelrk, c->nrounds, c->prevblock, in, out, nblocks);
+    return;
+  }
+
+  for(;nblocks;nblocks--,in+=16,out+=16)
+    memcpy(out, rijndaelcbc_encrypt(c, in), 16);
+}
+
+void rijndaelcbc_decrypt_blocks(rijndaelcbc *c, unsigned char *in, unsigned char *out, size_t nblocks) {
+  if(c->accel) {
+    cryptoaccel_aes_cbc_decrypt(c->accelrk, c->nrounds, c->prevblock, in, out, nblocks);
+    return;
+  }
+
+  for(;nblocks;nblocks--,in+=16,out+=16)
+    memcpy(out, rijndaelcbc_decrypt(c, in), 16);
+}
@@ -1,15 +1,21 @@
 #ifndef __LIB_CBC_H
 #define __LIB_CBC_H
 
+#include <stddef.h>
+
 typedef struct {
   unsigned char prevblock[16];
   unsigned char scratch[16];
   int nrounds;
+  int accel;
+  unsigned char accelrk[15 * 16];
   unsigned long rk[0];
 } rijndaelcbc;
 
 unsigned char *rijndaelcbc_decrypt(rijndaelcbc *c, unsigned char *ctblock);
 unsigned char *rijndaelcbc_encrypt(rijndaelcbc *c, unsigned char *ptblock);
+void rijndaelcbc_encrypt_blocks(rijndaelcbc *c, unsigned char *in, unsigned char *out, size_t nblocks);
+void rijndaelcbc_decrypt_blocks(rijndaelcbc *c, unsigned char *in, unsigned char *out, size_t nblocks);
 void rijndaelcbc_free(rijndaelcbc *c);
 rijndaelcbc *rijndaelcbc_init(unsigned char *key, int keybits, unsigned char *iv, int decrypt);
 
@@ -0,0 +1,189 @@
+#include <string.h>
+
+#include "cryptoaccel.h"
+
+#if (defined(__x86_64__) || defined(__i386__)) && defined(__GNUC__) && (__GNUC__ >= 5)
+#define CRYPTOACCEL_X86
+#include <immintrin.h>
+#endif
+
+static int hasaes = -1, hassha = -1, enabled = 1;
+
+static void cryptoaccel_probe(void) {
+#ifdef CRYPTOACCEL_X86
+  __builtin_cpu_init();
+  hasaes = __builtin_cpu_supports("aes") && __builtin_cpu_supports("sse2");
+  hassha = __builtin_cpu_supports("sha") && __builtin_cpu_supports("sse4.1");
+#else
+  hasaes = hassha = 0;
+#endif
+}
+
+int cryptoaccel_aes(void) {
+  if(hasaes == -1)
+    cryptoaccel_probe();
+
+  return enabled && hasaes;
+}
+
+int cryptoaccel_sha256(void) {
+  if(hassha == -1)
+    cryptoaccel_probe();
+
+  return enabled && hassha;
+}
+
+void cryptoaccel_enable(int enable) {
+  enabled = enable;
+}
+
+#ifdef CRYPTOACCEL_X86
+
+__attribute__((target("aes,sse2")))
+void cryptoaccel_aes_cbc_encrypt(const unsigned char *rk, int nrounds, unsigned char *iv, const unsigned char *in, unsigned char *out, size_t nblocks) {
+  __m128i k[15], b;
+  int i;
+
+  for(i=0;i<=nrounds;i++)
+    k[i] = _mm_loadu_si128((const __m128i *)(rk + i * 16));
+
+  /* CBC encryption is inherently serial, the win here is the hardware round */
+  b = _mm_loadu_si128((const __m128i *)iv);
+  for(;nblocks;nblocks--,in+=16,out+=16) {
+    b = _mm_xor_si128(b, _mm_loadu_si128((const __m128i *)in));
+    b = _mm_xor_si128(b, k[0]);
+    for(i=1;i<nrounds;i++)
+      b = _mm_aesenc_si128(b, k[i]);
+    b = _mm_aesenclast_si128(b, k[nrounds]);
+    _mm_storeu_si128((__m128i *)out, b);
+  }
+  _mm_storeu_si128((__m128i *)iv, b);
+}
+
+__attribute__((target("aes,sse2")))
+void cryptoaccel_aes_cbc_decrypt(const unsigned char *rk, int nrounds, unsigned char *iv, const unsigned char *in, unsigned char *out, size_t nblocks) {
+  __m128i k[15], prev, c0, c1, c2, c3, b0, b1, b2, b3;
+  int i;
+
+  for(i=0;i<=nrounds;i++)
+    k[i] = _mm_loadu_si128((const __m128i *)(rk + i * 16));
+
+  prev = _mm_loadu_si128((const __m128i *)iv);
+
+  /* decryption has no chaining dependency, keep four blocks in flight */
+  for(;nblocks>=4;nblocks-=4,in+=64,out+=64) {
+    c0 = _mm_loadu_si128((const __m128i *)in);
+    c1 = _mm_loadu_si128((const __m128i *)(in + 16));
+    c2 = _mm_loadu_si128((const __m128i *)(in + 32));
+    c3 = _mm_loadu_si128((const __m128i *)(in + 48));
+
+    b0 = _mm_xor_si128(c0, k[0]);
+    b1 = _mm_xor_si128(c1, k[0]);
+    b2 = _mm_xor_si128(c2, k[0]);
+    b3 = _mm_xor_si128(c3, k[0]);
+    for(i=1;i<nrounds;i++) {
+      b0 = _mm_aesdec_si128(b0, k[i]);
+      b1 = _mm_aesdec_si128(b1, k[i]);
+      b2 = _mm_aesdec_si128(b2, k[i]);
+      b3 = _mm_aesdec_si128(b3, k[i]);
+    }
+    b0 = _mm_aesdeclast_si128(b0, k[nrounds]);
+    b1 = _mm_aesdeclast_si128(b1, k[nrounds]);
+    b2 = _mm_aesdeclast_si128(b2, k[nrounds]);
+    b3 = _mm_aesdeclast_si128(b3, k[nrounds]);
+
+    _mm_storeu_si128((__m128i *)out, _mm_xor_si128(b0, prev));
+    _mm_storeu_si128((__m128i *)(out + 16), _mm_xor_si128(b1, c0));
+    _mm_storeu_si128((__m128i *)(out + 32), _mm_xor_si128(b2, c1));
+    _mm_storeu_si128((__m128i *)(out + 48), _mm_xor_si128(b3, c2));
+    prev = c3;
+  }
+
+  for(;nblocks;nblocks--,in+=16,out+=16) {
+    c0 = _mm_loadu_si128((const __m128i *)in);
+    b0 = _mm_xor_si128(c0, k[0]);
+    for(i=1;i<nrounds;i++)
+      b0 = _mm_aesdec_si128(b0, k[i]);
+    b0 = _mm_aesdeclast_si128(b0, k[nrounds]);
+    _mm_storeu_si128((__m128i *)out, _mm_xor_si128(b0, prev));
+    prev = c0;
+  }
+
+  _mm_storeu_si128((__m128i *)iv, prev);
+}
+
+static const uint32_t K256[64] = {
+  0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+  0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+  0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+  0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+  0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+  0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+  0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+  0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2
+};
+
+__attribute__((target("sha,sse4.1")))
+void cryptoaccel_sha256_blocks(uint32_t *state, const unsigned char *data, size_t nblocks) {
+  const __m128i bswap = _mm_set_epi64x(0x0c0d0e0f08090a0bULL, 0x0405060700010203ULL);
+  __m128i state0, state1, abefsave, cdghsave, msg, tmp, m[4];
+  int i;
+
+  /* the instructions want the state as ABEF/CDGH rather than ABCD/EFGH */
+  tmp = _mm_shuffle_epi32(_mm_loadu_si128((const __m128i *)state), 0xB1);
+  state1 = _mm_shuffle_epi32(_mm_loadu_si128((const __m128i *)(state + 4)), 0x1B);
+  state0 = _mm_alignr_epi8(tmp, state1, 8);
+  state1 = _mm_blend_epi16(state1, tmp, 0xF0);
+
+  for(;nblocks;nblocks--,data+=64) {
+    abefsave = state0;
+    cdghsave = state1;
+
+    /* four rounds per iteration, with the message schedule for later
+     * rounds computed alongside in m[] */
+    for(i=0;i<16;i++) {
+      if(i < 4)
+        m[i] = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *)(data + i * 16)), bswap);
+
+      msg = _mm_add_epi32(m[i & 3], _mm_loadu_si128((const __m128i *)&K256[i * 4]));
+      state1 = _mm_sha256rnds2_epu32(state1, state0, msg);
+
+      if(i >= 3 && i < 15) {
+        tmp = _mm_alignr_epi8(m[i & 3], m[(i - 1) & 3], 4);
+        m[(i + 1) & 3] = _mm_add_epi32(m[(i + 1) & 3], tmp);
+        m[(i + 1) & 3] = _mm_sha256msg2_epu32(m[(i + 1) & 3], m[i & 3]);
+      }
+
+      msg = _mm_shuffle_epi32(msg, 0x0E);
+      state0 = _mm_sha256rnds2_epu32(state0, state1, msg);
+
+      if(i >= 1 && i < 13)
+        m[(i - 1) & 3] = _mm_sha256msg1_epu32(m[(i - 1) & 3], m[i & 3]);
+    }
+
+    state0 = _mm_add_epi32(state0, abefsave);
+    state1 = _mm_add_epi32(state1, cdghsave);
+  }
+
+  tmp = _mm_shuffle_epi32(state0, 0x1B);
+  state1 = _mm_shuffle_epi32(state1, 0xB1);
+  state0 = _mm_blend_epi16(tmp, state1, 0xF0);
+  state1 = _mm_alignr_epi8(state1, tmp, 8);
+
+  _mm_storeu_si128((__m128i *)state, state0);
+  _mm_storeu_si128((__m128i *)(state + 4), state1);
+}
+
+#else
+
+/* never called: cryptoaccel_aes() and cryptoaccel_sha256() return 0 */
+void cryptoaccel_aes_cbc_encrypt(const unsigned char *rk, int nrounds, unsigned char *iv, const unsigned char *in, unsigned char *out, size_t nblocks) {
+}
+
+void cryptoaccel_aes_cbc_decrypt(const unsigned char *rk, int nrounds, unsigned char *iv, const unsigned char *in, unsigned char *out, size_t nblocks) {
+}
+
+void cryptoaccel_sha256_blocks(uint32_t *state, const unsigned char *data, size_t nblocks) {
+}
+
+#endif
@@ -0,0 +1,27 @@
+#ifndef __LIB_CRYPTOACCEL_H
+#define __LIB_CRYPTOACCEL_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* Hardware AES and SHA-256 kernels (AES-NI and the SHA extensions on x86).
+ * cbc.c and sha2.c check cryptoaccel_aes()/cryptoaccel_sha256() and fall
+ * back to the table driven code when they return 0, so callers never use
+ * these directly.  The checks are done once and cached. */
+
+int cryptoaccel_aes(void);
+int cryptoaccel_sha256(void);
+
+/* For benchmarks and testing: 0 turns acceleration off, 1 back on (where
+ * the CPU supports it).  Only affects contexts set up afterwards. */
+void cryptoaccel_enable(int enable);
+
+/* Round keys are the rijndael.c schedule stored as bytes, (nrounds+1)*16 of
+ * them; for decryption that's the rijndaelSetupDecrypt schedule, which is
+ * already in the form aesdec wants. */
+void cryptoaccel_aes_cbc_encrypt(const unsigned char *rk, int nrounds, unsigned char *iv, const unsigned char *in, unsigned char *out, size_t nblocks);
+void cryptoaccel_aes_cbc_decrypt(const unsigned char *rk, int nrounds, unsigned char *iv, const unsigned char *in, unsigned char *out, size_t nblocks);
+
+void cryptoaccel_sha256_blocks(uint32_t *state, const unsigned char *data, size_t nblocks);
+
+#endif
@@ -35,6 +35,7 @@
 #include <string.h>	/* memcpy()/memset() or bcopy()/bzero() */
 #include <assert.h>	/* assert() */
 #include "sha2.h"
+#include "cryptoaccel.h"
 
 /*
  * ASSERT NOTE:
@@ -388,6 +389,11 @@ void SHA256_Transform(SHA256_CTX* context, const sha2_word32* data) {
 	sha2_word32	T1, *W256;
 	int		j;
 
+	if (cryptoaccel_sha256()) {
+		cryptoaccel_sha256_blocks(context->state, (const sha2_byte*)data, 1);
+		return;
+	}
+
 	W256 = (sha2_word32*)context->buffer;
 
 	/* Initialize registers with the prev. intermediate value */
@@ -446,6 +452,11 @@ void SHA256_Transform(SHA256_CTX* context, const sha2_word32* data) {
 	sha2_word32	T1, T2, *W256;
 	int		j;
 
+	if (cryptoaccel_sha256()) {
+		cryptoaccel_sha256_blocks(context->state, (const sha2_byte*)data, 1);
+		return;
+	}
+
 	W256 = (sha2_word32*)context->buffer;
 
 	/* Initialize registers with the prev. intermediate value */
@@ -553,6 +564,15 @@ void SHA256_Update(SHA256_CTX* context, const sha2_byte *data, size_t len) {
 			return;
 		}
 	}
+	if (len >= SHA256_BLOCK_LENGTH && cryptoaccel_sha256()) {
+		/* Hand all the complete blocks to the hardware at once */
+		size_t	blocks = len / SHA256_BLOCK_LENGTH;
+
+		cryptoaccel_sha256_blocks(context->state, data, blocks);
+		context->bitcount += (sha2_word64)blocks * SHA256_BLOCK_LENGTH << 3;
+		len -= blocks * SHA256_BLOCK_LENGTH;
+		data += blocks * SHA256_BLOCK_LENGTH;
+	}
 	while (len >= SHA256_BLOCK_LENGTH) {
 		/* Process as many complete blocks as we can */
 		SHA256_Transform(context, (sha2_word32*)data);
@@ -90,6 +90,7 @@ void displaycommandhelp(nick *np, Command *cmd) {
     controlreply(np, " -l int    : Limit number of rows of results\n");
     controlreply(np, " -d string : a valid output format for the results\n"); 
     controlreply(np, " -s subset : ipmask subset of network to search (only for node search)\n");
+    controlreply(np, " -e        : show how the search would be executed instead of running it\n");
     controlreply(np, " \n");
     controlreply(np, "Available Output Formats:\n");
   
@@ -400,7 +401,7 @@ static void controlwallwrapper(int level, char *format, ...) {
   va_end(ap);
 }
 
-int parseopts(int cargc, char **cargv, int *arg, int *limit, void **subset, void *display, CommandTree *sl, replyFunc reply, void *sender) {
+int parseopts(int cargc, char **cargv, int *arg, int *limit, void **subset, int *explain, void *display, CommandTree *sl, replyFunc reply, void *sender) {
   char *ch;
   Command *cmd;
   struct irc_in_addr sin; unsigned char bits;
@@ -453,6 +454,14 @@ int parseopts(int cargc, char **cargv, int *arg, int *limit, void **subset, void
         *subset = (void *)refnode(iptree, &sin, bits);
         (*arg)++;
         break;
+
+      case 'e':
+        if (explain == NULL) {
+          reply(sender,"Error: -e switch not supported for this search.");
+          return CMD_ERROR;
+        }
+        *explain = 1;
+        break;
         
       default:
 	reply(sender,"Unrecognised flag -%c. (for help, see help <searchcmd>)",*ch);
@@ -482,6 +491,7 @@ int do_nicksearch_real(replyFunc reply, wallFunc wall, void *source, int cargc,
   nick *sender = source;
   int limit=500;
   int arg=0;
+  int explain=0;
   NickDisplayFunc display=defaultnickfn;
   int ret;
   parsertree *tree;
@@ -492,7 +502,7 @@ int do_nicksearch_real(replyFunc reply, wallFunc wall, void *source, int cargc,
     return CMD_OK;
   }
  
-  ret = parseopts(cargc, cargv, &arg, &limit, NULL, (void *)&display, reg_nicksearch->outputtree, reply, sender);
+  ret = parseopts(cargc, cargv, &arg, &limit, NULL, &explain, (void *)&display, reg_nicksearch->outputtree, reply, sender);
   if(ret != CMD_OK)
     return ret;
 
@@ -511,7 +521,10 @@ int do_nicksearch_real(replyFunc reply, wallFunc wall, void *source, int cargc,
     return CMD_ERROR;
   }
 
-  ast_nicksearch(tree->root, reply, sender, wall, display, NULL, NULL, limit, NULL);
+  if (explain)
+    ast_explain(tree->root, reg_nicksearch, reply, sender, wall);
+  else
+    ast_nicksearch(tree->root, reply, sender, wall, display, NULL, NULL, limit, NULL);
 
   parse_free(tree);
 
@@ -523,7 +536,8 @@ int do_nicksearch(void *source, int cargc, char **cargv) {
 }
 
 void nicksearch_exe(struct searchNode *search, searchCtx *ctx) {
-  int i, j, k;
+  int j, k;
+  nickiter iter;
   int matches = 0;
   unsigned int cmarker;
   unsigned int tchans=0,uchans=0;
@@ -532,45 +546,55 @@ void nicksearch_exe(struct searchNode *search, searchCtx *ctx) {
   senderNSExtern = sender;
   NickDisplayFunc display = ctx->displayfn;
   int limit = ctx->limit;
+  array candidates;
+  int usecandidates = 0;
 
   /* Get a marker value to mark "seen" channels for unique count */
   cmarker=nextchanmarker();
   
   /* The top-level node needs to return a BOOL */
   search=coerceNode(ctx, search, RETURNTYPE_BOOL);
+
+  /* Run cheap tests first, and only look at users an index says could match */
+  nsplan_optimise(ctx, search);
+  if (!ctx->targets && nsplan_nicktargets(ctx, search, &candidates)) {
+    ctx->targets = &candidates;
+    usecandidates = 1;
+  }
   
-  for (i=0;i<NICKHASHSIZE;i++) {
-    for (np=nicktable[i], k = 0;ctx->targets ? (k < ctx->targets->cursi) : (np != NULL);np=np->next, k++) {
-      if (ctx->targets) {
-        np = ((nick **)ctx->targets->content)[k];
-        if (!np)
-          continue;
-      }
+  /* everyone, in memory order, unless there's a list of candidates */
+  for (np = ctx->targets ? NULL : firstnick(&iter), k = 0;ctx->targets ? (k < ctx->targets->cursi) : (np != NULL);np = ctx->targets ? NULL : nextnick(&iter), k++) {
+    if (ctx->targets) {
+      np = ((nick **)ctx->targets->content)[k];
+      if (!np)
+        continue;
+    }
 
-      if ((search->exe)(ctx, search, np)) {
-        /* Add total channels */
-        tchans += np->channels->cursi;
-        
-        /* Check channels for uniqueness */
-        cs=(channel **)np->channels->content;
-        for (j=0;j<np->channels->cursi;j++) {
-          if (cs[j]->index->marker != cmarker) {
-            cs[j]->index->marker=cmarker;
-            uchans++;
-          }
+    if ((search->exe)(ctx, search, np)) {
+      /* Add total channels */
+      tchans += np->channels->cursi;
+      
+      /* Check channels for uniqueness */
+      cs=(channel **)np->channels->content;
+      for (j=0;j<np->channels->cursi;j++) {
+        if (cs[j]->index->marker != cmarker) {
+          cs[j]->index->marker=cmarker;
+          uchans++;
         }
-          
-	if (matches<limit)
-	  display(ctx, sender, np);
-	  
-	if (matches==limit)
-	  ctx->reply(sender, "--- More than %d matches, skipping the rest",limit);
-	matches++;
       }
+        
+      if (matches<limit)
+        display(ctx, sender, np);
+        
+      if (matches==limit)
+        ctx->reply(sender, "--- More than %d matches, skipping the rest",limit);
+      matches++;
     }
+  }
 
-    if (ctx->targets)
-      break;
+  if (usecandidates) {
+    array_free(&candidates);
+    ctx->targets = NULL;
   }
 
   ctx->reply(sender,"--- End of list: %d matches; users were on %u channels (%u unique, %.1f average clones)", 
@@ -581,6 +605,7 @@ int do_whowassearch_real(replyFunc reply, wallFunc wall, void *source, int cargc
   nick *sender = source;
   int limit=500;
   int arg=0;
+  int explain=0;
   WhowasDisplayFunc display=defaultwhowasfn;
   int ret;
   parsertree *tree;
@@ -591,7 +616,7 @@ int do_whowassearch_real(replyFunc reply, wallFunc wall, void *source, int cargc
     return CMD_OK;
   }
 
-  ret = parseopts(cargc, cargv, &arg, &limit, NULL, (void *)&display, reg_whowassearch->outputtree, reply, sender);
+  ret = parseopts(cargc, cargv, &arg, &limit, NULL, &explain, (void *)&display, reg_whowassearch->outputtree, reply, sender);
   if(ret != CMD_OK)
     return ret;
 
@@ -610,7 +635,10 @@ int do_whowassearch_real(replyFunc reply, wallFunc wall, void *source, int cargc
     return CMD_ERROR;
   }
 
-  ast_whowassearch(tree->root, reply, sender, wall, display, NULL, NULL, limit, NULL);
+  if (explain)
+    ast_explain(tree->root, reg_whowassearch, reply, sender, wall);
+  else
+    ast_whowassearch(tree->root, reply, sender, wall, display, NULL, NULL, limit, NULL);
 
   parse_free(tree);
 
@@ -624,6 +652,7 @@ int do_whowassearch(void *source, int cargc, char **cargv) {
 void whowassearch_exe(struct searchNode *search, searchCtx *ctx) {
   int i, matches = 0;
   whowas *ww;
+  nick *wnp;
   nick *sender = ctx->sender;
   senderNSExtern = sender;
   WhowasDisplayFunc display = ctx->displayfn;
@@ -633,6 +662,7 @@ void whowassearch_exe(struct searchNode *search, searchCtx *ctx) {
 
   /* The top-level node needs to return a BOOL */
   search=coerceNode(ctx, search, RETURNTYPE_BOOL);
+  nsplan_optimise(ctx, search);
 
   for (i = whowasoffset; i < whowasoffset + whowasmax; i++) {
     ww = &whowasrecs[i % whowasmax];
@@ -642,7 +672,9 @@ void whowassearch_exe(struct searchNode *search, searchCtx *ctx) {
 
     /* Note: We're passing the nick to the filter function. The original
      * whowas record is in the nick's ->next field. */
-    if ((search->exe)(ctx, search, &ww->nick)) {
+    wnp = whowas_tonick(ww);
+
+    if ((search->exe)(ctx, search, wnp)) {
       if (matches<limit)
         display(ctx, sender, ww);
 
@@ -650,6 +682,8 @@ void whowassearch_exe(struct searchNode *search, searchCtx *ctx) {
         ctx->reply(sender, "--- More than %d matches, skipping the rest",limit);
       matches++;
     }
+
+    whowas_freenick(wnp);
   }
 
   ctx->reply(sender,"--- End of list: %d matches", matches);
@@ -659,6 +693,7 @@ int do_chansearch_real(replyFunc reply, wallFunc wall, void *source, int cargc,
   nick *sender = source;
   int limit=500;
   int arg=0;
+  int explain=0;
   ChanDisplayFunc display=defaultchanfn;
   int ret;
   parsertree *tree;
@@ -669,7 +704,7 @@ int do_chansearch_real(replyFunc reply, wallFunc wall, void *source, int cargc,
     return CMD_OK;
   }
   
-  ret = parseopts(cargc, cargv, &arg, &limit, NULL, (void *)&display, reg_chansearch->outputtree, reply, sender);
+  ret = parseopts(cargc, cargv, &arg, &limit, NULL, &explain, (void *)&display, reg_chansearch->outputtree, reply, sender);
   if(ret != CMD_OK)
     return ret;
 
@@ -688,7 +723,10 @@ int do_chansearch_real(replyFunc reply, wallFunc wall, void *source, int cargc,
     return CMD_ERROR;
   }
 
-  ast_chansearch(tree->root, reply, sender, wall, display, NULL, NULL, limit, NULL);
+  if (explain)
+    ast_explain(tree->root, reg_chansearch, reply, sender, wall);
+  else
+    ast_chansearch(tree->root, reply, sender, wall, display, NULL, NULL, limit, NULL);
 
   parse_free(tree);
 
@@ -711,6 +749,7 @@ void chansearch_exe(struct searchNode *search, searchCtx *ctx) {
   assert(!ctx->targets);  
 
   search=coerceNode(ctx, search, RETURNTYPE_BOOL);
+  nsplan_optimise(ctx, search);
   
   for (i=0;i<CHANNELHASHSIZE;i++) {
     for (cip=chantable[i];cip;cip=cip->next) {
@@ -731,6 +770,7 @@ int do_usersearch_real(replyFunc reply, wallFunc wall, void *source, int cargc,
   nick *sender = source;
   int limit=500;
   int arg=0;
+  int explain=0;
   UserDisplayFunc display=defaultuserfn;
   int ret;
   parsertree *tree;
@@ -741,7 +781,7 @@ int do_usersearch_real(replyFunc reply, wallFunc wall, void *source, int cargc,
     return CMD_OK;
   }
  
-  ret = parseopts(cargc, cargv, &arg, &limit, NULL, (void *)&display, reg_usersearch->outputtree, reply, sender);
+  ret = parseopts(cargc, cargv, &arg, &limit, NULL, &explain, (void *)&display, reg_usersearch->outputtree, reply, sender);
   if(ret != CMD_OK)
     return ret;
 
@@ -760,7 +800,10 @@ int do_usersearch_real(replyFunc reply, wallFunc wall, void *source, int cargc,
     return CMD_ERROR;
   }
 
-  ast_usersearch(tree->root, reply, sender, wall, display, NULL, NULL, limit, NULL);
+  if (explain)
+    ast_explain(tree->root, reg_usersearch, reply, sender, wall);
+  else
+    ast_usersearch(tree->root, reply, sender, wall, display, NULL, NULL, limit, NULL);
 
   parse_free(tree);
 
@@ -783,6 +826,7 @@ void usersearch_exe(struct searchNode *search, searchCtx *ctx) {
   assert(!ctx->targets);
 
   search=coerceNode(ctx, search, RETURNTYPE_BOOL);
+  nsplan_optimise(ctx, search);
   
   for (i=0;i<AUTHNAMEHASHSIZE;i++) {
     for (aup=authnametable[i];aup;aup=aup->next) {
@@ -272,15 +272,18 @@ typedef struct searchASTCache {
 #define NSASTManualNode(fn, count, children) __NSASTChild(__NSASTRawNode(fn, count, children))
 
 searchNode *search_astparse(searchCtx *, char *);
+searchASTExpr *search_astexpr(searchCtx *, char *);
 
 int ast_nicksearch(searchASTExpr *tree, replyFunc reply, void *sender, wallFunc wall, NickDisplayFunc display, HeaderFunc header, void *headerarg, int limit, array *);
 int ast_chansearch(searchASTExpr *tree, replyFunc reply, void *sender, wallFunc wall, ChanDisplayFunc display, HeaderFunc header, void *headerarg, int limit, array *);
 int ast_usersearch(searchASTExpr *tree, replyFunc reply, void *sender, wallFunc wall, UserDisplayFunc display, HeaderFunc header, void *headerarg, int limit, array *);
 int ast_whowassearch(searchASTExpr *tree, replyFunc reply, void *sender, wallFunc wall, WhowasDisplayFunc display, HeaderFunc header, void *headerarg, int limit, array *);
 
+int ast_explain(searchASTExpr *tree, searchCmd *cmd, replyFunc reply, void *sender, wallFunc wall);
+
 char *ast_printtree(char *buf, size_t bufsize, searchASTExpr *expr, searchCmd *cmd);
 
-int parseopts(int cargc, char **cargv, int *arg, int *limit, void **subset, void *display, CommandTree *sl, replyFunc reply, void *sender);
+int parseopts(int cargc, char **cargv, int *arg, int *limit, void **subset, int *explain, void *display, CommandTree *sl, replyFunc reply, void *sender);
 
 typedef int (*ASTFunc)(searchASTExpr *, replyFunc, void *, wallFunc, void *, HeaderFunc, void *, int limit, array *targets);
 
@@ -299,4 +302,18 @@ extern WhowasDisplayFunc defaultwhowasfn;
 
 struct searchNode *argtoconststr(char *command, searchCtx *ctx, char *arg, char **p);
 
+/* Query planner (newsearch_plan.c) */
+void nsplan_optimise(searchCtx *ctx, searchNode *search);
+int nsplan_nicktargets(searchCtx *ctx, searchNode *search, array *targets);
+void nsplan_explain(searchCtx *ctx, searchNode *search);
+
+/* Accessors used by the planner */
+searchNode **and_children(searchNode *thenode, int *count);
+searchNode **or_children(searchNode *thenode, int *count);
+searchNode **eq_children(searchNode *thenode, int *count);
+searchNode **lt_children(searchNode *thenode, int *count);
+searchNode **gt_children(searchNode *thenode, int *count);
+void match_args(searchNode *thenode, searchNode **targnode, searchNode **patnode);
+void cidr_args(searchNode *thenode, struct irc_in_addr *ip, unsigned char *bits);
+
 #endif
@@ -64,6 +64,11 @@ searchASTExpr *cachesearch(searchASTCache *cache, exprunion *loc) {
   return treesearch(cache->tree, loc);
 }
 
+/* finds the expression a parse function was handed, for parsers that wrap search_astparse */
+searchASTExpr *search_astexpr(searchCtx *ctx, char *loc) {
+  return cachesearch(ctx->arg, (exprunion *)&loc);
+}
+
 /* pushes an item into the cache */
 static void cachepush(searchASTCache *cache, searchASTExpr *expr) {
   cache->cache[cache->nextpos] = expr;
@@ -159,6 +164,35 @@ int ast_nicksearch(searchASTExpr *tree, replyFunc reply, void *sender, wallFunc
   return CMD_OK;
 }
 
+int ast_explain(searchASTExpr *tree, searchCmd *cmd, replyFunc reply, void *sender, wallFunc wall) {
+  searchCtx ctx;
+  searchASTCache cache;
+  searchNode *search;
+  char buf[1024];
+
+  memset(&cache, 0, sizeof(cache));
+  cache.tree = tree;
+
+  newsearch_ctxinit(&ctx, search_astparse, reply, wall, &cache, cmd, sender, NULL, 0, NULL);
+
+  buf[0] = '\0';
+  reply(sender, "Parsing: %s", ast_printtree(buf, sizeof(buf), tree, cmd));
+  search = ctx.parser(&ctx, (char *)tree);
+  if(!search) {
+    reply(sender, "Parse error: %s", parseError);
+    return CMD_ERROR;
+  }
+
+  /* same steps as the *search_exe functions, without executing */
+  search = coerceNode(&ctx, search, RETURNTYPE_BOOL);
+  nsplan_optimise(&ctx, search);
+  nsplan_explain(&ctx, search);
+
+  (search->free)(&ctx, search);
+
+  return CMD_OK;
+}
+
 int ast_whowassearch(searchASTExpr *tree, replyFunc reply, void *sender, wallFunc wall, WhowasDisplayFunc display, HeaderFunc header, void *headerarg, int limit, array *targets) {
   searchCtx ctx;
   searchASTCache cache;
@@ -0,0 +1,639 @@
+/*
+ * Query planner
+ *
+ * Reorders the children of and/or nodes so that cheap and selective tests
+ * run first, and for nick searches picks an index (nick, real host,
+ * authname, channel membership or a CIDR via patricianick) to generate
+ * candidate users from instead of walking the whole nick table.
+ *
+ * Only indices that agree with the search semantics are used: the visible
+ * host (sethost, hidden host) and the realname table (case sensitive) are
+ * not, and neither is country, which has no index.
+ *
+ * Terms the planner doesn't know about (e.g. those registered by other
+ * modules) and terms with side effects (kill, gline, notice, ...) are never
+ * moved, and nothing is reordered across them.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "newsearch.h"
+#include "../lib/irc_string.h"
+#include "../lib/irc_ipv6.h"
+#include "../patricianick/patricianick.h"
+
+void *and_exe(searchCtx *, struct searchNode *, void *);
+void *or_exe(searchCtx *, struct searchNode *, void *);
+void *not_exe(searchCtx *, struct searchNode *, void *);
+void *eq_exe(searchCtx *, struct searchNode *, void *);
+void *lt_exe(searchCtx *, struct searchNode *, void *);
+void *gt_exe(searchCtx *, struct searchNode *, void *);
+void *match_exe(searchCtx *, struct searchNode *, void *);
+void *regex_exe(searchCtx *, struct searchNode *, void *);
+void *length_exe(searchCtx *, struct searchNode *, void *);
+void *nick_exe(searchCtx *, struct searchNode *, void *);
+void *ident_exe(searchCtx *, struct searchNode *, void *);
+void *host_exe(searchCtx *, struct searchNode *, void *);
+void *host_exe_real(searchCtx *, struct searchNode *, void *);
+void *hostmask_exe(searchCtx *, struct searchNode *, void *);
+void *hostmask_exe_rh(searchCtx *, struct searchNode *, void *);
+void *hostmask_exe_rn(searchCtx *, struct searchNode *, void *);
+void *hostmask_exe_rn_rh(searchCtx *, struct searchNode *, void *);
+void *realname_exe(searchCtx *, struct searchNode *, void *);
+void *away_exe(searchCtx *, struct searchNode *, void *);
+void *authname_exe(searchCtx *, struct searchNode *, void *);
+void *authts_exe(searchCtx *, struct searchNode *, void *);
+void *authid_exe(searchCtx *, struct searchNode *, void *);
+void *modes_exe(searchCtx *, struct searchNode *, void *);
+void *timestamp_exe(searchCtx *, struct searchNode *, void *);
+void *channel_exe(searchCtx *, struct searchNode *, void *);
+void *channels_exe(searchCtx *, struct searchNode *, void *);
+void *country_exe(searchCtx *, struct searchNode *, void *);
+void *ip_exe(searchCtx *, struct searchNode *, void *);
+void *ipv6_exe(searchCtx *, struct searchNode *, void *);
+void *cidr_exe(searchCtx *, struct searchNode *, void *);
+void *server_exe_bool(searchCtx *, struct searchNode *, void *);
+void *server_exe_str(searchCtx *, struct searchNode *, void *);
+void *exists_exe(searchCtx *, struct searchNode *, void *);
+void *services_exe(searchCtx *, struct searchNode *, void *);
+void *size_exe(searchCtx *, struct searchNode *, void *);
+void *name_exe(searchCtx *, struct searchNode *, void *);
+void *topic_exe(searchCtx *, struct searchNode *, void *);
+void *oppct_exe(searchCtx *, struct searchNode *, void *);
+void *hostpct_exe(searchCtx *, struct searchNode *, void *);
+void *authedpct_exe(searchCtx *, struct searchNode *, void *);
+void *cumodecount_exe(searchCtx *, struct searchNode *, void *);
+void *cumodepct_exe(searchCtx *, struct searchNode *, void *);
+void *cumodes_nick_exe(searchCtx *, struct searchNode *, void *);
+void *cumodes_chan_exe(searchCtx *, struct searchNode *, void *);
+void *quit_exe(searchCtx *, struct searchNode *, void *);
+void *killed_exe(searchCtx *, struct searchNode *, void *);
+void *renamed_exe(searchCtx *, struct searchNode *, void *);
+void *age_exe(searchCtx *, struct searchNode *, void *);
+void *newnick_exe(searchCtx *, struct searchNode *, void *);
+void *reason_exe(searchCtx *, struct searchNode *, void *);
+void *exe_tostr_null(searchCtx *, struct searchNode *, void *);
+void *exe_val_null(searchCtx *, struct searchNode *, void *);
+void *exe_inttostr(searchCtx *, struct searchNode *, void *);
+void *exe_booltostr(searchCtx *, struct searchNode *, void *);
+void *exe_strtoint(searchCtx *, struct searchNode *, void *);
+void *exe_booltoint(searchCtx *, struct searchNode *, void *);
+void *exe_strtobool(searchCtx *, struct searchNode *, void *);
+void *exe_inttobool(searchCtx *, struct searchNode *, void *);
+
+#define NSPLAN_PURE     0x01 /* no side effects, can be reordered */
+#define NSPLAN_COERCE   0x02 /* localdata is a struct coercedata */
+
+#define NSPLAN_UNKNOWN_COST 20.0
+#define NSPLAN_MAXDEPTH 16
+
+#define NSPLAN_INDEX_NONE     0
+#define NSPLAN_INDEX_NICK     1
+#define NSPLAN_INDEX_HOST     2
+#define NSPLAN_INDEX_AUTHNAME 3
+#define NSPLAN_INDEX_CHANNEL  4
+#define NSPLAN_INDEX_CIDR     5
+
+typedef struct nsplanterm {
+  exeFunc exe;
+  const char *name;
+  double cost;        /* own cost, children are added on top */
+  double selectivity; /* estimated fraction of inputs a BOOL term is true for */
+  int flags;
+} nsplanterm;
+
+typedef struct nsplanestimate {
+  double cost;
+  double selectivity;
+  int pure;
+} nsplanestimate;
+
+typedef struct nsplanindex {
+  int type;
+  unsigned long estimate;
+  const char *key;
+  char keybuf[64];
+  struct irc_in_addr ip;
+  unsigned char bits;
+  chanindex *cip;
+} nsplanindex;
+
+static nsplanterm nsplanterms[] = {
+  { and_exe,            "and",          0.0, 1.0,  NSPLAN_PURE },
+  { or_exe,             "or",           0.0, 1.0,  NSPLAN_PURE },
+  { not_exe,            "not",          0.0, 1.0,  NSPLAN_PURE },
+  { eq_exe,             "eq",           1.0, 0.1,  NSPLAN_PURE },
+  { lt_exe,             "lt",           1.0, 0.5,  NSPLAN_PURE },
+  { gt_exe,             "gt",           1.0, 0.5,  NSPLAN_PURE },
+  { match_exe,          "match",        5.0, 0.1,  NSPLAN_PURE },
+  { regex_exe,          "regex",        25.0, 0.1, NSPLAN_PURE },
+  { length_exe,         "length",       1.0, 0.5,  NSPLAN_PURE },
+  { literal_exe,        "literal",      0.0, 0.5,  NSPLAN_PURE },
+  { nick_exe,           "nick",         0.5, 0.5,  NSPLAN_PURE },
+  { ident_exe,          "ident",        0.5, 0.5,  NSPLAN_PURE },
+  { host_exe,           "host",         1.0, 0.5,  NSPLAN_PURE },
+  { host_exe_real,      "host real",    0.5, 0.5,  NSPLAN_PURE },
+  { hostmask_exe,       "hostmask",     4.0, 0.5,  NSPLAN_PURE },
+  { hostmask_exe_rh,    "hostmask",     4.0, 0.5,  NSPLAN_PURE },
+  { hostmask_exe_rn,    "hostmask",     4.0, 0.5,  NSPLAN_PURE },
+  { hostmask_exe_rn_rh, "hostmask",     4.0, 0.5,  NSPLAN_PURE },
+  { realname_exe,       "realname",     0.5, 0.5,  NSPLAN_PURE },
+  { away_exe,           "away",         0.5, 0.5,  NSPLAN_PURE },
+  { authname_exe,       "authname",     0.5, 0.3,  NSPLAN_PURE },
+  { authts_exe,         "authts",       0.5, 0.3,  NSPLAN_PURE },
+  { authid_exe,         "authid",       0.5, 0.3,  NSPLAN_PURE },
+  { modes_exe,          "modes",        0.5, 0.2,  NSPLAN_PURE },
+  { timestamp_exe,      "timestamp",    0.5, 0.5,  NSPLAN_PURE },
+  { channel_exe,        "channel",      2.0, 0.01, NSPLAN_PURE },
+  { channels_exe,       "channels",     0.5, 0.5,  NSPLAN_PURE },
+  { country_exe,        "country",      2.0, 0.05, NSPLAN_PURE },
+  { ip_exe,             "ip",           3.0, 0.5,  NSPLAN_PURE },
+  { ipv6_exe,           "ipv6",         0.5, 0.2,  NSPLAN_PURE },
+  { cidr_exe,           "cidr",         1.0, 0.02, NSPLAN_PURE },
+  { server_exe_bool,    "server",       0.5, 0.05, NSPLAN_PURE },
+  { server_exe_str,     "server",       0.5, 0.5,  NSPLAN_PURE },
+  { exists_exe,         "exists",       0.5, 0.5,  NSPLAN_PURE },
+  { services_exe,       "services",     5.0, 0.5,  NSPLAN_PURE },
+  { size_exe,           "size",         0.5, 0.5,  NSPLAN_PURE },
+  { name_exe,           "name",         0.5, 0.5,  NSPLAN_PURE },
+  { topic_exe,          "topic",        0.5, 0.5,  NSPLAN_PURE },
+  { oppct_exe,          "oppct",        30.0, 0.5, NSPLAN_PURE },
+  { hostpct_exe,        "hostpct",      30.0, 0.5, NSPLAN_PURE },
+  { authedpct_exe,      "authedpct",    30.0, 0.5, NSPLAN_PURE },
+  { cumodecount_exe,    "cumodecount",  30.0, 0.5, NSPLAN_PURE },
+  { cumodepct_exe,      "cumodepct",    30.0, 0.5, NSPLAN_PURE },
+  { cumodes_nick_exe,   "cumodes",      5.0, 0.5,  NSPLAN_PURE },
+  { cumodes_chan_exe,   "cumodes",      5.0, 0.5,  NSPLAN_PURE },
+  { quit_exe,           "quit",         0.5, 0.5,  NSPLAN_PURE },
+  { killed_exe,         "killed",       0.5, 0.2,  NSPLAN_PURE },
+  { renamed_exe,        "renamed",      0.5, 0.2,  NSPLAN_PURE },
+  { age_exe,            "age",          0.5, 0.5,  NSPLAN_PURE },
+  { newnick_exe,        "newnick",      0.5, 0.5,  NSPLAN_PURE },
+  { reason_exe,         "reason",       0.5, 0.5,  NSPLAN_PURE },
+  { exe_tostr_null,     "coerce",       0.0, 0.5,  NSPLAN_PURE | NSPLAN_COERCE },
+  { exe_val_null,       "var",          0.0, 0.5,  NSPLAN_PURE | NSPLAN_COERCE },
+  { exe_inttostr,       "coerce",       0.5, 0.5,  NSPLAN_PURE | NSPLAN_COERCE },
+  { exe_booltostr,      "coerce",       0.0, 0.5,  NSPLAN_PURE | NSPLAN_COERCE },
+  { exe_strtoint,       "coerce",       0.5, 0.5,  NSPLAN_PURE | NSPLAN_COERCE },
+  { exe_booltoint,      "coerce",       0.0, 0.5,  NSPLAN_PURE | NSPLAN_COERCE },
+  { exe_strtobool,      "coerce",       0.0, 0.5,  NSPLAN_PURE | NSPLAN_COERCE },
+  { exe_inttobool,      "coerce",       0.0, 0.5,  NSPLAN_PURE | NSPLAN_COERCE },
+  { NULL,               NULL,           0.0, 0.0,  0 }
+};
+
+static nsplanterm *nsplan_findterm(searchNode *node) {
+  nsplanterm *term;
+
+  for (term = nsplanterms; term->exe; term++)
+    if (term->exe == node->exe)
+      return term;
+
+  return NULL;
+}
+
+/* Children of the nodes we can look into, fills at most max entries. */
+static int nsplan_children(searchNode *node, searchNode **children, int max) {
+  searchNode **nodes, *targnode, *patnode;
+  nsplanterm *term = nsplan_findterm(node);
+  int count, i;
+
+  if (!term)
+    return 0;
+
+  if (term->flags & NSPLAN_COERCE) {
+    if (!((struct coercedata *)node->localdata)->child || max < 1)
+      return 0;
+
+    children[0] = ((struct coercedata *)node->localdata)->child;
+    return 1;
+  }
+
+  if (node->exe == not_exe) {
+    if (max < 1)
+      return 0;
+
+    children[0] = node->localdata;
+    return 1;
+  }
+
+  if (node->exe == match_exe) {
+    if (max < 2)
+      return 0;
+
+    match_args(node, &targnode, &patnode);
+    children[0] = targnode;
+    children[1] = patnode;
+    return 2;
+  }
+
+  if (node->exe == and_exe)
+    nodes = and_children(node, &count);
+  else if (node->exe == or_exe)
+    nodes = or_children(node, &count);
+  else if (node->exe == eq_exe)
+    nodes = eq_children(node, &count);
+  else if (node->exe == lt_exe)
+    nodes = lt_children(node, &count);
+  else if (node->exe == gt_exe)
+    nodes = gt_children(node, &count);
+  else
+    return 0;
+
+  for (i = 0; i < count && i < max; i++)
+    children[i] = nodes[i];
+
+  return i;
+}
+
+static void nsplan_estimate_depth(searchNode *node, nsplanestimate *est, int depth) {
+  searchNode *children[MAX_VARIABLES * 4];
+  nsplanestimate cest;
+  nsplanterm *term;
+  double reach = 1.0;
+  int count, i;
+
+  term = nsplan_findterm(node);
+  if (!term || depth > NSPLAN_MAXDEPTH) {
+    est->cost = NSPLAN_UNKNOWN_COST;
+    est->selectivity = 0.5;
+    est->pure = 0;
+    return;
+  }
+
+  est->cost = term->cost;
+  est->selectivity = term->selectivity;
+  est->pure = (term->flags & NSPLAN_PURE) ? 1 : 0;
+
+  count = nsplan_children(node, children, sizeof(children) / sizeof(children[0]));
+
+  if (node->exe == and_exe || node->exe == or_exe) {
+    /* expected cost given short-circuit evaluation in the current order */
+    for (i = 0; i < count; i++) {
+      nsplan_estimate_depth(children[i], &cest, depth + 1);
+      est->cost += reach * cest.cost;
+      est->pure &= cest.pure;
+
+      if (node->exe == and_exe)
+        reach *= cest.selectivity;
+      else
+        reach *= 1.0 - cest.selectivity;
+    }
+
+    est->selectivity = (node->exe == and_exe) ? reach : 1.0 - reach;
+    return;
+  }
+
+  for (i = 0; i < count; i++) {
+    nsplan_estimate_depth(children[i], &cest, depth + 1);
+    est->cost += cest.cost;
+    est->pure &= cest.pure;
+
+    if (node->exe == not_exe)
+      est->selectivity = 1.0 - cest.selectivity;
+    else if (term->flags & NSPLAN_COERCE)
+      est->selectivity = cest.selectivity;
+  }
+}
+
+static void nsplan_estimate(searchNode *node, nsplanestimate *est) {
+  nsplan_estimate_depth(node, est, 0);
+}
+
+/* Order in which a child should run: for and, the one most likely to cut
+ * the evaluation short per unit of cost goes first; likewise for or with
+ * the chance of being true. */
+static double nsplan_rank(nsplanestimate *est, int isand) {
+  double p = isand ? 1.0 - est->selectivity : est->selectivity;
+
+  if (p <= 0.0001)
+    p = 0.0001;
+
+  return est->cost / p;
+}
+
+static void nsplan_reorder(searchNode **nodes, int count, int isand) {
+  nsplanestimate est;
+  double rank[count > 0 ? count : 1], trank;
+  int pure[count > 0 ? count : 1];
+  searchNode *tnode;
+  int i, j, start;
+
+  if (count < 2)
+    return;
+
+  for (i = 0; i < count; i++) {
+    nsplan_estimate(nodes[i], &est);
+    rank[i] = nsplan_rank(&est, isand);
+    pure[i] = est.pure;
+  }
+
+  /* stable insertion sort within each run of pure children */
+  for (start = 0; start < count; start = i + 1) {
+    for (i = start; i < count && pure[i]; i++) {
+      for (j = i; j > start && rank[j - 1] > rank[j]; j--) {
+        tnode = nodes[j]; nodes[j] = nodes[j - 1]; nodes[j - 1] = tnode;
+        trank = rank[j]; rank[j] = rank[j - 1]; rank[j - 1] = trank;
+      }
+    }
+  }
+}
+
+static void nsplan_optimise_depth(searchNode *node, int depth) {
+  searchNode *children[MAX_VARIABLES * 4], **nodes;
+  int count, i;
+
+  if (depth > NSPLAN_MAXDEPTH)
+    return;
+
+  count = nsplan_children(node, children, sizeof(children) / sizeof(children[0]));
+  for (i = 0; i < count; i++)
+    nsplan_optimise_depth(children[i], depth + 1);
+
+  if (node->exe == and_exe) {
+    nodes = and_children(node, &count);
+    nsplan_reorder(nodes, count, 1);
+  } else if (node->exe == or_exe) {
+    nodes = or_children(node, &count);
+    nsplan_reorder(nodes, count, 0);
+  }
+}
+
+void nsplan_optimise(searchCtx *ctx, searchNode *search) {
+  nsplan_optimise_depth(search, 0);
+}
+
+static const char *nsplan_literal(searchNode *node) {
+  if (node->exe != literal_exe || !node->localdata)
+    return NULL;
+
+  return ((sstring *)node->localdata)->content;
+}
+
+/* A string equality test against a literal, either eq(x, "...") or a
+ * match() without wildcards. Returns the exe of the other side. */
+static exeFunc nsplan_stringeq(searchNode *node, const char **key) {
+  searchNode *children[2], *targnode, *patnode;
+
+  if (node->exe == eq_exe) {
+    children[0] = children[1] = NULL;
+    if (nsplan_children(node, children, 2) != 2)
+      return NULL;
+
+    if ((*key = nsplan_literal(children[1])))
+      return children[0]->exe;
+    if ((*key = nsplan_literal(children[0])))
+      return children[1]->exe;
+
+    return NULL;
+  }
+
+  if (node->exe == match_exe) {
+    match_args(node, &targnode, &patnode);
+
+    if (!(*key = nsplan_literal(patnode)))
+      return NULL;
+
+    if (strpbrk(*key, "*?\\"))
+      return NULL;
+
+    return targnode->exe;
+  }
+
+  return NULL;
+}
+
+static int nsplan_patriciaexts(int *nodeext, int *nickext) {
+  *nodeext = findnodeext("patricianick");
+  *nickext = findnickext("patricianick");
+
+  return *nodeext != -1 && *nickext != -1;
+}
+
+/* Works out whether node can be answered from an index, and roughly how
+ * many users the index would return. */
+static int nsplan_indexfor(searchNode *node, nsplanindex *idx) {
+  patricia_node_t *head, *pnode;
+  exeFunc exe;
+  const char *key;
+  host *hp;
+  authname *anp;
+  int nodeext, nickext;
+
+  memset(idx, 0, sizeof(nsplanindex));
+
+  if (node->exe == channel_exe) {
+    idx->type = NSPLAN_INDEX_CHANNEL;
+    idx->cip = node->localdata;
+    idx->key = idx->cip->name->content;
+    idx->estimate = idx->cip->channel ? idx->cip->channel->users->totalusers : 0;
+    return 1;
+  }
+
+  if (node->exe == cidr_exe) {
+    if (!nsplan_patriciaexts(&nodeext, &nickext))
+      return 0;
+
+    cidr_args(node, &idx->ip, &idx->bits);
+    idx->type = NSPLAN_INDEX_CIDR;
+    snprintf(idx->keybuf, sizeof(idx->keybuf), "%s/%d", CIDRtostr(idx->ip, idx->bits), irc_bitlen(&idx->ip, idx->bits));
+    idx->key = idx->keybuf;
+
+    head = refnode(iptree, &idx->ip, idx->bits);
+    PATRICIA_WALK(head, pnode) {
+      idx->estimate += pnode->usercount;
+    }
+    PATRICIA_WALK_END;
+    derefnode(iptree, head);
+
+    return 1;
+  }
+
+  if (!(exe = nsplan_stringeq(node, &key)))
+    return 0;
+
+  idx->key = key;
+
+  if (exe == nick_exe) {
+    idx->type = NSPLAN_INDEX_NICK;
+    idx->estimate = getnickbynick(key) ? 1 : 0;
+  } else if (exe == host_exe_real) {
+    idx->type = NSPLAN_INDEX_HOST;
+    idx->estimate = (hp = findhost(key)) ? hp->clonecount : 0;
+  } else if (exe == authname_exe) {
+    idx->type = NSPLAN_INDEX_AUTHNAME;
+    idx->estimate = (anp = findauthnamebyname(key)) ? anp->usercount : 0;
+  } else {
+    return 0;
+  }
+
+  return 1;
+}
+
+static const char *nsplan_indexname(int type) {
+  switch (type) {
+    case NSPLAN_INDEX_NICK:
+      return "nick";
+    case NSPLAN_INDEX_HOST:
+      return "host";
+    case NSPLAN_INDEX_AUTHNAME:
+      return "authname";
+    case NSPLAN_INDEX_CHANNEL:
+      return "channel";
+    case NSPLAN_INDEX_CIDR:
+      return "cidr";
+    default:
+      return "none";
+  }
+}
+
+/* Finds the most selective index usable for the whole search: the search
+ * itself or any child of a top-level and. */
+static int nsplan_bestindex(searchNode *search, nsplanindex *best) {
+  searchNode **nodes;
+  nsplanindex idx;
+  int count, i, found = 0;
+
+  while (nsplan_findterm(search) && (nsplan_findterm(search)->flags & NSPLAN_COERCE) && ((struct coercedata *)search->localdata)->child)
+    search = ((struct coercedata *)search->localdata)->child;
+
+  if (search->exe == and_exe) {
+    nodes = and_children(search, &count);
+  } else {
+    nodes = &search;
+    count = 1;
+  }
+
+  for (i = 0; i < count; i++) {
+    if (!nsplan_indexfor(nodes[i], &idx))
+      continue;
+
+    if (!found || idx.estimate < best->estimate) {
+      memcpy(best, &idx, sizeof(nsplanindex));
+      if (idx.key == idx.keybuf)
+        best->key = best->keybuf;
+      found = 1;
+    }
+  }
+
+  return found;
+}
+
+static void nsplan_addtarget(array *targets, nick *np) {
+  int slot = array_getfreeslot(targets);
+
+  ((nick **)targets->content)[slot] = np;
+}
+
+int nsplan_nicktargets(searchCtx *ctx, searchNode *search, array *targets) {
+  nsplanindex idx;
+  patricia_node_t *head, *pnode;
+  patricianick_t *pnp;
+  nick *np;
+  host *hp;
+  authname *anp;
+  channel *cp;
+  int i, nodeext, nickext;
+
+  if (!nsplan_bestindex(search, &idx))
+    return 0;
+
+  array_init(targets, sizeof(nick *));
+
+  switch (idx.type) {
+    case NSPLAN_INDEX_NICK:
+      if ((np = getnickbynick(idx.key)))
+        nsplan_addtarget(targets, np);
+      break;
+
+    case NSPLAN_INDEX_HOST:
+      if ((hp = findhost(idx.key)))
+        for (np = hp->nicks; np; np = np->nextbyhost)
+          nsplan_addtarget(targets, np);
+      break;
+
+    case NSPLAN_INDEX_AUTHNAME:
+      if ((anp = findauthnamebyname(idx.key)))
+        for (np = anp->nicks; np; np = np->nextbyauthname)
+          nsplan_addtarget(targets, np);
+      break;
+
+    case NSPLAN_INDEX_CHANNEL:
+      if ((cp = idx.cip->channel))
+        for (i = 0; i < cp->users->hashsize; i++)
+          if (cp->users->content[i] != nouser && (np = getnickbynumeric(cp->users->content[i])))
+            nsplan_addtarget(targets, np);
+      break;
+
+    case NSPLAN_INDEX_CIDR:
+      nsplan_patriciaexts(&nodeext, &nickext);
+
+      head = refnode(iptree, &idx.ip, idx.bits);
+      PATRICIA_WALK(head, pnode) {
+        if ((pnp = pnode->exts[nodeext]))
+          for (i = 0; i < PATRICIANICK_HASHSIZE; i++)
+            for (np = pnp->identhash[i]; np; np = np->exts[nickext])
+              nsplan_addtarget(targets, np);
+      }
+      PATRICIA_WALK_END;
+      derefnode(iptree, head);
+      break;
+  }
+
+  return 1;
+}
+
+static void nsplan_explainnode(searchCtx *ctx, nick *sender, searchNode *node, int depth) {
+  searchNode *children[MAX_VARIABLES * 4];
+  nsplanestimate est;
+  nsplanterm *term;
+  const char *literal;
+  int count, i;
+
+  if (depth > NSPLAN_MAXDEPTH)
+    return;
+
+  term = nsplan_findterm(node);
+
+  /* coercions are an implementation detail, show what's underneath */
+  if (term && (term->flags & NSPLAN_COERCE) && node->exe != exe_val_null) {
+    count = nsplan_children(node, children, 1);
+    if (count)
+      nsplan_explainnode(ctx, sender, children[0], depth);
+    return;
+  }
+
+  if ((literal = nsplan_literal(node))) {
+    ctx->reply(sender, "%*s\"%s\"", depth * 2, "", literal);
+    return;
+  }
+
+  nsplan_estimate(node, &est);
+
+  if ((node->returntype & RETURNTYPE_TYPE) == RETURNTYPE_BOOL)
+    ctx->reply(sender, "%*s%s (cost %.1f, selectivity %.3f%s)", depth * 2, "", term ? term->name : "?", est.cost, est.selectivity, est.pure ? "" : ", fixed position");
+  else
+    ctx->reply(sender, "%*s%s (cost %.1f%s)", depth * 2, "", term ? term->name : "?", est.cost, est.pure ? "" : ", fixed position");
+
+  count = nsplan_children(node, children, sizeof(children) / sizeof(children[0]));
+  for (i = 0; i < count; i++)
+    nsplan_explainnode(ctx, sender, children[i], depth + 1);
+}
+
+void nsplan_explain(searchCtx *ctx, searchNode *search) {
+  nsplanindex idx;
+  nick *sender = ctx->sender;
+
+  if (ctx->searchcmd == reg_nicksearch) {
+    if (ctx->targets)
+      ctx->reply(sender, "Candidates: %d supplied targets", ctx->targets->cursi);
+    else if (nsplan_bestindex(search, &idx))
+      ctx->reply(sender, "Candidates: %s index lookup on %s, about %lu users", nsplan_indexname(idx.type), idx.key, idx.estimate);
+    else
+      ctx->reply(sender, "Candidates: full scan of all users");
+  }
+
+  ctx->reply(sender, "Evaluation order:");
+  nsplan_explainnode(ctx, sender, search, 1);
+}
@@ -87,3 +87,10 @@ void *and_exe(searchCtx *ctx, struct searchNode *thenode, void *theinput) {
   }
   return (void *)1;
 }
+
+searchNode **and_children(struct searchNode *thenode, int *count) {
+  struct and_localdata *localdata = thenode->localdata;
+
+  *count = localdata->count;
+  return localdata->nodes;
+}
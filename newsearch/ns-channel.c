@@ -51,7 +51,7 @@ void *channel_exe(searchCtx *ctx, struct searchNode *thenode, void *theinput) {
   if (ctx->searchcmd == reg_whowassearch) {
     ww = (whowas *)np->next; /* Eww. */
 
-    for (i = 0; i < WW_MAXCHANNELS; i++)
+    for (i = 0; i < ww->channelcount; i++)
       if (ww->channels[i] == cip)
         return (void *)1;
   } else {
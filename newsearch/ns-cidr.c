@@ -81,3 +81,10 @@ void cidr_free(searchCtx *ctx, struct searchNode *thenode) {
   free(thenode->localdata);
   free(thenode);
 }
+
+void cidr_args(struct searchNode *thenode, struct irc_in_addr *ip, unsigned char *bits) {
+  struct cidr_localdata *c = thenode->localdata;
+
+  memcpy(ip, &c->ip, sizeof(struct irc_in_addr));
+  *bits = c->bits;
+}
@@ -132,3 +132,9 @@ void *eq_exe(searchCtx *ctx, struct searchNode *thenode, void *theinput) {
   }
 }
 
+searchNode **eq_children(struct searchNode *thenode, int *count) {
+  struct eq_localdata *localdata = thenode->localdata;
+
+  *count = localdata->count;
+  return localdata->nodes;
+}
@@ -222,8 +222,10 @@ void gline_free(searchCtx *ctx, struct searchNode *thenode) {
         continue;
 
       if (ww->marker == localdata->marker) {
-        if(!glineuser(&gbuf, &ww->nick, localdata, ti))
+        np = whowas_tonick(ww);
+        if(!glineuser(&gbuf, np, localdata, ti))
           safe++;
+        whowas_freenick(np);
       }
     }
   }
@@ -122,3 +122,9 @@ void *gt_exe(searchCtx *ctx, struct searchNode *thenode, void *theinput) {
   }
 }
 
+searchNode **gt_children(struct searchNode *thenode, int *count) {
+  struct gt_localdata *localdata = thenode->localdata;
+
+  *count = localdata->count;
+  return localdata->nodes;
+}
@@ -122,3 +122,9 @@ void *lt_exe(searchCtx *ctx, struct searchNode *thenode, void *theinput) {
   }
 }
 
+searchNode **lt_children(struct searchNode *thenode, int *count) {
+  struct lt_localdata *localdata = thenode->localdata;
+
+  *count = localdata->count;
+  return localdata->nodes;
+}
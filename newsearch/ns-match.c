@@ -87,3 +87,9 @@ void match_free(searchCtx *ctx, struct searchNode *thenode) {
   free(thenode);
 }
 
+void match_args(struct searchNode *thenode, struct searchNode **targnode, struct searchNode **patnode) {
+  struct match_localdata *localdata = thenode->localdata;
+
+  *targnode = localdata->targnode;
+  *patnode = localdata->patnode;
+}
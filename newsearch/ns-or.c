@@ -88,3 +88,10 @@ void *or_exe(searchCtx *ctx, struct searchNode *thenode, void *theinput) {
 
   return NULL;
 }
+
+searchNode **or_children(struct searchNode *thenode, int *count) {
+  struct or_localdata *localdata = thenode->localdata;
+
+  *count = localdata->count;
+  return localdata->nodes;
+}
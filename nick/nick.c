@@ -16,12 +16,16 @@
 #include "../core/nsmalloc.h"
 
 #include <stdlib.h>
+#include <stddef.h>
 #include <string.h>
 #include <stdio.h>
 
 MODULE_VERSION("");
 
 CCASSERT(sizeof(host) == sizeof(realname));
+/* see the comment on struct nick */
+CCASSERT(offsetof(nick, nick) + NICKLEN + 1 <= 64);
+CCASSERT(offsetof(nick, accountts) <= 128);
 
 const flag umodeflags[] = {
    { 'i', UMODE_INV },
@@ -86,6 +90,7 @@ void _init() {
   registerhook(HOOK_SERVER_NEWSERVER,&handleserverchange);
   registerhook(HOOK_SERVER_LOSTSERVER,&handleserverchange);
   registerhook(HOOK_CORE_STATSREQUEST,&nickstats);
+  registerbatchflush(&nick_flushburst);
   
   /* And our server handlers */
   registerserverhandler("N",&handlenickmsg,10);
@@ -106,6 +111,8 @@ void _fini() {
   nick *np;
   int i;
 
+  deregisterbatchflush(&nick_flushburst);
+
   fininickhelpers();
 
   for (i=0;i<NICKHASHSIZE;i++) {
@@ -145,7 +152,8 @@ void _fini() {
 
 void handleserverchange(int hooknum, void *arg) {
   long servernum;
-  int i;
+  nick **nicks;
+  int i, count;
   
   servernum=(long)arg;
   
@@ -156,33 +164,28 @@ void handleserverchange(int hooknum, void *arg) {
       break;
       
     case HOOK_SERVER_LOSTSERVER:
-      for (i=0;i<=serverlist[servernum].maxusernum;i++) {
+      nicks=(nick **)malloc((serverlist[servernum].maxusernum+1)*sizeof(nick *));
+      for (i=count=0;i<=serverlist[servernum].maxusernum;i++) {
         if (servernicks[servernum][i]!=NULL) {
-          deletenick(servernicks[servernum][i]);        
+          if (nicks)
+            nicks[count++]=servernicks[servernum][i];
+          else
+            deletenick(servernicks[servernum][i]);
         }
       }
+      if (nicks) {
+        deletenicks(nicks,count);
+        free(nicks);
+      }
       nsfree(POOL_NICK,servernicks[servernum]);
       break;
   }
 }
 
-/*
- * deletenick:
- *
- * This function handles the removal of a nick from the network 
- */
- 
-void deletenick(nick *np) {
+/* Unlinks a nick from its realname, host and account */
+static void unlinknick(nick *np) {
   nick **nh;
 
-  /* Fire a pre-lostnick trigger to allow hooks to check the channels etc. of a lost nick */
-  triggerhook(HOOK_NICK_PRE_LOSTNICK, np);
-
-  /* Fire the hook.  This will deal with removal from channels etc. */
-  triggerhook(HOOK_NICK_LOSTNICK, np);
-  
-  /* Release the realname and hostname parts */
-
   for (nh=&(np->realname->nicks);*nh;nh=&((*nh)->nextbyrealname)) {
     if (*nh==np) {
       *nh=np->nextbyrealname;
@@ -196,7 +199,19 @@ void deletenick(nick *np) {
       break;
     }
   }
-  
+
+  if (IsAccount(np) && np->auth) {
+    for (nh=&(np->auth->nicks);*nh;nh=&((*nh)->nextbyauthname)) {
+      if (*nh==np) {
+        *nh=np->nextbyauthname;
+        break;
+      }
+    }
+  }
+}
+
+/* Frees everything else, apart from its place in the IP tree */
+static void releasenick(nick *np) {
   releaserealname(np->realname);
   releasehost(np->host);
   
@@ -206,14 +221,6 @@ void deletenick(nick *np) {
         free(np->authname);
     } else {
       np->auth->usercount--;
-    
-      for (nh=&(np->auth->nicks);*nh;nh=&((*nh)->nextbyauthname)) {
-        if (*nh==np) {
-          *nh=np->nextbyauthname;
-          break;
-        }
-      }
-    
       releaseauthname(np->auth);
     }
   }
@@ -223,7 +230,6 @@ void deletenick(nick *np) {
   freesstring(np->opername); 
   freesstring(np->message);
 
-  node_decrement_usercount(np->ipnode);
   derefnode(iptree, np->ipnode);
   
   /* TODO: figure out how to cleanly remove nodes without affecting other modules */
@@ -241,6 +247,166 @@ void deletenick(nick *np) {
   freenick(np);
 }
 
+int nicksplitting;
+static nick **splitnicks;
+static int splitcount;
+
+/* A hook deleted one of the nicks being split off */
+static void nick_splitlost(nick *np) {
+  int i;
+
+  for (i=0;i<splitcount;i++) {
+    if (splitnicks[i]==np) {
+      splitnicks[i]=NULL;
+      break;
+    }
+  }
+}
+
+/*
+ * deletenick:
+ *
+ * This function handles the removal of a nick from the network 
+ */
+ 
+void deletenick(nick *np) {
+  nick_burstlost(np);
+
+  if (splitnicks)
+    nick_splitlost(np);
+
+  /* Fire a pre-lostnick trigger to allow hooks to check the channels etc. of a lost nick */
+  triggerhook(HOOK_NICK_PRE_LOSTNICK, np);
+
+  /* Fire the hook.  This will deal with removal from channels etc. */
+  triggerhook(HOOK_NICK_LOSTNICK, np);
+  
+  /* Release the realname and hostname parts */
+  unlinknick(np);
+
+  node_decrement_usercount(np->ipnode);
+  releasenick(np);
+}
+
+static int compareipnode(const void *a, const void *b) {
+  const nick *na=*(const nick **)a, *nb=*(const nick **)b;
+
+  if (na->ipnode==nb->ipnode)
+    return 0;
+
+  return ((unsigned long)na->ipnode<(unsigned long)nb->ipnode)?-1:1;
+}
+
+/*
+ * deletenicks:
+ *
+ * Removes a whole server's worth of nicks at once.  The hooks are as for
+ * deletenick() apart from HOOK_NICK_LOSTBATCH (see nick.h), and each
+ * realname, host, account and IP node is only walked once however many of
+ * its users are going.  The array is reordered.
+ */
+
+void deletenicks(nick **nicks, int count) {
+  nickbatch batch;
+  unsigned int marker, hostmarker, realnamemarker, authmarker;
+  nick *np, **nh;
+  int i, j;
+
+  if (!count)
+    return;
+
+  /* nothing can be left in a burst batch while we're freeing nicks */
+  for (i=0;i<count;i++)
+    nick_burstlost(nicks[i]);
+
+  /* can't be called from our own hooks: deleteserver() goes a server at a time */
+  if (splitnicks) {
+    for (i=0;i<count;i++)
+      deletenick(nicks[i]);
+    return;
+  }
+
+  splitnicks=nicks;
+  splitcount=count;
+
+  for (i=0;i<count;i++)
+    if (nicks[i])
+      triggerhook(HOOK_NICK_PRE_LOSTNICK, nicks[i]);
+
+  batch.nicks=nicks;
+  batch.count=count;
+  triggerhook(HOOK_NICK_LOSTBATCH, &batch);
+
+  nicksplitting=1;
+  for (i=0;i<count;i++)
+    if (nicks[i])
+      triggerhook(HOOK_NICK_LOSTNICK, nicks[i]);
+  nicksplitting=0;
+
+  splitnicks=NULL;
+  splitcount=0;
+
+  /* No hooks from here on: drop the NULLs, then mark the nicks and filter
+   * each list they're on in one pass. */
+  for (i=j=0;i<count;i++)
+    if (nicks[i])
+      nicks[j++]=nicks[i];
+  count=j;
+
+  marker=nextnickmarker();
+  for (i=0;i<count;i++)
+    nicks[i]->marker=marker;
+
+  realnamemarker=nextrealnamemarker();
+  hostmarker=nexthostmarker();
+  authmarker=nextauthnamemarker();
+
+  for (i=0;i<count;i++) {
+    np=nicks[i];
+
+    if (np->realname->marker!=realnamemarker) {
+      np->realname->marker=realnamemarker;
+      for (nh=&(np->realname->nicks);*nh;) {
+        if ((*nh)->marker==marker)
+          *nh=(*nh)->nextbyrealname;
+        else
+          nh=&((*nh)->nextbyrealname);
+      }
+    }
+
+    if (np->host->marker!=hostmarker) {
+      np->host->marker=hostmarker;
+      for (nh=&(np->host->nicks);*nh;) {
+        if ((*nh)->marker==marker)
+          *nh=(*nh)->nextbyhost;
+        else
+          nh=&((*nh)->nextbyhost);
+      }
+    }
+
+    if (IsAccount(np) && np->auth && np->auth->marker!=authmarker) {
+      np->auth->marker=authmarker;
+      for (nh=&(np->auth->nicks);*nh;) {
+        if ((*nh)->marker==marker)
+          *nh=(*nh)->nextbyauthname;
+        else
+          nh=&((*nh)->nextbyauthname);
+      }
+    }
+  }
+
+  /* clones share an IP node, so walk up the tree once for each of them */
+  qsort(nicks, count, sizeof(nick *), compareipnode);
+  for (i=0;i<count;i=j) {
+    for (j=i+1;j<count && nicks[j]->ipnode==nicks[i]->ipnode;j++)
+      ;
+    node_decrement_usercount_by(nicks[i]->ipnode, j-i);
+  }
+
+  for (i=0;i<count;i++)
+    releasenick(nicks[i]);
+}
+
 void addnicktohash(nick *np) {
   np->next=nicktable[nickhash(np->nick)];
   nicktable[nickhash(np->nick)]=np;
@@ -138,36 +138,54 @@ typedef struct realname {
   struct realname *next;
 } realname;
 
+/* Laid out so that what hash lookups need is in the first cache line and
+ * what full scans usually look at is in the second; rarely used fields come
+ * after that.  Nicks are allocated from cache line aligned slabs. */
 typedef struct nick {
-  char nick[NICKLEN+1];
+  /* lookups */
+  struct nick *next;
   long numeric;
-  char ident[USERLEN+1];
   host *host;
   realname *realname;
-  sstring *shident;  /* +h users: fake ident/host goes here */
-  sstring *sethost;
-  sstring *opername;
+  patricia_node_t *ipnode;
   flag_t umodes;
-  char *authname;
+  unsigned int marker;
+  char nick[NICKLEN+1];
+
+  /* scans */
+  char ident[USERLEN+1];
+  unsigned int cloak_count; /* fills the hole after ident */
+  struct irc_in_addr ipaddress;
   authname *auth; /* This requires User ID numbers to work */
+  char *authname;
   time_t timestamp;
+  array *channels;
+
   time_t accountts;
+  sstring *shident;  /* +h users: fake ident/host goes here */
+  sstring *sethost;
+  sstring *opername;
   sstring *away;
-  struct irc_in_addr ipaddress;
-  patricia_node_t *ipnode;
-  unsigned int cloak_count;
+  sstring *message;
   struct nick *cloak_extra;
-  unsigned int marker;
-  struct nick *next;
   struct nick *nextbyhost;
   struct nick *nextbyrealname;
   struct nick *nextbyauthname;
   /* These are extensions only used by other modules */
-  array *channels;
-  sstring *message;
   void *exts[MAXNICKEXTS];
 } nick;
 
+/* Visits every nick in the order they sit in memory, which for a full scan
+ * is much kinder to the cache than following nicktable's chains.  The order
+ * means nothing, and nicks mustn't be added or deleted along the way:
+ *
+ *   nickiter iter;
+ *   for (np=firstnick(&iter);np;np=nextnick(&iter))
+ */
+typedef struct nickiter {
+  unsigned int slab, index;
+} nickiter;
+
 #define NICKHASHSIZE      60000
 #define HOSTHASHSIZE      40000
 #define REALNAMEHASHSIZE  40000
@@ -180,6 +198,29 @@ extern const flag umodeflags[];
 extern const flag accountflags[];
 extern char *NULLAUTHNAME;
 
+/* Nicks introduced by a bursting server are handed out in batches: first
+ * HOOK_NICK_BURSTBATCH with the whole batch, then HOOK_NICK_NEWNICK for
+ * each nick with nickburstreplay set.  Nothing else has seen the nicks when
+ * the batch hook runs, so it's for lookups and bookkeeping only -- anything
+ * that could kill a user belongs in NEWNICK, where a module can use what it
+ * worked out for the batch.  Nicks which go away while the batch is being
+ * handed out are replaced by NULL. */
+#define NICKBURSTBATCH    4096
+
+typedef struct nickbatch {
+  nick **nicks;
+  int count;
+} nickbatch;
+
+extern int nickburstreplay;
+
+/* When a server goes, its users are removed together: HOOK_NICK_PRE_LOSTNICK
+ * for each of them, then HOOK_NICK_LOSTBATCH with the whole set, then
+ * HOOK_NICK_LOSTNICK for each with nicksplitting set.  A module which deals
+ * with the batch can skip the per-nick LOSTNICK.  Nicks deleted by a hook
+ * along the way are replaced by NULL. */
+extern int nicksplitting;
+
 #define MAXNUMERIC 0x3FFFFFFF
 
 #define homeserver(x)           (((x)>>18)&(MAXSERVERS-1))
@@ -197,12 +238,15 @@ realname *newrealname();
 void freerealname(realname *rn);
 nick *newnick();
 void freenick(nick *np);
+nick *firstnick(nickiter *iter);
+nick *nextnick(nickiter *iter);
 host *newhost();
 void freehost(host *hp);
 
 /* nick.c functions */
 void handleserverchange(int hooknum, void *arg);
 void deletenick(nick *np);
+void deletenicks(nick **nicks, int count);
 void addnicktohash(nick *np);
 void removenickfromhash(nick *np);
 nick *getnickbynick(const char *nick);
@@ -226,6 +270,8 @@ int handleprivmsg(void *source, int cargc, char **cargv);
 int handleawaymsg(void *source, int cargc, char **cargv);
 int handleaddcloak(void *source, int cargc, char **cargv);
 int handleclearcloak(void *source, int cargc, char **cargv);
+void nick_flushburst(void);
+void nick_burstlost(nick *np);
 
 /* These functions have been replaced by macros 
 nick **gethandlebynumeric(long numeric);
@@ -5,6 +5,7 @@
 
 #include <assert.h>
 #include <stdlib.h>
+#include <stdint.h>
 
 /* Hosts and realname structures are the same size */
 /* This assumption is checked in initnickalloc(); */
@@ -17,12 +18,71 @@ void freerealname(realname *rn) {
   freehost((host *)rn);
 }
 
+/* Nicks are carved out of slabs, a burst would otherwise be a malloc()
+ * per user.  Slabs are never given back, they're only freed with the pool.
+ * They start on a cache line, and free nicks have no host, so the slabs can
+ * be walked for a full scan. */
+#define NICKSLAB 1024
+#define CACHELINE 64
+
+static nick *freenicks;
+static nick **nickslabs;
+static unsigned int nickslabcount;
+
 nick *newnick() {
-  return nsmalloc(POOL_NICK, sizeof(nick));
+  nick *np, **slabs;
+  int i;
+
+  if (!freenicks) {
+    slabs=nsrealloc(POOL_NICK, nickslabs, (nickslabcount+1) * sizeof(nick *));
+    if (!slabs)
+      return NULL;
+    nickslabs=slabs;
+
+    np=nsmalloc(POOL_NICK, NICKSLAB * sizeof(nick) + CACHELINE - 1);
+    if (!np)
+      return NULL;
+
+    np=(nick *)(((uintptr_t)np + CACHELINE - 1) & ~(uintptr_t)(CACHELINE - 1));
+    nickslabs[nickslabcount++]=np;
+
+    for (i=NICKSLAB-1;i>=0;i--) {
+      np[i].host=NULL;
+      np[i].next=freenicks;
+      freenicks=&np[i];
+    }
+  }
+
+  np=freenicks;
+  freenicks=np->next;
+  return np;
 } 
 
 void freenick(nick *np) {
-  nsfree(POOL_NICK, np);
+  np->host=NULL;
+  np->next=freenicks;
+  freenicks=np;
+}
+
+nick *firstnick(nickiter *iter) {
+  iter->slab=0;
+  iter->index=0;
+
+  return nextnick(iter);
+}
+
+nick *nextnick(nickiter *iter) {
+  nick *np;
+
+  for (;iter->slab<nickslabcount;iter->slab++,iter->index=0) {
+    while (iter->index<NICKSLAB) {
+      np=&nickslabs[iter->slab][iter->index++];
+      if (np->host)
+        return np;
+    }
+  }
+
+  return NULL;
 }
 
 host *newhost() {
@@ -0,0 +1,198 @@
+/*
+  Builds a network's worth of nicks, churns them a bit so that they're no
+  longer in the order they were allocated, and times the kind of full scans
+  that trusts, glines and newsearch do, once following nicktable's chains
+  and once walking the slabs with firstnick()/nextnick().
+
+  make -C nick nickbench && nick/nickbench [nicks] [scans]
+*/
+
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <string.h>
+#include <time.h>
+
+#include "nick.h"
+#include "../core/error.h"
+#include "../core/nsmalloc.h"
+
+#define DEFAULTNICKS 1000000
+#define DEFAULTSCANS 10
+#define HOSTS        200000
+
+/* nick.o isn't linked in, so the table lives here */
+nick *nicktable[NICKHASHSIZE];
+
+static host *hosts;
+
+/* nsmalloc.o wants this, nothing should actually go wrong */
+void Error(char *source, int severity, char *reason, ...) {
+  va_list va;
+
+  va_start(va, reason);
+  fprintf(stderr, "%s: ", source);
+  vfprintf(stderr, reason, va);
+  fputc('\n', stderr);
+  va_end(va);
+
+  if (severity >= ERR_STOP)
+    exit(1);
+}
+
+static double now(void) {
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* xorshift, so every run sees exactly the same network */
+static unsigned int rnd(unsigned int *state) {
+  unsigned int x = *state;
+
+  x ^= x << 13;
+  x ^= x >> 17;
+  x ^= x << 5;
+  return *state = x;
+}
+
+static nick *addnick(unsigned int *state) {
+  nick *np = newnick();
+  unsigned int r = rnd(state);
+
+  if (!np)
+    Error("nickbench", ERR_STOP, "Out of memory.");
+
+  memset(np, 0, sizeof(nick));
+  np->numeric = r;
+  np->timestamp = 1000000000 + (r >> 8);
+  np->host = &hosts[rnd(state) % HOSTS];
+  np->host->clonecount++;
+  snprintf(np->nick, sizeof(np->nick), "nick%08x", r);
+  snprintf(np->ident, sizeof(np->ident), "%s%u", (r & 7) ? "user" : "~bot", r % 1000);
+
+  /* a handful of /16s, as if most users came from a few ISPs */
+  np->ipaddress.in6_16[5] = 65535;
+  np->ipaddress.in6_16[6] = (r % 64) << 8;
+  np->ipaddress.in6_16[7] = rnd(state);
+
+  if (r % 500 == 0)
+    SetOper(np);
+  if (r % 3 == 0)
+    SetAccount(np);
+
+  np->next = nicktable[np->numeric % NICKHASHSIZE];
+  nicktable[np->numeric % NICKHASHSIZE] = np;
+
+  return np;
+}
+
+static void delnick(nick *np) {
+  nick **nh;
+
+  for (nh = &nicktable[np->numeric % NICKHASHSIZE]; *nh != np; nh = &((*nh)->next))
+    ;
+
+  *nh = np->next;
+  np->host->clonecount--;
+  freenick(np);
+}
+
+/* The scans: one only touches the first cache line, the others the
+ * second and what the host points at, like trusts and glines do. */
+static unsigned long scanopers(nick *np, unsigned long acc) {
+  return acc + (IsOper(np) != 0);
+}
+
+static unsigned long scanprefix(nick *np, unsigned long acc) {
+  return acc + (np->ipaddress.in6_16[5] == 65535 && (np->ipaddress.in6_16[6] >> 8) == 42);
+}
+
+static unsigned long scanidents(nick *np, unsigned long acc) {
+  return acc + (np->ident[0] == '~' && np->host->clonecount > 5);
+}
+
+typedef struct scan {
+  const char *name;
+  unsigned long (*fn)(nick *, unsigned long);
+} scan;
+
+static const scan scans[] = {
+  { "opers (umodes)", scanopers },
+  { "ip prefix",      scanprefix },
+  { "~ident, clones", scanidents },
+};
+
+static void run(const scan *s, unsigned int count) {
+  unsigned long table = 0, slabs = 0;
+  double start, ttable, tslabs;
+  nickiter iter;
+  unsigned int i, j;
+  nick *np;
+
+  start = now();
+  for (i = 0; i < count; i++)
+    for (j = 0; j < NICKHASHSIZE; j++)
+      for (np = nicktable[j]; np; np = np->next)
+        table = s->fn(np, table);
+  ttable = (now() - start) / count;
+
+  start = now();
+  for (i = 0; i < count; i++)
+    for (np = firstnick(&iter); np; np = nextnick(&iter))
+      slabs = s->fn(np, slabs);
+  tslabs = (now() - start) / count;
+
+  if (table != slabs)
+    Error("nickbench", ERR_STOP, "%s: table scan found %lu, slab scan %lu.", s->name, table, slabs);
+
+  printf("  %-16s %8.2f ms table %8.2f ms slabs %9lu hits\n", s->name, ttable * 1000, tslabs * 1000, table / count);
+}
+
+int main(int argc, char **argv) {
+  unsigned int nicks = DEFAULTNICKS, count = DEFAULTSCANS, state = 12345, i, churn;
+  nick **all;
+
+  if (argc > 1)
+    nicks = atoi(argv[1]);
+  if (argc > 2)
+    count = atoi(argv[2]);
+
+  if (!nicks || !count) {
+    fprintf(stderr, "Usage: %s [nicks] [scans]\n", argv[0]);
+    return 1;
+  }
+
+  nsinit();
+
+  hosts = calloc(HOSTS, sizeof(host));
+  all = malloc(nicks * sizeof(nick *));
+  if (!hosts || !all)
+    Error("nickbench", ERR_STOP, "Out of memory.");
+
+  for (i = 0; i < nicks; i++)
+    all[i] = addnick(&state);
+
+  /* a third of them quit and come back, so the free list and the slabs
+   * are no longer in step */
+  churn = nicks / 3;
+  for (i = 0; i < churn; i++) {
+    unsigned int n = rnd(&state) % nicks;
+
+    delnick(all[n]);
+    all[n] = addnick(&state);
+  }
+
+  printf("%u nicks, %u byte nicks, average of %u scans:\n", nicks, (unsigned int)sizeof(nick), count);
+
+  for (i = 0; i < sizeof(scans) / sizeof(scans[0]); i++)
+    run(&scans[i], count);
+
+  free(all);
+  free(hosts);
+
+  return 0;
+}
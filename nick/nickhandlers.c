@@ -15,6 +15,66 @@
 #include <string.h>
 #include <stdint.h>
 
+static nick *burstnicks[NICKBURSTBATCH];
+static int burstcount, burstflushing;
+int nickburstreplay;
+
+/* Hands the held back nicks to the hooks; registered as a batch flush with
+ * the irc module, and called before anything that could touch them. */
+void nick_flushburst(void) {
+  nickbatch batch;
+  int i;
+
+  if (!burstcount || burstflushing)
+    return;
+
+  burstflushing=1;
+
+  batch.nicks=burstnicks;
+  batch.count=burstcount;
+  triggerhook(HOOK_NICK_BURSTBATCH,&batch);
+
+  nickburstreplay=1;
+  for (i=0;i<burstcount;i++)
+    if (burstnicks[i])
+      triggerhook(HOOK_NICK_NEWNICK,burstnicks[i]);
+  nickburstreplay=0;
+
+  burstcount=0;
+  burstflushing=0;
+}
+
+/* Called from deletenick(): a nick can't go away before it's been announced.
+ * Collisions flush the batch before deleting anything, so outside of a flush
+ * this is just a safety net. */
+void nick_burstlost(nick *np) {
+  int i;
+
+  if (!burstcount)
+    return;
+
+  if (!burstflushing) {
+    nick_flushburst();
+    return;
+  }
+
+  /* killed by a hook while the batch is being handed out */
+  for (i=0;i<burstcount;i++) {
+    if (burstnicks[i]==np) {
+      burstnicks[i]=NULL;
+      break;
+    }
+  }
+}
+
+static void burstnick(nick *np) {
+  burstnicks[burstcount++]=np;
+  irc_deferbatch();
+
+  if (burstcount==NICKBURSTBATCH)
+    nick_flushburst();
+}
+
 /*
  * handlenickmsg:
  *  Handle new nicks being introduced to the network.
@@ -38,6 +98,8 @@ int handlenickmsg(void *source, int cargc, char **cargv) {
     void *harg[2];
 
     /* Nyklon 1017697578 */
+    nick_flushburst();
+
     timestamp=strtol(cargv[1],NULL,10);
     np=getnickbynumericstr(sender);
     if (np==NULL) {
@@ -98,6 +160,12 @@ int handlenickmsg(void *source, int cargc, char **cargv) {
     /* Jupiler 2 1016645147 ~Jupiler www.iglobal.be +ir moo [FUTURE CRAP HERE] DV74O] BNBd7 :Jupiler */
     timestamp=strtol(cargv[2],NULL,10);
     np=getnickbynick(cargv[0]);
+    if (np!=NULL && burstcount) {
+      /* the loser might be waiting in the batch, and the batch's hooks
+       * could get rid of either of them */
+      nick_flushburst();
+      np=getnickbynick(cargv[0]);
+    }
     if (np!=NULL) {
       /* Nick collision */
       if (ircd_strcmp(np->ident,cargv[3]) || ircd_strcmp(np->host->name->content,cargv[4])) {
@@ -209,6 +277,9 @@ int handlenickmsg(void *source, int cargc, char **cargv) {
     }
     
     /* Place this nick in the server nick table.  Note that nh is valid from the numeric check above */
+    if (*nh && burstcount) {
+      nick_flushburst();
+    }
     if (*nh) {
       /* There was a nick there already -- we have a masked numeric collision
        * This shouldn't happen, but if it does the newer nick takes precedence
@@ -223,8 +294,13 @@ int handlenickmsg(void *source, int cargc, char **cargv) {
     /* And the nick hash table */
     addnicktohash(np);      
     
-    /* Trigger the hook */
-    triggerhook(HOOK_NICK_NEWNICK,np);
+    /* Trigger the hook, or hold it back for the batch if this is a burst */
+    if (serverlist[homeserver(np->numeric)].linkstate==LS_LINKING ||
+        serverlist[homeserver(np->numeric)].linkstate==LS_PLINKING) {
+      burstnick(np);
+    } else {
+      triggerhook(HOOK_NICK_NEWNICK,np);
+    }
   } else {
     Error("nick",ERR_WARNING,"Nick message with weird number of parameters (%d)",cargc);
   }
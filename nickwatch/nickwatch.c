@@ -1,5 +1,22 @@
+/*
+ * Watches are compiled once, when they are added, into newsearch nodes that
+ * stay around until the watch is removed.  Subexpressions that only look at
+ * the nick (no kill/gline/notice, no iterators or variables) are shared:
+ * every watch that contains (match (host) *.example.com) gets the same node,
+ * which remembers its result for the nick currently being looked at.  Each
+ * pending nick is then run past every watch in turn, so a common term is
+ * only evaluated once per nick however many watches use it.
+ *
+ * Watches with any other term (kill and gline only act when their node is
+ * freed, on the nicks they marked) are parsed, run over the round's nicks
+ * and freed again every round instead, as nicksearch would.
+ */
+
+#define _POSIX_C_SOURCE 199309L
+
 #include <stdarg.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 #include "../core/schedule.h"
 #include "../lib/irc_string.h"
@@ -10,6 +27,8 @@
 
 #define NW_FORMAT_TIME "%d/%m/%y %H:%M GMT"
 #define NW_DURATION_MAX (60*60*24*7) // 7 days
+#define NW_DISPLAY_LIMIT 10 // per watch and round
+#define NW_SHAREDHASHSIZE 256
 
 typedef struct nickwatch {
   int id;
@@ -21,6 +40,14 @@ typedef struct nickwatch {
   char term[512];
   parsertree *tree;
 
+  /* only for watches made up of nw_pureterms */
+  searchCtx ctx;
+  searchNode *node;
+  int shown;
+
+  unsigned long evaluations;
+  unsigned long long totalns;
+
   struct nickwatch *next;
 } nickwatch;
 
@@ -29,6 +56,29 @@ typedef struct nickwatchevent {
   struct nickwatchevent *next;
 } nickwatchevent;
 
+/* nick extension: where the nick is in nw_pendingnicks and what happened to it */
+typedef struct nickwatchpending {
+  int slot;
+  nickwatchevent *events;
+} nickwatchpending;
+
+/* localdata of a shared subexpression */
+typedef struct nickwatchshared {
+  searchNode *node;
+  searchNode *inner;
+  char *key;
+  int refcount;
+
+  unsigned int generation;
+  void *input;
+  void *result;
+
+  unsigned long hits;
+  unsigned long evaluations;
+
+  struct nickwatchshared *next;
+} nickwatchshared;
+
 static nickwatch *nickwatches;
 static int nextnickwatch = 1;
 static int nickwatchext;
@@ -39,6 +89,153 @@ static void nw_dummywall(int level, char *format, ...) { }
 static nickwatch *nw_currentwatch;
 static array nw_pendingnicks;
 
+static nickwatchshared *nw_shared[NW_SHAREDHASHSIZE];
+static int nw_sharedcount;
+static unsigned int nw_generation;
+
+/* Terms whose result only depends on the nick they're given. */
+static const char *nw_pureterms[] = {
+  "and", "not", "or", "eq", "lt", "gt", "match", "regex", "length",
+  "nick", "ident", "host", "hostmask", "realname", "away", "authname", "authts", "authid",
+  "modes", "timestamp", "channel", "channels", "country", "ip", "ipvsix", "cidr", "server", "age",
+  NULL
+};
+
+static int nw_ispure(searchASTExpr *expr) {
+  sstring *name;
+  int i;
+
+  if (expr->type == AST_NODE_LITERAL)
+    return 1;
+
+  name = getcommandname(reg_nicksearch->searchtree, (void *)expr->u.child.fn);
+  if (!name)
+    return 0;
+
+  for (i = 0; nw_pureterms[i]; i++)
+    if (!strcmp(name->content, nw_pureterms[i]))
+      break;
+
+  if (!nw_pureterms[i])
+    return 0;
+
+  for (i = 0; i < expr->u.child.argc; i++)
+    if (!nw_ispure(&expr->u.child.argv[i]))
+      return 0;
+
+  return 1;
+}
+
+static void *nw_shared_exe(searchCtx *ctx, searchNode *node, void *input) {
+  nickwatchshared *ns = node->localdata;
+
+  /* parse-time calls on constant nodes have no nick */
+  if (input && ns->generation == nw_generation && ns->input == input) {
+    ns->hits++;
+    return ns->result;
+  }
+
+  ns->evaluations++;
+  ns->result = (ns->inner->exe)(ctx, ns->inner, input);
+  ns->generation = nw_generation;
+  ns->input = input;
+
+  return ns->result;
+}
+
+static void nw_shared_free(searchCtx *ctx, searchNode *node) {
+  nickwatchshared *ns = node->localdata, **pnext;
+
+  if (--ns->refcount > 0)
+    return;
+
+  for (pnext = &nw_shared[irc_crc32(ns->key) % NW_SHAREDHASHSIZE]; *pnext; pnext = &((*pnext)->next)) {
+    if (*pnext == ns) {
+      *pnext = ns->next;
+      break;
+    }
+  }
+
+  nw_sharedcount--;
+
+  (ns->inner->free)(ctx, ns->inner);
+  free(ns->key);
+  free(ns);
+  free(node);
+}
+
+/* Parser for watches: hands out the existing node for a subexpression some
+ * other watch already has, otherwise parses it as usual. */
+static searchNode *nw_astparse(searchCtx *ctx, char *loc) {
+  searchASTExpr *expr = search_astexpr(ctx, loc);
+  nickwatchshared *ns;
+  searchNode *inner, *node;
+  char key[1024];
+  unsigned int hash;
+  size_t len;
+
+  if (!expr || expr->type != AST_NODE_CHILD || expr->u.child.argc == 0 || !nw_ispure(expr))
+    return search_astparse(ctx, loc);
+
+  key[0] = '\0';
+  ast_printtree(key, sizeof(key), expr, reg_nicksearch);
+  len = strlen(key);
+
+  /* a truncated key could match a different expression */
+  if (len >= sizeof(key) - 1)
+    return search_astparse(ctx, loc);
+
+  hash = irc_crc32(key) % NW_SHAREDHASHSIZE;
+
+  for (ns = nw_shared[hash]; ns; ns = ns->next) {
+    if (!strcmp(ns->key, key)) {
+      ns->refcount++;
+      return ns->node;
+    }
+  }
+
+  inner = search_astparse(ctx, loc);
+  if (!inner)
+    return NULL;
+
+  nsplan_optimise(ctx, inner);
+
+  node = malloc(sizeof(searchNode));
+  ns = malloc(sizeof(nickwatchshared));
+  if (ns)
+    ns->key = malloc(len + 1);
+
+  if (!node || !ns || !ns->key) {
+    parseError = "malloc: could not allocate memory for this search.";
+    if (ns)
+      free(ns->key);
+    free(ns);
+    free(node);
+    (inner->free)(ctx, inner);
+    return NULL;
+  }
+
+  memcpy(ns->key, key, len + 1);
+  ns->node = node;
+  ns->inner = inner;
+  ns->refcount = 1;
+  ns->generation = 0;
+  ns->input = NULL;
+  ns->result = NULL;
+  ns->hits = 0;
+  ns->evaluations = 0;
+  ns->next = nw_shared[hash];
+  nw_shared[hash] = ns;
+  nw_sharedcount++;
+
+  node->returntype = inner->returntype;
+  node->localdata = ns;
+  node->exe = nw_shared_exe;
+  node->free = nw_shared_free;
+
+  return node;
+}
+
 static int nw_nickunwatch(int id) {
   nickwatch **pnext, *nw;
 
@@ -46,6 +243,8 @@ static int nw_nickunwatch(int id) {
     nw = *pnext;
 
     if (nw->id == id) {
+      if (nw->node)
+        (nw->node->free)(&nw->ctx, nw->node);
       parse_free(nw->tree);
       *pnext = nw->next;
       free(nw);
@@ -59,7 +258,8 @@ static int nw_nickunwatch(int id) {
 static void nw_printnick(searchCtx *ctx, nick *sender, nick *np) {
   char hostbuf[HOSTLEN+NICKLEN+USERLEN+4], modebuf[34];
   char events[512];
-  nickwatchevent *nwe = np->exts[nickwatchext];
+  nickwatchpending *nwp = np->exts[nickwatchext];
+  nickwatchevent *nwe;
   int len;
 
   nw_currentwatch->hits++;
@@ -68,7 +268,7 @@ static void nw_printnick(searchCtx *ctx, nick *sender, nick *np) {
   events[0] = '\0';
   len = 0;
 
-  for (nwe = np->exts[nickwatchext]; nwe; nwe = nwe->next) {
+  for (nwe = nwp->events; nwe; nwe = nwe->next) {
     if (len > 0)
       len += snprintf(events + len, sizeof(events) - len, ", ");
 
@@ -82,9 +282,17 @@ static void nw_printnick(searchCtx *ctx, nick *sender, nick *np) {
 }
 
 static void nwe_enqueue(nick *np, const char *format, ...) {
+  nickwatchpending *nwp = np->exts[nickwatchext];
   nickwatchevent *nwe;
   va_list va;
-  int slot;
+
+  if (!nwp) {
+    nwp = malloc(sizeof(nickwatchpending));
+    nwp->slot = array_getfreeslot(&nw_pendingnicks);
+    nwp->events = NULL;
+    ((nick **)nw_pendingnicks.content)[nwp->slot] = np;
+    np->exts[nickwatchext] = nwp;
+  }
 
   nwe = malloc(sizeof(nickwatchevent));
 
@@ -92,34 +300,85 @@ static void nwe_enqueue(nick *np, const char *format, ...) {
   vsnprintf(nwe->description, sizeof(nwe->description), format, va);
   va_end(va);
 
-  nwe->next = np->exts[nickwatchext];
-  np->exts[nickwatchext] = nwe;
-
-  slot = array_getfreeslot(&nw_pendingnicks);
-  ((nick **)nw_pendingnicks.content)[slot] = np;
+  nwe->next = nwp->events;
+  nwp->events = nwe;
 }
 
 static void nwe_clear(nick *np) {
+  nickwatchpending *nwp = np->exts[nickwatchext];
   nickwatchevent *nwe, *next;
 
-  for (nwe = np->exts[nickwatchext]; nwe; nwe = next) {
+  if (!nwp)
+    return;
+
+  for (nwe = nwp->events; nwe; nwe = next) {
     next = nwe->next;
     free(nwe);
   }
 
+  ((nick **)nw_pendingnicks.content)[nwp->slot] = NULL;
+  free(nwp);
+
   np->exts[nickwatchext] = NULL;
 }
 
+static unsigned long long nw_nanoseconds(void) {
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (unsigned long long)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static void nw_evaluate(nick *np) {
+  nickwatch *nw;
+  unsigned long long start;
+  void *result;
+
+  /* invalidates every shared result */
+  nw_generation++;
+
+  for (nw = nickwatches; nw; nw = nw->next) {
+    if (!nw->node || nw->shown >= NW_DISPLAY_LIMIT)
+      continue;
+
+    start = nw_nanoseconds();
+    result = (nw->node->exe)(&nw->ctx, nw->node, np);
+    nw->totalns += nw_nanoseconds() - start;
+    nw->evaluations++;
+
+    if (result) {
+      nw_currentwatch = nw;
+      nw->shown++;
+      nw_printnick(&nw->ctx, mynick, np);
+    }
+  }
+}
+
 static void nw_sched_processevents(void *arg) {
   nickwatch *nw, *next;
-  int i, slot;
-  unsigned int marker;
+  unsigned long long start;
+  int i;
   nick *np;
-  array nicks;
   time_t now = time(NULL);
 
-  array_init(&nicks, sizeof(nick *));
-  marker = nextnickmarker();
+  senderNSExtern = mynick;
+
+  for (nw = nickwatches; nw; nw = nw->next) {
+    nw->ctx.sender = mynick;
+    nw->shown = 0;
+  }
+
+  /* cleared slots are NULL, which nicksearch skips */
+  for (nw = nickwatches; nw; nw = nw->next) {
+    if (nw->node)
+      continue;
+
+    nw_currentwatch = nw;
+    start = nw_nanoseconds();
+    ast_nicksearch(nw->tree->root, &nw_dummyreply, mynick, &nw_dummywall, &nw_printnick, NULL, NULL, NW_DISPLAY_LIMIT, &nw_pendingnicks);
+    nw->totalns += nw_nanoseconds() - start;
+    nw->evaluations++;
+  }
 
   for (i = 0; i < nw_pendingnicks.cursi; i++) {
     np = ((nick **)nw_pendingnicks.content)[i];
@@ -127,32 +386,22 @@ static void nw_sched_processevents(void *arg) {
     if (!np)
       continue;
 
-    if (np->marker != marker) {
-      np->marker = marker;
-      slot = array_getfreeslot(&nicks);
-      ((nick **)nicks.content)[slot] = np;
-    }
+    if (nickwatches)
+      nw_evaluate(np);
+
+    nwe_clear(np);
   }
 
   array_free(&nw_pendingnicks);
   array_init(&nw_pendingnicks, sizeof(nick *));
 
   for (nw = nickwatches; nw; nw = next) {
-    nw_currentwatch = nw;
     next = nw->next;
-    ast_nicksearch(nw->tree->root, &nw_dummyreply, mynick, &nw_dummywall, &nw_printnick, NULL, NULL, 10, &nicks);
     if (nw->expiry && nw->expiry <= now) {
       controlwall(NO_OPER, NL_HITS, "nickwatch(#%d) by %s expired (%d hits): %s", nw->id, nw->createdby, nw->hits, nw->term);
       nw_nickunwatch(nw->id);
     }
   }
-
-  for (i = 0; i < nicks.cursi; i++) {
-    np = ((nick **)nicks.content)[i];
-    nwe_clear(np);
-  }
-
-  array_free(&nicks);
 }
 
 static void nw_hook_newnick(int hooknum, void *arg) {
@@ -167,13 +416,8 @@ static void nw_hook_account(int hooknum, void *arg) {
 
 static void nw_hook_lostnick(int hooknum, void *arg) {
   nick *np = arg;
-  int i;
 
   nwe_clear(np);
-
-  for (i = 0; i < nw_pendingnicks.cursi; i++)
-    if (((nick **)nw_pendingnicks.content)[i] == np)
-      ((nick **)nw_pendingnicks.content)[i] = NULL;
 }
 
 static void nw_hook_rename(int hooknum, void *arg) {
@@ -206,6 +450,27 @@ static void nw_hook_joinchannel(int hooknum, void *arg) {
   nwe_enqueue(np, "join channel %s", cp->index->name->content);
 }
 
+static int nw_compile(nickwatch *nw) {
+  searchASTCache cache;
+
+  memset(&cache, 0, sizeof(cache));
+  cache.tree = nw->tree->root;
+
+  newsearch_ctxinit(&nw->ctx, nw_astparse, nw_dummyreply, nw_dummywall, &cache, reg_nicksearch, mynick, &nw_printnick, NW_DISPLAY_LIMIT, NULL);
+
+  nw->node = coerceNode(&nw->ctx, nw->ctx.parser(&nw->ctx, (char *)nw->tree->root), RETURNTYPE_BOOL);
+
+  /* the cache only lives as long as this call */
+  nw->ctx.arg = NULL;
+
+  if (!nw->node)
+    return 0;
+
+  nsplan_optimise(&nw->ctx, nw->node);
+
+  return 1;
+}
+
 static int nw_cmd_nickwatch(void *source, int cargc, char **cargv) {
   nick *sender = source;
   nickwatch *nw;
@@ -249,6 +514,18 @@ static int nw_cmd_nickwatch(void *source, int cargc, char **cargv) {
   nw->expiry = duration + time(NULL);
   strncpy(nw->term, cargv[i], sizeof(nw->term));
   nw->tree = tree;
+  nw->shown = 0;
+  nw->evaluations = 0;
+  nw->totalns = 0;
+  nw->node = NULL;
+
+  if (nw_ispure(tree->root) && !nw_compile(nw)) {
+    controlreply(sender, "Parse error: %s", parseError);
+    parse_free(tree);
+    free(nw);
+    return CMD_ERROR;
+  }
+
   nw->next = nickwatches;
   nickwatches = nw;
 
@@ -286,16 +563,30 @@ static void nw_formattime(time_t time, char *buf, size_t bufsize) {
 static int nw_cmd_nickwatches(void *source, int cargc, char **cargv) {
   nick *sender = source;
   nickwatch *nw;
+  nickwatchshared *ns;
   char timebuf1[20], timebuf2[20];
+  unsigned long hits = 0, evaluations = 0;
+  int i;
 
-  controlreply(sender, "ID    Created By      Hits    Expires            Last active        Term");
+  controlreply(sender, "ID    Created By      Hits    Expires            Last active        Total ms  Avg us  Term");
 
   for (nw = nickwatches; nw; nw = nw->next) {
     nw_formattime(nw->expiry, timebuf1, sizeof(timebuf1));
     nw_formattime(nw->lastactive, timebuf2, sizeof(timebuf2));
-    controlreply(sender, "%-5d %-15s %-7d %-18s %-18s %s", nw->id, nw->createdby, nw->hits, timebuf1, timebuf2, nw->term);
+    controlreply(sender, "%-5d %-15s %-7d %-18s %-18s %-9llu %-7.2f %s", nw->id, nw->createdby, nw->hits, timebuf1, timebuf2,
+                 nw->totalns / 1000000, nw->evaluations ? (double)nw->totalns / nw->evaluations / 1000 : 0.0, nw->term);
+  }
+
+  for (i = 0; i < NW_SHAREDHASHSIZE; i++) {
+    for (ns = nw_shared[i]; ns; ns = ns->next) {
+      hits += ns->hits;
+      evaluations += ns->evaluations;
+    }
   }
 
+  controlreply(sender, "Shared subexpressions: %d, evaluated %lu times, reused %lu times (%.1f%%).", nw_sharedcount, evaluations, hits,
+               (hits + evaluations) ? 100.0 * hits / (hits + evaluations) : 0.0);
+  controlreply(sender, "Time is spent by the first watch to need a shared subexpression for a nick.");
   controlreply(sender, "--- End of nickwatches.");
 
   return CMD_OK;
@@ -350,6 +641,8 @@ void _fini(void) {
   for (nw = nickwatches; nw; nw = next) {
     next = nw->next;
 
+    if (nw->node)
+      (nw->node->free)(&nw->ctx, nw->node);
     parse_free(nw->tree);
     free(nw);
   }
@@ -0,0 +1,481 @@
+/*
+ * nsmprofile: the control side of nsmalloc's allocation profiling.
+ *
+ * The per pool counters are always there; this samples them every minute
+ * for rates and every hour for a month of history, so slow growth can be
+ * pinned on a pool.  Turning profiling on charges every allocation to the
+ * code that made it, which is what says which module is responsible, and
+ * sampling records stack traces for pools where the direct caller is a
+ * wrapper (sstrings, arrays) or for the allocations that never get freed.
+ *
+ * Anything allocated with plain malloc() doesn't go through any of this;
+ * it shows up as the difference between the heap and the pools.
+ */
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdarg.h>
+#include <errno.h>
+#include <time.h>
+#include <dlfcn.h>
+#include <malloc.h>
+#include <unistd.h>
+
+#include "../core/nsmalloc.h"
+#include "../core/schedule.h"
+#include "../core/config.h"
+#include "../core/error.h"
+#include "../core/modules.h"
+#include "../control/control.h"
+#include "../lib/irc_string.h"
+#include "../lib/strlfunc.h"
+#include "nsmstats.h"
+
+#define NSMP_HISTORY   (24 * 31)  /* hourly samples */
+#define NSMP_MAXLINES  2000       /* most lines any list sends to a user */
+
+typedef struct nsmout {
+  nick *np;
+  FILE *fp;
+} nsmout;
+
+/* heap and RSS, in the last two columns of the history */
+#define NSMP_HEAP MAXPOOL
+#define NSMP_RSS  (MAXPOOL + 1)
+
+static unsigned long lastallocs[MAXPOOL], lastfrees[MAXPOOL];
+static double allocrate[MAXPOOL], freerate[MAXPOOL];
+static time_t lastsample;
+static int minutes;
+
+static unsigned int (*history)[MAXPOOL + 2];  /* KB */
+static time_t historytime[NSMP_HISTORY];
+static int historyhead, historycount;
+
+static void *minutesched;
+
+static int nsmprofile(void *sender, int cargc, char **cargv);
+
+static void nsmout_printf(nsmout *o, char *format, ...) {
+  char buf[512];
+  va_list va;
+
+  va_start(va, format);
+  vsnprintf(buf, sizeof(buf), format, va);
+  va_end(va);
+
+  if (o->fp)
+    fprintf(o->fp, "%s\n", buf);
+  else
+    controlreply(o->np, "%s", buf);
+}
+
+static const char *poolname(unsigned int poolid) {
+  return (poolid < MAXPOOL && nsmpoolnames[poolid]) ? nsmpoolnames[poolid] : "??";
+}
+
+static size_t heapinuse(void) {
+#if defined(__GLIBC__) && (__GLIBC__ > 2 || (__GLIBC__ == 2 && __GLIBC_MINOR__ >= 33))
+  struct mallinfo2 mi = mallinfo2();
+
+  return mi.uordblks + mi.hblkhd;
+#else
+  return 0;
+#endif
+}
+
+static size_t residentsize(void) {
+  unsigned long pages, resident;
+  FILE *fp;
+
+  if (!(fp = fopen("/proc/self/statm", "r")))
+    return 0;
+
+  if (fscanf(fp, "%lu %lu", &pages, &resident) != 2)
+    resident = 0;
+
+  fclose(fp);
+  return (size_t)resident * sysconf(_SC_PAGESIZE);
+}
+
+static void nsmprofile_sample(void *arg) {
+  time_t now = time(NULL);
+  double elapsed = now - lastsample;
+  unsigned int *row;
+  int i;
+
+  for (i = 0; i < MAXPOOL; i++) {
+    if (lastsample && elapsed > 0) {
+      allocrate[i] = (nsmpools[i].allocs - lastallocs[i]) * 60 / elapsed;
+      freerate[i] = (nsmpools[i].frees - lastfrees[i]) * 60 / elapsed;
+    }
+
+    lastallocs[i] = nsmpools[i].allocs;
+    lastfrees[i] = nsmpools[i].frees;
+  }
+
+  lastsample = now;
+
+  if (minutes++ % 60 || !history)
+    return;
+
+  row = history[historyhead];
+  for (i = 0; i < MAXPOOL; i++)
+    row[i] = nsmpools[i].size / 1024;
+  row[NSMP_HEAP] = heapinuse() / 1024;
+  row[NSMP_RSS] = residentsize() / 1024;
+
+  historytime[historyhead] = now;
+  historyhead = (historyhead + 1) % NSMP_HISTORY;
+  if (historycount < NSMP_HISTORY)
+    historycount++;
+}
+
+void nsmprofile_init(void) {
+  sstring *s;
+
+  if ((s = getconfigitem("nsmstats", "profile")) && atoi(s->content))
+    nsmprofiling = 1;
+
+  if ((s = getconfigitem("nsmstats", "samplesize")))
+    nsmsamplesize = strtoul(s->content, NULL, 10);
+
+  history = calloc(NSMP_HISTORY, sizeof(*history));
+
+  nsmprofile_sample(NULL);
+  minutesched = schedulerecurring(time(NULL) + 60, 0, 60, &nsmprofile_sample, NULL);
+
+  registercontrolhelpcmd("nsmprofile", NO_DEVELOPER, 3, &nsmprofile,
+    "Usage: nsmprofile <on|off|reset|pools|sizes|sites|modules|stacks|growth|sample|samplesize|dump> [args]\n"
+    "Allocation profiling for nsmalloc pools.\n"
+    " on|off|reset          - charge allocations to their callers (and forget what's been charged)\n"
+    " pools                 - per pool live, peak and allocs/frees per minute, plus heap and RSS\n"
+    " sizes <pool>          - allocations by power of two size class\n"
+    " sites [pool] [count]  - callsites with the most bytes live (profiling)\n"
+    " modules               - live bytes by module (profiling)\n"
+    " stacks [count]        - sampled stack traces with what's still live from them\n"
+    " growth [hours]        - what each pool, the heap and RSS have grown by\n"
+    " sample <pool|all> <n> - sample a stack every n allocations (0 to stop)\n"
+    " samplesize <bytes>    - also sample every allocation at least this big (0 to stop)\n"
+    " dump <file>           - write all of the above to a file");
+}
+
+void nsmprofile_fini(void) {
+  deregistercontrolcmd("nsmprofile", &nsmprofile);
+  deleteschedule(minutesched, &nsmprofile_sample, NULL);
+  free(history);
+}
+
+static void showpools(nsmout *o) {
+  size_t pooled = 0, heap = heapinuse(), rss = residentsize();
+  int i;
+
+  for (i = 0; i < MAXPOOL; i++)
+    pooled += nsmpools[i].size;
+
+  nsmout_printf(o, "RSS %zuKb, heap %zuKb, pooled %zuKb, not pooled %zuKb.  Profiling is %s.", rss / 1024, heap / 1024,
+    pooled / 1024, heap > pooled ? (heap - pooled) / 1024 : 0, nsmprofiling ? "on" : "off");
+  nsmout_printf(o, "%-3s %-12s %10s %10s %10s %10s %9s %9s %12s %6s", "Id", "Pool", "Items", "Live Kb", "Peak items", "Peak Kb",
+    "Allocs/m", "Frees/m", "Allocs", "Sample");
+
+  for (i = 0; i < MAXPOOL; i++) {
+    struct nsmpool *p = &nsmpools[i];
+
+    if (!p->allocs)
+      continue;
+
+    nsmout_printf(o, "%-3d %-12s %10lu %10zu %10lu %10zu %9.0f %9.0f %12lu %6u", i, poolname(i), p->count, p->size / 1024, p->peakcount,
+      p->peaksize / 1024, allocrate[i], freerate[i], p->allocs, p->sampleevery);
+  }
+}
+
+static void showsizes(nsmout *o, unsigned int poolid) {
+  struct nsmpool *p = &nsmpools[poolid];
+  int i;
+
+  nsmout_printf(o, "Pool %u (%s) by size class:", poolid, poolname(poolid));
+  nsmout_printf(o, "%10s %12s %10s", "Up to", "Allocs", "Live");
+
+  for (i = 0; i < NSM_SIZECLASSES; i++) {
+    if (!p->classallocs[i])
+      continue;
+
+    if (i == NSM_SIZECLASSES - 1)
+      nsmout_printf(o, "%10s %12lu %10lu", "more", p->classallocs[i], p->classlive[i]);
+    else
+      nsmout_printf(o, "%10lu %12lu %10lu", 16UL << i, p->classallocs[i], p->classlive[i]);
+  }
+}
+
+/* "module:symbol+offset", as near as dladdr can get */
+static const char *describe(void *addr) {
+  static char buf[128];
+  Dl_info info;
+
+  if (!dladdr(addr, &info) || !info.dli_fname)
+    return (snprintf(buf, sizeof(buf), "%p", addr), buf);
+
+  if (info.dli_sname)
+    snprintf(buf, sizeof(buf), "%s:%s+%#lx", modulenamefromaddr(addr), info.dli_sname,
+      (unsigned long)((char *)addr - (char *)info.dli_saddr));
+  else
+    snprintf(buf, sizeof(buf), "%s:+%#lx", modulenamefromaddr(addr), (unsigned long)((char *)addr - (char *)info.dli_fbase));
+
+  return buf;
+}
+
+static int sitecompare(const void *a, const void *b) {
+  const struct nsmsite *sa = &nsmsites[*(const unsigned int *)a], *sb = &nsmsites[*(const unsigned int *)b];
+
+  return (sa->size < sb->size) - (sa->size > sb->size);
+}
+
+static void showsites(nsmout *o, int poolid, int count) {
+  unsigned int order[NSM_MAXSITES], i, n = 0;
+  struct nsmsite *sp;
+
+  for (i = 1; i < nsmsitecount; i++)
+    if (poolid < 0 || nsmsites[i].poolid == poolid)
+      order[n++] = i;
+
+  if (!n) {
+    nsmout_printf(o, "No callsites recorded%s.", nsmprofiling ? " yet" : " (profiling is off)");
+    return;
+  }
+
+  qsort(order, n, sizeof(unsigned int), sitecompare);
+
+  nsmout_printf(o, "%-12s %10s %10s %10s %12s %12s  %s", "Pool", "Live", "Live Kb", "Peak Kb", "Allocs", "Frees", "Caller");
+  for (i = 0; i < n && i < count; i++) {
+    sp = &nsmsites[order[i]];
+    nsmout_printf(o, "%-12s %10lu %10zu %10zu %12lu %12lu  %s", poolname(sp->poolid), sp->count, sp->size / 1024, sp->peaksize / 1024,
+      sp->allocs, sp->frees, describe(sp->caller));
+  }
+
+  nsmout_printf(o, "End of list (%u of %u callsites%s).", (i < n) ? i : n, n, (nsmsitecount == NSM_MAXSITES) ? ", table full" : "");
+}
+
+typedef struct moduletotal {
+  char name[64];
+  unsigned long count;
+  size_t size;
+} moduletotal;
+
+static int modulecompare(const void *a, const void *b) {
+  const moduletotal *ma = a, *mb = b;
+
+  return (ma->size < mb->size) - (ma->size > mb->size);
+}
+
+static void showmodules(nsmout *o) {
+  moduletotal *totals;
+  size_t charged = 0, pooled = 0, heap = heapinuse();
+  unsigned int i, j, n = 0;
+  const char *name;
+
+  if (nsmsitecount == 1) {
+    nsmout_printf(o, "No callsites recorded%s.", nsmprofiling ? " yet" : " (profiling is off)");
+    return;
+  }
+
+  if (!(totals = calloc(nsmsitecount, sizeof(moduletotal)))) {
+    nsmout_printf(o, "Out of memory.");
+    return;
+  }
+
+  for (i = 1; i < nsmsitecount; i++) {
+    name = modulenamefromaddr(nsmsites[i].caller);
+
+    for (j = 0; j < n && strcmp(totals[j].name, name); j++)
+      ;
+    if (j == n)
+      strlcpy(totals[n++].name, name, sizeof(totals[0].name));
+
+    totals[j].count += nsmsites[i].count;
+    totals[j].size += nsmsites[i].size;
+    charged += nsmsites[i].size;
+  }
+
+  qsort(totals, n, sizeof(moduletotal), modulecompare);
+
+  for (i = 0; i < MAXPOOL; i++)
+    pooled += nsmpools[i].size;
+
+  nsmout_printf(o, "%-20s %10s %10s", "Module", "Live", "Live Kb");
+  for (i = 0; i < n; i++)
+    nsmout_printf(o, "%-20s %10lu %10zu", totals[i].name, totals[i].count, totals[i].size / 1024);
+
+  nsmout_printf(o, "%-20s %10s %10zu", "(pooled, uncharged)", "", pooled > charged ? (pooled - charged) / 1024 : 0);
+  nsmout_printf(o, "%-20s %10s %10zu", "(not pooled)", "", heap > pooled ? (heap - pooled) / 1024 : 0);
+
+  free(totals);
+}
+
+static int stackcompare(const void *a, const void *b) {
+  const struct nsmstack *sa = &nsmstacks[*(const unsigned int *)a], *sb = &nsmstacks[*(const unsigned int *)b];
+
+  return (sa->size < sb->size) - (sa->size > sb->size);
+}
+
+static void showstacks(nsmout *o, int count) {
+  unsigned int order[NSM_MAXSTACKS], i, n = 0;
+  struct nsmstack *st;
+  int f;
+
+  for (i = 1; i < nsmstackcount; i++)
+    order[n++] = i;
+
+  if (!n) {
+    nsmout_printf(o, "No stacks sampled (see nsmprofile sample/samplesize).");
+    return;
+  }
+
+  qsort(order, n, sizeof(unsigned int), stackcompare);
+
+  for (i = 0; i < n && i < count; i++) {
+    st = &nsmstacks[order[i]];
+    nsmout_printf(o, "Pool %s: %lu sampled, %lu (%zuKb) still live:", poolname(st->poolid), st->samples, st->count, st->size / 1024);
+
+    for (f = 0; f < st->depth; f++)
+      nsmout_printf(o, "  %s", describe(st->frames[f]));
+  }
+
+  nsmout_printf(o, "End of list (%u of %u stacks%s).", (i < n) ? i : n, n, (nsmstackcount == NSM_MAXSTACKS) ? ", table full" : "");
+}
+
+static void showgrowth(nsmout *o, int hours) {
+  unsigned int *then, now[MAXPOOL + 2];
+  int i, back;
+
+  if (!history || !historycount) {
+    nsmout_printf(o, "No history yet, the first sample is taken an hour after loading.");
+    return;
+  }
+
+  back = (hours < historycount) ? hours : historycount;
+  then = history[(historyhead - back + NSMP_HISTORY) % NSMP_HISTORY];
+
+  for (i = 0; i < MAXPOOL; i++)
+    now[i] = nsmpools[i].size / 1024;
+  now[NSMP_HEAP] = heapinuse() / 1024;
+  now[NSMP_RSS] = residentsize() / 1024;
+
+  nsmout_printf(o, "Growth over the last %d hour%s:", back, back == 1 ? "" : "s");
+  nsmout_printf(o, "%-12s %10s %10s %10s", "", "Then Kb", "Now Kb", "Change Kb");
+  nsmout_printf(o, "%-12s %10u %10u %+10ld", "RSS", then[NSMP_RSS], now[NSMP_RSS], (long)now[NSMP_RSS] - (long)then[NSMP_RSS]);
+  nsmout_printf(o, "%-12s %10u %10u %+10ld", "heap", then[NSMP_HEAP], now[NSMP_HEAP], (long)now[NSMP_HEAP] - (long)then[NSMP_HEAP]);
+
+  for (i = 0; i < MAXPOOL; i++)
+    if (then[i] || now[i])
+      nsmout_printf(o, "%-12s %10u %10u %+10ld", poolname(i), then[i], now[i], (long)now[i] - (long)then[i]);
+}
+
+static int dump(char *filename) {
+  nsmout o = { NULL, NULL };
+  int i;
+
+  if (!(o.fp = fopen(filename, "w")))
+    return -1;
+
+  nsmout_printf(&o, "nsmalloc profile at %ld", (long)time(NULL));
+  nsmout_printf(&o, "%s", "");
+  showpools(&o);
+
+  for (i = 0; i < MAXPOOL; i++) {
+    if (nsmpools[i].allocs) {
+      nsmout_printf(&o, "%s", "");
+      showsizes(&o, i);
+    }
+  }
+
+  nsmout_printf(&o, "%s", "");
+  showmodules(&o);
+  nsmout_printf(&o, "%s", "");
+  showsites(&o, -1, NSM_MAXSITES);
+  nsmout_printf(&o, "%s", "");
+  showstacks(&o, NSM_MAXSTACKS);
+  nsmout_printf(&o, "%s", "");
+  showgrowth(&o, NSMP_HISTORY);
+
+  return fclose(o.fp);
+}
+
+static int nsmprofile(void *sender, int cargc, char **cargv) {
+  nick *np = (nick *)sender;
+  nsmout o = { np, NULL };
+  unsigned int poolid, every;
+  int count;
+
+  if (cargc < 1)
+    return CMD_USAGE;
+
+  if (!ircd_strcmp(cargv[0], "on") || !ircd_strcmp(cargv[0], "off")) {
+    nsmprofiling = !ircd_strcmp(cargv[0], "on");
+    controlwall(NO_DEVELOPER, NL_OPERATIONS, "%s switched allocation profiling %s.", controlid(np), nsmprofiling ? "on" : "off");
+    controlreply(np, "Allocation profiling is now %s.", nsmprofiling ? "on" : "off");
+  } else if (!ircd_strcmp(cargv[0], "reset")) {
+    nsmresetprofile();
+    controlreply(np, "Callsites and stacks forgotten.");
+  } else if (!ircd_strcmp(cargv[0], "pools")) {
+    showpools(&o);
+  } else if (!ircd_strcmp(cargv[0], "sizes")) {
+    if (cargc < 2 || (poolid = atoi(cargv[1])) >= MAXPOOL)
+      return CMD_USAGE;
+    showsizes(&o, poolid);
+  } else if (!ircd_strcmp(cargv[0], "sites")) {
+    count = (cargc > 2) ? atoi(cargv[2]) : 20;
+    if (count < 1 || count > NSMP_MAXLINES)
+      return CMD_USAGE;
+    showsites(&o, (cargc > 1 && strcmp(cargv[1], "all")) ? atoi(cargv[1]) : -1, count);
+  } else if (!ircd_strcmp(cargv[0], "modules")) {
+    showmodules(&o);
+  } else if (!ircd_strcmp(cargv[0], "stacks")) {
+    count = (cargc > 1) ? atoi(cargv[1]) : 10;
+    if (count < 1 || count > NSMP_MAXLINES / NSM_STACKDEPTH)
+      return CMD_USAGE;
+    showstacks(&o, count);
+  } else if (!ircd_strcmp(cargv[0], "growth")) {
+    count = (cargc > 1) ? atoi(cargv[1]) : 24;
+    if (count < 1)
+      return CMD_USAGE;
+    showgrowth(&o, count);
+  } else if (!ircd_strcmp(cargv[0], "sample")) {
+    if (cargc < 3)
+      return CMD_USAGE;
+
+    every = atoi(cargv[2]);
+    if (!ircd_strcmp(cargv[1], "all")) {
+      for (poolid = 0; poolid < MAXPOOL; poolid++)
+        nsmpools[poolid].sampleevery = every;
+    } else if ((poolid = atoi(cargv[1])) < MAXPOOL) {
+      nsmpools[poolid].sampleevery = every;
+    } else {
+      return CMD_USAGE;
+    }
+
+    controlreply(np, "Done.%s", nsmprofiling ? "" : "  Nothing is sampled while profiling is off.");
+  } else if (!ircd_strcmp(cargv[0], "samplesize")) {
+    if (cargc < 2)
+      return CMD_USAGE;
+
+    nsmsamplesize = strtoul(cargv[1], NULL, 10);
+    controlreply(np, "Done.%s", nsmprofiling ? "" : "  Nothing is sampled while profiling is off.");
+  } else if (!ircd_strcmp(cargv[0], "dump")) {
+    if (cargc < 2)
+      return CMD_USAGE;
+
+    if (dump(cargv[1])) {
+      controlreply(np, "Unable to write %s: %s", cargv[1], strerror(errno));
+      return CMD_ERROR;
+    }
+
+    controlreply(np, "Profile written to %s.", cargv[1]);
+  } else {
+    return CMD_USAGE;
+  }
+
+  return CMD_OK;
+}
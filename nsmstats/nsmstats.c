@@ -7,6 +7,7 @@
 #include "../core/hooks.h"
 #include "../control/control.h"
 #include "../lib/version.h"
+#include "nsmstats.h"
 
 MODULE_VERSION("");
 
@@ -16,11 +17,13 @@ int nsmhistogram(void *sender, int cargc, char **cargv);
 void _init(void) {
   registerhook(HOOK_CORE_STATSREQUEST, &nsmstats);
   registercontrolhelpcmd("nsmhistogram", NO_DEVELOPER,1,&nsmhistogram,"Usage: nsmhistogram [pool id]\nDisplays memory information for given pool.");
+  nsmprofile_init();
 }
 
 void _fini(void) {
   deregisterhook(HOOK_CORE_STATSREQUEST, &nsmstats);
   deregistercontrolcmd("nsmhistogram", &nsmhistogram);
+  nsmprofile_fini();
 }
 
 static char *formatmbuf(unsigned long count, size_t size, size_t realsize) {
@@ -37,7 +40,7 @@ void nsmgenstats(struct nsmpool *pool, double *mean, double *stddev) {
   *mean = (double)pool->size / pool->count;
 
   for (np=pool->blocks;np;np=np->next)
-    sumsq+=np->size * np->size;
+    sumsq+=(unsigned long long)np->size * np->size;
 
   *stddev = sqrtf((double)sumsq / pool->count - *mean * *mean);
 }
@@ -68,7 +71,7 @@ void nsmstats(int hookhum, void *arg) {
         double mean, stddev;
         nsmgenstats(pool, &mean, &stddev);
 
-        snprintf(extra, sizeof(extra), ", mean: %.2fKb stddev: %.2fKb", mean / 1024, stddev / 1024);
+        snprintf(extra, sizeof(extra), ", mean: %.2fKb stddev: %.2fKb, peak: %lu items %luKb", mean / 1024, stddev / 1024, pool->peakcount, (unsigned long)pool->peaksize / 1024);
       }
 
       snprintf(buf, sizeof(buf), "NSMalloc: pool %2d (%10s): %s%s", i, nsmpoolnames[i]?nsmpoolnames[i]:"??", formatmbuf(pool->count, pool->size, realsize), extra);
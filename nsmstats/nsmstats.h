@@ -0,0 +1,7 @@
+#ifndef __NSMSTATS_H
+#define __NSMSTATS_H
+
+void nsmprofile_init(void);
+void nsmprofile_fini(void);
+
+#endif
@@ -11,11 +11,12 @@
 #include <stdlib.h>
 #include <unistd.h>
 #include <string.h>
-#include <limits.h>
 #include <stdarg.h>
 #include <netinet/in.h>
+#include <sys/uio.h>
 
 #include "../core/events.h"
+#include "../core/schedule.h"
 
 struct esocket *socklist = NULL;
 char signal_set = 0;
@@ -23,6 +24,10 @@ unsigned short token = 1;
 
 void sigpipe_handler(int moo) { }
 
+static int esocket_flush(struct esocket *sock);
+static void esocket_pump(struct esocket *sock);
+static void esocket_flush_event(void *arg);
+
 unsigned short esocket_token(void) {
   return token++;
 }
@@ -75,7 +80,9 @@ struct esocket *esocket_add(int fd, char socket_type, struct esocket_events *eve
 
   newsock->out.head = NULL;
   newsock->out.end = NULL;
-  newsock->out.count = 0;
+  newsock->out.bytes = 0;
+  newsock->out.blocked = 0;
+  newsock->out.flushsched = NULL;
   newsock->token = token;
   newsock->tag = NULL;
   
@@ -143,10 +150,7 @@ void esocket_poll_event(int fd, short events) {
         return;
       }
       if(events & POLLOUT) { /* flush buffer */
-        if(esocket_raw_write(active, NULL, 0)) {
-          esocket_disconnect(active);
-          return;
-        }
+        esocket_pump(active);
         return;
       }
       if(events & POLLIN) { /* read buffer */
@@ -170,7 +174,7 @@ void esocket_disconnect(struct esocket *active) {
 
   for(;p;l=p,p=p->next)
     if(p == active) {
-      struct esocket_packet *pkt = p->out.head, *npkt;
+      struct esocket_out_chunk *c = p->out.head, *nc;
       if(l) {
         l->next = p->next;
       } else {
@@ -180,11 +184,12 @@ void esocket_disconnect(struct esocket *active) {
 
       deregisterhandler(p->fd, 1);
 
-      for(;pkt;) {
-        npkt = pkt->next;
-        ntfree(pkt->line);
-        ntfree(pkt);
-        pkt = npkt;
+      if(p->out.flushsched)
+        deleteschedule(p->out.flushsched, esocket_flush_event, p);
+
+      for(;c;c=nc) {
+        nc = c->next;
+        ntfree(c);
       }
 
       if(p->in.data)
@@ -198,7 +203,7 @@ void esocket_disconnect(struct esocket *active) {
 }
 
 void esocket_disconnect_when_complete(struct esocket *active) {
-  if(active->out.count) {
+  if(active->out.bytes) {
     active->socket_status = ST_BLANK;
   } else {
     esocket_disconnect(active);
@@ -342,127 +347,167 @@ int esocket_read(struct esocket *sock) {
   return 0;
 }
 
-struct esocket_packet *esocket_new_packet(struct esocket_out_buffer *buf, char *buffer, int bytes) {
-  struct esocket_packet *nw;
+/* Returns room for bytes more output at the end of the buffer, which
+ * esocket_commit then adds, or NULL if the buffer's full. */
+static char *esocket_reserve(struct esocket_out_buffer *buf, int bytes) {
+  struct esocket_out_chunk *c = buf->end;
+  int size;
 
-  if(buf->count == MAX_OUT_QUEUE_SIZE)
+  if(buf->bytes + bytes > MAX_OUT_BUFFER_SIZE)
     return NULL;
 
-  nw = ntmalloc(sizeof(struct esocket_packet));
-  if(!nw)
-    return NULL;
+  if(c && (c->size - c->end >= bytes))
+    return c->data + c->end;
 
-  nw->line = ntmalloc(bytes);
-  if(!nw->line) {
-    ntfree(nw);
+  size = (bytes > OUT_CHUNK_SIZE) ? bytes : OUT_CHUNK_SIZE;
+  c = ntmalloc(sizeof(struct esocket_out_chunk) + size);
+  if(!c)
     return NULL;
-  }
 
-  if(!buf->head) {
-    buf->head = nw;
+  c->next = NULL;
+  c->size = size;
+  c->start = 0;
+  c->end = 0;
+
+  if(buf->end) {
+    buf->end->next = c;
   } else {
-    buf->end->next = nw;
+    buf->head = c;
   }
+  buf->end = c;
 
-  buf->end = nw;
-
-  nw->next = NULL;
-  nw->size = bytes;
-  nw->startpos = 0;
+  return c->data;
+}
 
-  memcpy(nw->line, buffer, bytes);
+static void esocket_commit(struct esocket_out_buffer *buf, int bytes) {
+  buf->end->end+=bytes;
+  buf->bytes+=bytes;
+}
 
-  buf->count++;
+static void esocket_setblocked(struct esocket *sock, int blocked) {
+  sock->out.blocked = blocked;
 
-  return nw;
+  deregisterhandler(sock->fd, 0);
+  registerhandler(sock->fd, (blocked ? POLLOUT : POLLIN) | POLLERR | POLLHUP, esocket_poll_event);
 }
 
-int esocket_raw_write(struct esocket *sock, char *buffer, int bytes) {
+/* Writes out as much of the buffer as the socket will take, returning 1
+ * on error.  Never disconnects the socket itself. */
+static int esocket_flush(struct esocket *sock) {
   struct esocket_out_buffer *buf = &sock->out;
+  struct esocket_out_chunk *c, *nc;
+  struct iovec iov[OUT_MAX_IOV];
+  int n, ret, avail;
+
+  while(buf->bytes) {
+    for(n=0,c=buf->head;c && n<OUT_MAX_IOV;c=c->next) {
+      if(c->end == c->start)
+        continue;
+
+      iov[n].iov_base = c->data + c->start;
+      iov[n].iov_len = c->end - c->start;
+      n++;
+    }
 
-  if((bytes > USHRT_MAX) || (!buffer && bytes) || (buffer && !bytes))
-    return 1;
-
-  if(bytes) { /* if we're not flushing */
-    if(buf->count) { /* if we're currently blocked */
-      if(!esocket_new_packet(buf, buffer, bytes))
-        return 1;
-      return 0;
-    } else { /* not currently blocked */
-      int ret;
-      for(;;) {
-        ret = write(sock->fd, buffer, bytes);
-        if(ret == bytes) {
+    ret = writev(sock->fd, iov, n);
+    if(ret == -1) {
+      switch(errno) {
+        case EINTR:
+          continue;
+        case EAGAIN: /* wait for POLLOUT */
+          if(!buf->blocked)
+            esocket_setblocked(sock, 1);
           return 0;
-        } else if(ret == -1) { /* something bad happened */
-          switch(errno) {
-            case EAGAIN: /* was going to block, store the data in the buffer */
-              if(!esocket_new_packet(buf, buffer, bytes))
-                return 1;
-
-              deregisterhandler(sock->fd, 0); /* now we need to ignore the socket until it's unblocked */
-              registerhandler(sock->fd, POLLOUT | POLLERR | POLLHUP, esocket_poll_event);
-
-              return 0;
-              break;
-            case EPIPE: /* if there's some weird code disconnect the socket */
-            default:
-              return 1;
-              break;
-          }
-        } else { /* less than total was written, try again */
-          buffer+=ret;
-          bytes-=ret;
-        }
+        case EPIPE:
+        default:
+          return 1;
       }
     }
-  } else if(buf->count) { /* if we're just flushing the buffer */
-    int ret;
-    for(;;) {
-      ret = write(sock->fd, buf->head->line + buf->head->startpos, buf->head->size);
-      if(!ret) {
-        return 0;
-      } else if(ret == buf->head->size) {
-        struct esocket_packet *p = buf->head;
-        buf->head = buf->head->next;
-
-        ntfree(p->line);
-        ntfree(p);
-
-        buf->count--;
-        if(!buf->head) { /* if we've exhausted the buffer */
-          buf->end = NULL;
-
-          if(sock->socket_status == ST_BLANK) {
-            esocket_disconnect(sock);
-          } else {
-            deregisterhandler(sock->fd, 0);
-
-            registerhandler(sock->fd, POLLIN | POLLERR | POLLHUP, esocket_poll_event);
-          }
-          return 0;
-        }
-      } else if(ret == -1) {
-        switch(errno) {
-          case EAGAIN: /* was going to block, wait until we're called again */
-            return 0;
-            break;
-
-          case EPIPE: /* if there's some weird code disconnect the socket */
-          default:
-            return 1;
-            break;
-        }
-      } else {
-        buf->head->startpos+=ret;
-        buf->head->size-=ret;
+
+    buf->bytes-=ret;
+    for(c=buf->head;ret>0;c=c->next) {
+      avail = c->end - c->start;
+      if(ret < avail) {
+        c->start+=ret;
+        break;
       }
+
+      c->start = c->end;
+      ret-=avail;
     }
-    return 0;
+
+    while(buf->head != buf->end && buf->head->start == buf->head->end) {
+      c = buf->head;
+      buf->head = c->next;
+      ntfree(c);
+    }
+  }
+
+  /* all gone */
+  for(c=buf->head;c;c=nc) {
+    nc = c->next;
+    ntfree(c);
   }
+  buf->head = buf->end = NULL;
+
+  if(buf->blocked)
+    esocket_setblocked(sock, 0);
 
-  /* something went wrong */
-  return 1;
+  return 0;
+}
+
+/* Flushes from the event loop, where we're allowed to get rid of the socket. */
+static void esocket_pump(struct esocket *sock) {
+  if(esocket_flush(sock)) {
+    esocket_disconnect(sock);
+    return;
+  }
+
+  if(!sock->out.bytes && (sock->socket_status == ST_BLANK))
+    esocket_disconnect(sock);
+}
+
+static void esocket_flush_event(void *arg) {
+  struct esocket *sock = arg;
+
+  sock->out.flushsched = NULL;
+  esocket_pump(sock);
+}
+
+/* Called after output is added: writes now if there's plenty pending,
+ * otherwise makes sure it goes out at the end of this loop iteration. */
+static int esocket_queued(struct esocket *sock) {
+  struct esocket_out_buffer *buf = &sock->out;
+
+  if(buf->blocked)
+    return 0;
+
+  if((buf->bytes >= OUT_FLUSH_SIZE) && (sock->socket_status != ST_BLANK))
+    return esocket_flush(sock);
+
+  if(!buf->flushsched)
+    buf->flushsched = scheduleoneshot(time(NULL), esocket_flush_event, sock);
+
+  return 0;
+}
+
+int esocket_raw_write(struct esocket *sock, char *buffer, int bytes) {
+  char *p;
+
+  if((!buffer && bytes) || (buffer && !bytes))
+    return 1;
+
+  if(!bytes) /* just flushing */
+    return esocket_flush(sock);
+
+  p = esocket_reserve(&sock->out, bytes);
+  if(!p)
+    return 1;
+
+  memcpy(p, buffer, bytes);
+  esocket_commit(&sock->out, bytes);
+
+  return esocket_queued(sock);
 }
 
 int esocket_write(struct esocket *sock, char *buffer, int bytes) {
@@ -470,37 +515,36 @@ int esocket_write(struct esocket *sock, char *buffer, int bytes) {
   if(sock->in.mode == PARSE_ASCII) {
     ret = esocket_raw_write(sock, buffer, bytes);
   } else {
-    unsigned char newbuf[MAX_BUFSIZE + USED_MAC_LEN], *p = newbuf, hmacdigest[32];
+    unsigned char *p, hmacdigest[32];
     hmacsha256 hmac;
     int padding = 16 - bytes % 16, i;
 
     if(padding == 16)
       padding = 0;
 
-    memcpy(newbuf, buffer, bytes);
-    for(i=0;i<padding;i++)
-      newbuf[bytes + i] = i;
-    bytes+=padding;
-
-    hmacsha256_init(&hmac, sock->serverhmackey, 32);
-    seqno_update(&hmac, sock->serverseqno);
-    sock->serverseqno++;
+    /* encrypt straight into the output buffer */
+    p = (unsigned char *)esocket_reserve(&sock->out, bytes + padding + USED_MAC_LEN);
+    if(!p) {
+      ret = 1;
+    } else {
+      memcpy(p, buffer, bytes);
+      for(i=0;i<padding;i++)
+        p[bytes + i] = i;
+      bytes+=padding;
 
-    i = bytes;
-    while(i) {
-      unsigned char *ct = rijndaelcbc_encrypt(sock->servercrypto, p);
-      hmacsha256_update(&hmac, ct, 16);
-      memcpy(p, ct, 16);
+      hmac = sock->serverhmacbase;
+      seqno_update(&hmac, sock->serverseqno);
+      sock->serverseqno++;
 
-      buffer+=16;
-      p+=16;
-      i-=16;
-    }
+      rijndaelcbc_encrypt_blocks(sock->servercrypto, p, p, bytes / 16);
+      hmacsha256_update(&hmac, p, bytes);
 
-    hmacsha256_final(&hmac, hmacdigest);
-    memcpy(p, hmacdigest, USED_MAC_LEN);
+      hmacsha256_final(&hmac, hmacdigest);
+      memcpy(p + bytes, hmacdigest, USED_MAC_LEN);
 
-    ret = esocket_raw_write(sock, (char *)newbuf, bytes + USED_MAC_LEN);
+      esocket_commit(&sock->out, bytes + USED_MAC_LEN);
+      ret = esocket_queued(sock);
+    }
   }
 
   /* AWOOGA!! */
@@ -544,6 +588,7 @@ void rekey_esocket(struct esocket *sock, unsigned char *serveriv, unsigned char
   derive_key(key, sock->serverrawkey, sock->serverkeyno, (unsigned char *)":SKEY", 5);
   sock->servercrypto = rijndaelcbc_init(key, 256, serveriv, 0);
   derive_key(sock->serverhmackey, sock->serverrawkey, sock->serverkeyno, (unsigned char *)":SHMAC", 6);
+  hmacsha256_init(&sock->serverhmacbase, sock->serverhmackey, 32);
   sock->serverkeyno++;
 
   derive_key(key, sock->clientrawkey, sock->clientkeyno, (unsigned char *)":CKEY", 5);
@@ -51,7 +51,10 @@ typedef unsigned short packet_t;
 #define MAX_BINARY_LINE_SIZE MAX_BUFSIZE
 #define MAX_ASCII_LINE_SIZE  MAX_BINARY_LINE_SIZE - 10 - USED_MAC_LEN
 
-#define MAX_OUT_QUEUE_SIZE   5000
+#define OUT_CHUNK_SIZE       16384
+#define OUT_FLUSH_SIZE       65536 /* write immediately once this much is pending */
+#define OUT_MAX_IOV          64
+#define MAX_OUT_BUFFER_SIZE  (16 * 1024 * 1024)
 
 struct buffer;
 struct esocket;
@@ -69,17 +72,23 @@ typedef struct esocket_in_buffer {
   short mac;
 } in_buffer;
 
-typedef struct esocket_packet {
-  char *line;
-  packet_t size;
-  packet_t startpos;
-  struct esocket_packet *next;
-} esocket_packet;
+/* Output is appended to a chain of chunks and written out with writev, at
+ * the end of the current loop iteration or as soon as OUT_FLUSH_SIZE bytes
+ * are pending, so a burst of lines costs a handful of syscalls. */
+typedef struct esocket_out_chunk {
+  struct esocket_out_chunk *next;
+  int size;
+  int start;
+  int end;
+  char data[];
+} esocket_out_chunk;
 
 typedef struct esocket_out_buffer {
-  struct esocket_packet *head;
-  struct esocket_packet *end;
-  unsigned short count;
+  struct esocket_out_chunk *head;
+  struct esocket_out_chunk *end;
+  unsigned int bytes;
+  char blocked;
+  void *flushsched;
 } out_buffer;
 
 typedef void (*esocket_event)(struct esocket *socket);
@@ -108,6 +117,7 @@ typedef struct esocket {
   u_int64_t clientkeyno, serverkeyno;
 
   hmacsha256 clienthmac;
+  hmacsha256 serverhmacbase; /* keyed with serverhmackey, copied for each line */
   rijndaelcbc *clientcrypto;
   rijndaelcbc *servercrypto;
 } esocket;
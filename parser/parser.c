@@ -1,5 +1,7 @@
 /* parser.c */
 
+#define _POSIX_C_SOURCE 199309L
+
 #include "parser.h"
 #include "../lib/sstring.h"
 #include "../lib/irc_string.h"
@@ -9,12 +11,17 @@
 #include <string.h>
 #include <ctype.h>
 #include <stdio.h>
+#include <time.h>
 
 /* Local functions */
 int insertcommand(Command *c, CommandTree *ct, int depth);
 int deletecommand(sstring *cmdname, CommandTree *ct, int depth, CommandHandler handler);
 Command *findcommand(CommandTree *ct, const char *command, int depth);
 int countcommandtree(CommandTree *ct);
+static void freecommand(Command *c);
+
+int commandprofiling;
+CommandProfile *commandprofiles;
 
 /* newcommandtree:
  *
@@ -46,16 +53,40 @@ void destroycommandtree(CommandTree *ct) {
     }
   }
 
-  if(ct->cmd) {
-    if(ct->cmd->command)
-      freesstring(ct->cmd->command);
-    if(ct->cmd->ext && ct->cmd->destroyext)
-      (ct->cmd->destroyext)(ct->cmd->ext);
-    free(ct->cmd);
-  } 
+  if(ct->cmd)
+    freecommand(ct->cmd);
+
   free(ct);
 }
 
+static void unlinkcommandprofile(CommandProfile *p) {
+  if (p->prev)
+    p->prev->next=p->next;
+  else
+    commandprofiles=p->next;
+
+  if (p->next)
+    p->next->prev=p->prev;
+
+  free(p);
+}
+
+static void freecommand(Command *c) {
+  if (c->profile) {
+    /* profilecommand() frees it once the handler returns */
+    if (c->profile->running)
+      c->profile->command=NULL;
+    else
+      unlinkcommandprofile(c->profile);
+  }
+
+  if(c->command)
+    freesstring(c->command);
+  if(c->ext && c->destroyext)
+    (c->destroyext)(c->ext);
+  free(c);
+}
+
 /* countcommandtree:
  *
  * This returns the number of commands registered in
@@ -131,6 +162,7 @@ Command *addcommandexttotree(CommandTree *ct, const char *cmdname, int level, in
   nc->ext=NULL;
   nc->next=NULL;
   nc->calls=0;
+  nc->profile=NULL;
   nc->destroyext=NULL;
 
   if ((c=findcommandintree(ct,cmdname,1))!=NULL) {
@@ -235,10 +267,7 @@ int deletecommand(sstring *cmdname, CommandTree *ct, int depth, CommandHandler h
       if ((*ch)->handler==handler) {
         c=*ch;
         (*ch)=(Command *)((*ch)->next);
-        freesstring(c->command);
-        if(c->ext && c->destroyext)
-          (c->destroyext)(c->ext);
-        free(c);
+        freecommand(c);
         return 0;
       }
     }
@@ -254,10 +283,7 @@ int deletecommand(sstring *cmdname, CommandTree *ct, int depth, CommandHandler h
       if ((*ch)->handler==handler) {
         c=*ch;
         (*ch)=(Command *)((*ch)->next);
-        freesstring(c->command);
-        if(c->ext && c->destroyext)
-          (c->destroyext)(c->ext);
-        free(c);
+        freecommand(c);
 
         /* We need to regenerate the final pointer if needed;
          * if ct->cmd is still pointing to a command it has the same name.
@@ -378,3 +404,71 @@ sstring *getcommandname(CommandTree *ct, CommandHandler handler) {
 
   return NULL;
 }
+
+/*
+ * profilecommand: calls a command's handler and records how long it took.
+ *
+ * Used by callcommand() when commandprofiling is set.  The handler may
+ * delete its own command (e.g. by unloading the module that owns it), in
+ * which case the profile outlives it until we get back here.
+ */
+
+int profilecommand(Command *c, void *source, int cargc, char **cargv) {
+  CommandProfile *p;
+  struct timespec start, end;
+  unsigned long long ns, us;
+  int ret, bucket;
+
+  c->calls++;
+
+  if (!(p=c->profile)) {
+    if (!(p=calloc(1,sizeof(CommandProfile))))
+      return (c->handler)(source,cargc,cargv);
+
+    p->command=c;
+    p->next=commandprofiles;
+    if (commandprofiles)
+      commandprofiles->prev=p;
+    commandprofiles=p;
+    c->profile=p;
+  }
+
+  p->running++;
+  clock_gettime(CLOCK_MONOTONIC,&start);
+
+  ret=(c->handler)(source,cargc,cargv);
+
+  clock_gettime(CLOCK_MONOTONIC,&end);
+  p->running--;
+
+  ns=(end.tv_sec-start.tv_sec)*1000000000ULL+end.tv_nsec-start.tv_nsec;
+
+  p->calls++;
+  p->totalns+=ns;
+  if (ns>p->maxns)
+    p->maxns=ns;
+
+  for (bucket=0,us=ns/1000;us && bucket<CMDPROFILE_BUCKETS-1;us>>=1)
+    bucket++;
+  p->histogram[bucket]++;
+
+  if (!p->command && !p->running)
+    unlinkcommandprofile(p);
+
+  return ret;
+}
+
+/*
+ * resetcommandprofiles: zeroes the timings for every command.
+ */
+
+void resetcommandprofiles() {
+  CommandProfile *p;
+
+  for (p=commandprofiles;p;p=p->next) {
+    p->calls=0;
+    p->totalns=0;
+    p->maxns=0;
+    memset(p->histogram,0,sizeof(p->histogram));
+  }
+}
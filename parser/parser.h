@@ -31,6 +31,20 @@
 
 typedef int (*CommandHandler)(void *, int, char**);
 typedef void (*DestroyExt)(void *); 
+
+/* Handler times are bucketed by powers of two microseconds: bucket 0 is
+ * under 1us, bucket n is [2^(n-1), 2^n) and the last one catches the rest. */
+#define CMDPROFILE_BUCKETS  24
+
+typedef struct CommandProfile {
+  struct Command *command;       /* NULL if deleted while its handler ran */
+  unsigned int    running;       /* Calls in progress (handlers can recurse) */
+  unsigned long   calls;         /* Calls timed since the last reset */
+  unsigned long long totalns;    /* Total time spent in the handler */
+  unsigned long long maxns;      /* Slowest call */
+  unsigned int    histogram[CMDPROFILE_BUCKETS];
+  struct CommandProfile *next, *prev;
+} CommandProfile;
  
 typedef struct Command {
   sstring        *command;       /* Name of the command/token/thing */
@@ -40,6 +54,7 @@ typedef struct Command {
   void           *ext;           /* Pointer to some arbitrary other data */
   DestroyExt      destroyext;    /* Function to destroy ->ext on destroycommandtree (if necessary) */
   unsigned int    calls;         /* How many times this command has been called */
+  CommandProfile *profile;       /* Timings, allocated on the first profiled call */
   struct Command *next;          /* Next handler chained onto this command */
 } Command;
   
@@ -59,4 +74,16 @@ sstring *getcommandname(CommandTree *ct, CommandHandler handler);
 
 #define addcommandtotree(a, b, c, d, e) addcommandexttotree(a, b, c, d, e, NULL)
 
+extern int commandprofiling;
+extern CommandProfile *commandprofiles;
+
+int profilecommand(Command *c, void *source, int cargc, char **cargv);
+void resetcommandprofiles();
+
+/* Calls a command's handler, timing it if profiling is switched on.
+ * Everything that dispatches commands should go through here. */
+#define callcommand(c, source, cargc, cargv) \
+  (commandprofiling ? profilecommand((c), (source), (cargc), (cargv)) : \
+                      ((c)->calls++, ((c)->handler)((source), (cargc), (cargv))))
+
 #endif
@@ -634,6 +634,18 @@ void node_decrement_usercount( patricia_node_t *node) {
   }
 }
 
+/* for several users leaving the same node at once */
+void node_decrement_usercount_by( patricia_node_t *node, int count) {
+#ifdef LEAK_DETECTION
+  node = getrealnode(node);
+#endif
+
+  while(node) {
+    node->usercount-=count;
+    node=node->parent;
+  }
+}
+
 int is_normalized_ipmask( struct irc_in_addr *sin, unsigned char bitlen ) {
   u_char *addr = (u_char *)sin;
 
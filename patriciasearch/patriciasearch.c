@@ -59,7 +59,7 @@ int do_pnodesearch_real(replyFunc reply, wallFunc wall, void *source, int cargc,
     return CMD_OK;
   }
 
-  ret = parseopts(cargc, cargv, &arg, &limit, (void *)&subset, (void *)&display, reg_nodesearch->outputtree, reply, sender);
+  ret = parseopts(cargc, cargv, &arg, &limit, (void *)&subset, NULL, (void *)&display, reg_nodesearch->outputtree, reply, sender);
   if(ret != CMD_OK)
     return ret;
 
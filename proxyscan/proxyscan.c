@@ -421,7 +421,7 @@ void proxyscanuserhandler(nick *target, int message, void **params) {
         cargc = (ps_command->maxparams) + 1;
       }
 
-      (ps_command->handler)((void *)sender, cargc - 1, &(cargv[1]));
+      callcommand(ps_command, (void *)sender, cargc - 1, &(cargv[1]));
       break;
     }
 
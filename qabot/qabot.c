@@ -291,7 +291,7 @@ void qabot_handler(nick* me, int type, void** args) {
       cargc=(cmd->maxparams) + 1;
     }
     
-    (cmd->handler)((void*)sender, cargc - 1, &(cargv[1]));
+    callcommand(cmd, (void*)sender, cargc - 1, &(cargv[1]));
 
     break;
 
@@ -359,7 +359,7 @@ void qabot_child_handler(nick* me, int type, void** args) {
       qabot_currentbot = bot;
       qabot_currentchan = cp;
       
-      (cmd->handler)((void*)sender, cargc - 1, &(cargv[1]));
+      callcommand(cmd, (void*)sender, cargc - 1, &(cargv[1]));
     }
     else if ((*text != '!') && (bot->micnumeric == sender->numeric) && (cp->index == bot->staff_chan)) {
       bot->lastmic = time(NULL);
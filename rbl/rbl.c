@@ -24,6 +24,8 @@ int registerrbl(const char *name, const rbl_ops *ops, void *udata) {
   instance->name = getsstring(name, 255);
   instance->ops = ops;
   instance->udata = udata;
+  instance->lookups = 0;
+  instance->hits = 0;
 
   instance->next = rbl_instances;
   rbl_instances = instance;
@@ -51,6 +53,18 @@ void deregisterrblbyops(const rbl_ops *ops) {
   }
 }
 
+int rbl_lookup(rbl_instance *rbl, struct irc_in_addr *ip, char *message, size_t msglen) {
+  int result;
+
+  result = rbl->ops->lookup(rbl, ip, message, msglen);
+
+  rbl->lookups++;
+  if (result > 0)
+    rbl->hits++;
+
+  return result;
+}
+
 static void rbl_sched_refresh(void *uarg) {
   rbl_instance *rbl;
 
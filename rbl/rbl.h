@@ -7,12 +7,16 @@ typedef struct rbl_ops {
   int (*lookup)(struct rbl_instance *rbl, struct irc_in_addr *ip, char *message, size_t msglen);
   int (*refresh)(struct rbl_instance *rbl);
   void (*dtor)(struct rbl_instance *rbl);
+  /* optional, describes the backend's current state */
+  void (*info)(struct rbl_instance *rbl, char *buf, size_t buflen);
 } rbl_ops;
 
 typedef struct rbl_instance {
   sstring *name;
   const rbl_ops *ops;
   void *udata;
+  unsigned long lookups;
+  unsigned long hits;
   struct rbl_instance *next;
 } rbl_instance;
 
@@ -20,8 +24,9 @@ extern rbl_instance *rbl_instances;
 
 int registerrbl(const char *name, const rbl_ops *ops, void *udata);
 void deregisterrblbyops(const rbl_ops *ops);
+int rbl_lookup(rbl_instance *rbl, struct irc_in_addr *ip, char *message, size_t msglen);
 
-#define RBL_LOOKUP(rbl, ip, msg, msglen) rbl->ops->lookup(rbl, ip, msg, msglen)
+#define RBL_LOOKUP(rbl, ip, msg, msglen) rbl_lookup(rbl, ip, msg, msglen)
 #define RBL_REFRESH(rbl) rbl->ops->refresh(rbl)
 #define RBL_DTOR(rbl) rbl->ops->dtor(rbl)
 
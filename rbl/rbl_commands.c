@@ -39,8 +39,16 @@ static int rbl_cmdlistrbl(void *source, int cargc, char **cargv) {
   nick *sender = source;
   rbl_instance *rbl;
 
-  for (rbl = rbl_instances; rbl; rbl = rbl->next)
-    controlreply(sender, "%s", rbl->name->content);
+  for (rbl = rbl_instances; rbl; rbl = rbl->next) {
+    char info[255];
+
+    info[0] = '\0';
+    if (rbl->ops->info)
+      rbl->ops->info(rbl, info, sizeof(info));
+
+    controlreply(sender, "%s: %lu lookups, %lu hits (%.1f%%)%s%s", rbl->name->content, rbl->lookups, rbl->hits,
+                 rbl->lookups ? (100.0 * rbl->hits / rbl->lookups) : 0.0, info[0] ? ", " : "", info);
+  }
 
   controlreply(sender, "End of list.");
 
@@ -49,7 +57,7 @@ static int rbl_cmdlistrbl(void *source, int cargc, char **cargv) {
 
 void _init(void) {
   registercontrolhelpcmd("lookuprbl", NO_OPER, 1, &rbl_cmdlookuprbl, "Usage: lookuprbl <IP>\nLooks up whether RBL records exist for the specified IP address.");
-  registercontrolhelpcmd("listrbl", NO_OPER, 0, &rbl_cmdlistrbl, "Usage: listrbl\nLists RBLs.");
+  registercontrolhelpcmd("listrbl", NO_OPER, 0, &rbl_cmdlistrbl, "Usage: listrbl\nLists RBLs along with their lookup statistics.");
 }
 
 void _fini(void) {
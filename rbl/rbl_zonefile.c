@@ -1,6 +1,17 @@
+#define _POSIX_C_SOURCE 200809L
+
 #include <string.h>
 #include <stdio.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
 #include "../core/hooks.h"
+#include "../core/schedule.h"
 #include "../control/control.h"
 #include "../irc/irc.h"
 #include "../lib/irc_string.h"
@@ -10,168 +21,732 @@
 
 MODULE_VERSION("");
 
-static int rbl_zf_cmpip(const struct irc_in_addr *a, const struct irc_in_addr *b) {
-  for (int i = 0; i < 8; i++) {
-    if (ntohs(a->in6_16[i]) < ntohs(b->in6_16[i]))
-      return -1;
-    else if (ntohs(a->in6_16[i]) > ntohs(b->in6_16[i]))
-      return 1;
+#define RBL_ZF_PAD(x) (((x) + 7) & ~(size_t)7)
+
+typedef struct rbl_zf_key {
+  uint64_t hi;
+  uint64_t lo;
+} rbl_zf_key;
+
+/* A zone line, as seen by the compiler. */
+typedef struct rbl_zf_centry {
+  rbl_zf_key start;
+  rbl_zf_key end;
+  unsigned char bits;
+  uint32_t value;
+} rbl_zf_centry;
+
+/* A compiled range table, before it's written out. */
+typedef struct rbl_zf_ctable {
+  rbl_zf_key *start;
+  uint32_t *value;
+  uint32_t count;
+  uint32_t size;
+} rbl_zf_ctable;
+
+typedef struct rbl_zf_cmessages {
+  char **messages;
+  uint32_t count;
+  uint32_t size;
+  uint32_t *hash;
+  uint32_t hashsize;
+  uint32_t blobsize;
+} rbl_zf_cmessages;
+
+/*
+ * Layout
+ */
+
+static size_t rbl_zf_layout(const rbl_zf_header *header, size_t *v4dir, size_t *v4start, size_t *v4value,
+                            size_t *v6dir, size_t *v6start, size_t *v6value, size_t *msgoffset, size_t *blob) {
+  size_t pos = RBL_ZF_PAD(sizeof(rbl_zf_header));
+
+  *v4dir = pos;
+  pos = RBL_ZF_PAD(pos + sizeof(uint32_t) * (RBL_ZF_DIRSIZE + 1));
+  *v4start = pos;
+  pos = RBL_ZF_PAD(pos + sizeof(uint32_t) * header->v4count);
+  *v4value = pos;
+  pos = RBL_ZF_PAD(pos + sizeof(uint32_t) * header->v4count);
+  *v6dir = pos;
+  pos = RBL_ZF_PAD(pos + sizeof(uint32_t) * (RBL_ZF_DIRSIZE + 1));
+  *v6start = pos;
+  pos = RBL_ZF_PAD(pos + sizeof(uint64_t) * 2 * header->v6count);
+  *v6value = pos;
+  pos = RBL_ZF_PAD(pos + sizeof(uint32_t) * header->v6count);
+  *msgoffset = pos;
+  pos = RBL_ZF_PAD(pos + sizeof(uint32_t) * header->msgcount);
+  *blob = pos;
+
+  return pos + header->blobsize;
+}
+
+/*
+ * Lookups
+ */
+
+static uint32_t rbl_zf_lookup4(const rbl_zf_zone *zone, uint32_t ip) {
+  uint32_t first, last, mid;
+
+  first = zone->v4dir[ip >> 16];
+  last = zone->v4dir[(ip >> 16) + 1];
+
+  /* find the first range starting after ip, the one before it applies */
+  while (first < last) {
+    mid = first + (last - first) / 2;
+
+    if (zone->v4start[mid] <= ip)
+      first = mid + 1;
+    else
+      last = mid;
   }
 
+  if (first == 0)
+    return RBL_ZF_NOTLISTED;
+
+  return zone->v4value[first - 1];
+}
+
+static int rbl_zf_cmpkey(const rbl_zf_key *a, const rbl_zf_key *b) {
+  if (a->hi != b->hi)
+    return (a->hi < b->hi) ? -1 : 1;
+
+  if (a->lo != b->lo)
+    return (a->lo < b->lo) ? -1 : 1;
+
   return 0;
 }
 
-static int rbl_zf_bsearch(array *entries, struct irc_in_addr *ip, char *message, size_t msglen) {
-  int first, last, mid;
+static uint32_t rbl_zf_lookup6(const rbl_zf_zone *zone, const rbl_zf_key *ip) {
+  uint32_t first, last, mid;
+  rbl_zf_key start;
+
+  first = zone->v6dir[ip->hi >> 48];
+  last = zone->v6dir[(ip->hi >> 48) + 1];
 
-  first = 0;
-  last = entries->cursi - 1;
-  mid = (first + last) / 2;
+  while (first < last) {
+    mid = first + (last - first) / 2;
 
-  while (first <= last) {
-    rbl_zf_entry *ze = &((rbl_zf_entry *)entries->content)[mid];
+    start.hi = zone->v6start[mid * 2];
+    start.lo = zone->v6start[mid * 2 + 1];
 
-    if (rbl_zf_cmpip(&ze->ipaddress, ip) < 0 && !ipmask_check(&ze->ipaddress, ip, ze->bits))
+    if (rbl_zf_cmpkey(&start, ip) <= 0)
       first = mid + 1;
-    else if (ipmask_check(&ze->ipaddress, ip, ze->bits)) {
-      if (message) {
-        if (ze->message)
-          strncpy(message, ze->message->content, msglen);
-        else
-          message[0] = '\0';
-      }
+    else
+      last = mid;
+  }
 
-      return 1;
-    } else
-      last = mid - 1;
+  if (first == 0)
+    return RBL_ZF_NOTLISTED;
 
-    mid = (first + last) / 2;
-  }
+  return zone->v6value[first - 1];
+}
 
-  return -1;
+static void rbl_zf_ip2key(const struct irc_in_addr *ip, rbl_zf_key *key) {
+  int i;
+
+  key->hi = key->lo = 0;
+
+  for (i = 0; i < 4; i++) {
+    key->hi = (key->hi << 16) | ntohs(ip->in6_16[i]);
+    key->lo = (key->lo << 16) | ntohs(ip->in6_16[i + 4]);
+  }
 }
 
 static int rbl_zf_lookup(rbl_instance *rbl, struct irc_in_addr *ip, char *message, size_t msglen) {
   rbl_zf_udata *udata = rbl->udata;
+  rbl_zf_zone *zone = udata->zone;
+  uint32_t value = RBL_ZF_NOTLISTED, value6;
+  rbl_zf_key key;
 
-  if (rbl_zf_bsearch(&udata->whitelist, ip, NULL, 0) > 0)
+  if (!zone)
     return -1;
 
-  return rbl_zf_bsearch(&udata->blacklist, ip, message, msglen);
+  if (irc_in_addr_is_ipv4(ip))
+    value = rbl_zf_lookup4(zone, irc_in_addr_v4_to_int(ip));
+
+  /* IPv6 entries are always less specific than IPv4 ones, but exemptions
+   * still apply across both tables. */
+  if (value != RBL_ZF_EXEMPT && zone->header->v6count > 0) {
+    rbl_zf_ip2key(ip, &key);
+    value6 = rbl_zf_lookup6(zone, &key);
+
+    if (value6 == RBL_ZF_EXEMPT || value == RBL_ZF_NOTLISTED)
+      value = value6;
+  }
+
+  if (value < RBL_ZF_MSGBASE)
+    return -1;
+
+  if (message) {
+    strncpy(message, zone->blob + zone->msgoffset[value - RBL_ZF_MSGBASE], msglen);
+    if (msglen > 0)
+      message[msglen - 1] = '\0';
+  }
+
+  return 1;
 }
 
-static void rbl_zf_freeentries(array *entries) {
-  rbl_zf_entry *ze;
-  int i;
+/*
+ * Compiler, runs in a child process.
+ */
+
+static uint32_t rbl_zf_addmessage(rbl_zf_cmessages *msgs, const char *message) {
+  uint32_t h, i;
+
+  if (msgs->count * 2 >= msgs->hashsize) {
+    uint32_t *oldhash = msgs->hash, oldsize = msgs->hashsize;
+
+    msgs->hashsize = oldsize ? oldsize * 2 : 1024;
+    msgs->hash = malloc(sizeof(uint32_t) * msgs->hashsize);
+    memset(msgs->hash, 0xff, sizeof(uint32_t) * msgs->hashsize);
+
+    for (i = 0; i < oldsize; i++) {
+      if (oldhash[i] == UINT32_MAX)
+        continue;
 
-  for (i = 0; i < entries->cursi; i++) {
-    ze = &((rbl_zf_entry *)entries->content)[i];
-    freesstring(ze->message);
+      for (h = irc_crc32(msgs->messages[oldhash[i]]) & (msgs->hashsize - 1); msgs->hash[h] != UINT32_MAX; h = (h + 1) & (msgs->hashsize - 1))
+        ;
+
+      msgs->hash[h] = oldhash[i];
+    }
+
+    free(oldhash);
   }
-  array_free(entries);
+
+  for (h = irc_crc32(message) & (msgs->hashsize - 1); msgs->hash[h] != UINT32_MAX; h = (h + 1) & (msgs->hashsize - 1))
+    if (strcmp(msgs->messages[msgs->hash[h]], message) == 0)
+      return msgs->hash[h];
+
+  if (msgs->count == msgs->size) {
+    msgs->size = msgs->size ? msgs->size * 2 : 256;
+    msgs->messages = realloc(msgs->messages, sizeof(char *) * msgs->size);
+  }
+
+  msgs->messages[msgs->count] = strdup(message);
+  msgs->blobsize += strlen(message) + 1;
+  msgs->hash[h] = msgs->count;
+
+  return msgs->count++;
 }
 
-static int rbl_zf_parseentry(rbl_instance *rbl, const char *line) {
-  rbl_zf_udata *udata = rbl->udata;
-  int slot, exempt = 0;
-  char mask[255], message[255];
+static int rbl_zf_parseline(char *line, rbl_zf_centry *ce, rbl_zf_cmessages *msgs, int *v4) {
+  int exempt = 0;
+  char *message, *pos;
   struct irc_in_addr ip;
   unsigned char bits;
-  rbl_zf_entry *ze;
+  rbl_zf_key mask;
 
   if (line[0] == '$' || line[0] == ':')
-    return 0; /* Ignore option lines */
+    return -1; /* Ignore option lines */
 
   if (line[0] == '!') {
     exempt = 1;
     line++;
   }
 
-  message[0] = '\0';
+  for (pos = line; *pos && *pos != ' ' && *pos != '\t'; pos++)
+    ;
 
-  if (sscanf(line, "%s %[^\n]", mask, message) < 1)
+  if (pos == line)
     return -1;
 
-  if (!ipmask_parse(mask, &ip, &bits))
+  message = pos;
+
+  if (*pos) {
+    *pos = '\0';
+    for (message = pos + 1; *message == ' ' || *message == '\t'; message++)
+      ;
+  }
+
+  if (strlen(message) > RBL_ZF_MAXMSGLEN)
+    message[RBL_ZF_MAXMSGLEN] = '\0';
+
+  if (!ipmask_parse(line, &ip, &bits))
     return -1;
 
-  if (exempt) {
-    slot = array_getfreeslot(&udata->whitelist);
-    ze = &((rbl_zf_entry *)udata->whitelist.content)[slot];
+  rbl_zf_ip2key(&ip, &ce->start);
+
+  if (irc_in_addr_is_ipv4(&ip) && bits >= 96) {
+    *v4 = 1;
+    bits -= 96;
+    ce->start.hi = 0;
+    ce->start.lo &= 0xffffffff;
+    mask.hi = 0;
+    mask.lo = (bits == 0) ? 0 : (0xffffffffULL << (32 - bits)) & 0xffffffffULL;
+    ce->start.lo &= mask.lo;
+    ce->end.hi = 0;
+    ce->end.lo = ce->start.lo | (~mask.lo & 0xffffffffULL);
   } else {
-    slot = array_getfreeslot(&udata->blacklist);
-    ze = &((rbl_zf_entry *)udata->blacklist.content)[slot];
+    *v4 = 0;
+    if (bits == 0) {
+      mask.hi = mask.lo = 0;
+    } else if (bits <= 64) {
+      mask.hi = ~0ULL << (64 - bits);
+      mask.lo = 0;
+    } else {
+      mask.hi = ~0ULL;
+      mask.lo = (bits == 128) ? ~0ULL : ~0ULL << (128 - bits);
+    }
+    ce->start.hi &= mask.hi;
+    ce->start.lo &= mask.lo;
+    ce->end.hi = ce->start.hi | ~mask.hi;
+    ce->end.lo = ce->start.lo | ~mask.lo;
   }
 
-  memcpy(&ze->ipaddress, &ip, sizeof(ip));
-  ze->bits = bits;
-  ze->exempt = exempt;
-  ze->message = getsstring(message, 255);
+  ce->bits = bits;
+  ce->value = exempt ? RBL_ZF_EXEMPT : RBL_ZF_MSGBASE + rbl_zf_addmessage(msgs, message);
 
   return 0;
 }
 
-static int rbl_zf_cmpentry(const void *a, const void *b) {
-  const rbl_zf_entry *za = a;
-  const rbl_zf_entry *zb = b;
+static int rbl_zf_cmpcentry(const void *a, const void *b) {
+  const rbl_zf_centry *ca = a;
+  const rbl_zf_centry *cb = b;
+  int result;
+
+  result = rbl_zf_cmpkey(&ca->start, &cb->start);
+
+  if (result)
+    return result;
+
+  /* wider prefixes first so they end up below narrower ones on the stack */
+  return (int)ca->bits - (int)cb->bits;
+}
+
+static void rbl_zf_emit(rbl_zf_ctable *table, const rbl_zf_key *start, uint32_t value) {
+  uint32_t previous;
+
+  if (table->count > 0 && rbl_zf_cmpkey(&table->start[table->count - 1], start) == 0) {
+    table->value[table->count - 1] = value;
+  } else {
+    if (table->count == table->size) {
+      table->size = table->size ? table->size * 2 : 1024;
+      table->start = realloc(table->start, sizeof(rbl_zf_key) * table->size);
+      table->value = realloc(table->value, sizeof(uint32_t) * table->size);
+    }
 
-  return rbl_zf_cmpip(&za->ipaddress, &zb->ipaddress);
+    table->start[table->count] = *start;
+    table->value[table->count] = value;
+    table->count++;
+  }
+
+  /* merge with the previous range if nothing changed */
+  previous = (table->count > 1) ? table->value[table->count - 2] : RBL_ZF_NOTLISTED;
+  if (table->value[table->count - 1] == previous)
+    table->count--;
 }
 
-static int rbl_zf_refresh(rbl_instance *rbl) {
-  char line[512];
+/* Flattens a set of CIDRs into disjoint ranges. CIDRs are either nested or
+ * disjoint, so a stack of the currently open prefixes is enough: the value
+ * of a range is "exempt" if any enclosing prefix is exempt, otherwise the
+ * message of the most specific prefix. */
+static void rbl_zf_flatten(rbl_zf_centry *entries, uint32_t count, const rbl_zf_key *maxkey, rbl_zf_ctable *table) {
+  struct {
+    rbl_zf_key end;
+    unsigned char bits;
+    uint32_t value;
+  } stack[129];
+  int sp = 0;
+  uint32_t i, value;
+  rbl_zf_key next;
+
+  qsort(entries, count, sizeof(rbl_zf_centry), rbl_zf_cmpcentry);
+
+  for (i = 0; i <= count; i++) {
+    /* close the prefixes which end before this one starts */
+    while (sp > 0 && (i == count || rbl_zf_cmpkey(&stack[sp - 1].end, &entries[i].start) < 0)) {
+      sp--;
+
+      if (rbl_zf_cmpkey(&stack[sp].end, maxkey) == 0)
+        continue;
+
+      next = stack[sp].end;
+      if (++next.lo == 0)
+        next.hi++;
+
+      rbl_zf_emit(table, &next, sp > 0 ? stack[sp - 1].value : RBL_ZF_NOTLISTED);
+    }
+
+    if (i == count)
+      break;
+
+    if (sp > 0 && stack[sp - 1].bits == entries[i].bits && rbl_zf_cmpkey(&stack[sp - 1].end, &entries[i].end) == 0) {
+      /* the same prefix listed twice: exemptions win, otherwise the last message */
+      sp--;
+      value = (stack[sp].value == RBL_ZF_EXEMPT) ? RBL_ZF_EXEMPT : entries[i].value;
+    } else if (sp > 0 && stack[sp - 1].value == RBL_ZF_EXEMPT)
+      value = RBL_ZF_EXEMPT;
+    else
+      value = entries[i].value;
+
+    stack[sp].end = entries[i].end;
+    stack[sp].bits = entries[i].bits;
+    stack[sp].value = value;
+    sp++;
+
+    rbl_zf_emit(table, &entries[i].start, value);
+  }
+}
+
+static void rbl_zf_builddir(uint32_t *dir, const rbl_zf_ctable *table, int v4) {
+  uint32_t i, h = 0, top;
+
+  for (i = 0; i < table->count; i++) {
+    top = v4 ? (uint32_t)(table->start[i].lo >> 16) : (uint32_t)(table->start[i].hi >> 48);
+
+    while (h <= top)
+      dir[h++] = i;
+  }
+
+  while (h <= RBL_ZF_DIRSIZE)
+    dir[h++] = table->count;
+}
+
+static int rbl_zf_writepadded(FILE *fp, const void *data, size_t len) {
+  static const char zeroes[8];
+
+  if (len > 0 && fwrite(data, len, 1, fp) != 1)
+    return -1;
+
+  if (RBL_ZF_PAD(len) != len && fwrite(zeroes, RBL_ZF_PAD(len) - len, 1, fp) != 1)
+    return -1;
+
+  return 0;
+}
+
+static int rbl_zf_compile(const char *source, const char *target) {
+  FILE *in, *out;
+  char line[512], tmpfile[1024];
+  struct stat st;
+  rbl_zf_header header;
+  rbl_zf_cmessages msgs;
+  rbl_zf_centry *v4entries = NULL, *v6entries = NULL, ce;
+  uint32_t v4count = 0, v4size = 0, v6count = 0, v6size = 0, i, offset;
+  rbl_zf_ctable v4table, v6table;
+  uint32_t *dir, *u32;
+  uint64_t *u64;
+  rbl_zf_key v4max = { 0, 0xffffffffULL }, v6max = { ~0ULL, ~0ULL };
+  int v4;
+  size_t len;
+
+  memset(&header, 0, sizeof(header));
+  memset(&msgs, 0, sizeof(msgs));
+  memset(&v4table, 0, sizeof(v4table));
+  memset(&v6table, 0, sizeof(v6table));
+
+  in = fopen(source, "r");
+  if (!in)
+    return -1;
+
+  if (fstat(fileno(in), &st) < 0) {
+    fclose(in);
+    return -1;
+  }
+
+  memcpy(header.magic, RBL_ZF_MAGIC, sizeof(header.magic));
+  header.sourcemtime = st.st_mtime;
+  header.sourcesize = st.st_size;
+
+  while (fgets(line, sizeof(line), in)) {
+    len = strlen(line);
+
+    if (len > 0 && line[len - 1] == '\n')
+      line[--len] = '\0';
+
+    if (len > 0 && line[len - 1] == '\r')
+      line[--len] = '\0';
+
+    if (line[0] == '\0' || rbl_zf_parseline(line, &ce, &msgs, &v4) < 0)
+      continue;
+
+    header.entries++;
+    if (ce.value == RBL_ZF_EXEMPT)
+      header.exempts++;
+
+    if (v4) {
+      if (v4count == v4size) {
+        v4size = v4size ? v4size * 2 : 1024;
+        v4entries = realloc(v4entries, sizeof(rbl_zf_centry) * v4size);
+      }
+      v4entries[v4count++] = ce;
+    } else {
+      if (v6count == v6size) {
+        v6size = v6size ? v6size * 2 : 1024;
+        v6entries = realloc(v6entries, sizeof(rbl_zf_centry) * v6size);
+      }
+      v6entries[v6count++] = ce;
+    }
+  }
+
+  fclose(in);
+
+  rbl_zf_flatten(v4entries, v4count, &v4max, &v4table);
+  rbl_zf_flatten(v6entries, v6count, &v6max, &v6table);
+
+  header.v4count = v4table.count;
+  header.v6count = v6table.count;
+  header.msgcount = msgs.count;
+  header.blobsize = msgs.blobsize;
+
+  snprintf(tmpfile, sizeof(tmpfile), "%s.tmp", target);
+  out = fopen(tmpfile, "w");
+  if (!out)
+    return -1;
+
+  dir = malloc(sizeof(uint32_t) * (RBL_ZF_DIRSIZE + 1));
+  u32 = malloc(sizeof(uint32_t) * (v4table.count + v6table.count + msgs.count + 1));
+  u64 = malloc(sizeof(uint64_t) * (2 * v6table.count + 1));
+
+  if (rbl_zf_writepadded(out, &header, sizeof(header)) < 0)
+    goto fail;
+
+  rbl_zf_builddir(dir, &v4table, 1);
+  if (rbl_zf_writepadded(out, dir, sizeof(uint32_t) * (RBL_ZF_DIRSIZE + 1)) < 0)
+    goto fail;
+
+  for (i = 0; i < v4table.count; i++)
+    u32[i] = (uint32_t)v4table.start[i].lo;
+  if (rbl_zf_writepadded(out, u32, sizeof(uint32_t) * v4table.count) < 0)
+    goto fail;
+
+  if (rbl_zf_writepadded(out, v4table.value, sizeof(uint32_t) * v4table.count) < 0)
+    goto fail;
+
+  rbl_zf_builddir(dir, &v6table, 0);
+  if (rbl_zf_writepadded(out, dir, sizeof(uint32_t) * (RBL_ZF_DIRSIZE + 1)) < 0)
+    goto fail;
+
+  for (i = 0; i < v6table.count; i++) {
+    u64[i * 2] = v6table.start[i].hi;
+    u64[i * 2 + 1] = v6table.start[i].lo;
+  }
+  if (rbl_zf_writepadded(out, u64, sizeof(uint64_t) * 2 * v6table.count) < 0)
+    goto fail;
+
+  if (rbl_zf_writepadded(out, v6table.value, sizeof(uint32_t) * v6table.count) < 0)
+    goto fail;
+
+  for (i = 0, offset = 0; i < msgs.count; i++) {
+    u32[i] = offset;
+    offset += strlen(msgs.messages[i]) + 1;
+  }
+  if (rbl_zf_writepadded(out, u32, sizeof(uint32_t) * msgs.count) < 0)
+    goto fail;
+
+  for (i = 0; i < msgs.count; i++)
+    if (fwrite(msgs.messages[i], strlen(msgs.messages[i]) + 1, 1, out) != 1)
+      goto fail;
+
+  if (fclose(out) != 0)
+    return -1;
+
+  return rename(tmpfile, target);
+
+fail:
+  fclose(out);
+  unlink(tmpfile);
+  return -1;
+}
+
+/*
+ * Loading and reloading.
+ */
+
+static void rbl_zf_freezone(rbl_zf_zone *zone) {
+  if (!zone)
+    return;
+
+  munmap(zone->map, zone->maplen);
+  free(zone);
+}
+
+static rbl_zf_zone *rbl_zf_mapzone(rbl_zf_udata *udata, const struct stat *source) {
+  int fd;
+  struct stat st;
+  void *map;
+  rbl_zf_zone *zone;
+  const rbl_zf_header *header;
+  size_t v4dir, v4start, v4value, v6dir, v6start, v6value, msgoffset, blob;
+
+  fd = open(udata->compiled->content, O_RDONLY);
+  if (fd < 0)
+    return NULL;
+
+  if (fstat(fd, &st) < 0 || st.st_size < (off_t)sizeof(rbl_zf_header)) {
+    close(fd);
+    return NULL;
+  }
+
+  map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+  close(fd);
+
+  if (map == MAP_FAILED)
+    return NULL;
+
+  header = map;
+
+  if (memcmp(header->magic, RBL_ZF_MAGIC, sizeof(header->magic)) != 0 ||
+      header->sourcemtime != (uint64_t)source->st_mtime || header->sourcesize != (uint64_t)source->st_size ||
+      rbl_zf_layout(header, &v4dir, &v4start, &v4value, &v6dir, &v6start, &v6value, &msgoffset, &blob) != (size_t)st.st_size) {
+    munmap(map, st.st_size);
+    return NULL;
+  }
+
+  zone = malloc(sizeof(rbl_zf_zone));
+  zone->map = map;
+  zone->maplen = st.st_size;
+  zone->header = header;
+  zone->v4dir = (const uint32_t *)((const char *)map + v4dir);
+  zone->v4start = (const uint32_t *)((const char *)map + v4start);
+  zone->v4value = (const uint32_t *)((const char *)map + v4value);
+  zone->v6dir = (const uint32_t *)((const char *)map + v6dir);
+  zone->v6start = (const uint64_t *)((const char *)map + v6start);
+  zone->v6value = (const uint32_t *)((const char *)map + v6value);
+  zone->msgoffset = (const uint32_t *)((const char *)map + msgoffset);
+  zone->blob = (const char *)map + blob;
+
+  return zone;
+}
+
+/* Swaps in a freshly mapped zone; lookups only ever see the old or the new one. */
+static int rbl_zf_swapzone(rbl_instance *rbl, const struct stat *source) {
   rbl_zf_udata *udata = rbl->udata;
-  FILE *fp = fopen(udata->file->content, "r");
+  rbl_zf_zone *zone, *oldzone;
 
-  if (!fp)
+  zone = rbl_zf_mapzone(udata, source);
+  if (!zone)
     return -1;
 
-  rbl_zf_freeentries(&udata->whitelist);
-  array_init(&udata->whitelist, sizeof(rbl_zf_entry));
+  oldzone = udata->zone;
+  udata->zone = zone;
+  udata->generation++;
+  udata->loadedat = time(NULL);
 
-  rbl_zf_freeentries(&udata->blacklist);
-  array_init(&udata->blacklist, sizeof(rbl_zf_entry));
+  rbl_zf_freezone(oldzone);
 
-  while (!feof(fp)) {
-    if (fgets(line, sizeof(line), fp) == NULL)
-      break;
+  Error("rbl_zonefile", ERR_INFO, "Loaded zone %s (generation %u): %u entries, %u ranges, %u unique messages.",
+        rbl->name->content, udata->generation, zone->header->entries,
+        zone->header->v4count + zone->header->v6count, zone->header->msgcount);
+
+  return 0;
+}
+
+static void rbl_zf_checkcompiler(void *arg) {
+  rbl_instance *rbl = arg;
+  rbl_zf_udata *udata = rbl->udata;
+  struct stat st;
+  int status;
+  pid_t pid;
+
+  udata->compilecheck = NULL;
+
+  pid = waitpid(udata->compiler, &status, WNOHANG);
+
+  if (pid == 0) {
+    udata->compilecheck = scheduleoneshot(time(NULL) + 1, rbl_zf_checkcompiler, rbl);
+    return;
+  }
+
+  udata->compiler = 0;
+
+  if (pid < 0 || !WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+    Error("rbl_zonefile", ERR_WARNING, "Failed to compile zone %s from %s.", rbl->name->content, udata->file->content);
+    return;
+  }
+
+  if (stat(udata->file->content, &st) < 0 || rbl_zf_swapzone(rbl, &st) < 0)
+    Error("rbl_zonefile", ERR_WARNING, "Failed to load compiled zone %s (%s).", rbl->name->content, udata->compiled->content);
+  else
+    Error("rbl_zonefile", ERR_INFO, "Compiled zone %s in %ld seconds.", rbl->name->content, (long)(time(NULL) - udata->compilestart));
+}
 
-    if (line[strlen(line) - 1] == '\n')
-      line[strlen(line) - 1] = '\0';
+static int rbl_zf_refresh(rbl_instance *rbl) {
+  rbl_zf_udata *udata = rbl->udata;
+  struct stat st;
+  pid_t pid;
+
+  if (stat(udata->file->content, &st) < 0)
+    return -1;
+
+  if (udata->compiler)
+    return 0; /* already being rebuilt */
+
+  if (udata->zone && udata->zone->header->sourcemtime == (uint64_t)st.st_mtime &&
+      udata->zone->header->sourcesize == (uint64_t)st.st_size)
+    return 0; /* unchanged */
 
-    if (line[strlen(line) - 1] == '\r')
-      line[strlen(line) - 1] = '\0';
+  /* a compiled copy may already be up to date, e.g. after a restart */
+  if (rbl_zf_swapzone(rbl, &st) == 0)
+    return 0;
 
-    if (line[0] != '\0')
-      rbl_zf_parseentry(rbl, line);
+  /* Rebuild in a child process so the main loop isn't blocked. The current
+   * zone keeps answering lookups until the new one is swapped in. */
+  pid = fork();
+
+  if (pid < 0) {
+    Error("rbl_zonefile", ERR_WARNING, "Could not fork zone compiler for %s: %s", rbl->name->content, strerror(errno));
+    return -1;
   }
 
-  fclose(fp);
+  if (pid == 0)
+    _exit(rbl_zf_compile(udata->file->content, udata->compiled->content) < 0 ? 1 : 0);
 
-  qsort(udata->whitelist.content, udata->whitelist.cursi, sizeof(rbl_zf_entry), rbl_zf_cmpentry);
-  qsort(udata->blacklist.content, udata->blacklist.cursi, sizeof(rbl_zf_entry), rbl_zf_cmpentry);
+  udata->compiler = pid;
+  udata->compilestart = time(NULL);
+  udata->compilecheck = scheduleoneshot(time(NULL) + 1, rbl_zf_checkcompiler, rbl);
 
   return 0;
 }
 
+static void rbl_zf_info(rbl_instance *rbl, char *buf, size_t buflen) {
+  rbl_zf_udata *udata = rbl->udata;
+  rbl_zf_zone *zone = udata->zone;
+
+  if (!zone) {
+    snprintf(buf, buflen, "%s", udata->compiler ? "compiling" : "not loaded");
+    return;
+  }
+
+  snprintf(buf, buflen, "generation %u: %u entries (%u exempt), %u ranges, %u messages, %lu bytes mapped%s",
+           udata->generation, zone->header->entries, zone->header->exempts,
+           zone->header->v4count + zone->header->v6count, zone->header->msgcount,
+           (unsigned long)zone->maplen, udata->compiler ? ", recompiling" : "");
+}
+
 static void rbl_zf_dtor(rbl_instance *rbl) {
   rbl_zf_udata *udata = rbl->udata;
+
+  if (udata->compilecheck)
+    deleteschedule(udata->compilecheck, rbl_zf_checkcompiler, rbl);
+
+  if (udata->compiler) {
+    kill(udata->compiler, SIGKILL);
+    waitpid(udata->compiler, NULL, 0);
+  }
+
+  rbl_zf_freezone(udata->zone);
   freesstring(udata->file);
-  rbl_zf_freeentries(&udata->whitelist);
-  rbl_zf_freeentries(&udata->blacklist);
+  freesstring(udata->compiled);
+  free(udata);
 }
 
 static rbl_ops rbl_zonefile_ops = {
   .lookup = rbl_zf_lookup,
   .refresh = rbl_zf_refresh,
-  .dtor = rbl_zf_dtor
+  .dtor = rbl_zf_dtor,
+  .info = rbl_zf_info
 };
 
 int rbl_zf_load(const char *name, const char *file) {
+  char compiled[512];
   rbl_zf_udata *udata = malloc(sizeof(*udata));
+
+  memset(udata, 0, sizeof(*udata));
+
+  snprintf(compiled, sizeof(compiled), "%s%s", file, RBL_ZF_SUFFIX);
   udata->file = getsstring(file, 512);
-  array_init(&udata->whitelist, sizeof(rbl_zf_entry));
-  array_init(&udata->blacklist, sizeof(rbl_zf_entry));
+  udata->compiled = getsstring(compiled, 512);
+
   return registerrbl(name, &rbl_zonefile_ops, udata);
 }
 
@@ -208,4 +783,3 @@ void _init(void) {
 void _fini(void) {
   deregisterrblbyops(&rbl_zonefile_ops);
 }
-
@@ -1,19 +1,71 @@
 #ifndef __RBL_ZONEFILE_H
 #define __RBL_ZONEFILE_H
 
+#include <stdint.h>
+#include <sys/types.h>
 #include "rbl.h"
 
-typedef struct rbl_zf_entry {
-  struct irc_in_addr ipaddress;
-  unsigned char bits;
-  int exempt;
-  sstring *message;
-} rbl_zf_entry;
+#define RBL_ZF_MAGIC "NSRBLZ01"
+#define RBL_ZF_SUFFIX ".compiled"
+#define RBL_ZF_DIRSIZE 65536
+#define RBL_ZF_MAXMSGLEN 254
+
+/* Values stored in the range tables. */
+#define RBL_ZF_NOTLISTED 0
+#define RBL_ZF_EXEMPT 1
+#define RBL_ZF_MSGBASE 2 /* listed, message index is value - RBL_ZF_MSGBASE */
+
+/* On-disk header of a compiled zone. The file is mmapped as-is, sections
+ * follow the header in this order, each padded to 8 bytes:
+ *
+ *   uint32_t v4dir[RBL_ZF_DIRSIZE + 1]
+ *   uint32_t v4start[v4count]
+ *   uint32_t v4value[v4count]
+ *   uint32_t v6dir[RBL_ZF_DIRSIZE + 1]
+ *   uint64_t v6start[v6count * 2]      (high word, low word)
+ *   uint32_t v6value[v6count]
+ *   uint32_t msgoffset[msgcount]
+ *   char blob[blobsize]                (NUL terminated messages)
+ *
+ * The range tables hold the start of each disjoint address range and the
+ * value that applies up to the start of the next range, so nested and
+ * overlapping CIDRs are resolved at compile time. The directories index
+ * each table by the top 16 bits of the address. */
+typedef struct rbl_zf_header {
+  char magic[8];
+  uint64_t sourcemtime;
+  uint64_t sourcesize;
+  uint32_t v4count;
+  uint32_t v6count;
+  uint32_t msgcount;
+  uint32_t blobsize;
+  uint32_t entries;
+  uint32_t exempts;
+} rbl_zf_header;
+
+typedef struct rbl_zf_zone {
+  void *map;
+  size_t maplen;
+  const rbl_zf_header *header;
+  const uint32_t *v4dir;
+  const uint32_t *v4start;
+  const uint32_t *v4value;
+  const uint32_t *v6dir;
+  const uint64_t *v6start;
+  const uint32_t *v6value;
+  const uint32_t *msgoffset;
+  const char *blob;
+} rbl_zf_zone;
 
 typedef struct rbl_zf_udata {
   sstring *file;
-  array whitelist;
-  array blacklist;
+  sstring *compiled;
+  rbl_zf_zone *zone;
+  unsigned int generation;
+  time_t loadedat;
+  pid_t compiler;
+  time_t compilestart;
+  void *compilecheck;
 } rbl_zf_udata;
 
 int rbl_zf_load(const char *name, const char *file);
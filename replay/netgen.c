@@ -0,0 +1,478 @@
+/*
+  Writes a made up network as a capture replay/replaydriver can feed to
+  newserv: servers, a user burst, channel bursts with bans, and glines, all
+  in the P10 newserv would get from a real hub, so it goes through the
+  normal server/nick/burst/gline handlers.
+
+  replay/netgen [-u users] [-S servers] [-c channels] [-M maxmembers]
+                [-z zipf] [-C clones] [-k clustermax] [-a accounts]
+                [-b maxbans] [-g glines] [-q splits] [-r seed] [-o file]
+
+  Channel sizes and how many users come from each ISP follow a Zipf
+  distribution (-z, 1.0 by default), but no channel gets more than -M
+  users, as the biggest real ones stop growing long before a big
+  network's Zipf curve would.  -C is the fraction of users in clone
+  clusters of up to -k users sharing an IP (a quarter of clusters are
+  spread over a /24 instead), -a the fraction who are authed.  -q splits
+  that many servers off again at the end.  The same options and seed
+  always give the same network.
+*/
+
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <unistd.h>
+
+#include "../lib/base64.h"
+
+#define MAXPERSERVER 262144   /* numerics up to "]]]" */
+#define MAXSERVERS   4000     /* and ours, "]]", stays free */
+#define SERVICES     "services.test.net"
+#define SERVICESNUM  "]]"
+#define BASETS       1700000000L
+#define BURSTLINE    400      /* B lines are split well under 512 bytes */
+#define MAXCHANS     20
+
+typedef struct user {
+  unsigned int ip;
+  unsigned int account;       /* 0 for none */
+  unsigned short server;
+  unsigned short cluster;     /* size of its clone cluster, 0 if none */
+} user;
+
+static unsigned long users = 10000, channels, maxmembers = 20000;
+static long glines = -1;
+static unsigned int servers = 20, maxcluster = 32, maxbans = 45, splits;
+static double zipf = 1.0, clonefrac = 0.1, accountfrac = 0.4;
+
+static user *userlist;
+static FILE *out;
+
+static unsigned int state = 1;
+
+/* xorshift, so a seed always gives the same network */
+static unsigned int rnd(void) {
+  unsigned int x = state;
+
+  x ^= x << 13;
+  x ^= x >> 17;
+  x ^= x << 5;
+  return state = x;
+}
+
+static double rndf(void) {
+  return (rnd() >> 8) / 16777216.0;
+}
+
+/* P(rank k) is proportional to 1/k^s, sampled from the CDF */
+typedef struct zipfdist {
+  unsigned long n;
+  double *cdf;
+} zipfdist;
+
+static void zipf_init(zipfdist *z, unsigned long n, double s) {
+  unsigned long i;
+  double total = 0;
+
+  z->n = n;
+  if (!(z->cdf = malloc(sizeof(double) * n))) {
+    perror("malloc");
+    exit(1);
+  }
+
+  for (i = 0; i < n; i++)
+    z->cdf[i] = (total += 1.0 / pow(i + 1, s));
+
+  for (i = 0; i < n; i++)
+    z->cdf[i] /= total;
+}
+
+static unsigned long zipf_sample(zipfdist *z) {
+  unsigned long lo = 0, hi = z->n - 1, mid;
+  double u = rndf();
+
+  while (lo < hi) {
+    mid = (lo + hi) / 2;
+
+    if (z->cdf[mid] < u)
+      lo = mid + 1;
+    else
+      hi = mid;
+  }
+
+  return lo;
+}
+
+static void usage(const char *name) {
+  fprintf(stderr, "Usage: %s [-u users] [-S servers] [-c channels] [-z zipf] [-C clones] [-k clustermax]\n"
+                  "       [-M maxmembers] [-a accounts] [-b maxbans] [-g glines] [-q splits] [-r seed] [-o file]\n", name);
+  exit(1);
+}
+
+/* server 0 is the hub */
+static char *servernum(unsigned int server, char *buf) {
+  return longtonumeric2(server + 1, 2, buf);
+}
+
+static char *usernum(unsigned long i, char *buf) {
+  servernum(userlist[i].server, buf);
+  longtonumeric2(i / servers, 3, buf + 2);
+  return buf;
+}
+
+static char *ipstring(unsigned int ip, char *buf, size_t len) {
+  snprintf(buf, len, "%u.%u.%u.%u", ip >> 24, (ip >> 16) & 255, (ip >> 8) & 255, ip & 255);
+  return buf;
+}
+
+/* most IPs resolve, clones on one IP all get the same answer */
+static int resolves(unsigned int ip) {
+  return ((ip * 2654435761U) >> 24) % 100 < 70;
+}
+
+static char *hostname(unsigned int ip, char *buf, size_t len) {
+  if (resolves(ip))
+    snprintf(buf, len, "%u-%u.%u-%u.dyn.example.net", ip & 255, (ip >> 8) & 255, ip >> 24, (ip >> 16) & 255);
+  else
+    ipstring(ip, buf, len);
+
+  return buf;
+}
+
+/* ISPs are /16s, kept out of the reserved ranges */
+static unsigned int ispprefix(unsigned long isp) {
+  unsigned int a = 11 + (isp * 7919) % 180, b = (isp * 104729) % 256;
+
+  if (a == 127 || a == 169 || a == 172)
+    a++;
+
+  return (a << 24) | (b << 16);
+}
+
+static void makeusers(void) {
+  zipfdist isps;
+  unsigned long i, j, size, accounts = 0;
+  unsigned int ip;
+  int spread;
+
+  zipf_init(&isps, users / 2000 + 16, zipf);
+
+  for (i = 0; i < users; i += size) {
+    size = 1;
+    spread = 0;
+
+    /* mostly small clusters, the odd big one */
+    if (rndf() < clonefrac / 4) {
+      size = 2 + (unsigned long)(pow(rndf(), 3) * (maxcluster - 1));
+      spread = !(rnd() % 4);
+    }
+
+    if (i + size > users)
+      size = users - i;
+
+    ip = ispprefix(zipf_sample(&isps)) | (rnd() & 0xffff);
+    if (!(ip & 255))
+      ip |= 1;
+
+    for (j = i; j < i + size; j++) {
+      userlist[j].ip = spread ? (ip & ~255U) | (1 + rnd() % 254) : ip;
+      userlist[j].cluster = (size > 1) ? size : 0;
+      userlist[j].server = j % servers;
+
+      /* one in ten authed clients shares an account with another */
+      if (rndf() >= accountfrac)
+        userlist[j].account = 0;
+      else if (accounts && !(rnd() % 10))
+        userlist[j].account = 1 + rnd() % accounts;
+      else
+        userlist[j].account = ++accounts;
+    }
+  }
+
+  free(isps.cdf);
+}
+
+static void writeservers(void) {
+  char hub[3], num[3];
+  unsigned int i;
+
+  servernum(0, hub);
+
+  fprintf(out, "# connect %ld %s %s\n", BASETS, SERVICES, SERVICESNUM);
+  fprintf(out, "%ld.000000 PASS :netgen\n", BASETS);
+  fprintf(out, "%ld.000000 SERVER hub.test.net 1 %ld %ld J10 %s]]] +h6 :netgen hub\n", BASETS, BASETS, BASETS, hub);
+
+  for (i = 1; i < servers; i++)
+    fprintf(out, "%ld.000000 %s S irc%u.test.net 2 %ld %ld J10 %s]]] +6 :netgen server %u\n", BASETS, hub, i, BASETS, BASETS,
+      servernum(i, num), i);
+}
+
+static void writeusers(void) {
+  char snum[3], unum[6], ipnum[7], host[64], modes[64];
+  unsigned long i;
+  user *u;
+
+  for (i = 0; i < users; i++) {
+    u = &userlist[i];
+
+    snprintf(modes, sizeof(modes), "+i%s", (i % 1000) ? "" : "ow");
+    if (u->account)
+      snprintf(modes + strlen(modes), sizeof(modes) - strlen(modes), "r acct%u:%ld:%u", u->account,
+        BASETS - 86400L * (u->account % 1000), u->account);
+
+    /* clones share their ident and realname too */
+    if (u->cluster)
+      fprintf(out, "%ld.000000 %s N clone%lu 2 %ld bot%u %s %s %s %s :cluster of %u\n", BASETS, servernum(u->server, snum), i,
+        BASETS - (long)(rnd() % 86400), u->ip % 1000, hostname(u->ip, host, sizeof(host)), modes, longtonumeric2(u->ip, 6, ipnum),
+        usernum(i, unum), u->cluster);
+    else
+      fprintf(out, "%ld.000000 %s N user%lu 2 %ld u%lu %s %s %s %s :Real Name %lu\n", BASETS, servernum(u->server, snum), i,
+        BASETS - (long)(rnd() % 86400), i, hostname(u->ip, host, sizeof(host)), modes, longtonumeric2(u->ip, 6, ipnum),
+        usernum(i, unum), i % 5000);
+  }
+}
+
+/* how many channels a user is on: mostly one to three, a few on lots */
+static int chancount(void) {
+  unsigned int r = rnd() % 100;
+
+  if (r < 10)
+    return 0;
+  if (r < 60)
+    return 1;
+  if (r < 78)
+    return 2;
+  if (r < 88)
+    return 3;
+
+  return 4 + rnd() % (MAXCHANS - 3);
+}
+
+static void banmask(unsigned long chan, unsigned int n, char *buf, size_t len) {
+  char host[64];
+  unsigned int ip = userlist[(chan * 31 + n * 7919) % users].ip;
+
+  switch (rnd() % 4) {
+    case 0:
+      snprintf(buf, len, "*!*@%s", hostname(ip, host, sizeof(host)));
+      break;
+    case 1:
+      snprintf(buf, len, "*!*@*.%u-%u.dyn.example.net", ip >> 24, (ip >> 16) & 255);
+      break;
+    case 2:
+      snprintf(buf, len, "*!u%lu@*", (unsigned long)rnd() % users);
+      break;
+    default:
+      snprintf(buf, len, "user%lu*!*@*", (unsigned long)rnd() % users);
+      break;
+  }
+}
+
+static void writechannels(void) {
+  unsigned long *start, *fill, i, c, total = 0, maxpicks, pos;
+  unsigned int *pickuser, *pickchan, *members, mine[MAXCHANS], n, j, k, bans;
+  char line[512], unum[6], mask[128], hub[3];
+  zipfdist sizes;
+  size_t len;
+
+  servernum(0, hub);
+  zipf_init(&sizes, channels, zipf);
+
+  maxpicks = users * MAXCHANS / 4;
+  start = calloc(channels + 1, sizeof(unsigned long));
+  fill = calloc(channels, sizeof(unsigned long));
+  pickuser = malloc(sizeof(unsigned int) * maxpicks);
+  pickchan = malloc(sizeof(unsigned int) * maxpicks);
+  if (!start || !fill || !pickuser || !pickchan) {
+    perror("malloc");
+    exit(1);
+  }
+
+  /* everyone picks their channels, then they're bucketed by channel */
+  for (i = 0; i < users && total < maxpicks; i++) {
+    n = chancount();
+
+    for (j = 0; j < n && total < maxpicks; j++) {
+      mine[j] = zipf_sample(&sizes);
+
+      for (k = 0; k < j && mine[k] != mine[j]; k++)
+        ;
+      if (k < j || start[mine[j] + 1] >= maxmembers)
+        continue;
+
+      pickuser[total] = i;
+      pickchan[total++] = mine[j];
+      start[mine[j] + 1]++;
+    }
+  }
+
+  for (c = 0; c < channels; c++)
+    start[c + 1] += start[c];
+
+  members = malloc(sizeof(unsigned int) * (total + 1));
+  if (!members) {
+    perror("malloc");
+    exit(1);
+  }
+
+  for (i = 0; i < total; i++)
+    members[start[pickchan[i]] + fill[pickchan[i]]++] = pickuser[i];
+
+  free(pickuser);
+  free(pickchan);
+  free(fill);
+
+  for (c = 0; c < channels; c++) {
+    if (start[c] == start[c + 1])
+      continue;
+
+    /* ops go last, as a suffix sticks for everyone after it */
+    len = snprintf(line, sizeof(line), "%ld.000000 %s B #chan%lu %ld +tn%s ", BASETS, hub, c, BASETS - (long)(c % 100000),
+      (c % 10) ? "" : "l 500");
+
+    for (pos = start[c]; pos < start[c + 1]; pos++) {
+      if (len > BURSTLINE) {
+        line[len - 1] = '\n';
+        fwrite(line, 1, len, out);
+        len = snprintf(line, sizeof(line), "%ld.000000 %s B #chan%lu %ld ", BASETS, hub, c, BASETS - (long)(c % 100000));
+      }
+
+      len += snprintf(line + len, sizeof(line) - len, "%s%s,", usernum(members[pos], unum), (pos == start[c + 1] - 1) ? ":o" : "");
+    }
+    line[len - 1] = '\n';
+    fwrite(line, 1, len, out);
+
+    /* bigger channels have more bans */
+    bans = (start[c + 1] - start[c]) / 8 + rnd() % 3;
+    if (bans > maxbans)
+      bans = maxbans;
+
+    for (k = 0; k < bans;) {
+      len = snprintf(line, sizeof(line), "%ld.000000 %s B #chan%lu %ld :%%", BASETS, hub, c, BASETS - (long)(c % 100000));
+
+      for (; k < bans && len < BURSTLINE; k++) {
+        banmask(c, k, mask, sizeof(mask));
+        len += snprintf(line + len, sizeof(line) - len, "%s ", mask);
+      }
+
+      line[len - 1] = '\n';
+      fwrite(line, 1, len, out);
+    }
+  }
+
+  free(start);
+  free(members);
+  free(sizes.cdf);
+}
+
+static void writeglines(void) {
+  char hub[3], ip[16], mask[128];
+  long i;
+  unsigned int u;
+
+  servernum(0, hub);
+
+  for (i = 0; i < glines; i++) {
+    u = userlist[rnd() % users].ip;
+
+    switch (i % 10) {
+      case 0: case 1: case 2: case 3:
+        /* some of these hit clones */
+        snprintf(mask, sizeof(mask), "*@%s", ipstring(u, ip, sizeof(ip)));
+        break;
+      case 4: case 5: case 6:
+        snprintf(mask, sizeof(mask), "*@*.%u-%u.dyn.example.net", u >> 24, (u >> 16) & 255);
+        break;
+      case 7: case 8:
+        snprintf(mask, sizeof(mask), "*@%s/24", ipstring(u & ~255U, ip, sizeof(ip)));
+        break;
+      default:
+        snprintf(mask, sizeof(mask), "u%lu@*", (unsigned long)rnd() % users);
+        break;
+    }
+
+    fprintf(out, "%ld.000000 %s GL * +%s %ld %ld %ld :netgen gline %ld\n", BASETS, hub, mask, 86400L + (long)(i % 1000),
+      BASETS + (long)i, BASETS + 86400L * 30, i);
+  }
+}
+
+static void writeend(void) {
+  char hub[3], num[3];
+  unsigned int i;
+
+  for (i = 1; i < servers; i++)
+    fprintf(out, "%ld.000000 %s EB\n", BASETS, servernum(i, num));
+
+  fprintf(out, "%ld.000000 %s EB\n", BASETS, servernum(0, hub));
+
+  /* and then lose some, to time netsplits */
+  for (i = 1; i <= splits && i < servers; i++)
+    fprintf(out, "%ld.000000 %s SQ irc%u.test.net 0 :netgen split\n", BASETS, hub, i);
+}
+
+int main(int argc, char **argv) {
+  char *output = NULL;
+  int c;
+
+  while ((c = getopt(argc, argv, "u:S:c:M:z:C:k:a:b:g:q:r:o:")) != -1) {
+    switch (c) {
+      case 'u': users = strtoul(optarg, NULL, 10); break;
+      case 'S': servers = atoi(optarg); break;
+      case 'c': channels = strtoul(optarg, NULL, 10); break;
+      case 'M': maxmembers = strtoul(optarg, NULL, 10); break;
+      case 'z': zipf = atof(optarg); break;
+      case 'C': clonefrac = atof(optarg); break;
+      case 'k': maxcluster = atoi(optarg); break;
+      case 'a': accountfrac = atof(optarg); break;
+      case 'b': maxbans = atoi(optarg); break;
+      case 'g': glines = atol(optarg); break;
+      case 'q': splits = atoi(optarg); break;
+      case 'r': state = strtoul(optarg, NULL, 10) | 1; break;
+      case 'o': output = optarg; break;
+      default: usage(argv[0]);
+    }
+  }
+
+  if (optind != argc || !users || !servers || servers > MAXSERVERS || maxcluster < 2)
+    usage(argv[0]);
+
+  if ((users + servers - 1) / servers > MAXPERSERVER) {
+    fprintf(stderr, "%lu users won't fit on %u servers, give more with -S.\n", users, servers);
+    return 1;
+  }
+
+  if (!channels)
+    channels = users / 4 + 1;
+  if (glines < 0)
+    glines = users / 200;
+
+  if (!(userlist = malloc(sizeof(user) * users))) {
+    perror("malloc");
+    return 1;
+  }
+
+  if (!output) {
+    out = stdout;
+  } else if (!(out = fopen(output, "w"))) {
+    perror(output);
+    return 1;
+  }
+
+  makeusers();
+  writeservers();
+  writeusers();
+  writechannels();
+  writeglines();
+  writeend();
+
+  if (out != stdout && fclose(out)) {
+    perror(output);
+    return 1;
+  }
+
+  free(userlist);
+  return 0;
+}
@@ -0,0 +1,164 @@
+/*
+ * replay: the newserv side of replay/replaydriver.  Loaded alongside the
+ * modules being measured, it switches on command and hook profiling as
+ * soon as it's loaded, and when the driver has finished feeding the
+ * capture and sends SIGUSR1 it writes out where the time went and shuts
+ * newserv down.
+ *
+ * Nothing here is any use on a live network.
+ */
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <dlfcn.h>
+#include <sys/time.h>
+#include <sys/resource.h>
+
+#include "../core/hooks.h"
+#include "../core/error.h"
+#include "../core/config.h"
+#include "../core/modules.h"
+#include "../parser/parser.h"
+#include "../lib/version.h"
+#include "../lib/sstring.h"
+
+MODULE_VERSION("");
+
+#define REPLAY_TOPCOMMANDS 30
+#define REPLAY_TOPHOOKS    30
+
+static sstring *reportfile;
+
+static void replay_done(int hooknum, void *arg);
+
+void _init(void) {
+  reportfile = getcopyconfigitem("replay", "report", "replay.report", 256);
+
+  resetcommandprofiles();
+  resethookprofiles();
+  commandprofiling = 1;
+  hookprofiling = 1;
+
+  registerhook(HOOK_CORE_SIGUSR1, &replay_done);
+}
+
+void _fini(void) {
+  deregisterhook(HOOK_CORE_SIGUSR1, &replay_done);
+
+  commandprofiling = 0;
+  hookprofiling = 0;
+
+  freesstring(reportfile);
+}
+
+/* static callbacks have no dynamic symbol, so they're given as an offset
+ * into their object for addr2line */
+static const char *replay_symbol(void *fn) {
+  static char buf[30];
+  Dl_info info;
+
+  if (!dladdr(fn, &info))
+    snprintf(buf, sizeof(buf), "%p", fn);
+  else if (info.dli_sname && info.dli_saddr == fn)
+    return info.dli_sname;
+  else
+    snprintf(buf, sizeof(buf), "+%#lx", (unsigned long)((char *)fn - (char *)info.dli_fbase));
+
+  return buf;
+}
+
+static int replay_commandsort(const void *a, const void *b) {
+  const CommandProfile *pa = *(const CommandProfile **)a, *pb = *(const CommandProfile **)b;
+
+  return (pa->totalns < pb->totalns) - (pa->totalns > pb->totalns);
+}
+
+static int replay_hooksort(const void *a, const void *b) {
+  const HookProfile *pa = a, *pb = b;
+
+  return (pa->totalns < pb->totalns) - (pa->totalns > pb->totalns);
+}
+
+static double replay_seconds(struct timeval *tv) {
+  return tv->tv_sec + tv->tv_usec / 1e6;
+}
+
+static void replay_commands(FILE *fp) {
+  CommandProfile *p, **list;
+  int i, n;
+
+  for (n = 0, p = commandprofiles; p; p = p->next)
+    if (p->command && p->calls)
+      n++;
+
+  fprintf(fp, "\n%d commands profiled, slowest %d by total time (microseconds):\n", n, REPLAY_TOPCOMMANDS);
+  if (!n || !(list = malloc(n * sizeof(CommandProfile *))))
+    return;
+
+  for (i = 0, p = commandprofiles; p; p = p->next)
+    if (p->command && p->calls)
+      list[i++] = p;
+
+  qsort(list, n, sizeof(CommandProfile *), replay_commandsort);
+
+  fprintf(fp, "%-20s %-20s %10s %12s %8s %8s\n", "Command", "Module", "Calls", "Total", "Avg", "Max");
+  for (i = 0; i < n && i < REPLAY_TOPCOMMANDS; i++) {
+    p = list[i];
+    fprintf(fp, "%-20s %-20s %10lu %12llu %8llu %8llu\n", p->command->command->content, modulenamefromaddr((void *)p->command->handler),
+      p->calls, p->totalns / 1000, p->totalns / 1000 / p->calls, p->maxns / 1000);
+  }
+
+  free(list);
+}
+
+static void replay_hooks(FILE *fp) {
+  HookProfile *list;
+  int i, n;
+
+  n = gethookprofiles(NULL, 0);
+
+  fprintf(fp, "\n%d hook callbacks profiled, slowest %d by total time (microseconds, including nested hooks):\n", n, REPLAY_TOPHOOKS);
+  if (!n || !(list = malloc(n * sizeof(HookProfile))))
+    return;
+
+  n = gethookprofiles(list, n);
+  qsort(list, n, sizeof(HookProfile), replay_hooksort);
+
+  fprintf(fp, "%-5s %-32s %-20s %10s %12s %8s %8s\n", "Hook", "Callback", "Module", "Calls", "Total", "Avg", "Max");
+  for (i = 0; i < n && i < REPLAY_TOPHOOKS; i++)
+    fprintf(fp, "%-5d %-32s %-20s %10lu %12llu %8llu %8llu\n", list[i].hooknum, replay_symbol((void *)list[i].callback),
+      modulenamefromaddr((void *)list[i].callback), list[i].calls, list[i].totalns / 1000, list[i].totalns / 1000 / list[i].calls,
+      list[i].maxns / 1000);
+
+  free(list);
+}
+
+static void replay_done(int hooknum, void *arg) {
+  struct rusage ru;
+  FILE *fp;
+
+  /* don't time our own report */
+  commandprofiling = 0;
+  hookprofiling = 0;
+
+  if (!(fp = fopen(reportfile->content, "w"))) {
+    Error("replay", ERR_ERROR, "Unable to write report to %s: %s", reportfile->content, strerror(errno));
+  } else {
+    getrusage(RUSAGE_SELF, &ru);
+
+    fprintf(fp, "cpu: %.3fs user, %.3fs system\n", replay_seconds(&ru.ru_utime), replay_seconds(&ru.ru_stime));
+    fprintf(fp, "peak rss: %ld KB\n", ru.ru_maxrss);
+
+    replay_commands(fp);
+    replay_hooks(fp);
+
+    fclose(fp);
+    Error("replay", ERR_INFO, "Report written to %s.", reportfile->content);
+  }
+
+  newserv_shutdown_pending = 1;
+}
@@ -0,0 +1,457 @@
+/*
+  Feeds a capture made with [irc] capture=<file> back into a newserv that
+  thinks we're its uplink, then prints how fast it went and the report the
+  replay module writes (CPU and time per command and per hook callback,
+  peak RSS).
+
+  replay/replaydriver [-r] [-v] [-m module]... [-c extra.conf] [-s name]
+                      [-n numeric] [-x newserv] [-d moduledir] [-o report]
+                      capture
+
+  By default lines are sent as fast as newserv will take them; -r sends
+  them at the speed they were recorded.  Only the first connection in the
+  capture is replayed.  Modules are loaded from ./modules (make install),
+  and -c merges a file into the generated config for their settings.
+*/
+
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#define MAXMODULES    100
+#define OUTBUFSIZE    65536
+#define INLINESIZE    1024
+#define STARTTIMEOUT  30000 /* ms to wait for newserv to connect */
+#define FINISHTIMEOUT 60000 /* ms to wait for it to exit once told to */
+
+static char *modules[MAXMODULES];
+static int modulecount;
+
+static char *servername, *servernumeric, *newserv = "./newserv", *moduledir = "./modules";
+static char *extraconf, *reportfile = "replay.report";
+static int realtime, verbose;
+
+static char outbuf[OUTBUFSIZE];
+static size_t outlen, outpos;
+
+static char inbuf[INLINESIZE];
+static size_t inlen;
+static char donetoken[64];
+static int done;
+
+static double now(void) {
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void usage(const char *name) {
+  fprintf(stderr, "Usage: %s [-r] [-v] [-m module]... [-c extra.conf] [-s servername] [-n numeric]\n"
+                  "       [-x newserv] [-d moduledir] [-o report] capture\n", name);
+  exit(1);
+}
+
+/* Takes our name and numeric from the capture's "# connect" line unless
+   they were given, so the stream still addresses us. */
+static void readheader(FILE *fp) {
+  static char name[256], numeric[8];
+  char *line = NULL;
+  size_t len = 0;
+  long ts;
+
+  while (getline(&line, &len, fp) != -1) {
+    if (sscanf(line, "# connect %ld %255s %7s", &ts, name, numeric) == 3) {
+      if (!servername)
+        servername = name;
+      if (!servernumeric)
+        servernumeric = numeric;
+      break;
+    }
+  }
+
+  free(line);
+  rewind(fp);
+}
+
+/* newserv only reads the first section of each name, so the extra config
+   is merged: lines from a section we write ourselves go at the end of ours
+   (where they override it), anything else goes after. */
+static const char *oursections[] = { "core", "irc", "hub-replay", "replay", NULL };
+
+static int oursection(const char *section) {
+  int i;
+
+  for (i = 0; oursections[i]; i++)
+    if (!strcmp(section, oursections[i]))
+      return 1;
+
+  return 0;
+}
+
+static void copyextra(FILE *fp, FILE *extra, const char *want) {
+  char line[512], section[256] = "", *p;
+
+  if (!extra)
+    return;
+
+  rewind(extra);
+  while (fgets(line, sizeof(line), extra)) {
+    if (line[0] == '[' && (p = strchr(line, ']'))) {
+      snprintf(section, sizeof(section), "%.*s", (int)(p - line - 1), line + 1);
+
+      if (!want && !oursection(section))
+        fputs(line, fp);
+
+      continue;
+    }
+
+    if (want ? !strcmp(section, want) : (*section && !oursection(section)))
+      fputs(line, fp);
+  }
+}
+
+static char *writeconfig(int port) {
+  static char path[] = "/tmp/replayconf.XXXXXX";
+  FILE *fp, *extra = NULL;
+  int fd, i;
+
+  if ((fd = mkstemp(path)) == -1 || !(fp = fdopen(fd, "w"))) {
+    perror("mkstemp");
+    exit(1);
+  }
+
+  if (extraconf && !(extra = fopen(extraconf, "r"))) {
+    perror(extraconf);
+    unlink(path);
+    exit(1);
+  }
+
+  fprintf(fp, "[core]\nmoduledir=%s\nmodulesuffix=.so\nloadmodule=replay\nloadmodule=irc\n", moduledir);
+  for (i = 0; i < modulecount; i++)
+    fprintf(fp, "loadmodule=%s\n", modules[i]);
+  copyextra(fp, extra, "core");
+
+  fprintf(fp, "\n[irc]\nservername=%s\nservernumeric=%s\nhub=replay\n", servername, servernumeric);
+  copyextra(fp, extra, "irc");
+
+  fprintf(fp, "\n[hub-replay]\nhost=127.0.0.1\nport=%d\npass=replay\npingfreq=86400\n", port);
+  copyextra(fp, extra, "hub-replay");
+
+  fprintf(fp, "\n[replay]\nreport=%s\n", reportfile);
+  copyextra(fp, extra, "replay");
+
+  fputc('\n', fp);
+  copyextra(fp, extra, NULL);
+
+  if (extra)
+    fclose(extra);
+
+  fclose(fp);
+  return path;
+}
+
+static pid_t startnewserv(const char *config) {
+  pid_t pid;
+  int fd;
+
+  if ((pid = fork()) == -1) {
+    perror("fork");
+    exit(1);
+  }
+
+  if (pid)
+    return pid;
+
+  if (!verbose && (fd = open("/dev/null", O_WRONLY)) != -1) {
+    dup2(fd, 1);
+    dup2(fd, 2);
+  }
+
+  execl(newserv, newserv, config, (char *)NULL);
+  perror(newserv);
+  _exit(1);
+}
+
+/* Reads whatever newserv has sent, watching for the reply to our last ping.
+   Returns 0 once the connection has gone. */
+static int drain(int fd) {
+  char buf[16384], *p;
+  ssize_t n, i;
+
+  for (;;) {
+    n = read(fd, buf, sizeof(buf));
+    if (n == 0)
+      return 0;
+    if (n < 0)
+      return errno == EAGAIN || errno == EINTR;
+
+    for (i = 0; i < n; i++) {
+      if (buf[i] != '\n') {
+        if (inlen < sizeof(inbuf) - 1)
+          inbuf[inlen++] = buf[i];
+        continue;
+      }
+
+      inbuf[inlen] = '\0';
+      inlen = 0;
+
+      if ((p = strstr(inbuf, " Z ")) && strstr(p, donetoken))
+        done = 1;
+    }
+  }
+}
+
+/* Writes as much of the buffer as the socket takes.  Returns 0 if it's gone. */
+static int flush(int fd) {
+  ssize_t n;
+
+  while (outpos < outlen) {
+    n = write(fd, outbuf + outpos, outlen - outpos);
+    if (n < 0)
+      return errno == EAGAIN || errno == EINTR;
+
+    outpos += n;
+  }
+
+  outpos = outlen = 0;
+  return 1;
+}
+
+/* Waits for the socket to be readable, and writable too if there's anything
+   to write, for at most timeout ms.  Returns 0 if the connection has gone. */
+static int pump(int fd, int timeout) {
+  struct pollfd pfd;
+
+  pfd.fd = fd;
+  pfd.events = POLLIN | ((outpos < outlen) ? POLLOUT : 0);
+
+  if (poll(&pfd, 1, timeout) < 0 && errno != EINTR)
+    return 0;
+
+  if ((pfd.revents & (POLLIN | POLLHUP | POLLERR)) && !drain(fd))
+    return 0;
+
+  if (pfd.revents & POLLOUT)
+    return flush(fd);
+
+  return 1;
+}
+
+/* The uplink's numeric, from its SERVER line, so our final ping looks like
+   it came from there. */
+static void hubnumeric(const char *line, char *numeric) {
+  char word[64];
+  const char *p = line;
+  int i;
+
+  for (i = 0; i < 7; i++) {
+    if (sscanf(p, "%63s", word) != 1)
+      return;
+
+    if (i == 6) {
+      numeric[0] = word[0];
+      numeric[1] = word[1];
+      numeric[2] = '\0';
+      return;
+    }
+
+    while (*p == ' ')
+      p++;
+    p += strlen(word);
+  }
+}
+
+int main(int argc, char **argv) {
+  struct sockaddr_in sin;
+  socklen_t sinlen = sizeof(sin);
+  char *config, *line = NULL, *text, hub[3] = "", buf[4096];
+  double firstts = -1, ts, start = 0, elapsed, wait;
+  unsigned long lines = 0, bytes = 0;
+  size_t linecap = 0, len;
+  ssize_t linelen;
+  int c, listenfd, fd, status, alive = 1, one = 1;
+  struct pollfd pfd;
+  FILE *fp;
+  pid_t pid;
+
+  while ((c = getopt(argc, argv, "rvm:c:s:n:x:d:o:")) != -1) {
+    switch (c) {
+      case 'r': realtime = 1; break;
+      case 'v': verbose = 1; break;
+      case 'm':
+        if (modulecount == MAXMODULES)
+          usage(argv[0]);
+        modules[modulecount++] = optarg;
+        break;
+      case 'c': extraconf = optarg; break;
+      case 's': servername = optarg; break;
+      case 'n': servernumeric = optarg; break;
+      case 'x': newserv = optarg; break;
+      case 'd': moduledir = optarg; break;
+      case 'o': reportfile = optarg; break;
+      default: usage(argv[0]);
+    }
+  }
+
+  if (optind != argc - 1)
+    usage(argv[0]);
+
+  if (!(fp = fopen(argv[optind], "r"))) {
+    perror(argv[optind]);
+    return 1;
+  }
+
+  readheader(fp);
+  if (!servername || !servernumeric) {
+    fprintf(stderr, "%s has no \"# connect\" line, give -s and -n.\n", argv[optind]);
+    return 1;
+  }
+
+  signal(SIGPIPE, SIG_IGN);
+
+  memset(&sin, 0, sizeof(sin));
+  sin.sin_family = AF_INET;
+  sin.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+  if ((listenfd = socket(AF_INET, SOCK_STREAM, 0)) == -1 || setsockopt(listenfd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one)) ||
+      bind(listenfd, (struct sockaddr *)&sin, sizeof(sin)) || listen(listenfd, 1) ||
+      getsockname(listenfd, (struct sockaddr *)&sin, &sinlen)) {
+    perror("listen");
+    return 1;
+  }
+
+  config = writeconfig(ntohs(sin.sin_port));
+  unlink(reportfile);
+  pid = startnewserv(config);
+
+  pfd.fd = listenfd;
+  pfd.events = POLLIN;
+  if (poll(&pfd, 1, STARTTIMEOUT) != 1 || (fd = accept(listenfd, NULL, NULL)) == -1) {
+    fprintf(stderr, "newserv didn't connect, run with -v to see why.\n");
+    kill(pid, SIGKILL);
+    waitpid(pid, NULL, 0);
+    unlink(config);
+    return 1;
+  }
+
+  close(listenfd);
+  fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+  snprintf(donetoken, sizeof(donetoken), "replaydone.%d", (int)getpid());
+
+  start = now();
+
+  while (alive && (linelen = getline(&line, &linecap, fp)) != -1) {
+    while (linelen && (line[linelen - 1] == '\n' || line[linelen - 1] == '\r'))
+      line[--linelen] = '\0';
+
+    if (line[0] == '#') {
+      if (!strncmp(line, "# connect ", 10) && lines)
+        break;
+      continue;
+    }
+
+    ts = strtod(line, &text);
+    if (text == line || *text != ' ')
+      continue;
+    text++;
+
+    if (!*hub && lines < 3 && !strncmp(text, "SERVER ", 7))
+      hubnumeric(text, hub);
+
+    if (realtime) {
+      if (firstts < 0)
+        firstts = ts;
+
+      /* get everything before this line to newserv, then sleep until it's due */
+      while (alive && (wait = (ts - firstts) - (now() - start)) > 0)
+        alive = pump(fd, (int)(wait * 1000) + 1);
+    }
+
+    len = strlen(text);
+    while (alive && outlen + len + 2 > sizeof(outbuf))
+      if ((alive = flush(fd)) && outlen)
+        alive = pump(fd, -1);
+
+    memcpy(outbuf + outlen, text, len);
+    outlen += len;
+    outbuf[outlen++] = '\r';
+    outbuf[outlen++] = '\n';
+
+    lines++;
+    bytes += len + 2;
+
+    if (alive && !realtime && (lines & 63) == 0)
+      alive = drain(fd);
+  }
+
+  free(line);
+  fclose(fp);
+
+  /* newserv answers pings in order, so once this comes back it's been
+     through everything before it */
+  if (alive) {
+    len = snprintf(buf, sizeof(buf), "%s G :%s\r\n", *hub ? hub : "AA", donetoken);
+    while (alive && outlen + len > sizeof(outbuf))
+      if ((alive = flush(fd)) && outlen)
+        alive = pump(fd, -1);
+
+    memcpy(outbuf + outlen, buf, len);
+    outlen += len;
+
+    while (alive && !done)
+      alive = pump(fd, -1);
+  }
+
+  elapsed = now() - start;
+
+  if (!done)
+    fprintf(stderr, "newserv dropped the connection before the end of the capture.\n");
+
+  printf("%lu lines (%lu bytes) in %.3f s: %.0f lines/s, %.2f MB/s%s\n", lines, bytes, elapsed,
+    lines / elapsed, bytes / elapsed / 1048576, realtime ? " (recorded speed)" : "");
+
+  kill(pid, SIGUSR1);
+
+  start = now();
+  while (waitpid(pid, &status, WNOHANG) == 0) {
+    if (now() - start > FINISHTIMEOUT / 1000) {
+      fprintf(stderr, "newserv didn't exit, killing it.\n");
+      kill(pid, SIGKILL);
+      waitpid(pid, &status, 0);
+      break;
+    }
+
+    if (!alive || !pump(fd, 100)) {
+      alive = 0;
+      poll(NULL, 0, 100);
+    }
+  }
+
+  close(fd);
+  unlink(config);
+
+  if (!(fp = fopen(reportfile, "r"))) {
+    fprintf(stderr, "No report in %s, run with -v to see why.\n", reportfile);
+    return 1;
+  }
+
+  while ((len = fread(buf, 1, sizeof(buf), fp)) > 0)
+    fwrite(buf, 1, len, stdout);
+
+  fclose(fp);
+  return done ? 0 : 1;
+}
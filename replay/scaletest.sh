@@ -0,0 +1,82 @@
+#!/bin/sh
+#
+# Generates networks of each size with netgen and replays them into
+# newserv, once with just the core network modules and once with the
+# modules under test, so the difference is what those modules cost.
+# Results go to stdout and scaletest-<date>.log.
+#
+# Run from the top of the tree after "make && make install":
+#   replay/scaletest.sh [users ...]
+#
+# MODULES overrides the modules under test; any that weren't built here
+# (newsearch and chanfix need pcre) are skipped and listed in the log.
+
+MODULES=${MODULES:-"sqlite-dbapi2 trusts_master glines chanfix newsearch proxyscan"}
+SIZES=${*:-"10000 100000 1000000"}
+TOP=`pwd`
+TMP=${TMPDIR:-/tmp}/scaletest.$$
+LOG=$TOP/scaletest-`date +%Y%m%d-%H%M%S`.log
+
+if [ ! -x ./newserv -o ! -d ./modules -o ! -x replay/netgen -o ! -x replay/replaydriver ]; then
+  echo "Build and install first (make && make install), and run from the top of the tree." >&2
+  exit 1
+fi
+
+# newserv runs in here, so its databases and logs don't touch the tree
+mkdir -p $TMP/logs || exit 1
+trap 'rm -rf $TMP' 0 INT TERM
+
+# nothing here should talk to the outside world or need a real database
+cat > $TMP/scaletest.conf <<EOF
+[trusts]
+master=1
+
+[proxyscan]
+maxscans=0
+ip=127.0.0.1
+EOF
+
+modargs=
+skipped=
+for m in $MODULES; do
+  if [ -f modules/$m.so ]; then
+    modargs="$modargs -m $m"
+  else
+    skipped="$skipped $m"
+  fi
+done
+
+log() {
+  echo "$*" | tee -a $LOG
+}
+
+log "scaletest `date`, `uname -srm`, `git describe --always --dirty 2>/dev/null`"
+log "modules:$modargs"
+[ -n "$skipped" ] && log "not built, skipped:$skipped"
+
+for users in $SIZES; do
+  servers=$(( users / 50000 + 20 ))
+
+  log ""
+  log "=== $users users on $servers servers"
+
+  start=`date +%s`
+  # real networks don't have more glines just because they're bigger;
+  # the SQ line in the report is one server splitting off afterwards
+  replay/netgen -u $users -S $servers -g 500 -q 1 -o $TMP/net || exit 1
+  log "netgen: `wc -l < $TMP/net` lines, `du -k $TMP/net | cut -f1` KB, $(( `date +%s` - start ))s"
+
+  for run in baseline modules; do
+    if [ $run = baseline ]; then
+      args="-m channel"
+    else
+      args="-m channel $modargs"
+    fi
+
+    log ""
+    log "--- $run"
+    (cd $TMP && rm -f *.db && $TOP/replay/replaydriver -x $TOP/newserv -d $TOP/modules $args -c scaletest.conf net) 2>&1 | tee -a $LOG
+  done
+
+  rm -f $TMP/net
+done
@@ -196,7 +196,7 @@ void rq_handler(nick *target, int type, void **params) {
         rejoinline(cargv[cmd->maxparams], cargc - cmd->maxparams);
 
       /* handle the command */
-      cmd->handler((void*)user, min(cargc - 1, cmd->maxparams), &(cargv[1]));
+      callcommand(cmd, (void*)user, min(cargc - 1, cmd->maxparams), &(cargv[1]));
 
       break;
     case LU_KILLED:
@@ -24,6 +24,15 @@ void serverlist_hook_lostserver(int hook, void *arg);
 int serverlist_versionreply(void *source, int cargc, char **cargv);
 void serverlist_pingservers(void *arg);
 int serverlist_rpong(void *source, int cargc, char **cargv);
+int cmd_serverlatency(void *sender, int cargc, char **cargv);
+void serverlist_hook_pingreply(int hook, void *arg);
+void serverlist_hook_stats(int hook, void *arg);
+
+/* every server is pinged once per interval, a slot at a time */
+#define SERVERLIST_PING_INTERVAL 60
+#define SERVERLIST_PING_SLOTS    12
+
+#define SERVERLIST_SPIKE_WARN_INTERVAL 300
 
 const flag servertypeflags[] = {
   { 'c', SERVERTYPEFLAG_CLIENT_SERVER },
@@ -37,7 +46,7 @@ const flag servertypeflags[] = {
 
 struct {
   int used;
-  int lag;
+  serverlatency latency;
   sstring *version1;
   sstring *version2;
   flag_t type;
@@ -48,6 +57,9 @@ void serverlist_doversion(void);
 static sstring *s_server, *q_server;
 static pcre *service_re, *hub_re, *not_client_re;
 
+static serverlatency uplinklatency;
+static unsigned int pingslot;
+
 static pcre *compilefree(sstring *re) {
   const char *err;
   int erroffset;
@@ -66,9 +78,12 @@ static pcre *compilefree(sstring *re) {
 
 void _init(void) {
   registercontrolhelpcmd("serverlist",NO_OPER,1,&cmd_serverlist,"Usage: serverlist [pattern]\nShows all currently connected servers");
+  registercontrolhelpcmd("serverlatency",NO_OPER,1,&cmd_serverlatency,"Usage: serverlatency [pattern]\nShows round trip times to connected servers over the last few pings.");
   /* hooks for serverlist */
   registerhook(HOOK_SERVER_NEWSERVER, &serverlist_hook_newserver);
   registerhook(HOOK_SERVER_LOSTSERVER, &serverlist_hook_lostserver);
+  registerhook(HOOK_IRC_PINGREPLY, &serverlist_hook_pingreply);
+  registerhook(HOOK_CORE_STATSREQUEST, &serverlist_hook_stats);
   int i;
 
   q_server = getcopyconfigitem("serverlist", "q_server", "CServe.quakenet.org", HOSTLEN);
@@ -84,7 +99,7 @@ void _init(void) {
     else
       serverinfo[i].used = 0;
 
-    serverinfo[i].lag = -1;
+    serverlatency_reset(&serverinfo[i].latency);
     serverinfo[i].version1 = NULL;
     serverinfo[i].version2 = NULL;
     serverinfo[i].type = getservertype(&serverlist[i]);
@@ -92,7 +107,9 @@ void _init(void) {
   registernumerichandler(351, &serverlist_versionreply, 2);
   registerserverhandler("RO", &serverlist_rpong, 4);
 
-  schedulerecurring(time(NULL)+1, 0, 60, &serverlist_pingservers, NULL);
+  serverlatency_reset(&uplinklatency);
+
+  schedulerecurring(time(NULL)+1, 0, SERVERLIST_PING_INTERVAL / SERVERLIST_PING_SLOTS, &serverlist_pingservers, NULL);
 }
 
 void _fini(void) {
@@ -108,8 +125,11 @@ void _fini(void) {
 
   deregisterhook(HOOK_SERVER_NEWSERVER, &serverlist_hook_newserver);
   deregisterhook(HOOK_SERVER_LOSTSERVER, &serverlist_hook_lostserver);
+  deregisterhook(HOOK_IRC_PINGREPLY, &serverlist_hook_pingreply);
+  deregisterhook(HOOK_CORE_STATSREQUEST, &serverlist_hook_stats);
 
   deregistercontrolcmd("serverlist",cmd_serverlist);
+  deregistercontrolcmd("serverlatency",cmd_serverlatency);
 
   deleteschedule(NULL, &serverlist_pingservers, NULL);
 
@@ -141,10 +161,10 @@ int cmd_serverlist(void *sender, int cargc, char **cargv) {
       acount += ucount;
       scount++;
 
-      if (serverinfo[i].lag == -1)
+      if (serverinfo[i].latency.last == -1)
         strcpy(lagstr, "-");
       else
-        snprintf(lagstr, sizeof(lagstr), "%d", serverinfo[i].lag);
+        snprintf(lagstr, sizeof(lagstr), "%d", serverinfo[i].latency.last);
 
       strlcpy(buf, printflags(serverinfo[i].type, servertypeflags), sizeof(buf));
 
@@ -208,6 +228,7 @@ void serverlist_hook_newserver(int hook, void *arg) {
   long num = (long)arg;
 
   serverinfo[num].used = 1;
+  serverlatency_reset(&serverinfo[num].latency);
   serverinfo[num].version1 = NULL;
   serverinfo[num].version2 = NULL;
   serverinfo[num].type = getservertype(&serverlist[num]);
@@ -228,6 +249,7 @@ void serverlist_hook_lostserver(int hook, void *arg) {
   long num = (long)arg;
 
   serverinfo[num].used = 0;
+  serverlatency_reset(&serverinfo[num].latency);
   freesstring(serverinfo[num].version1);
   freesstring(serverinfo[num].version2);
 }
@@ -286,7 +308,7 @@ flag_t getservertype(server *server) {
 }
 
 void serverlist_pingservers(void *arg) {
-  int i;
+  int i, slot;
   server *from, *to;
   char fnum[10], tnum[10];
   struct timeval tv;
@@ -294,7 +316,9 @@ void serverlist_pingservers(void *arg) {
   if (!mynick)
     return;
 
-  for(i=0;i<MAXSERVERS;i++) {
+  slot = pingslot++ % SERVERLIST_PING_SLOTS;
+
+  for(i=slot;i<MAXSERVERS;i+=SERVERLIST_PING_SLOTS) {
     to = &serverlist[i];
 
     if (to->parent == -1)
@@ -319,6 +343,22 @@ void serverlist_pingservers(void *arg) {
   }
 }
 
+static void serverlist_addlatency(int num, int lag) {
+  serverlatency *sl = &serverinfo[num].latency;
+
+  if (!serverinfo[num].used)
+    return;
+
+  if (!serverlatency_add(sl, lag) || sl->lastwarned + SERVERLIST_SPIKE_WARN_INTERVAL > time(NULL))
+    return;
+
+  sl->lastwarned = time(NULL);
+
+  /* the uplink's own lag says whether it's this server or us */
+  controlwall(NO_OPER, NL_MISC, "Lag spike on %s: %dms (p50 %dms, p95 %dms), uplink currently %dms",
+              serverlist[num].name->content, lag, serverlatency_percentile(sl, 50), serverlatency_percentile(sl, 95), uplinklatency.last);
+}
+
 int serverlist_rpong(void *source, int cargc, char **cargv) {
   int to, lag;
   struct timeval tv;
@@ -346,7 +386,96 @@ int serverlist_rpong(void *source, int cargc, char **cargv) {
     lag = atoi(cargv[2]);
   }
 
-  serverinfo[to].lag = lag;
+  serverlist_addlatency(to, lag);
 
   return CMD_OK;
 }
+
+void serverlist_hook_pingreply(int hook, void *arg) {
+  long rtt = (long)arg;
+
+  if (serverlatency_add(&uplinklatency, rtt) && uplinklatency.lastwarned + SERVERLIST_SPIKE_WARN_INTERVAL <= time(NULL)) {
+    uplinklatency.lastwarned = time(NULL);
+    controlwall(NO_OPER, NL_MISC, "Lag spike on uplink %s: %ldms (p50 %dms, p95 %dms)",
+                (myhub != -1 && serverlist[myhub].name) ? serverlist[myhub].name->content : "(unknown)", rtt,
+                serverlatency_percentile(&uplinklatency, 50), serverlatency_percentile(&uplinklatency, 95));
+  }
+}
+
+static void formatlatency(char *buf, size_t len, int ms) {
+  if (ms == -1)
+    strlcpy(buf, "-", len);
+  else
+    snprintf(buf, len, "%d", ms);
+}
+
+static void replylatency(nick *np, const char *numeric, const char *name, serverlatency *sl) {
+  char last[12], p50[12], p95[12], p99[12];
+
+  formatlatency(last, sizeof(last), sl->last);
+  formatlatency(p50, sizeof(p50), serverlatency_percentile(sl, 50));
+  formatlatency(p95, sizeof(p95), serverlatency_percentile(sl, 95));
+  formatlatency(p99, sizeof(p99), serverlatency_percentile(sl, 99));
+
+  controlreply(np, "%-7s %-35s %6s %6s %6s %6s %6d %7u %6u", numeric, name, last, p50, p95, p99,
+               serverlatency_jitter(sl), sl->total, sl->spikes);
+}
+
+int cmd_serverlatency(void *sender, int cargc, char **cargv) {
+  nick *np = (nick *)sender;
+  char numeric[12];
+  int i;
+
+  controlreply(np, "%-7s %-35s %6s %6s %6s %6s %6s %7s %6s", "Numeric", "Hostname", "Last", "p50", "p95", "p99", "Jitter", "Samples", "Spikes");
+
+  if (cargc < 1 || match2strings(cargv[0], "uplink"))
+    replylatency(np, "-", "(uplink)", &uplinklatency);
+
+  for (i = 0; i < MAXSERVERS; i++) {
+    if (serverlist[i].linkstate != LS_LINKED || !serverinfo[i].used)
+      continue;
+
+    if (cargc >= 1 && !match2strings(cargv[0], serverlist[i].name->content))
+      continue;
+
+    snprintf(numeric, sizeof(numeric), "%d", i);
+    replylatency(np, numeric, serverlist[i].name->content, &serverinfo[i].latency);
+  }
+
+  controlreply(np, "--- End of list. Times are in ms over the last %d pings.", SERVERLATENCY_SAMPLES);
+
+  return CMD_OK;
+}
+
+void serverlist_hook_stats(int hook, void *arg) {
+  long level = (long)arg;
+  int i, p95, worst = -1, worstp95 = -1;
+  unsigned int spikes = uplinklatency.spikes;
+  char buf[512];
+
+  for (i = 0; i < MAXSERVERS; i++) {
+    if (!serverinfo[i].used)
+      continue;
+
+    spikes += serverinfo[i].latency.spikes;
+
+    p95 = serverlatency_percentile(&serverinfo[i].latency, 95);
+    if (p95 > worstp95) {
+      worstp95 = p95;
+      worst = i;
+    }
+  }
+
+  if (level > 2) {
+    snprintf(buf, sizeof(buf), "Latency : uplink last %dms, p50 %dms, p95 %dms, p99 %dms, jitter %dms, %u spikes in total",
+             uplinklatency.last, serverlatency_percentile(&uplinklatency, 50), serverlatency_percentile(&uplinklatency, 95),
+             serverlatency_percentile(&uplinklatency, 99), serverlatency_jitter(&uplinklatency), spikes);
+    triggerhook(HOOK_CORE_STATSREPLY, buf);
+  }
+
+  if (level > 5 && worst != -1 && serverlist[worst].name) {
+    snprintf(buf, sizeof(buf), "Latency : worst p95 %dms on %s (p50 %dms, p99 %dms)", worstp95, serverlist[worst].name->content,
+             serverlatency_percentile(&serverinfo[worst].latency, 50), serverlatency_percentile(&serverinfo[worst].latency, 99));
+    triggerhook(HOOK_CORE_STATSREPLY, buf);
+  }
+}
@@ -16,4 +16,25 @@
 extern const flag servertypeflags[];
 flag_t getservertype(server *server);
 
+#define SERVERLATENCY_SAMPLES     64
+#define SERVERLATENCY_MINSAMPLES  10  /* history needed before anything counts as a spike */
+#define SERVERLATENCY_SPIKEFACTOR 3   /* a spike is over this many times the p95... */
+#define SERVERLATENCY_SPIKEMIN    250 /* ...and at least this many ms over the p50 */
+
+typedef struct serverlatency {
+  int samples[SERVERLATENCY_SAMPLES]; /* ring, oldest at head once full */
+  int sorted[SERVERLATENCY_SAMPLES];
+  int count, head;
+  int last;                           /* -1 until the first sample */
+  int jitter;                         /* in 1/16 ms */
+  unsigned int total, spikes;
+  time_t lastwarned;
+} serverlatency;
+
+#define serverlatency_jitter(sl) (((sl)->jitter + 8) / 16)
+
+void serverlatency_reset(serverlatency *sl);
+int serverlatency_add(serverlatency *sl, int ms);
+int serverlatency_percentile(serverlatency *sl, int pct);
+
 #endif
@@ -0,0 +1,90 @@
+/*
+ * Round trip history for one server.
+ *
+ * The last SERVERLATENCY_SAMPLES pings are kept twice: in arrival order, so
+ * the oldest can be dropped, and sorted, so percentiles are just a lookup.
+ * Keeping the sorted copy up to date is one binary search and memmove per
+ * sample, which is nothing at this size.
+ */
+
+#include <string.h>
+
+#include "serverlist.h"
+
+void serverlatency_reset(serverlatency *sl) {
+  memset(sl, 0, sizeof(serverlatency));
+  sl->last = -1;
+}
+
+/* first position in sorted that isn't less than ms */
+static int serverlatency_find(serverlatency *sl, int ms) {
+  int lo = 0, hi = sl->count, mid;
+
+  while (lo < hi) {
+    mid = (lo + hi) / 2;
+
+    if (sl->sorted[mid] < ms)
+      lo = mid + 1;
+    else
+      hi = mid;
+  }
+
+  return lo;
+}
+
+int serverlatency_percentile(serverlatency *sl, int pct) {
+  int rank;
+
+  if (!sl->count)
+    return -1;
+
+  /* nearest rank */
+  rank = (pct * sl->count + 99) / 100;
+  if (rank < 1)
+    rank = 1;
+
+  return sl->sorted[rank - 1];
+}
+
+int serverlatency_add(serverlatency *sl, int ms) {
+  int pos, old, p50, p95, spike = 0;
+
+  if (ms < 0)
+    ms = 0;
+
+  /* judged against the history before this sample joins it */
+  if (sl->count >= SERVERLATENCY_MINSAMPLES) {
+    p50 = serverlatency_percentile(sl, 50);
+    p95 = serverlatency_percentile(sl, 95);
+
+    if (ms > p95 * SERVERLATENCY_SPIKEFACTOR && ms - p50 >= SERVERLATENCY_SPIKEMIN)
+      spike = 1;
+  }
+
+  if (sl->count == SERVERLATENCY_SAMPLES) {
+    old = sl->samples[sl->head];
+    pos = serverlatency_find(sl, old);
+    memmove(&sl->sorted[pos], &sl->sorted[pos + 1], sizeof(int) * (sl->count - pos - 1));
+    sl->count--;
+  }
+
+  pos = serverlatency_find(sl, ms);
+  memmove(&sl->sorted[pos + 1], &sl->sorted[pos], sizeof(int) * (sl->count - pos));
+  sl->sorted[pos] = ms;
+  sl->count++;
+
+  sl->samples[sl->head] = ms;
+  sl->head = (sl->head + 1) % SERVERLATENCY_SAMPLES;
+
+  /* RFC 3550 style: J += (|D| - J) / 16, kept scaled up by 16 */
+  if (sl->last != -1)
+    sl->jitter += ((ms > sl->last) ? ms - sl->last : sl->last - ms) - (sl->jitter + 8) / 16;
+
+  sl->last = ms;
+  sl->total++;
+
+  if (spike)
+    sl->spikes++;
+
+  return spike;
+}
@@ -0,0 +1,224 @@
+/* nssnap.c: reader for the snapshot module's shared memory file.
+ *
+ * Doesn't depend on anything else in newserv, so it can be linked straight
+ * into external tools. */
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "nssnap.h"
+
+#define NSSNAP_RETRIES 100
+
+struct nssnap {
+  char *path;
+  const unsigned char *map;
+  size_t size;
+};
+
+static int nssnap_map(nssnap *s) {
+  const nssnap_header *h;
+  struct stat st;
+  void *map;
+  int fd;
+
+  if((fd = open(s->path, O_RDONLY)) < 0)
+    return 0;
+
+  if(fstat(fd, &st) || st.st_size < (off_t)sizeof(nssnap_header)) {
+    close(fd);
+    return 0;
+  }
+
+  map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+  close(fd);
+  if(map == MAP_FAILED)
+    return 0;
+
+  h = map;
+  if(h->magic != NSSNAP_MAGIC || h->version != NSSNAP_VERSION || h->size > (uint64_t)st.st_size) {
+    munmap(map, st.st_size);
+    return 0;
+  }
+
+  s->map = map;
+  s->size = st.st_size;
+  return 1;
+}
+
+static void nssnap_unmap(nssnap *s) {
+  if(s->map)
+    munmap((void *)s->map, s->size);
+  s->map = NULL;
+}
+
+nssnap *nssnap_open(const char *path) {
+  nssnap *s = calloc(1, sizeof(nssnap));
+
+  if(!s)
+    return NULL;
+
+  s->path = malloc(strlen(path) + 1);
+  if(!s->path) {
+    free(s);
+    return NULL;
+  }
+  strcpy(s->path, path);
+
+  if(!nssnap_map(s)) {
+    nssnap_close(s);
+    return NULL;
+  }
+
+  return s;
+}
+
+void nssnap_close(nssnap *s) {
+  nssnap_unmap(s);
+  free(s->path);
+  free(s);
+}
+
+/* Follows newserv onto a new file if the one we have has been replaced. */
+static int nssnap_current(nssnap *s) {
+  if(s->map && !((const nssnap_header *)s->map)->retired)
+    return 1;
+
+  nssnap_unmap(s);
+  return nssnap_map(s);
+}
+
+uint64_t nssnap_generation(nssnap *s) {
+  const nssnap_header *h;
+
+  if(!nssnap_current(s))
+    return 0;
+
+  h = (const nssnap_header *)s->map;
+  return h->slot[h->active & 1].generation;
+}
+
+static int nssnap_validate(nssnap_view *v, const nssnap_data *d, uint64_t length) {
+  uint64_t i;
+
+  if(d->useroffset + (uint64_t)d->users * sizeof(nssnap_user) > length ||
+     d->channeloffset + (uint64_t)d->channels * sizeof(nssnap_channel) > length ||
+     d->memberoffset + (uint64_t)d->members * sizeof(nssnap_member) > length ||
+     d->accountoffset + (uint64_t)d->accounts * sizeof(nssnap_account) > length ||
+     d->stringoffset + d->stringsize > length || !d->stringsize)
+    return 0;
+
+  v->nusers = d->users;
+  v->nchannels = d->channels;
+  v->nmembers = d->members;
+  v->naccounts = d->accounts;
+  v->users = (const nssnap_user *)((const char *)d + d->useroffset);
+  v->channels = (const nssnap_channel *)((const char *)d + d->channeloffset);
+  v->members = (const nssnap_member *)((const char *)d + d->memberoffset);
+  v->accounts = (const nssnap_account *)((const char *)d + d->accountoffset);
+  v->strings = (const char *)d + d->stringoffset;
+  v->stringsize = d->stringsize;
+
+  if(v->strings[v->stringsize - 1])
+    return 0;
+
+  for(i=0;i<v->nchannels;i++)
+    if((uint64_t)v->channels[i].firstmember + v->channels[i].members > v->nmembers)
+      return 0;
+
+  for(i=0;i<v->nmembers;i++)
+    if(v->members[i].user >= v->nusers)
+      return 0;
+
+  return 1;
+}
+
+/* Copies the latest snapshot out.  Returns NULL if there isn't one, or if
+ * newserv kept overwriting it faster than we could copy. */
+nssnap_view *nssnap_acquire(nssnap *s) {
+  const nssnap_header *h;
+  const nssnap_slot *slot;
+  nssnap_view *v;
+  uint32_t seq;
+  uint64_t length, generation;
+  int64_t timestamp;
+  int i;
+
+  for(i=0;i<NSSNAP_RETRIES;i++) {
+    if(!nssnap_current(s))
+      return NULL;
+
+    h = (const nssnap_header *)s->map;
+    slot = &h->slot[h->active & 1];
+
+    seq = slot->seq;
+    __sync_synchronize();
+    if(seq & 1)
+      continue;
+
+    length = slot->length;
+    generation = slot->generation;
+    timestamp = slot->timestamp;
+    if(!generation)
+      return NULL;
+
+    if(length < sizeof(nssnap_data) || length > slot->capacity || slot->offset + slot->capacity > s->size)
+      continue;
+
+    v = calloc(1, sizeof(nssnap_view));
+    if(!v)
+      return NULL;
+    v->buf = malloc(length);
+    if(!v->buf) {
+      free(v);
+      return NULL;
+    }
+
+    memcpy(v->buf, s->map + slot->offset, length);
+    __sync_synchronize();
+
+    if(slot->seq == seq && !h->retired && nssnap_validate(v, v->buf, length)) {
+      v->generation = generation;
+      v->timestamp = timestamp;
+      return v;
+    }
+
+    nssnap_release(v);
+  }
+
+  return NULL;
+}
+
+void nssnap_release(nssnap_view *v) {
+  free(v->buf);
+  free(v);
+}
+
+const char *nssnap_str(const nssnap_view *v, uint32_t offset) {
+  if(offset >= v->stringsize)
+    return "";
+
+  return v->strings + offset;
+}
+
+const nssnap_user *nssnap_userbynumeric(const nssnap_view *v, uint32_t numeric) {
+  uint32_t lo = 0, hi = v->nusers, mid;
+
+  while(lo < hi) {
+    mid = lo + (hi - lo) / 2;
+    if(v->users[mid].numeric < numeric)
+      lo = mid + 1;
+    else
+      hi = mid;
+  }
+
+  if(lo < v->nusers && v->users[lo].numeric == numeric)
+    return &v->users[lo];
+
+  return NULL;
+}
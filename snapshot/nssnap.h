@@ -0,0 +1,121 @@
+/* nssnap.h: layout of the network snapshot published by the snapshot
+ * module, and a small library for reading it.
+ *
+ * The snapshot file is mapped MAP_SHARED by newserv and by any number of
+ * readers.  It holds two slots: newserv writes a new snapshot into the one
+ * readers aren't being pointed at and then flips "active" over to it.
+ * Each slot has a sequence number which is odd while it's being written,
+ * so a reader that copies a slot out and sees the same even sequence
+ * number before and after has a consistent copy.
+ *
+ * When a snapshot outgrows its slot newserv creates a bigger file, renames
+ * it over the old one and marks the old one retired; readers notice that
+ * and reopen the path.
+ *
+ * Everything is in host byte order (the file isn't meant to leave the
+ * machine), except IP addresses which are in network order.  Strings are
+ * NUL terminated and referenced by offset into the string table; offset 0
+ * is always the empty string. */
+
+#ifndef __NSSNAP_H
+#define __NSSNAP_H
+
+#include <stdint.h>
+
+#define NSSNAP_MAGIC   0x50414e53  /* "SNAP" */
+#define NSSNAP_VERSION 1
+
+typedef struct nssnap_slot {
+  volatile uint32_t seq;
+  uint32_t pad;
+  uint64_t offset;      /* from the start of the file */
+  uint64_t capacity;
+  uint64_t length;
+  uint64_t generation;
+  int64_t timestamp;
+} nssnap_slot;
+
+typedef struct nssnap_header {
+  uint32_t magic;
+  uint32_t version;
+  uint64_t size;
+  volatile uint32_t active;
+  volatile uint32_t retired;
+  uint32_t pid;
+  uint32_t pad;
+  nssnap_slot slot[2];
+} nssnap_header;
+
+/* Start of each slot. */
+typedef struct nssnap_data {
+  uint32_t users, channels, members, accounts;
+  uint64_t useroffset, channeloffset, memberoffset, accountoffset;
+  uint64_t stringoffset, stringsize;
+} nssnap_data;
+
+/* Users are sorted by numeric. */
+typedef struct nssnap_user {
+  uint32_t numeric;
+  uint32_t nick, ident, host, fakehost, realname, account;
+  uint32_t channels;
+  uint64_t accountid;
+  uint64_t umodes;
+  int64_t timestamp;
+  uint8_t ip[16];
+} nssnap_user;
+
+typedef struct nssnap_channel {
+  uint32_t name, topic, key;
+  uint32_t limit;
+  uint32_t firstmember, members;
+  uint64_t modes;
+  int64_t timestamp;
+} nssnap_channel;
+
+#define NSSNAP_MEMBER_OP    0x1
+#define NSSNAP_MEMBER_VOICE 0x2
+
+typedef struct nssnap_member {
+  uint32_t user;        /* index into the user table */
+  uint32_t flags;
+} nssnap_member;
+
+typedef struct nssnap_account {
+  uint64_t id;
+  uint64_t flags;
+  uint32_t name;
+  uint32_t users;
+} nssnap_account;
+
+/* Reader side. */
+
+typedef struct nssnap nssnap;
+
+/* A private, validated copy of one snapshot. */
+typedef struct nssnap_view {
+  uint64_t generation;
+  int64_t timestamp;
+
+  uint32_t nusers, nchannels, nmembers, naccounts;
+  const nssnap_user *users;
+  const nssnap_channel *channels;
+  const nssnap_member *members;
+  const nssnap_account *accounts;
+
+  const char *strings;
+  uint64_t stringsize;
+
+  void *buf;
+} nssnap_view;
+
+nssnap *nssnap_open(const char *path);
+void nssnap_close(nssnap *s);
+
+uint64_t nssnap_generation(nssnap *s);
+nssnap_view *nssnap_acquire(nssnap *s);
+void nssnap_release(nssnap_view *v);
+
+const char *nssnap_str(const nssnap_view *v, uint32_t offset);
+const nssnap_user *nssnap_userbynumeric(const nssnap_view *v, uint32_t numeric);
+
+#endif
@@ -0,0 +1,102 @@
+/* snapdump: prints the contents of a snapshot published by the snapshot
+ * module, mainly as an example of using nssnap.
+ *
+ * Usage: snapdump [-u] [-c] [-m] [-a] [file]
+ *   -u  users:    N <nick> <ident> <host> <ip> <account or 0> <realname>
+ *   -c  channels: C <channel> <users> [<topic>]
+ *   -m  members:  M <channel> <nick> [@][+]
+ *   -a  accounts: A <account> <id> <users>
+ * Without any of those only a summary line is printed. */
+
+#define _POSIX_C_SOURCE 200112L
+
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+
+#include "nssnap.h"
+
+static void formatip(const uint8_t *ip, char *buf, size_t len) {
+  static const uint8_t v4mapped[12] = { 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0xff, 0xff };
+
+  if(!memcmp(ip, v4mapped, sizeof(v4mapped)))
+    inet_ntop(AF_INET, ip + 12, buf, len);
+  else
+    inet_ntop(AF_INET6, ip, buf, len);
+}
+
+int main(int argc, char **argv) {
+  int dumpusers = 0, dumpchannels = 0, dumpmembers = 0, dumpaccounts = 0;
+  const char *file = "data/snapshot";
+  const nssnap_channel *cp;
+  const nssnap_member *mp;
+  const nssnap_user *up;
+  nssnap_view *v;
+  nssnap *s;
+  char ip[INET6_ADDRSTRLEN];
+  uint32_t i, j;
+  int c;
+
+  while((c = getopt(argc, argv, "ucma")) != -1) {
+    switch(c) {
+      case 'u': dumpusers = 1; break;
+      case 'c': dumpchannels = 1; break;
+      case 'm': dumpmembers = 1; break;
+      case 'a': dumpaccounts = 1; break;
+      default:
+        fprintf(stderr, "Usage: %s [-u] [-c] [-m] [-a] [file]\n", argv[0]);
+        return 1;
+    }
+  }
+
+  if(optind < argc)
+    file = argv[optind];
+
+  if(!(s = nssnap_open(file))) {
+    fprintf(stderr, "Unable to open snapshot %s.\n", file);
+    return 1;
+  }
+
+  if(!(v = nssnap_acquire(s))) {
+    fprintf(stderr, "No consistent snapshot available in %s.\n", file);
+    nssnap_close(s);
+    return 1;
+  }
+
+  printf("S %llu %lld %u %u %u %u\n", (unsigned long long)v->generation, (long long)v->timestamp,
+         v->nusers, v->nchannels, v->nmembers, v->naccounts);
+
+  if(dumpusers) {
+    for(i=0;i<v->nusers;i++) {
+      up = &v->users[i];
+      formatip(up->ip, ip, sizeof(ip));
+      printf("N %s %s %s %s %s %s\n", nssnap_str(v, up->nick), nssnap_str(v, up->ident), nssnap_str(v, up->host), ip,
+             up->account ? nssnap_str(v, up->account) : "0", nssnap_str(v, up->realname));
+    }
+  }
+
+  for(i=0;i<v->nchannels;i++) {
+    cp = &v->channels[i];
+
+    if(dumpchannels)
+      printf("C %s %u%s%s\n", nssnap_str(v, cp->name), cp->members, cp->topic ? " " : "", nssnap_str(v, cp->topic));
+
+    if(dumpmembers) {
+      for(j=0;j<cp->members;j++) {
+        mp = &v->members[cp->firstmember + j];
+        printf("M %s %s %s%s\n", nssnap_str(v, cp->name), nssnap_str(v, v->users[mp->user].nick),
+               (mp->flags & NSSNAP_MEMBER_OP) ? "@" : "", (mp->flags & NSSNAP_MEMBER_VOICE) ? "+" : "");
+      }
+    }
+  }
+
+  if(dumpaccounts)
+    for(i=0;i<v->naccounts;i++)
+      printf("A %s %llu %u\n", nssnap_str(v, v->accounts[i].name), (unsigned long long)v->accounts[i].id, v->accounts[i].users);
+
+  nssnap_release(v);
+  nssnap_close(s);
+
+  return 0;
+}
@@ -0,0 +1,438 @@
+/*
+ * snapshot: publishes a read-only copy of the network (users, channels,
+ * memberships and accounts) into a shared memory file, so that external
+ * tools can read it without talking to newserv at all.  See nssnap.h for
+ * the layout and the reader library.
+ *
+ * The snapshot is built a few hash buckets at a time from the deferred
+ * queue, then copied into whichever slot readers aren't using.  Records are
+ * linked by numeric rather than by pointer while building, so changes to
+ * the network between steps can't leave anything dangling: a user who
+ * arrives after their bucket has been visited just isn't in this snapshot,
+ * and neither are their memberships.
+ */
+
+#define _XOPEN_SOURCE 500
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "../core/config.h"
+#include "../core/error.h"
+#include "../core/schedule.h"
+#include "../core/deferred.h"
+#include "../nick/nick.h"
+#include "../channel/channel.h"
+#include "../authext/authext.h"
+#include "../lib/version.h"
+#include "nssnap.h"
+
+MODULE_VERSION("");
+
+#define SNAP_DEFAULTINTERVAL 10
+#define SNAP_BUCKETSTEP      512
+#define SNAP_HEADERSIZE      4096
+#define SNAP_MINCAPACITY     (1024 * 1024)
+
+#define SNAP_IDLE     0
+#define SNAP_USERS    1
+#define SNAP_CHANNELS 2
+#define SNAP_ACCOUNTS 3
+
+typedef struct snapbuf {
+  char *buf;
+  size_t len, capacity;
+} snapbuf;
+
+static snapbuf users, channels, members, accounts, strings;
+static int phase = SNAP_IDLE, bucket, buildfailed;
+
+static sstring *snapfile;
+static void *snapsched;
+static deferqueue *snapqueue;
+
+static nssnap_header *header;
+static size_t mapsize;
+static uint64_t generation;
+
+static void snap_start(void *arg);
+static void snap_step(void *arg);
+
+void _init(void) {
+  sstring *interval;
+  int secs;
+
+  snapfile = getcopyconfigitem("snapshot", "file", "data/snapshot", 256);
+
+  interval = getcopyconfigitem("snapshot", "interval", "10", 10);
+  secs = atoi(interval->content);
+  freesstring(interval);
+  if(secs < 1)
+    secs = SNAP_DEFAULTINTERVAL;
+
+  snapqueue = newdeferqueue("snapshot", DEFER_PRIO_LOW, 0);
+  snapsched = schedulerecurring(time(NULL), 0, secs, &snap_start, NULL);
+}
+
+void _fini(void) {
+  deleteschedule(snapsched, &snap_start, NULL);
+  freedeferqueue(snapqueue);
+
+  if(header)
+    munmap(header, mapsize);
+
+  free(users.buf);
+  free(channels.buf);
+  free(members.buf);
+  free(accounts.buf);
+  free(strings.buf);
+
+  freesstring(snapfile);
+}
+
+static void *snap_reserve(snapbuf *sb, size_t len) {
+  size_t capacity;
+  char *p;
+
+  if(sb->len + len > sb->capacity) {
+    for(capacity=sb->capacity?sb->capacity:4096;capacity<sb->len+len;capacity*=2)
+      ;
+
+    p = realloc(sb->buf, capacity);
+    if(!p) {
+      buildfailed = 1;
+      return NULL;
+    }
+    sb->buf = p;
+    sb->capacity = capacity;
+  }
+
+  p = sb->buf + sb->len;
+  sb->len += len;
+  return p;
+}
+
+static uint32_t snap_string(const char *s) {
+  size_t len;
+  char *p;
+  uint32_t offset;
+
+  if(!s || !*s)
+    return 0;
+
+  len = strlen(s) + 1;
+  offset = strings.len;
+  if(!(p = snap_reserve(&strings, len)))
+    return 0;
+
+  memcpy(p, s, len);
+  return offset;
+}
+
+static int snap_usercmp(const void *a, const void *b) {
+  uint32_t na = ((const nssnap_user *)a)->numeric, nb = ((const nssnap_user *)b)->numeric;
+
+  return (na > nb) - (na < nb);
+}
+
+static nssnap_user *snap_finduser(uint32_t numeric) {
+  nssnap_user key;
+
+  key.numeric = numeric;
+  return bsearch(&key, users.buf, users.len / sizeof(nssnap_user), sizeof(nssnap_user), snap_usercmp);
+}
+
+static void snap_adduser(nick *np) {
+  nssnap_user *up = snap_reserve(&users, sizeof(nssnap_user));
+
+  if(!up)
+    return;
+
+  memset(up, 0, sizeof(nssnap_user));
+  up->numeric = np->numeric;
+  up->nick = snap_string(np->nick);
+  up->ident = snap_string(np->ident);
+  up->host = snap_string(np->host->name->content);
+  if(IsSetHost(np) && np->sethost)
+    up->fakehost = snap_string(np->sethost->content);
+  up->realname = snap_string(np->realname->name->content);
+  if(IsAccount(np)) {
+    up->account = snap_string(np->authname);
+    if(np->auth)
+      up->accountid = np->auth->userid;
+  }
+  up->umodes = np->umodes;
+  up->timestamp = np->timestamp;
+  memcpy(up->ip, &np->ipaddress, sizeof(up->ip));
+}
+
+static void snap_addchannel(chanindex *cip) {
+  channel *cp = cip->channel;
+  nssnap_channel *chp;
+  nssnap_member *mp;
+  nssnap_user *up;
+  unsigned long entry;
+  int i;
+
+  if(!(chp = snap_reserve(&channels, sizeof(nssnap_channel))))
+    return;
+
+  memset(chp, 0, sizeof(nssnap_channel));
+  chp->name = snap_string(cip->name->content);
+  if(cp->topic)
+    chp->topic = snap_string(cp->topic->content);
+  if(cp->key)
+    chp->key = snap_string(cp->key->content);
+  chp->limit = cp->limit;
+  chp->modes = cp->flags;
+  chp->timestamp = cp->timestamp;
+  chp->firstmember = members.len / sizeof(nssnap_member);
+
+  for(i=0;i<cp->users->hashsize;i++) {
+    entry = cp->users->content[i];
+    if(entry == nouser)
+      continue;
+
+    /* not seen in the user pass: they joined after we'd gone by */
+    if(!(up = snap_finduser(entry & CU_NUMERICMASK)))
+      continue;
+
+    if(!(mp = snap_reserve(&members, sizeof(nssnap_member))))
+      return;
+
+    mp->user = up - (nssnap_user *)users.buf;
+    mp->flags = ((entry & CUMODE_OP) ? NSSNAP_MEMBER_OP : 0) | ((entry & CUMODE_VOICE) ? NSSNAP_MEMBER_VOICE : 0);
+    up->channels++;
+    chp->members++;
+  }
+}
+
+static void snap_addaccount(authname *anp) {
+  nssnap_account *ap = snap_reserve(&accounts, sizeof(nssnap_account));
+
+  if(!ap)
+    return;
+
+  memset(ap, 0, sizeof(nssnap_account));
+  ap->id = anp->userid;
+  ap->flags = anp->flags;
+  ap->name = snap_string(anp->name);
+  ap->users = anp->usercount;
+}
+
+/* Creates a new file next to the real one with room for capacity bytes in
+ * each slot; snap_install() puts it in place once there's something in it. */
+static nssnap_header *snap_create(size_t capacity, size_t *size) {
+  char tmpfile[300];
+  nssnap_header *newheader;
+  void *map;
+  int fd;
+
+  *size = SNAP_HEADERSIZE + 2 * capacity;
+  snprintf(tmpfile, sizeof(tmpfile), "%s.new", snapfile->content);
+
+  if((fd = open(tmpfile, O_RDWR | O_CREAT | O_TRUNC, 0644)) < 0) {
+    Error("snapshot", ERR_WARNING, "Unable to create %s.", tmpfile);
+    return NULL;
+  }
+
+  if(ftruncate(fd, *size)) {
+    Error("snapshot", ERR_WARNING, "Unable to size %s to %zu bytes.", tmpfile, *size);
+    close(fd);
+    unlink(tmpfile);
+    return NULL;
+  }
+
+  map = mmap(NULL, *size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  close(fd);
+  if(map == MAP_FAILED) {
+    Error("snapshot", ERR_WARNING, "Unable to map %s.", tmpfile);
+    unlink(tmpfile);
+    return NULL;
+  }
+
+  newheader = map;
+  newheader->magic = NSSNAP_MAGIC;
+  newheader->version = NSSNAP_VERSION;
+  newheader->size = *size;
+  newheader->pid = getpid();
+  newheader->slot[0].offset = SNAP_HEADERSIZE;
+  newheader->slot[1].offset = SNAP_HEADERSIZE + capacity;
+  newheader->slot[0].capacity = newheader->slot[1].capacity = capacity;
+
+  return newheader;
+}
+
+/* Renames a file from snap_create() over the old one, which is retired. */
+static void snap_install(nssnap_header *newheader, size_t size) {
+  char tmpfile[300];
+  uint32_t retired = 1;
+  int fd;
+
+  snprintf(tmpfile, sizeof(tmpfile), "%s.new", snapfile->content);
+
+  /* a file left behind by an earlier run (or load) may still have readers */
+  if(!header && (fd = open(snapfile->content, O_WRONLY)) >= 0) {
+    if(pwrite(fd, &retired, sizeof(retired), offsetof(nssnap_header, retired)) != sizeof(retired))
+      Error("snapshot", ERR_WARNING, "Unable to retire old %s.", snapfile->content);
+    close(fd);
+  }
+
+  if(rename(tmpfile, snapfile->content)) {
+    Error("snapshot", ERR_WARNING, "Unable to rename %s to %s.", tmpfile, snapfile->content);
+    munmap(newheader, size);
+    unlink(tmpfile);
+    return;
+  }
+
+  if(header) {
+    header->retired = 1;
+    munmap(header, mapsize);
+  }
+
+  header = newheader;
+  mapsize = size;
+}
+
+static uint64_t snap_align(uint64_t n) {
+  return (n + 7) & ~(uint64_t)7;
+}
+
+static void snap_publish(void) {
+  nssnap_header *target;
+  nssnap_data d;
+  nssnap_slot *slot;
+  unsigned char *base;
+  uint64_t length;
+  size_t capacity, size = 0;
+  int index;
+
+  memset(&d, 0, sizeof(d));
+  d.users = users.len / sizeof(nssnap_user);
+  d.channels = channels.len / sizeof(nssnap_channel);
+  d.members = members.len / sizeof(nssnap_member);
+  d.accounts = accounts.len / sizeof(nssnap_account);
+
+  d.useroffset = snap_align(sizeof(nssnap_data));
+  d.channeloffset = snap_align(d.useroffset + users.len);
+  d.memberoffset = snap_align(d.channeloffset + channels.len);
+  d.accountoffset = snap_align(d.memberoffset + members.len);
+  d.stringoffset = snap_align(d.accountoffset + accounts.len);
+  d.stringsize = strings.len;
+  length = d.stringoffset + d.stringsize;
+
+  if(!header || header->slot[0].capacity < length) {
+    /* leave some room to grow so this doesn't happen every time */
+    for(capacity=SNAP_MINCAPACITY;capacity<length+length/2;capacity*=2)
+      ;
+    if(!(target = snap_create(capacity, &size)))
+      return;
+    index = 0;
+  } else {
+    target = header;
+    index = !header->active;
+  }
+
+  slot = &target->slot[index];
+  base = (unsigned char *)target + slot->offset;
+
+  slot->seq++;
+  __sync_synchronize();
+
+  memcpy(base, &d, sizeof(d));
+  memcpy(base + d.useroffset, users.buf, users.len);
+  memcpy(base + d.channeloffset, channels.buf, channels.len);
+  memcpy(base + d.memberoffset, members.buf, members.len);
+  memcpy(base + d.accountoffset, accounts.buf, accounts.len);
+  memcpy(base + d.stringoffset, strings.buf, strings.len);
+
+  slot->length = length;
+  slot->generation = ++generation;
+  slot->timestamp = time(NULL);
+
+  __sync_synchronize();
+  slot->seq++;
+  __sync_synchronize();
+
+  target->active = index;
+
+  if(target != header)
+    snap_install(target, size);
+}
+
+static void snap_start(void *arg) {
+  if(phase != SNAP_IDLE)
+    return;
+
+  users.len = channels.len = members.len = accounts.len = strings.len = 0;
+  buildfailed = 0;
+  snap_reserve(&strings, 1);
+  if(buildfailed)
+    return;
+  strings.buf[0] = '\0';
+
+  phase = SNAP_USERS;
+  bucket = 0;
+  defer(snapqueue, &snap_step, NULL);
+}
+
+static void snap_step(void *arg) {
+  chanindex *cip;
+  authname *anp;
+  nick *np;
+  int end;
+
+  switch(phase) {
+    case SNAP_USERS:
+      for(end=bucket+SNAP_BUCKETSTEP;bucket<end && bucket<NICKHASHSIZE;bucket++)
+        for(np=nicktable[bucket];np;np=np->next)
+          snap_adduser(np);
+
+      if(bucket >= NICKHASHSIZE) {
+        qsort(users.buf, users.len / sizeof(nssnap_user), sizeof(nssnap_user), snap_usercmp);
+        phase = SNAP_CHANNELS;
+        bucket = 0;
+      }
+      break;
+
+    case SNAP_CHANNELS:
+      for(end=bucket+SNAP_BUCKETSTEP;bucket<end && bucket<CHANNELHASHSIZE;bucket++)
+        for(cip=chantable[bucket];cip;cip=cip->next)
+          if(cip->channel)
+            snap_addchannel(cip);
+
+      if(bucket >= CHANNELHASHSIZE) {
+        phase = SNAP_ACCOUNTS;
+        bucket = 0;
+      }
+      break;
+
+    case SNAP_ACCOUNTS:
+      for(end=bucket+SNAP_BUCKETSTEP;bucket<end && bucket<AUTHNAMEHASHSIZE;bucket++)
+        for(anp=authnametable[bucket];anp;anp=anp->next)
+          if(anp->usercount)
+            snap_addaccount(anp);
+
+      if(bucket >= AUTHNAMEHASHSIZE) {
+        if(buildfailed)
+          Error("snapshot", ERR_WARNING, "Out of memory building snapshot, skipping it.");
+        else
+          snap_publish();
+        phase = SNAP_IDLE;
+        return;
+      }
+      break;
+
+    default:
+      return;
+  }
+
+  defer(snapqueue, &snap_step, NULL);
+}
@@ -0,0 +1,114 @@
+/*
+  Checks the literals trojanscan_matcher_literal() picks out of a table of
+  phrases.  A literal has to turn up in every line the phrase matches, so
+  escapes must be decoded or end the run, never be taken as text.
+
+  make -C trojanscan matchtest && trojanscan/matchtest
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <string.h>
+
+#include "trojanscan_match.h"
+#include "../core/error.h"
+#include "../core/nsmalloc.h"
+
+typedef struct literaltest {
+  const char *pattern;
+  const char *literal; /* "" for none */
+} literaltest;
+
+static const literaltest tests[] = {
+  { "hello world",             "hello world" },
+  { "Hello",                   "hello" },
+  { "foo|barbaz",              "" },
+  { "ab",                      "" },
+  { "abcd?ef",                 "abc" },
+  { "abc+def",                 "abc" },
+  { "x{2}abcd",                "abcd" },
+  { "(optional)?text",         "text" },
+  { "[abc]def[ghi]",           "def" },
+  { "\\.exe$",                 ".exe" },
+  { "\\x01VERSION\\x01",       "\001version\001" },
+  { "\\x{01}PING",             "\001ping" },
+  { "\\x{100}abc",             "abc" },
+  { "\\001DCC SEND",           "\001dcc send" },
+  { "\\0x",                    "" },
+  { "\\x41\\x42C",             "abc" },
+  { "\\x4GHI",                 "\004ghi" },
+  { "\\x00abc",                "abc" },
+  { "\\cAtrail",               "\001trail" },
+  { "\\ca\\cbx",               "\001\002x" },
+  { "foo\\k<n>bar",            "foo" },
+  { "foo\\k{name}bar",         "foo" },
+  { "foo\\k'n'barbaz",         "barbaz" },
+  { "abc\\g{-1}defg",          "defg" },
+  { "abc\\g-1defg",            "defg" },
+  { "abc\\g12defg",            "defg" },
+  { "(a)\\1xyz",               "xyz" },
+  { "(a)\\123xyz",             "xyz" },
+  { "word\\p{Lu}longer",       "longer" },
+  { "wordy\\pLab",             "wordy" },
+  { "a\\o{101}bcd",            "bcd" },
+  { "\\Qa.b*c\\Edef",          "a.b*cdef" },
+  { "\\Qab)c\\E?de",           "ab)" },
+  { "(\\Q)\\Eabc)?xyz",        "xyz" },
+  { "[\\Q]\\E]abcd",           "abcd" },
+  { "ab\\Ecd",                 "abcd" },
+  { "\\d+abc\\s+defg\\bxy",    "defg" },
+  { "tab\\there",              "tab\there" },
+  { "(?i)abc",                 "abc" },
+  { "(?x)a b c d",             "" },
+};
+
+/* nsmalloc.o wants this, nothing should actually go wrong */
+void Error(char *source, int severity, char *reason, ...) {
+  va_list va;
+
+  va_start(va, reason);
+  fprintf(stderr, "%s: ", source);
+  vfprintf(stderr, reason, va);
+  fputc('\n', stderr);
+  va_end(va);
+
+  if (severity >= ERR_STOP)
+    exit(1);
+}
+
+static const char *printable(const char *s, char *buf, size_t len) {
+  size_t n = 0;
+
+  for (; *s && n + 5 < len; s++) {
+    if ((unsigned char)*s < 32 || (unsigned char)*s >= 127)
+      n += snprintf(buf + n, len - n, "\\x%02x", (unsigned char)*s);
+    else
+      buf[n++] = *s;
+  }
+
+  buf[n] = '\0';
+  return buf;
+}
+
+int main(void) {
+  char literal[512], buf1[128], buf2[128];
+  unsigned int i, failed = 0;
+  size_t len;
+
+  for (i = 0; i < sizeof(tests) / sizeof(tests[0]); i++) {
+    len = trojanscan_matcher_literal(tests[i].pattern, literal, sizeof(literal));
+    if (!len)
+      literal[0] = '\0';
+
+    if (strcmp(literal, tests[i].literal)) {
+      printf("FAIL %-24s got \"%s\", expected \"%s\"\n", tests[i].pattern, printable(literal, buf1, sizeof(buf1)),
+        printable(tests[i].literal, buf2, sizeof(buf2)));
+      failed++;
+    }
+  }
+
+  printf("%u of %u literal tests passed.\n", i - failed, i);
+
+  return failed ? 1 : 0;
+}
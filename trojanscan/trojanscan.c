@@ -26,7 +26,8 @@ MODULE_VERSION(TROJANSCAN_VERSION);
 
 void trojanscan_phrasematch(channel *chp, nick *sender, trojanscan_phrases *phrase, char messagetype, char *matchbuf);
 char *trojanscan_sanitise(char *input);
-void trojanscan_refresh_settings(void);
+void trojanscan_refresh_settings(int checkrehash);
+void trojanscan_load_users(void);
 static void trojanscan_part_watch(int hook, void *arg);
 static void trojanscan_connect_nick(void *);
 
@@ -43,7 +44,19 @@ static char *versionreply;
 static int hooksregistered = 0;
 static void *trojanscan_connect_nick_schedule;
 
-static void *db_ping_schedule;
+static void *trojanscan_flushschedule;
+
+static trojanscan_db trojanscan_loading;
+static int trojanscan_dbloading, trojanscan_dbloadfailed;
+
+static trojanscan_user *trojanscan_users;
+static int trojanscan_usersloaded;
+static unsigned int trojanscan_userchanges;
+
+static trojanscan_hostcount *trojanscan_hostcounts[TROJANSCAN_HOSTHASHSIZE];
+
+static trojanscan_logentry *trojanscan_loghead, **trojanscan_logtail = &trojanscan_loghead;
+static int trojanscan_logcount;
 
 void _init() {
   trojanscan_cmds = newcommandtree();
@@ -193,7 +206,7 @@ static void trojanscan_connect_nick(void *arg) {
 }
 
 void trojanscan_connect(void *arg) {
-  sstring *dbhost, *dbuser, *dbpass, *db, *dbport, *temp;
+  sstring *temp;
   int length, i;
   char buf[10];
   
@@ -207,13 +220,6 @@ void trojanscan_connect(void *arg) {
   trojanscan_database.glines = 0;
   trojanscan_database.detections = 0;
     
-  dbhost = getcopyconfigitem("trojanscan", "dbhost", "localhost", 100);
-  dbuser = getcopyconfigitem("trojanscan", "dbuser", "moo", 100);
-  dbpass = getcopyconfigitem("trojanscan", "dbpass", "changeme", 100);
-  db = getcopyconfigitem("trojanscan", "db", "moo", 100);
-  
-  dbport = getcopyconfigitem("trojanscan", "dbport", "3306", 10);
-  
   length = snprintf(buf, sizeof(buf) - 1, "%d", TROJANSCAN_DEFAULT_MAXCHANS);
   temp = getcopyconfigitem("trojanscan", "maxchans", buf, length);
 
@@ -238,11 +244,6 @@ void trojanscan_connect(void *arg) {
   
   if ((trojanscan_cycletime / trojanscan_maxchans) < 1) {
     Error("trojanscan", ERR_FATAL, "Cycletime / maxchans < 1, increase cycletime or decrease maxchans else cycling breaks.");
-    freesstring(dbhost);
-    freesstring(dbuser);
-    freesstring(dbpass);
-    freesstring(db);
-    freesstring(dbport);
     return; /* PPA: module failed to load */
   }
   
@@ -253,41 +254,15 @@ void trojanscan_connect(void *arg) {
 
   trojanscan_connect_nick(NULL);
 
-  if (trojanscan_database_connect(dbhost->content, dbuser->content, dbpass->content, db->content, atoi(dbport->content)) < 0) {
-    Error("trojanscan", ERR_FATAL, "Cannot connect to database host!");
-    freesstring(dbhost);
-    freesstring(dbuser);
-    freesstring(dbpass);
-    freesstring(db);
-    freesstring(dbport);
+  if (trojanscan_database_open() < 0) {
+    Error("trojanscan", ERR_FATAL, "Cannot connect to database!");
     return; /* PPA: module failed to load */
   }
   
-  trojanscan_database_query("CREATE TABLE phrases (id INT(10) PRIMARY KEY AUTO_INCREMENT, wormid INT(10) NOT NULL, phrase TEXT NOT NULL, priority INT(10) DEFAULT 0 NOT NULL, dateadded int(10), disabled BOOL DEFAULT 0 NOT NULL)");
-  trojanscan_database_query("CREATE TABLE worms (id INT(10) PRIMARY KEY AUTO_INCREMENT, wormname TEXT NOT NULL, glinetype INT DEFAULT 0, data text, hitmsgs BOOL DEFAULT 1, hitchans BOOL DEFAULT 0, epidemic BOOL DEFAULT 0, privinfo text)");
-  trojanscan_database_query("CREATE TABLE logs (id INT(10) PRIMARY KEY AUTO_INCREMENT, userid INT(10) NOT NULL, act TEXT NOT NULL, description TEXT NOT NULL, ts TIMESTAMP)");
-  trojanscan_database_query("CREATE TABLE channels (id INT(10) PRIMARY KEY AUTO_INCREMENT, channel VARCHAR(%d) NOT NULL, exempt BOOL DEFAULT 0)", CHANNELLEN);
-  trojanscan_database_query("CREATE TABLE users (id INT(10) PRIMARY KEY AUTO_INCREMENT, authname VARCHAR(%d) NOT NULL, authlevel TINYINT(4) NOT NULL)", ACCOUNTLEN);
-  trojanscan_database_query("CREATE TABLE hits (id INT(10) PRIMARY KEY AUTO_INCREMENT, nickname VARCHAR(%d) NOT NULL, ident VARCHAR(%d) NOT NULL, host VARCHAR(%d) NOT NULL, phrase INT(10) NOT NULL, ts TIMESTAMP, messagetype VARCHAR(1) NOT NULL DEFAULT 'm', glined BOOL DEFAULT 1)", NICKLEN, USERLEN, HOSTLEN);
-  trojanscan_database_query("CREATE TABLE settings (id INT(10) PRIMARY KEY AUTO_INCREMENT, setting VARCHAR(255) NOT NULL UNIQUE, value VARCHAR(255) NOT NULL)");
-  trojanscan_database_query("CREATE TABLE wwwlogs (id INT(10) PRIMARY KEY AUTO_INCREMENT, authid INT(10) NOT NULL, ip VARCHAR(15), action TEXT, ts TIMESTAMP)");
-  trojanscan_database_query("CREATE TABLE unknownlog (id INT(10) PRIMARY KEY AUTO_INCREMENT, data TEXT, user VARCHAR(%d) NOT NULL, ts TIMESTAMP)", NICKLEN+USERLEN+HOSTLEN+3);
-  
-  trojanscan_database_query("DELETE FROM settings WHERE setting = 'rehash' OR setting = 'changed'");
-  trojanscan_database_query("INSERT INTO settings (setting, value) VALUES ('rehash','0')");
-  trojanscan_database_query("INSERT INTO settings (setting, value) VALUES ('changed','0')");
-
-  /* assumption: constants aren't supplied by someone evil */
-  trojanscan_database_query("INSERT INTO settings (setting, value) VALUES ('versionreply','" TROJANSCAN_DEFAULT_VERSION_REPLY "')");
-  
-  trojanscan_refresh_settings();
+  trojanscan_refresh_settings(0);
+  trojanscan_load_users();
   trojanscan_read_database(1);
  
-  freesstring(dbhost);
-  freesstring(dbuser);
-  freesstring(dbpass);
-  freesstring(db);
-  freesstring(dbport);
   trojanscan_registerclones(NULL);
   
   trojanscan_rehashschedule = scheduleoneshot(time(NULL) + 60, &trojanscan_rehash_schedule, NULL);
@@ -306,23 +281,28 @@ char *trojanscan_get_setting(char *setting) {
   return NULL;
 }
 
-void trojanscan_refresh_settings(void) {
-  trojanscan_database_res *res;
-  trojanscan_database_row sqlrow;
+static void trojanscan_settings_loaded(const DBAPIResult *res, void *tag) {
+  char *setting, *value, *v;
   int i = 0;
 
-  if(trojanscan_database_query("SELECT setting, value FROM settings"))
+  if (!res)
     return;
 
-  if(!(res = trojanscan_database_store_result(&trojanscan_sql)))
+  if (!res->success) {
+    Error("trojanscan", ERR_ERROR, "Error loading settings.");
+    res->clear(res);
     return;
+  }
 
-  if (trojanscan_database_num_rows(res) <= 0)
-    return;
+  while (res->next(res)) {
+    setting = res->get(res, 0);
+    value = res->get(res, 1);
 
-  while((sqlrow = trojanscan_database_fetch_row(res))) {
-    strlcpy(trojanscan_settings[i].setting, sqlrow[0], TROJANSCAN_SETTING_SIZE);
-    strlcpy(trojanscan_settings[i].value, sqlrow[1], TROJANSCAN_SETTING_SIZE);
+    if (!setting || !value)
+      continue;
+
+    strlcpy(trojanscan_settings[i].setting, setting, TROJANSCAN_SETTING_SIZE);
+    strlcpy(trojanscan_settings[i].value, value, TROJANSCAN_SETTING_SIZE);
 
     trojanscan_sanitise(trojanscan_settings[i].value);
 
@@ -330,48 +310,73 @@ void trojanscan_refresh_settings(void) {
       break;
   }
 
-  settingcount = i;
+  res->clear(res);
 
-  trojanscan_database_free_result(res);
+  if (i <= 0)
+    return;
+
+  settingcount = i;
 
   /* optimisation hack */
   versionreply = trojanscan_get_setting("versionreply");
+
+  if (tag) {
+    v = trojanscan_get_setting("rehash");
+    if(v && v[0] == '1') {
+      trojanscan_mainchanmsg("n: rehash initiated by website. . .");
+      trojanscan_read_database(0);
+    }
+  }
+}
+
+/* if checkrehash is set the database is reloaded when the website asks */
+void trojanscan_refresh_settings(int checkrehash) {
+  if (!trojanscan_dbconn)
+    return;
+
+  trojanscan_dbconn->query(trojanscan_dbconn, trojanscan_settings_loaded, checkrehash ? (void *)1 : NULL,
+                           "SELECT setting, value FROM ?", "T", "settings");
 }
 
 void trojanscan_rehash_schedule(void *arg) {
-  char *v;
   trojanscan_rehashschedule = scheduleoneshot(time(NULL) + 60, &trojanscan_rehash_schedule, NULL);
 
-  trojanscan_refresh_settings();
+  /* users used to be looked up on every command, this keeps website changes showing up */
+  trojanscan_load_users();
+  trojanscan_refresh_settings(1);
+}
 
-  v = trojanscan_get_setting("rehash");
-  if(v && v[0] == '1') {
-    trojanscan_mainchanmsg("n: rehash initiated by website. . .");
-    trojanscan_read_database(0);
-  }
+static void trojanscan_free_db(trojanscan_db *db) {
+  int i;
+  for(i=0;i<db->total_channels;i++)
+    freesstring(db->channels[i].name);
+  if (db->channels)
+    tfree(db->channels);
+  for(i=0;i<db->total_phrases;i++) {
+    if (db->phrases[i].phrase)
+      pcre_free(db->phrases[i].phrase);
+    if (db->phrases[i].hint)
+      pcre_free(db->phrases[i].hint);
+    if (db->phrases[i].literal)
+      tfree(db->phrases[i].literal);
+  }
+  if (db->phrases)
+    tfree(db->phrases);
+  for(i=0;i<db->total_worms;i++)
+    freesstring(db->worms[i].name);
+  if (db->worms)
+    tfree(db->worms);
+  trojanscan_matcher_free(&db->matcher);
+  db->total_channels = 0;
+  db->total_phrases = 0;
+  db->total_worms = 0;
+  db->channels = NULL;
+  db->phrases = NULL;
+  db->worms = NULL;  
 }
 
 void trojanscan_free_database(void) {
-  int i;
-  for(i=0;i<trojanscan_database.total_channels;i++)
-    freesstring(trojanscan_database.channels[i].name);
-  tfree(trojanscan_database.channels);
-  for(i=0;i<trojanscan_database.total_phrases;i++) {
-    if (trojanscan_database.phrases[i].phrase)
-      pcre_free(trojanscan_database.phrases[i].phrase);
-    if (trojanscan_database.phrases[i].hint)
-      pcre_free(trojanscan_database.phrases[i].hint);
-  }
-  tfree(trojanscan_database.phrases);
-  for(i=0;i<trojanscan_database.total_worms;i++)
-    freesstring(trojanscan_database.worms[i].name);
-  tfree(trojanscan_database.worms);
-  trojanscan_database.total_channels = 0;
-  trojanscan_database.total_phrases = 0;
-  trojanscan_database.total_worms = 0;
-  trojanscan_database.channels = NULL;
-  trojanscan_database.phrases = NULL;
-  trojanscan_database.worms = NULL;  
+  trojanscan_free_db(&trojanscan_database);
 }
 
 char *trojanscan_sanitise(char *input) {
@@ -466,112 +471,346 @@ int trojanscan_strip_codes(char *buf, size_t max, char *original) {
   return p3 - buf;
 }
 
-struct trojanscan_worms *trojanscan_find_worm_by_id(int id) {
+static struct trojanscan_worms *trojanscan_find_worm(trojanscan_db *db, int id) {
   int i;
-  for(i=0;i<trojanscan_database.total_worms;i++)
-    if (trojanscan_database.worms[i].id == id)
-      return &trojanscan_database.worms[i];
+  for(i=0;i<db->total_worms;i++)
+    if (db->worms[i].id == id)
+      return &db->worms[i];
   return NULL;
 }
 
-void trojanscan_read_database(int first_time) {
+struct trojanscan_worms *trojanscan_find_worm_by_id(int id) {
+  return trojanscan_find_worm(&trojanscan_database, id);
+}
+
+/* Grows one of the arrays in trojanscan_loading so it has room for count + 1 items. */
+static int trojanscan_loadgrow(void **array, int count, size_t size) {
+  void *newarray;
+
+  /* 16, then doubling */
+  if (count && (count < 16 || (count & (count - 1))))
+    return 1;
+
+  newarray = nsrealloc(POOL_TROJANSCAN, *array, size * (count ? count * 2 : 16));
+  if (!newarray) {
+    Error("trojanscan", ERR_ERROR, "Out of memory loading database.");
+    trojanscan_dbloadfailed = 1;
+    return 0;
+  }
+
+  *array = newarray;
+  return 1;
+}
+
+static int trojanscan_loadresult(const DBAPIResult *res, char *table) {
+  if (!res) {
+    trojanscan_dbloadfailed = 1;
+    return 0;
+  }
+
+  if (!res->success) {
+    Error("trojanscan", ERR_ERROR, "Error loading %s table.", table);
+    trojanscan_dbloadfailed = 1;
+    res->clear(res);
+    return 0;
+  }
+
+  if (trojanscan_dbloadfailed) {
+    res->clear(res);
+    return 0;
+  }
+
+  return 1;
+}
+
+static void trojanscan_loadchannels(const DBAPIResult *res, void *tag) {
+  trojanscan_db *db = &trojanscan_loading;
+  char name[CHANNELLEN + 1], *exempt;
+
+  if (!trojanscan_loadresult(res, "channels"))
+    return;
+
+  while(res->next(res)) {
+    if (!res->get(res, 0))
+      continue;
+
+    if (!trojanscan_loadgrow((void **)&db->channels, db->total_channels, sizeof(trojanscan_channels)))
+      break;
+
+    strlcpy(name, res->get(res, 0), sizeof(name));
+    exempt = res->get(res, 1);
+
+    db->channels[db->total_channels].name = trojanscan_getsstring(trojanscan_sanitise(name), strlen(name));
+    db->channels[db->total_channels].exempt = (exempt && exempt[0] == '1');
+    db->total_channels++;
+  }
+
+  res->clear(res);
+}
+
+static void trojanscan_loadworms(const DBAPIResult *res, void *tag) {
+  trojanscan_db *db = &trojanscan_loading;
+  trojanscan_worms *worm;
+  char name[512];
+  int tempresult;
+
+  if (!trojanscan_loadresult(res, "worms"))
+    return;
+
+  while(res->next(res)) {
+    if (!res->get(res, 0) || !res->get(res, 1))
+      continue;
+
+    if (!trojanscan_loadgrow((void **)&db->worms, db->total_worms, sizeof(trojanscan_worms)))
+      break;
+
+    worm = &db->worms[db->total_worms++];
+    strlcpy(name, res->get(res, 1), sizeof(name));
+
+    worm->id = atoi(res->get(res, 0));
+    worm->name = trojanscan_getsstring(trojanscan_sanitise(name), strlen(name));
+    tempresult = res->get(res, 2) ? atoi(res->get(res, 2)) : 0;
+    worm->glineuser = (tempresult == 0);
+    worm->glinehost = (tempresult == 1);
+    worm->monitor = (tempresult == 2);
+    if(res->get(res, 3)) {
+      worm->datalen = ((atoi(res->get(res, 3)) == 0) ? 0 : 1);
+    } else {
+      worm->datalen = 0;
+    }
+
+    worm->hitpriv = res->get(res, 4) && (atoi(res->get(res, 4)) == 1);
+    worm->hitchans = res->get(res, 5) && (atoi(res->get(res, 5)) == 1);
+    worm->epidemic = res->get(res, 6) && (atoi(res->get(res, 6)) == 1);
+  }
+
+  res->clear(res);
+}
+
+/* Swaps the newly loaded tables in, the phrases query is always the last. */
+static void trojanscan_loadcomplete(void) {
+  trojanscan_db *db = &trojanscan_loading;
+  char **literals;
+  int i;
+
+  trojanscan_dbloading = 0;
+
+  if (trojanscan_dbloadfailed) {
+    Error("trojanscan", ERR_WARNING, "Database load failed, keeping the previous tables.");
+    trojanscan_free_db(db);
+    return;
+  }
+
+  literals = tmalloc(sizeof(char *) * (db->total_phrases ? db->total_phrases : 1));
+  if (literals) {
+    for(i=0;i<db->total_phrases;i++)
+      literals[i] = db->phrases[i].literal;
+
+    if (!trojanscan_matcher_build(&db->matcher, literals, db->total_phrases))
+      Error("trojanscan", ERR_WARNING, "Could not build phrase prefilter, all phrases will be tried.");
+
+    tfree(literals);
+  }
+
+  db->detections = trojanscan_database.detections;
+  db->glines = trojanscan_database.glines;
+
+  trojanscan_free_db(&trojanscan_database);
+  trojanscan_database = *db;
+  memset(db, 0, sizeof(trojanscan_db));
+
+  trojanscan_dbconn->squery(trojanscan_dbconn, "UPDATE ? SET value = '0' WHERE setting = 'rehash'", "T", "settings");
+}
+
+static void trojanscan_loadphrases(const DBAPIResult *res, void *tag) {
+  trojanscan_db *db = &trojanscan_loading;
+  trojanscan_phrases *phrase;
   const char *error;
-  int erroroffset, i, tempresult;
+  char *pattern, literal[512];
+  int erroroffset;
+  size_t len;
 
-  trojanscan_database_res *res;
-  trojanscan_database_row sqlrow;
+  if (trojanscan_loadresult(res, "phrases")) {
+    while(res->next(res)) {
+      pattern = res->get(res, 1);
+      if (!res->get(res, 0) || !pattern)
+        continue;
 
-  if (!first_time) {
-    trojanscan_free_database();
-  } else {
-    trojanscan_database.total_channels = 0;
-    trojanscan_database.total_phrases = 0;
-    trojanscan_database.total_worms = 0;
-  }
-  
-  if (!(trojanscan_database_query("SELECT channel, exempt FROM channels"))) {
-    if ((res = trojanscan_database_store_result(&trojanscan_sql))) {
-      trojanscan_database.total_channels = trojanscan_database_num_rows(res);
-      if (trojanscan_database.total_channels > 0) {
-        if ((trojanscan_database.channels = (trojanscan_channels *)tmalloc(sizeof(trojanscan_channels) * trojanscan_database.total_channels))) {
-          if ((trojanscan_database.total_channels>0) && trojanscan_database.channels) {
-            i = 0;
-            while((sqlrow = trojanscan_database_fetch_row(res))) {
-              trojanscan_database.channels[i].name = trojanscan_getsstring(trojanscan_sanitise(sqlrow[0]), strlen(sqlrow[0]));
-              trojanscan_database.channels[i].exempt = (sqlrow[1][0] == '1');
-              i++;
-            }
-          }
+      if (!trojanscan_loadgrow((void **)&db->phrases, db->total_phrases, sizeof(trojanscan_phrases)))
+        break;
+
+      phrase = &db->phrases[db->total_phrases++];
+      memset(phrase, 0, sizeof(trojanscan_phrases));
+
+      phrase->id = atoi(res->get(res, 0));
+      phrase->worm = res->get(res, 2) ? trojanscan_find_worm(db, atoi(res->get(res, 2))) : NULL;
+      if (!(phrase->phrase = pcre_compile(pattern, PCRE_CASELESS, &error, &erroroffset, NULL))) {
+        Error("trojanscan", ERR_WARNING, "Error compiling expression %s at offset %d: %s", pattern, erroroffset, error);
+      } else {
+        phrase->hint = pcre_study(phrase->phrase, 0, &error);
+        if (error) {
+          Error("trojanscan", ERR_WARNING, "Error studying expression %s: %s", pattern, error);
+          pcre_free(phrase->phrase);
+          phrase->phrase = NULL;
+        } else if ((len = trojanscan_matcher_literal(pattern, literal, sizeof(literal)))) {
+          if ((phrase->literal = tmalloc(len + 1)))
+            memcpy(phrase->literal, literal, len + 1);
         }
       }
-      trojanscan_database_free_result(res);
     }
-  } 
- 
-  if (!(trojanscan_database_query("SELECT id, wormname, glinetype, length(data), hitmsgs, hitchans, epidemic FROM worms"))) {
-    if ((res = trojanscan_database_store_result(&trojanscan_sql))) {
-      trojanscan_database.total_worms = trojanscan_database_num_rows(res);
-      if (trojanscan_database.total_worms > 0) {
-        if ((trojanscan_database.worms = (trojanscan_worms *)tmalloc(sizeof(trojanscan_worms) * trojanscan_database.total_worms))) {
-          i = 0;
-          while((sqlrow = trojanscan_database_fetch_row(res))) {
-            trojanscan_database.worms[i].id = atoi(sqlrow[0]);
-            trojanscan_database.worms[i].name = trojanscan_getsstring(trojanscan_sanitise(sqlrow[1]), strlen(sqlrow[1]));
-            tempresult = atoi(sqlrow[2]);
-            trojanscan_database.worms[i].glineuser = (tempresult == 0);
-            trojanscan_database.worms[i].glinehost = (tempresult == 1);
-            trojanscan_database.worms[i].monitor = (tempresult == 2);
-            if(sqlrow[3]) {
-              trojanscan_database.worms[i].datalen = ((atoi(sqlrow[3]) == 0) ? 0 : 1);
-            } else {
-              trojanscan_database.worms[i].datalen = 0;
-            }
-            
-            trojanscan_database.worms[i].hitpriv = (atoi(sqlrow[4]) == 1);
-            trojanscan_database.worms[i].hitchans = (atoi(sqlrow[5]) == 1);
-            trojanscan_database.worms[i].epidemic = (atoi(sqlrow[6]) == 1);
-            
-            i++;
-          }
-        }
-      }
-      trojanscan_database_free_result(res);
+
+    res->clear(res);
+  }
+
+  trojanscan_loadcomplete();
+}
+
+/* The new tables are loaded on the side and only replace the current ones
+ * once everything has arrived, so matching carries on meanwhile. */
+void trojanscan_read_database(int first_time) {
+  if (!trojanscan_dbconn || trojanscan_dbloading)
+    return;
+
+  memset(&trojanscan_loading, 0, sizeof(trojanscan_loading));
+  trojanscan_dbloading = 1;
+  trojanscan_dbloadfailed = 0;
+
+  trojanscan_dbconn->query(trojanscan_dbconn, trojanscan_loadchannels, NULL,
+                           "SELECT channel, exempt FROM ?", "T", "channels");
+  trojanscan_dbconn->query(trojanscan_dbconn, trojanscan_loadworms, NULL,
+                           "SELECT id, wormname, glinetype, length(data), hitmsgs, hitchans, epidemic FROM ?", "T", "worms");
+  trojanscan_dbconn->query(trojanscan_dbconn, trojanscan_loadphrases, NULL,
+                           "SELECT id, phrase, wormid FROM ? WHERE disabled = 0 ORDER BY priority DESC", "T", "phrases");
+}
+
+static char *trojanscan_strdup(const char *string) {
+  size_t len = strlen(string);
+  char *copy = tmalloc(len + 1);
+
+  if (copy)
+    memcpy(copy, string, len + 1);
+
+  return copy;
+}
+
+static trojanscan_hostcount **trojanscan_hostcount_bucket(const char *host) {
+  return &trojanscan_hostcounts[irc_crc32i(host) % TROJANSCAN_HOSTHASHSIZE];
+}
+
+static unsigned int trojanscan_hostcount_get(const char *host) {
+  trojanscan_hostcount *hc;
+
+  for(hc=*trojanscan_hostcount_bucket(host);hc;hc=hc->next)
+    if (!ircd_strcmp(hc->host->content, host))
+      return hc->count;
+
+  return 0;
+}
+
+static void trojanscan_hostcount_add(const char *host, unsigned int count) {
+  trojanscan_hostcount **bucket = trojanscan_hostcount_bucket(host), *hc;
+
+  for(hc=*bucket;hc;hc=hc->next) {
+    if (!ircd_strcmp(hc->host->content, host)) {
+      hc->count += count;
+      return;
     }
-  } 
-  
-  if (!(trojanscan_database_query("SELECT id, phrase, wormid FROM phrases WHERE disabled = 0 ORDER BY priority DESC"))) {
-    if ((res = trojanscan_database_store_result(&trojanscan_sql))) {
-      trojanscan_database.total_phrases = trojanscan_database_num_rows(res);
-      if (trojanscan_database.total_phrases > 0) {
-        if ((trojanscan_database.phrases = (trojanscan_phrases *)tmalloc(sizeof(trojanscan_phrases) * trojanscan_database.total_phrases))) {
-          i = 0;
-          while((sqlrow = trojanscan_database_fetch_row(res))) {
-            trojanscan_database.phrases[i].id = atoi(sqlrow[0]);
-            trojanscan_database.phrases[i].worm = trojanscan_find_worm_by_id(atoi(sqlrow[2]));
-            if (!(trojanscan_database.phrases[i].phrase = pcre_compile(sqlrow[1], PCRE_CASELESS, &error, &erroroffset, NULL))) {
-              Error("trojanscan", ERR_WARNING, "Error compiling expression %s at offset %d: %s", sqlrow[1], erroroffset, error);
-            } else {
-              trojanscan_database.phrases[i].hint = pcre_study(trojanscan_database.phrases[i].phrase, 0, &error);
-              if (error) {
-                Error("trojanscan", ERR_WARNING, "Error studying expression %s: %s", sqlrow[1], error);
-                pcre_free(trojanscan_database.phrases[i].phrase);
-                trojanscan_database.phrases[i].phrase = NULL;
-              }
-            }
-            i++;
-          }
-        }
-      }
-      trojanscan_database_free_result(res);
+  }
+
+  if (!(hc = tmalloc(sizeof(trojanscan_hostcount))))
+    return;
+
+  hc->host = getsstring(host, HOSTLEN);
+  hc->count = count;
+  hc->next = *bucket;
+  *bucket = hc;
+}
+
+static void trojanscan_hostcount_free(void) {
+  trojanscan_hostcount *hc, *next;
+  int i;
+
+  for(i=0;i<TROJANSCAN_HOSTHASHSIZE;i++) {
+    for(hc=trojanscan_hostcounts[i];hc;hc=next) {
+      next = hc->next;
+      freesstring(hc->host);
+      tfree(hc);
     }
+    trojanscan_hostcounts[i] = NULL;
   }
+}
 
-  trojanscan_database_query("UPDATE settings SET value = '0' where setting = 'rehash'");
+static void trojanscan_queuelog(int type, int number, char messagetype, int glined, const char *s1, const char *s2, const char *s3) {
+  trojanscan_logentry *le;
+
+  if (!trojanscan_dbconn)
+    return;
+
+  if (!(le = tmalloc(sizeof(trojanscan_logentry))))
+    return;
+
+  le->type = type;
+  le->number = number;
+  le->messagetype[0] = messagetype;
+  le->messagetype[1] = '\0';
+  le->glined = glined;
+  le->ts = time(NULL);
+  le->strings[0] = s1 ? trojanscan_strdup(s1) : NULL;
+  le->strings[1] = s2 ? trojanscan_strdup(s2) : NULL;
+  le->strings[2] = s3 ? trojanscan_strdup(s3) : NULL;
+  le->next = NULL;
+
+  *trojanscan_logtail = le;
+  trojanscan_logtail = &le->next;
+
+  if (++trojanscan_logcount >= TROJANSCAN_LOG_BATCH)
+    trojanscan_flushlog(NULL);
+}
+
+/* Writes the queued hits and log lines in one transaction. */
+void trojanscan_flushlog(void *arg) {
+  trojanscan_logentry *le, *next;
+  int i;
+
+  if (!trojanscan_loghead)
+    return;
+
+  trojanscan_dbconn->squery(trojanscan_dbconn, "BEGIN TRANSACTION", "");
+
+  for (le = trojanscan_loghead; le; le = next) {
+    next = le->next;
+
+    switch (le->type) {
+      case TROJANSCAN_LOG_HIT:
+        trojanscan_dbconn->squery(trojanscan_dbconn, "INSERT INTO ? (nickname, ident, host, phrase, ts, messagetype, glined) VALUES (?, ?, ?, ?, ?, ?, ?)",
+                                  "Tsssdtsd", "hits", le->strings[0], le->strings[1], le->strings[2], le->number, le->ts, le->messagetype, le->glined);
+        break;
+      case TROJANSCAN_LOG_UNKNOWN:
+        trojanscan_dbconn->squery(trojanscan_dbconn, "INSERT INTO ? (data, \"user\", ts) VALUES (?, ?, ?)",
+                                  "Tsst", "unknownlog", le->strings[0], le->strings[1], le->ts);
+        break;
+      case TROJANSCAN_LOG_ACTION:
+        trojanscan_dbconn->squery(trojanscan_dbconn, "INSERT INTO ? (userid, act, description, ts) VALUES (?, ?, ?, ?)",
+                                  "Tdsst", "logs", le->number, le->strings[0], le->strings[1], le->ts);
+        break;
+    }
+
+    for (i = 0; i < 3; i++)
+      if (le->strings[i])
+        tfree(le->strings[i]);
+    tfree(le);
+  }
+
+  trojanscan_dbconn->squery(trojanscan_dbconn, "COMMIT TRANSACTION", "");
+
+  trojanscan_loghead = NULL;
+  trojanscan_logtail = &trojanscan_loghead;
+  trojanscan_logcount = 0;
 }
 
 void trojanscan_log(nick *np, char *event, char *details, ...) {
   int nickid = 0;
-  char eevent[TROJANSCAN_QUERY_TEMP_BUF_SIZE], edetails[TROJANSCAN_QUERY_TEMP_BUF_SIZE], buf[513];
+  char buf[513];
   va_list va;
     
   va_start(va, details);
@@ -582,9 +821,7 @@ void trojanscan_log(nick *np, char *event, char *details, ...) {
     if (IsAccount(np))
       nickid = trojanscan_user_id_by_authname(np->authname);
   
-  trojanscan_database_escape_string(eevent, event, strlen(event));
-  trojanscan_database_escape_string(edetails, buf, strlen(buf));
-  trojanscan_database_query("INSERT INTO logs (userid, act, description) VALUES ('%d', '%s', '%s')", nickid, eevent, edetails);
+  trojanscan_queuelog(TROJANSCAN_LOG_ACTION, nickid, 0, 0, event, buf, NULL);
 }
 
 void trojanscan_generateclone(void *arg) {
@@ -833,6 +1070,15 @@ int trojanscan_reschedule(void *sender, int cargc, char **cargv) {
   return CMD_OK;
 }
 
+static int trojanscan_usersort(const void *v1, const void *v2) {
+  const trojanscan_user *u1 = *(const trojanscan_user **)v1, *u2 = *(const trojanscan_user **)v2;
+
+  if (u1->level != u2->level)
+    return u2->level - u1->level;
+
+  return ircd_strcmp(u1->authname, u2->authname);
+}
+
 int trojanscan_listusers(void *sender, int cargc, char **cargv) {
   nick *np = (nick *)sender;
 
@@ -840,18 +1086,26 @@ int trojanscan_listusers(void *sender, int cargc, char **cargv) {
 
   trojanscan_reply(np, "User list:");
   
-  if (!(trojanscan_database_query("SELECT authname, authlevel FROM users ORDER BY authlevel DESC, authname"))) {
-    trojanscan_database_res *res;
-    if ((res = trojanscan_database_store_result(&trojanscan_sql))) {
-      if (trojanscan_database_num_rows(res)) {
-        trojanscan_database_row sqlrow;
-        union trojanscan_userlevel flags;
-        while((sqlrow = trojanscan_database_fetch_row(res))) {
-          flags.number = atoi(sqlrow[1]);
-          trojanscan_reply(np, "%s +" TROJANSCAN_FLAG_MASK, sqlrow[0], TrojanscanIsDeveloper(flags) ? "d" : "", TrojanscanIsTeamLeader(flags) ? "t" : "", TrojanscanIsStaff(flags) ? "s" : "", TrojanscanIsWebsite(flags) ? "w" : "", TrojanscanIsCat(flags) ? "c" : "");
-        }
+  if (trojanscan_users) {
+    trojanscan_user *up, **list;
+    union trojanscan_userlevel flags;
+    int count = 0, i;
+
+    for(up=trojanscan_users;up;up=up->next)
+      count++;
+
+    if ((list = tmalloc(sizeof(trojanscan_user *) * count))) {
+      for(i=0,up=trojanscan_users;up;up=up->next)
+        list[i++] = up;
+
+      qsort(list, count, sizeof(trojanscan_user *), trojanscan_usersort);
+
+      for(i=0;i<count;i++) {
+        flags.number = list[i]->level;
+        trojanscan_reply(np, "%s +" TROJANSCAN_FLAG_MASK, list[i]->authname, TrojanscanIsDeveloper(flags) ? "d" : "", TrojanscanIsTeamLeader(flags) ? "t" : "", TrojanscanIsStaff(flags) ? "s" : "", TrojanscanIsWebsite(flags) ? "w" : "", TrojanscanIsCat(flags) ? "c" : "");
       }
-      trojanscan_database_free_result(res);
+
+      tfree(list);
     }
   }
 
@@ -924,7 +1178,7 @@ int trojanscan_help(void *sender, int cargc, char **cargv) {
 
 int trojanscan_hello(void *sender, int cargc, char **cargv) {
   nick *np = (nick *)sender, *toadd;
-  char eaccount[TROJANSCAN_QUERY_TEMP_BUF_SIZE];
+  trojanscan_user *up;
   int level = 0;
   
   if (cargc > 0) {
@@ -944,6 +1198,11 @@ int trojanscan_hello(void *sender, int cargc, char **cargv) {
     }
     toadd = np;
   }
+
+  if (!trojanscan_usersloaded) {
+    trojanscan_reply(np, "User list hasn't been loaded yet, try again shortly.");
+    return CMD_ERROR;
+  }
   
   if (trojanscan_user_level_by_authname(toadd->authname)!=-1) {
     trojanscan_reply(np, "Authname (%s) is already on file.", toadd->authname);
@@ -952,57 +1211,113 @@ int trojanscan_hello(void *sender, int cargc, char **cargv) {
   
   trojanscan_log(np, "hello", toadd->authname);
 
-  if (!(trojanscan_database_query("SELECT id FROM users LIMIT 1"))) {
-    trojanscan_database_res *res;
-    if ((res = trojanscan_database_store_result(&trojanscan_sql))) {
-      if (trojanscan_database_num_rows(res) == 0)
-        level = TROJANSCAN_ACL_DEVELOPER | TROJANSCAN_ACL_STAFF | TROJANSCAN_ACL_WEBSITE | TROJANSCAN_ACL_CAT;
-      trojanscan_database_free_result(res);
-    }
+  if (!trojanscan_users)
+    level = TROJANSCAN_ACL_DEVELOPER | TROJANSCAN_ACL_STAFF | TROJANSCAN_ACL_WEBSITE | TROJANSCAN_ACL_CAT;
+
+  if (!(up = tmalloc(sizeof(trojanscan_user)))) {
+    trojanscan_reply(np, "Out of memory.");
+    return CMD_ERROR;
   }
 
-  trojanscan_database_escape_string(eaccount, toadd->authname, strlen(toadd->authname));
-  trojanscan_database_query("INSERT INTO users (authname, authlevel) VALUES ('%s', %d)", eaccount, level);
+  /* the id turns up with the next reload */
+  up->id = 0;
+  up->level = level;
+  strlcpy(up->authname, toadd->authname, sizeof(up->authname));
+  up->next = trojanscan_users;
+  trojanscan_users = up;
+  trojanscan_userchanges++;
+
+  trojanscan_dbconn->squery(trojanscan_dbconn, "INSERT INTO ? (authname, authlevel) VALUES (?, ?)", "Tsd", "users", toadd->authname, level);
   trojanscan_reply(np, "Account added to database, account %s%s.", toadd->authname, level>0?" (first user so developer access)":"");
   
   return CMD_OK;
 }
 
-int trojanscan_user_level_by_authname(char *authname) {
-  int result = -1, sl = strlen(authname);
-  char eaccount[TROJANSCAN_QUERY_TEMP_BUF_SIZE];
-  
-  trojanscan_database_escape_string(eaccount, authname, sl);
-  if (!(trojanscan_database_query("SELECT authlevel, authname FROM users WHERE authname = '%s'", eaccount))) {
-    trojanscan_database_res *res;
-    if ((res = trojanscan_database_store_result(&trojanscan_sql))) {
-      if (trojanscan_database_num_rows(res) > 0) {
-        trojanscan_database_row sqlrow = trojanscan_database_fetch_row(res);
-        result = atoi(sqlrow[0]);
-        strlcpy(authname, sqlrow[1], sl + 1);
-      }
-      trojanscan_database_free_result(res);
-    }
+static trojanscan_user *trojanscan_finduser(char *authname) {
+  trojanscan_user *up;
+
+  for(up=trojanscan_users;up;up=up->next)
+    if (!ircd_strcmp(up->authname, authname))
+      return up;
+
+  return NULL;
+}
+
+static void trojanscan_freeusers(trojanscan_user *up) {
+  trojanscan_user *next;
+
+  for(;up;up=next) {
+    next = up->next;
+    tfree(up);
   }
-  return result;
 }
 
-int trojanscan_user_id_by_authname(char *authname) {
-  int result = 0;
-  char eaccount[TROJANSCAN_QUERY_TEMP_BUF_SIZE];
-
-  trojanscan_database_escape_string(eaccount, authname, strlen(authname));
-  if (!(trojanscan_database_query("SELECT id FROM users WHERE authname = '%s'", eaccount))) {
-    trojanscan_database_res *res;
-    if ((res = trojanscan_database_store_result(&trojanscan_sql))) {
-      if (trojanscan_database_num_rows(res) > 0) {
-        trojanscan_database_row sqlrow = trojanscan_database_fetch_row(res);
-        result = atoi(sqlrow[0]);
-      }
-      trojanscan_database_free_result(res);
-    }
+static void trojanscan_users_loaded(const DBAPIResult *res, void *tag) {
+  trojanscan_user *list = NULL, *up;
+  char *id, *authname, *level;
+
+  if (!res)
+    return;
+
+  if (!res->success) {
+    Error("trojanscan", ERR_ERROR, "Error loading users table.");
+    res->clear(res);
+    return;
   }
-  return result;
+
+  /* someone was added, changed or deleted since we asked: try again next time */
+  if ((uintptr_t)tag != trojanscan_userchanges) {
+    res->clear(res);
+    return;
+  }
+
+  while(res->next(res)) {
+    id = res->get(res, 0);
+    authname = res->get(res, 1);
+    level = res->get(res, 2);
+
+    if (!authname || !level)
+      continue;
+
+    if (!(up = tmalloc(sizeof(trojanscan_user))))
+      break;
+
+    up->id = id ? atoi(id) : 0;
+    up->level = atoi(level);
+    strlcpy(up->authname, authname, sizeof(up->authname));
+    up->next = list;
+    list = up;
+  }
+
+  res->clear(res);
+
+  trojanscan_freeusers(trojanscan_users);
+  trojanscan_users = list;
+  trojanscan_usersloaded = 1;
+}
+
+void trojanscan_load_users(void) {
+  if (!trojanscan_dbconn)
+    return;
+
+  trojanscan_dbconn->query(trojanscan_dbconn, trojanscan_users_loaded, (void *)(uintptr_t)trojanscan_userchanges,
+                           "SELECT id, authname, authlevel FROM ?", "T", "users");
+}
+
+int trojanscan_user_level_by_authname(char *authname) {
+  trojanscan_user *up = trojanscan_finduser(authname);
+
+  if (!up)
+    return -1;
+
+  strlcpy(authname, up->authname, strlen(authname) + 1);
+  return up->level;
+}
+
+int trojanscan_user_id_by_authname(char *authname) {
+  trojanscan_user *up = trojanscan_finduser(authname);
+
+  return up ? up->id : 0;
 }
 
 struct trojanscan_clones *trojanscan_selectclone(char type) {
@@ -1157,17 +1472,19 @@ int trojanscan_userjoin(void *sender, int cargc, char **cargv) {
 
 int trojanscan_rehash(void *sender, int cargc, char **cargv) {
   nick *np = (void *)sender;
-  trojanscan_refresh_settings();
+  trojanscan_refresh_settings(0);
+  trojanscan_load_users();
   trojanscan_read_database(0);
   trojanscan_log(np, "rehash", "");
-  trojanscan_reply(np, "Done.");
+  trojanscan_reply(np, "Reloading.");
   return CMD_OK;
 }
 
 int trojanscan_changelev(void *sender, int cargc, char **cargv) {
   nick *np = (nick *)sender, *np2;
   int templevel;
-  char eaccount[TROJANSCAN_QUERY_TEMP_BUF_SIZE], *tochange, *p, mode = 1, error = 0, clast = 0, specialcase;
+  trojanscan_user *up;
+  char *tochange, *p, mode = 1, error = 0, clast = 0, specialcase;
   union trojanscan_userlevel flags1, flags2;
   
   if (cargc < 2) {
@@ -1270,8 +1587,12 @@ int trojanscan_changelev(void *sender, int cargc, char **cargv) {
   }
   
   trojanscan_log(np, "changelev", "%s %s", tochange, cargv[1]);
-  trojanscan_database_escape_string(eaccount, tochange, strlen(tochange));
-  trojanscan_database_query("UPDATE users SET authlevel = %d WHERE authname = '%s'", flags2.number, eaccount);
+
+  if ((up = trojanscan_finduser(tochange)))
+    up->level = flags2.number;
+  trojanscan_userchanges++;
+
+  trojanscan_dbconn->squery(trojanscan_dbconn, "UPDATE ? SET authlevel = ? WHERE authname = ?", "Tds", "users", flags2.number, tochange);
   
   trojanscan_reply(np, "Flags changed.");
   
@@ -1281,7 +1602,8 @@ int trojanscan_changelev(void *sender, int cargc, char **cargv) {
 int trojanscan_deluser(void *sender, int cargc, char **cargv) {
   nick *np = (nick *)sender, *to;
   int templevel;
-  char eaccount[TROJANSCAN_QUERY_TEMP_BUF_SIZE], *account;
+  trojanscan_user **pup, *up;
+  char *account;
   union trojanscan_userlevel flags1, flags2;
   
   if (cargc < 1) {
@@ -1320,8 +1642,18 @@ int trojanscan_deluser(void *sender, int cargc, char **cargv) {
   }
   
   trojanscan_log(np, "deluser", account);
-  trojanscan_database_escape_string(eaccount, account, strlen(account));
-  trojanscan_database_query("DELETE FROM users WHERE authname = '%s'", eaccount);
+
+  for(pup=&trojanscan_users;*pup;pup=&(*pup)->next) {
+    if (!ircd_strcmp((*pup)->authname, account)) {
+      up = *pup;
+      *pup = up->next;
+      tfree(up);
+      break;
+    }
+  }
+  trojanscan_userchanges++;
+
+  trojanscan_dbconn->squery(trojanscan_dbconn, "DELETE FROM ? WHERE authname = ?", "Ts", "users", account);
   trojanscan_reply(np, "User deleted.");
   
   return CMD_OK;
@@ -1669,7 +2001,7 @@ void trojanscan_handlemessages(nick *target, int messagetype, void **args) {
         cargc = (cmd->maxparams) + 1;
       }
       
-      (cmd->handler)((void *)sender, cargc - 1, &(cargv[1]));
+      callcommand(cmd, (void *)sender, cargc - 1, &(cargv[1]));
       break;
       
     case LU_KILLED:
@@ -1711,9 +2043,12 @@ static void trojanscan_process(nick *sender, channel *cp, char mt, char *pretext
   trojanscan_strip_codes(text, sizeof(text) - 1, pretext);
       
   len = strlen(text);
+
+  trojanscan_matcher_scan(&trojanscan_database.matcher, text, len);
       
   for(i=0;i<trojanscan_database.total_phrases;i++) {
     if (
+         trojanscan_matcher_candidate(&trojanscan_database.matcher, trojanscan_database.phrases[i].literal, i) &&
          (
            (worm = trojanscan_database.phrases[i].worm)
          ) &&
@@ -1755,12 +2090,9 @@ static void trojanscan_process(nick *sender, channel *cp, char mt, char *pretext
     }
   }
   if (!detected && (mt != 'N') && (mt != 'M')) {
-    char etext[TROJANSCAN_QUERY_TEMP_BUF_SIZE], enick[TROJANSCAN_QUERY_TEMP_BUF_SIZE], eident[TROJANSCAN_QUERY_TEMP_BUF_SIZE], ehost[TROJANSCAN_QUERY_TEMP_BUF_SIZE];
-    trojanscan_database_escape_string(etext, text, len);
-    trojanscan_database_escape_string(enick, sender->nick, strlen(sender->nick));
-    trojanscan_database_escape_string(eident, sender->ident, strlen(sender->ident));
-    trojanscan_database_escape_string(ehost, sender->host->name->content, sender->host->name->length);
-    trojanscan_database_query("INSERT INTO unknownlog (data, user) VALUES ('%s','%s!%s@%s')", etext, enick, eident, ehost);
+    char user[NICKLEN + USERLEN + HOSTLEN + 3];
+    snprintf(user, sizeof(user), "%s!%s@%s", sender->nick, sender->ident, sender->host->name->content);
+    trojanscan_queuelog(TROJANSCAN_LOG_UNKNOWN, 0, 0, 0, text, user, NULL);
   }
 }
 
@@ -1919,7 +2251,7 @@ static void trojanscan_part_watch(int hook, void *arg) {
 }
 
 void trojanscan_phrasematch(channel *chp, nick *sender, trojanscan_phrases *phrase, char messagetype, char *matchbuf) {
-  char glinemask[HOSTLEN + USERLEN + NICKLEN + 4], enick[TROJANSCAN_QUERY_TEMP_BUF_SIZE], eident[TROJANSCAN_QUERY_TEMP_BUF_SIZE], ehost[TROJANSCAN_QUERY_TEMP_BUF_SIZE];
+  char glinemask[HOSTLEN + USERLEN + NICKLEN + 4];
   unsigned int frequency;
   int glining = 0, usercount;
   struct trojanscan_worms *worm = phrase->worm;
@@ -1956,21 +2288,7 @@ void trojanscan_phrasematch(channel *chp, nick *sender, trojanscan_phrases *phra
     return;
   }
     
-  trojanscan_database_escape_string(enick, sender->nick, strlen(sender->nick));
-  trojanscan_database_escape_string(eident, sender->ident, strlen(sender->ident));
-  trojanscan_database_escape_string(ehost, sender->host->name->content, sender->host->name->length);
-  
-  frequency = 1;
-  
-  if (!(trojanscan_database_query("SELECT COUNT(*) FROM hits WHERE glined = %d AND host = '%s'", glining, ehost))) {
-    trojanscan_database_res *res;
-    if ((res = trojanscan_database_store_result(&trojanscan_sql))) {
-      trojanscan_database_row sqlrow;
-      if ((trojanscan_database_num_rows(res) > 0) && (sqlrow = trojanscan_database_fetch_row(res)))
-        frequency = atoi(sqlrow[0]) + 1;
-      trojanscan_database_free_result(res);
-    }
-  } 
+  frequency = trojanscan_hostcount_get(sender->host->name->content) + 1;
 
   if (!glining) {
     trojanscan_mainchanmsg("m: t: %c u: %s!%s@%s%s%s w: %s p: %d %s%s", messagetype, sender->nick, sender->ident, sender->host->name->content, messagetype=='N'||messagetype=='M'||messagetype=='P'?" #: ":"", messagetype=='N'||messagetype=='M'||messagetype=='P'?chp->index->name->content:"", worm->name->content, phrase->id, matchbuf[0]?" --: ":"", matchbuf[0]?matchbuf:"");
@@ -1982,7 +2300,8 @@ void trojanscan_phrasematch(channel *chp, nick *sender, trojanscan_phrases *phra
     if(glinetime > 7 * 24)
       glinetime = 7 * 24; /* can't set glines over 7 days with normal non U:lined glines */
 
-    trojanscan_database_query("INSERT INTO hits (nickname, ident, host, phrase, messagetype, glined) VALUES ('%s', '%s', '%s', %d, '%c', %d)", enick, eident, ehost, phrase->id, messagetype, glining);
+    trojanscan_hostcount_add(sender->host->name->content, 1);
+    trojanscan_queuelog(TROJANSCAN_LOG_HIT, phrase->id, messagetype, glining, sender->nick, sender->ident, sender->host->name->content);
     trojanscan_database.glines++;
     
     snprintf(reason, sizeof(reason), "You (%s!%s@%s) are infected with a trojan (%s/%d), see %s%d for details - banned for %d hours", sender->nick, sender->ident, sender->host->name->content, worm->name->content, phrase->id, TROJANSCAN_URL_PREFIX, worm->id, glinetime);
@@ -2098,63 +2417,80 @@ nick *trojanscan_selectuser(void) {
   return NULL;
 }
 
-static void db_ping(void *arg) {
-  if (!(trojanscan_database_query("SELECT 1"))) {
-    trojanscan_database_res *res;
-    if ((res = trojanscan_database_store_result(&trojanscan_sql))) {
-      trojanscan_database_free_result(res);
-    }
-  } 
+static void trojanscan_hostcounts_loaded(const DBAPIResult *res, void *tag) {
+  char *host, *count;
 
-  db_ping_schedule = scheduleoneshot(time(NULL) + 60, &db_ping, NULL);
-}
+  if (!res)
+    return;
 
-void trojanscan_database_close(void) {
-  if(db_ping_schedule)
-    deleteschedule(db_ping_schedule, db_ping, NULL);
+  if (!res->success) {
+    Error("trojanscan", ERR_ERROR, "Error loading hit counts.");
+    res->clear(res);
+    return;
+  }
+
+  while(res->next(res)) {
+    host = res->get(res, 0);
+    count = res->get(res, 1);
 
-  mysql_close(&trojanscan_sql);
+    if (host && count)
+      trojanscan_hostcount_add(host, atoi(count));
+  }
+
+  res->clear(res);
 }
 
-int trojanscan_database_connect(char *dbhost, char *dbuser, char *dbpass, char *db, unsigned int port) {
-  mysql_init(&trojanscan_sql);
-  if (!mysql_real_connect(&trojanscan_sql, dbhost, dbuser, dbpass, db, port, NULL, 0))
+int trojanscan_database_open(void) {
+  if (!(trojanscan_dbconn = dbapi2open(DBAPI2_DEFAULT, "trojanscan")))
     return -1;
 
+  trojanscan_dbconn->createtable(trojanscan_dbconn, NULL, NULL, "CREATE TABLE ? (id SERIAL PRIMARY KEY, wormid INT NOT NULL, phrase TEXT NOT NULL, priority INT DEFAULT 0 NOT NULL, dateadded INT, disabled INT DEFAULT 0 NOT NULL)", "T", "phrases");
+  trojanscan_dbconn->createtable(trojanscan_dbconn, NULL, NULL, "CREATE TABLE ? (id SERIAL PRIMARY KEY, wormname TEXT NOT NULL, glinetype INT DEFAULT 0, data TEXT, hitmsgs INT DEFAULT 1, hitchans INT DEFAULT 0, epidemic INT DEFAULT 0, privinfo TEXT)", "T", "worms");
+  trojanscan_dbconn->createtable(trojanscan_dbconn, NULL, NULL, "CREATE TABLE ? (id SERIAL PRIMARY KEY, userid INT NOT NULL, act TEXT NOT NULL, description TEXT NOT NULL, ts INT)", "T", "logs");
+  trojanscan_dbconn->createtable(trojanscan_dbconn, NULL, NULL, "CREATE TABLE ? (id SERIAL PRIMARY KEY, channel VARCHAR(?) NOT NULL, exempt INT DEFAULT 0)", "Td", "channels", CHANNELLEN);
+  trojanscan_dbconn->createtable(trojanscan_dbconn, NULL, NULL, "CREATE TABLE ? (id SERIAL PRIMARY KEY, authname VARCHAR(?) NOT NULL, authlevel INT NOT NULL)", "Td", "users", ACCOUNTLEN);
+  trojanscan_dbconn->createtable(trojanscan_dbconn, NULL, NULL, "CREATE TABLE ? (id SERIAL PRIMARY KEY, nickname VARCHAR(?) NOT NULL, ident VARCHAR(?) NOT NULL, host VARCHAR(?) NOT NULL, phrase INT NOT NULL, ts INT, messagetype VARCHAR(1) NOT NULL DEFAULT 'm', glined INT DEFAULT 1)", "Tddd", "hits", NICKLEN, USERLEN, HOSTLEN);
+  trojanscan_dbconn->createtable(trojanscan_dbconn, NULL, NULL, "CREATE TABLE ? (id SERIAL PRIMARY KEY, setting VARCHAR(255) NOT NULL UNIQUE, value VARCHAR(255) NOT NULL)", "T", "settings");
+  trojanscan_dbconn->createtable(trojanscan_dbconn, NULL, NULL, "CREATE TABLE ? (id SERIAL PRIMARY KEY, authid INT NOT NULL, ip VARCHAR(15), action TEXT, ts INT)", "T", "wwwlogs");
+  trojanscan_dbconn->createtable(trojanscan_dbconn, NULL, NULL, "CREATE TABLE ? (id SERIAL PRIMARY KEY, data TEXT, \"user\" VARCHAR(?) NOT NULL, ts INT)", "Td", "unknownlog", NICKLEN + USERLEN + HOSTLEN + 3);
+
+  trojanscan_dbconn->squery(trojanscan_dbconn, "DELETE FROM ? WHERE setting = 'rehash' OR setting = 'changed'", "T", "settings");
+  trojanscan_dbconn->squery(trojanscan_dbconn, "INSERT INTO ? (setting, value) VALUES ('rehash', '0')", "T", "settings");
+  trojanscan_dbconn->squery(trojanscan_dbconn, "INSERT INTO ? (setting, value) VALUES ('changed', '0')", "T", "settings");
+
+  /* doesn't overwrite a reply that's been changed, as the unique key used to stop it doing */
+  trojanscan_dbconn->squery(trojanscan_dbconn, "INSERT INTO ? (setting, value) SELECT 'versionreply', ? WHERE NOT EXISTS (SELECT 1 FROM ? WHERE setting = 'versionreply')",
+                            "TsT", "settings", TROJANSCAN_DEFAULT_VERSION_REPLY, "settings");
 
-  db_ping_schedule = scheduleoneshot(time(NULL) + 60, &db_ping, NULL);
+  /* repeat offenders get longer glines, this is how we know who they are */
+  trojanscan_dbconn->query(trojanscan_dbconn, trojanscan_hostcounts_loaded, NULL,
+                           "SELECT host, COUNT(*) FROM ? WHERE glined = 1 GROUP BY host", "T", "hits");
+
+  trojanscan_flushschedule = schedulerecurring(time(NULL) + TROJANSCAN_LOG_FLUSH_INTERVAL, 0, TROJANSCAN_LOG_FLUSH_INTERVAL, trojanscan_flushlog, NULL);
 
   return 0;
 }
 
-void trojanscan_database_escape_string(char *dest, char *source, size_t length) {
-  mysql_escape_string(dest, source, length);
-}
+void trojanscan_database_close(void) {
+  if (!trojanscan_dbconn)
+    return;
 
-int trojanscan_database_query(char *format, ...) {
-  char trojanscan_sqlquery[TROJANSCAN_QUERY_BUF_SIZE];
-  va_list va;
-  
-  va_start(va, format);
-  vsnprintf(trojanscan_sqlquery, sizeof(trojanscan_sqlquery) - 1, format, va);
-  va_end(va);
-  return mysql_query(&trojanscan_sql, trojanscan_sqlquery);
-}
+  if (trojanscan_flushschedule) {
+    deleteschedule(trojanscan_flushschedule, trojanscan_flushlog, NULL);
+    trojanscan_flushschedule = NULL;
+  }
 
-int trojanscan_database_num_rows(trojanscan_database_res *res) {
-  return mysql_num_rows(res);
-}
+  trojanscan_flushlog(NULL);
 
-trojanscan_database_res *trojanscan_database_store_result() {
-  return mysql_store_result(&trojanscan_sql);
-}
+  trojanscan_dbconn->close(trojanscan_dbconn);
+  trojanscan_dbconn = NULL;
 
-trojanscan_database_row trojanscan_database_fetch_row(trojanscan_database_res *res) {
-  return mysql_fetch_row(res);
-}
+  trojanscan_freeusers(trojanscan_users);
+  trojanscan_users = NULL;
+  trojanscan_usersloaded = 0;
 
-void trojanscan_database_free_result(trojanscan_database_res *res) {
-  mysql_free_result(res);
+  trojanscan_hostcount_free();
+  trojanscan_free_db(&trojanscan_loading);
 }
 
 int trojanscan_isip(char *host) {
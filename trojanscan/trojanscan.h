@@ -7,10 +7,10 @@
 #include "../lib/splitline.h"
 #include "../lib/strlfunc.h"
 #include "../localuser/localuserchannel.h"
+#include "../dbapi2/dbapi2.h"
+#include "trojanscan_match.h"
 
 #include <assert.h>
-#include <mysql/mysql.h>
-#include <mysql/mysql_version.h>
 #include <pcre.h>
 #include <stdarg.h>
 #include <stdio.h>
@@ -59,8 +59,10 @@
 #define TROJANSCAN_NORMAL_CLONES 0
 #define TROJANSCAN_WATCH_CLONES  1
 
-#define TROJANSCAN_QUERY_TEMP_BUF_SIZE 1040
-#define TROJANSCAN_QUERY_BUF_SIZE 5040
+#define TROJANSCAN_HOSTHASHSIZE 4096
+
+#define TROJANSCAN_LOG_FLUSH_INTERVAL 10
+#define TROJANSCAN_LOG_BATCH          100
 
 #define TROJANSCAN_FIRST_OFFENSE 12
 #define TROJANSCAN_IPLEN         20
@@ -94,6 +96,7 @@ typedef struct trojanscan_phrases {
   int id;
   pcre *phrase;
   pcre_extra *hint;
+  char *literal; /* for the prefilter, NULL if it has none */
   trojanscan_worms *worm;
 } trojanscan_phrases;
 
@@ -102,8 +105,38 @@ typedef struct trojanscan_db {
   trojanscan_channels       *channels;
   trojanscan_phrases        *phrases;
   trojanscan_worms          *worms;
+  trojanscan_matcher        matcher;
 } trojanscan_db;
 
+typedef struct trojanscan_user {
+  int id;
+  int level;
+  char authname[ACCOUNTLEN + 1];
+  struct trojanscan_user *next;
+} trojanscan_user;
+
+/* glined hits per host, the database only gets told about new ones */
+typedef struct trojanscan_hostcount {
+  sstring *host;
+  unsigned int count;
+  struct trojanscan_hostcount *next;
+} trojanscan_hostcount;
+
+#define TROJANSCAN_LOG_HIT     0
+#define TROJANSCAN_LOG_UNKNOWN 1
+#define TROJANSCAN_LOG_ACTION  2
+
+/* rows waiting to be written, see trojanscan_flushlog() */
+typedef struct trojanscan_logentry {
+  int type;
+  int number;         /* phrase or userid */
+  char messagetype[2];
+  int glined;
+  time_t ts;
+  char *strings[3];
+  struct trojanscan_logentry *next;
+} trojanscan_logentry;
+
 typedef struct trojanscan_prechannels {
   sstring *name;
   int size;
@@ -158,10 +191,6 @@ typedef struct trojanscan_templist {
   char active;  /* required as copy of trojanscan_inchannel could be nil unfortunatly */
 } trojanscan_templist;
 
-typedef MYSQL_RES trojanscan_database_res;
-typedef MYSQL_ROW trojanscan_database_row;
-typedef MYSQL trojanscan_database_connection;
-
 #define TROJANSCAN_FLAG_MASK      "%s%s%s%s%s"
 
 #define TrojanscanIsCat(x)        (x.values.cat)
@@ -234,14 +263,9 @@ char *trojanscan_getuser(int id);
 
 int trojanscan_minmaxrand(float min, float max);
 
-int trojanscan_database_connect(char *dbhost, char *dbuser, char *dbpass, char *db, unsigned int port);
+int trojanscan_database_open(void);
 void trojanscan_database_close(void);
-void trojanscan_database_escape_string(char *dest, char *source, size_t length);
-int trojanscan_database_query(char *format, ...) __attribute__ ((format (printf, 1, 2)));
-int trojanscan_database_num_rows(trojanscan_database_res *res);
-trojanscan_database_res *trojanscan_database_store_result();
-trojanscan_database_row trojanscan_database_fetch_row(trojanscan_database_res *res);
-void trojanscan_database_free_result(trojanscan_database_res *res);
+void trojanscan_flushlog(void *arg);
 nick *trojanscan_selectuser(void);
 
 void trojanscan_watch_clone_update(struct trojanscan_prechannels *hp, int count);
@@ -269,7 +293,7 @@ int trojanscan_swarm_created = 0;
 
 nick *trojanscan_nick;
 CommandTree *trojanscan_cmds; 
-trojanscan_database_connection trojanscan_sql;
+DBAPIConn *trojanscan_dbconn;
 struct trojanscan_rejoinlist *trojanscan_schedulerejoins = NULL;
 
 #endif  
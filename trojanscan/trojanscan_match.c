@@ -0,0 +1,490 @@
+/*
+ * Phrase prefilter
+ *
+ * Most phrases contain a run of plain characters that any line they match
+ * has to contain too.  Those runs go into one Aho-Corasick automaton, so a
+ * single pass over a line finds every phrase that could possibly match and
+ * PCRE is only run for those (and for phrases where no such run could be
+ * found, e.g. because of a top level alternation).
+ *
+ * Phrases are compiled caseless, so literals and text are compared in
+ * lower case.  Only ASCII is folded, as that's all PCRE folds by default.
+ */
+
+#include <string.h>
+
+#include "../core/nsmalloc.h"
+#include "trojanscan_match.h"
+
+#define TROJANSCAN_MATCH_MAXRUN 512
+
+static unsigned char trojanscan_lower(unsigned char c) {
+  if (c >= 'A' && c <= 'Z')
+    return c - 'A' + 'a';
+
+  return c;
+}
+
+static int trojanscan_isalnum(unsigned char c) {
+  return (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || (c >= '0' && c <= '9');
+}
+
+static int trojanscan_hexval(unsigned char c) {
+  if (c >= '0' && c <= '9')
+    return c - '0';
+  if (c >= 'a' && c <= 'f')
+    return c - 'a' + 10;
+  if (c >= 'A' && c <= 'F')
+    return c - 'A' + 10;
+
+  return -1;
+}
+
+/* Skips \Q...\E starting at p ('\\'), returns the character after it. */
+static const char *trojanscan_skipquoted(const char *p) {
+  for (p += 2; *p; p++)
+    if (p[0] == '\\' && p[1] == 'E')
+      return p + 2;
+
+  return p;
+}
+
+/* Skips the name or number after \k, \g, \p and friends, starting at p (the
+ * letter), returns the character after it. */
+static const char *trojanscan_skipreference(const char *p) {
+  const char *q;
+  char close;
+
+  switch (p[1]) {
+    case '{':
+      close = '}';
+      break;
+    case '<':
+      close = '>';
+      break;
+    case '\'':
+      close = '\'';
+      break;
+    default:
+      if (*p == 'p' || *p == 'P')
+        return p[1] ? p + 2 : p + 1;
+
+      /* \g1, \g-1, \g+1 */
+      for (q = p + 1; *q == '-' || *q == '+'; q++)
+        ;
+      while (*q >= '0' && *q <= '9')
+        q++;
+      return q;
+  }
+
+  q = strchr(p + 2, close);
+  return q ? q + 1 : p + strlen(p);
+}
+
+#define TROJANSCAN_ESCAPE_NOTHING -2 /* \E on its own */
+#define TROJANSCAN_ESCAPE_VARIES  -1 /* classes, assertions, backreferences... */
+
+/*
+ * Reads the escape starting at p ('\\') and returns the character after it.
+ * *c is set to the byte it stands for, or to one of the values above.
+ * Escapes for a NUL or for anything above 255 count as VARIES, as literals
+ * are C strings of single bytes.
+ */
+static const char *trojanscan_escape(const char *p, int *c) {
+  const char *q;
+  int v, i;
+
+  p++;
+  *c = TROJANSCAN_ESCAPE_VARIES;
+
+  if (!*p)
+    return p;
+
+  if (!trojanscan_isalnum(*p)) {
+    *c = (unsigned char)*p;
+    return p + 1;
+  }
+
+  switch (*p) {
+    case 'a':
+      *c = '\a';
+      return p + 1;
+    case 'e':
+      *c = 27;
+      return p + 1;
+    case 'f':
+      *c = '\f';
+      return p + 1;
+    case 'n':
+      *c = '\n';
+      return p + 1;
+    case 'r':
+      *c = '\r';
+      return p + 1;
+    case 't':
+      *c = '\t';
+      return p + 1;
+    case 'E':
+      *c = TROJANSCAN_ESCAPE_NOTHING;
+      return p + 1;
+    case 'c':
+      /* \cX: X upper cased, with bit 6 flipped */
+      if (!p[1])
+        return p + 1;
+      *c = ((p[1] >= 'a' && p[1] <= 'z') ? p[1] - 'a' + 'A' : (unsigned char)p[1]) ^ 0x40;
+      return p + 2;
+    case 'x':
+      if (p[1] == '{') {
+        for (q = p + 2, v = 0; trojanscan_hexval(*q) != -1 && v <= 255; q++)
+          v = v * 16 + trojanscan_hexval(*q);
+
+        if (*q == '}' && q > p + 2 && v <= 255)
+          *c = v;
+        if ((q = strchr(p + 2, '}')))
+          return q + 1;
+        return p + strlen(p);
+      }
+
+      /* up to two hex digits, none means NUL */
+      for (p++, i = 0, v = 0; i < 2 && trojanscan_hexval(*p) != -1; i++, p++)
+        v = v * 16 + trojanscan_hexval(*p);
+      *c = v;
+      return p;
+    case '0':
+      /* up to two more octal digits */
+      for (p++, i = 0, v = 0; i < 2 && *p >= '0' && *p <= '7'; i++, p++)
+        v = v * 8 + *p - '0';
+      *c = v;
+      return p;
+    case 'o':
+      /* \o{...}: PCRE has no shorter form, so don't bother decoding it */
+    case 'k':
+    case 'g':
+    case 'p':
+    case 'P':
+      return trojanscan_skipreference(p);
+    default:
+      /* \1 to \999 may be a backreference or octal, all of the digits go
+       * either way */
+      if (*p >= '1' && *p <= '9') {
+        while (*p >= '0' && *p <= '9')
+          p++;
+        return p;
+      }
+
+      /* \d, \w, \b, \A, \z, ... */
+      return p + 1;
+  }
+}
+
+/* Skips a character class starting at p ('['), returns the character after it. */
+static const char *trojanscan_skipclass(const char *p) {
+  p++;
+  if (*p == '^')
+    p++;
+  if (*p == ']')
+    p++;
+
+  while (*p && *p != ']') {
+    if (*p == '\\' && p[1] == 'Q')
+      p = trojanscan_skipquoted(p);
+    else if (*p == '\\' && p[1])
+      p += 2;
+    else
+      p++;
+  }
+
+  return *p ? p + 1 : p;
+}
+
+/* Skips a group starting at p ('('), returns the character after it. */
+static const char *trojanscan_skipgroup(const char *p) {
+  int depth = 0;
+
+  while (*p) {
+    if (*p == '\\' && p[1] == 'Q') {
+      p = trojanscan_skipquoted(p);
+      continue;
+    }
+
+    if (*p == '\\' && p[1]) {
+      p += 2;
+      continue;
+    }
+
+    if (*p == '[') {
+      p = trojanscan_skipclass(p);
+      continue;
+    }
+
+    if (*p == '(') {
+      depth++;
+    } else if (*p == ')' && !--depth) {
+      return p + 1;
+    }
+
+    p++;
+  }
+
+  return p;
+}
+
+/*
+ * Finds the longest run of characters the pattern can't match without and
+ * copies it (lower cased) into buf.  Returns its length, or 0 if there isn't
+ * one worth using.  Anything it isn't sure about ends the current run, so the
+ * result may be shorter than it could be but is never wrong.
+ */
+size_t trojanscan_matcher_literal(const char *pattern, char *buf, size_t buflen) {
+  char run[TROJANSCAN_MATCH_MAXRUN];
+  size_t runlen = 0, best = 0;
+  int lastwaschar = 0;
+  const char *p = pattern, *q;
+  int c;
+
+#define ENDRUN() do { if (runlen > best && runlen < buflen) { memcpy(buf, run, runlen); best = runlen; } runlen = 0; lastwaschar = 0; } while(0)
+#define ADDCHAR(c) do { if (runlen < sizeof(run)) run[runlen++] = trojanscan_lower(c); lastwaschar = 1; } while(0)
+
+  while (*p) {
+    switch (*p) {
+      case '|':
+        /* any branch could match on its own */
+        return 0;
+      case '(':
+        if (p[1] == '?') {
+          /* in extended mode whitespace in the pattern means nothing */
+          for (q = p + 2; trojanscan_isalnum(*q) || *q == '-'; q++)
+            if (*q == 'x')
+              return 0;
+        }
+        ENDRUN();
+        p = trojanscan_skipgroup(p);
+        break;
+      case '[':
+        ENDRUN();
+        p = trojanscan_skipclass(p);
+        break;
+      case '\\':
+        if (p[1] == 'Q') {
+          /* everything up to \E is literal */
+          for (p += 2; *p && !(p[0] == '\\' && p[1] == 'E'); p++)
+            ADDCHAR(*p);
+          if (*p)
+            p += 2;
+          break;
+        }
+
+        p = trojanscan_escape(p, &c);
+        if (c > 0)
+          ADDCHAR(c);
+        else if (c != TROJANSCAN_ESCAPE_NOTHING)
+          ENDRUN();
+        break;
+      case '*':
+      case '?':
+      case '{':
+        /* the previous character is optional */
+        if (lastwaschar)
+          runlen--;
+        ENDRUN();
+        if (*p == '{' && (q = strchr(p, '}')))
+          p = q;
+        p++;
+        break;
+      case '+':
+      case '.':
+      case '^':
+      case '$':
+        ENDRUN();
+        p++;
+        break;
+      default:
+        ADDCHAR(*p);
+        p++;
+        break;
+    }
+  }
+
+  ENDRUN();
+
+#undef ENDRUN
+#undef ADDCHAR
+
+  if (best < TROJANSCAN_MATCH_MINLITERAL)
+    return 0;
+
+  buf[best] = '\0';
+  return best;
+}
+
+void trojanscan_matcher_free(trojanscan_matcher *m) {
+  if (m->next)
+    nsfree(POOL_TROJANSCAN, m->next);
+  if (m->outstart)
+    nsfree(POOL_TROJANSCAN, m->outstart);
+  if (m->outcount)
+    nsfree(POOL_TROJANSCAN, m->outcount);
+  if (m->out)
+    nsfree(POOL_TROJANSCAN, m->out);
+  if (m->seen)
+    nsfree(POOL_TROJANSCAN, m->seen);
+
+  memset(m, 0, sizeof(trojanscan_matcher));
+}
+
+/* literals[i] is the literal for phrase i, or NULL. */
+int trojanscan_matcher_build(trojanscan_matcher *m, char **literals, int count) {
+  int *fail = NULL, *queue = NULL, *ownhead = NULL, *ownnext = NULL;
+  int i, c, s, t, head, tail, maxstates, total;
+  unsigned char *p;
+
+  memset(m, 0, sizeof(trojanscan_matcher));
+  m->phrases = count;
+
+  if (!(m->seen = nsmalloc(POOL_TROJANSCAN, sizeof(unsigned int) * (count ? count : 1))))
+    return 0;
+  memset(m->seen, 0, sizeof(unsigned int) * (count ? count : 1));
+
+  m->classes = 1;
+  maxstates = 1;
+  for (i = 0; i < count; i++) {
+    if (!literals[i])
+      continue;
+
+    for (p = (unsigned char *)literals[i]; *p; p++) {
+      if (!m->classof[*p])
+        m->classof[*p] = m->classes++;
+      maxstates++;
+    }
+  }
+
+  m->next = nsmalloc(POOL_TROJANSCAN, sizeof(int) * maxstates * m->classes);
+  m->outstart = nsmalloc(POOL_TROJANSCAN, sizeof(int) * maxstates);
+  m->outcount = nsmalloc(POOL_TROJANSCAN, sizeof(int) * maxstates);
+  fail = nsmalloc(POOL_TROJANSCAN, sizeof(int) * maxstates);
+  queue = nsmalloc(POOL_TROJANSCAN, sizeof(int) * maxstates);
+  ownhead = nsmalloc(POOL_TROJANSCAN, sizeof(int) * maxstates);
+  ownnext = nsmalloc(POOL_TROJANSCAN, sizeof(int) * (count ? count : 1));
+
+  if (!m->next || !m->outstart || !m->outcount || !fail || !queue || !ownhead || !ownnext)
+    goto error;
+
+  memset(m->next, 0xff, sizeof(int) * maxstates * m->classes);
+  memset(ownhead, 0xff, sizeof(int) * maxstates);
+
+  /* the trie */
+  m->states = 1;
+  for (i = 0; i < count; i++) {
+    if (!literals[i])
+      continue;
+
+    s = 0;
+    for (p = (unsigned char *)literals[i]; *p; p++) {
+      t = m->next[s * m->classes + m->classof[*p]];
+      if (t == -1)
+        t = m->next[s * m->classes + m->classof[*p]] = m->states++;
+      s = t;
+    }
+
+    ownnext[i] = ownhead[s];
+    ownhead[s] = i;
+  }
+
+  /* failure links, turning the trie into a DFA as we go (breadth first, so
+   * a state's failure is always complete before the state itself) */
+  head = tail = 0;
+  fail[0] = 0;
+  for (c = 0; c < m->classes; c++) {
+    t = m->next[c];
+    if (t == -1) {
+      m->next[c] = 0;
+    } else {
+      fail[t] = 0;
+      queue[tail++] = t;
+    }
+  }
+
+  while (head < tail) {
+    s = queue[head++];
+
+    for (c = 0; c < m->classes; c++) {
+      t = m->next[s * m->classes + c];
+      if (t == -1) {
+        m->next[s * m->classes + c] = m->next[fail[s] * m->classes + c];
+      } else {
+        fail[t] = m->next[fail[s] * m->classes + c];
+        queue[tail++] = t;
+      }
+    }
+  }
+
+  /* each state outputs its own phrases and those of its failure */
+  total = 0;
+  m->outcount[0] = 0;
+  for (head = -1; head < tail; head++) {
+    s = (head == -1) ? 0 : queue[head];
+
+    m->outcount[s] = (s == 0) ? 0 : m->outcount[fail[s]];
+    for (i = ownhead[s]; i != -1; i = ownnext[i])
+      m->outcount[s]++;
+
+    m->outstart[s] = total;
+    total += m->outcount[s];
+  }
+
+  if (!(m->out = nsmalloc(POOL_TROJANSCAN, sizeof(int) * (total ? total : 1))))
+    goto error;
+
+  for (head = 0; head < tail; head++) {
+    s = queue[head];
+    t = m->outstart[s];
+
+    for (i = ownhead[s]; i != -1; i = ownnext[i])
+      m->out[t++] = i;
+
+    if (m->outcount[fail[s]])
+      memcpy(&m->out[t], &m->out[m->outstart[fail[s]]], sizeof(int) * m->outcount[fail[s]]);
+  }
+
+  nsfree(POOL_TROJANSCAN, fail);
+  nsfree(POOL_TROJANSCAN, queue);
+  nsfree(POOL_TROJANSCAN, ownhead);
+  nsfree(POOL_TROJANSCAN, ownnext);
+
+  return 1;
+
+error:
+  if (fail)
+    nsfree(POOL_TROJANSCAN, fail);
+  if (queue)
+    nsfree(POOL_TROJANSCAN, queue);
+  if (ownhead)
+    nsfree(POOL_TROJANSCAN, ownhead);
+  if (ownnext)
+    nsfree(POOL_TROJANSCAN, ownnext);
+
+  trojanscan_matcher_free(m);
+  return 0;
+}
+
+/* Marks every phrase whose literal occurs in text. */
+void trojanscan_matcher_scan(trojanscan_matcher *m, const char *text, size_t len) {
+  const unsigned char *p = (const unsigned char *)text;
+  int s = 0, k;
+  size_t i;
+
+  if (!m->next)
+    return;
+
+  if (++m->scan == 0) {
+    memset(m->seen, 0, sizeof(unsigned int) * (m->phrases ? m->phrases : 1));
+    m->scan = 1;
+  }
+
+  for (i = 0; i < len; i++) {
+    s = m->next[s * m->classes + m->classof[trojanscan_lower(p[i])]];
+
+    for (k = 0; k < m->outcount[s]; k++)
+      m->seen[m->out[m->outstart[s] + k]] = m->scan;
+  }
+}
@@ -0,0 +1,29 @@
+#ifndef __trojanscan_match_H
+#define __trojanscan_match_H
+
+#include <stddef.h>
+
+/* shortest literal worth putting in the prefilter */
+#define TROJANSCAN_MATCH_MINLITERAL 3
+
+/* An Aho-Corasick automaton over the literals that phrases can't match
+ * without, so one pass over a line says which phrases need running. */
+typedef struct trojanscan_matcher {
+  int phrases, states, classes;
+  unsigned char classof[256];
+  int *next;                /* states * classes */
+  int *outstart, *outcount; /* into out, per state */
+  int *out;                 /* phrase indices */
+  unsigned int scan;
+  unsigned int *seen;       /* per phrase: last scan its literal turned up in */
+} trojanscan_matcher;
+
+size_t trojanscan_matcher_literal(const char *pattern, char *buf, size_t buflen);
+int trojanscan_matcher_build(trojanscan_matcher *m, char **literals, int count);
+void trojanscan_matcher_free(trojanscan_matcher *m);
+void trojanscan_matcher_scan(trojanscan_matcher *m, const char *text, size_t len);
+
+/* phrases without a literal always need running */
+#define trojanscan_matcher_candidate(m, literal, i) (!(literal) || !(m)->next || (m)->seen[(i)] == (m)->scan)
+
+#endif
@@ -374,14 +374,12 @@ void th_adjusthosts(trusthost *th, trusthost *superset, trusthost *subset) {
 
   if((!superset && !subset) || (!superset && subset) || (superset && subset)) { /* cases 1, 3 and 4 */
     nick *np;
-    int i;
+    nickiter iter;
 
-    for(i=0;i<NICKHASHSIZE;i++) {
-      for(np=nicktable[i];np;np=np->next) {
-        ip_canonicalize_tunnel(&ipaddress_canonical, &np->ipaddress);
-        if(!gettrusthost(np) && ipmask_check(&ipaddress_canonical, &th->ip, th->bits))
-          trusts_newnick(np, 1);
-      }
+    for(np=firstnick(&iter);np;np=nextnick(&iter)) {
+      ip_canonicalize_tunnel(&ipaddress_canonical, &np->ipaddress);
+      if(!gettrusthost(np) && ipmask_check(&ipaddress_canonical, &th->ip, th->bits))
+        trusts_newnick(np, 1);
     }
   }
 }
@@ -1,17 +1,13 @@
+#include <stdlib.h>
+#include <string.h>
 #include "../core/hooks.h"
 #include "../irc/irc.h"
 #include "trusts.h"
 
 static void __counthandler(int hooknum, void *arg);
 
-void trusts_newnick(nick *sender, int moving) {
-  trusthost *th;
+static void __addnick(nick *sender, int moving, trusthost *th) {
   void *arg[2];
-  struct irc_in_addr ipaddress;
-
-  ip_canonicalize_tunnel(&ipaddress, &sender->ipaddress);
-
-  th = th_getbyhost(&ipaddress);
 
   settrusthost(sender, th);
   if(!th) {
@@ -30,10 +26,134 @@ void trusts_newnick(nick *sender, int moving) {
   triggerhook(HOOK_TRUSTS_NEWNICK, arg);
 }
 
+void trusts_newnick(nick *sender, int moving) {
+  struct irc_in_addr ipaddress;
+
+  ip_canonicalize_tunnel(&ipaddress, &sender->ipaddress);
+
+  __addnick(sender, moving, th_getbyhost(&ipaddress));
+}
+
 static void __newnick(int hooknum, void *arg) {
+  /* looked up with the rest of the batch */
+  if(nickburstreplay) {
+    __addnick(arg, 0, gettrusthost((nick *)arg));
+    return;
+  }
+
   trusts_newnick(arg, 0);
 }
 
+/*
+ * Burst batches find their trust hosts through iptree rather than by checking
+ * every host for every IP: each host's node carries the host in a node
+ * extension, so the most specific match is the first one found walking up
+ * from the nick's node.  The index is rebuilt when the host list has changed
+ * since the last batch, which is spotted by a signature over the list (a walk
+ * of the list, but no address comparisons).
+ */
+static int hostnodeext = -1;
+static patricia_node_t **hostnodes;
+static int hostnodecount;
+static unsigned long hostnodesig;
+
+static unsigned long __hostsig(int *count) {
+  unsigned long sig = 0;
+  trustgroup *tg;
+  trusthost *th;
+  int i;
+
+  *count = 0;
+  for(tg=tglist;tg;tg=tg->next) {
+    for(th=tg->hosts;th;th=th->next) {
+      sig = sig * 31 + (unsigned long)th + th->bits;
+      for(i=0;i<8;i++)
+        sig = sig * 31 + th->ip.in6_16[i];
+      (*count)++;
+    }
+  }
+
+  return sig;
+}
+
+static void __dropindex(void) {
+  int i;
+
+  for(i=0;i<hostnodecount;i++) {
+    hostnodes[i]->exts[hostnodeext] = NULL;
+    derefnode(iptree, hostnodes[i]);
+  }
+
+  free(hostnodes);
+  hostnodes = NULL;
+  hostnodecount = 0;
+}
+
+static int __buildindex(void) {
+  unsigned long sig;
+  patricia_node_t *node;
+  trustgroup *tg;
+  trusthost *th;
+  int count;
+
+  sig = __hostsig(&count);
+  if(hostnodes && sig == hostnodesig && count == hostnodecount)
+    return 1;
+
+  __dropindex();
+
+  if(!count)
+    return 0;
+
+  hostnodes = malloc(count * sizeof(patricia_node_t *));
+  if(!hostnodes)
+    return 0;
+
+  /* same answer as th_getbyhost: for hosts with the same mask, the first wins */
+  for(tg=tglist;tg;tg=tg->next) {
+    for(th=tg->hosts;th;th=th->next) {
+      node = refnode(iptree, &th->ip, th->bits);
+      if(!node->exts[hostnodeext])
+        node->exts[hostnodeext] = th;
+      hostnodes[hostnodecount++] = node;
+    }
+  }
+
+  hostnodesig = sig;
+  return 1;
+}
+
+static void __burstbatch(int hooknum, void *arg) {
+  nickbatch *batch = arg;
+  struct irc_in_addr ipaddress;
+  patricia_node_t *node;
+  trusthost *th;
+  int i, indexed;
+  nick *np;
+
+  indexed = hostnodeext != -1 && __buildindex();
+
+  for(i=0;i<batch->count;i++) {
+    np = batch->nicks[i];
+    if(!np)
+      continue;
+
+    ip_canonicalize_tunnel(&ipaddress, &np->ipaddress);
+
+    if(!indexed || !np->ipnode) {
+      settrusthost(np, th_getbyhost(&ipaddress));
+      continue;
+    }
+
+    th = NULL;
+    for(node=np->ipnode;node;node=node->parent)
+      if((th = node->exts[hostnodeext]) && ipmask_check(&ipaddress, &th->ip, th->bits))
+        break;
+
+    settrusthost(np, node ? th : NULL);
+  }
+}
+
 void trusts_lostnick(nick *sender, int moving) {
   nick *np, *lp;
   trusthost *th = gettrusthost(sender);
@@ -106,7 +226,10 @@ static void __dbloaded(int hooknum, void *arg) {
     return;
   hooksregistered = 1;
 
+  hostnodeext = registernodeext("trustsburst");
+
   registerhook(HOOK_NICK_NEWNICK, __newnick);
+  registerhook(HOOK_NICK_BURSTBATCH, __burstbatch);
   registerhook(HOOK_NICK_LOSTNICK, __lostnick);
 
 /*  registerhook(HOOK_TRUSTS_NEWNICK, __counthandler);
@@ -124,7 +247,14 @@ static void __dbclosed(int hooknum, void *arg) {
     return;
   hooksregistered = 0;
 
+  if(hostnodeext != -1) {
+    __dropindex();
+    releasenodeext(hostnodeext);
+    hostnodeext = -1;
+  }
+
   deregisterhook(HOOK_NICK_NEWNICK, __newnick);
+  deregisterhook(HOOK_NICK_BURSTBATCH, __burstbatch);
   deregisterhook(HOOK_NICK_LOSTNICK, __lostnick);
 
 /*
@@ -0,0 +1,59 @@
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include "../lib/sha1.h"
+#include "../irc/irc.h"
+#include "trusts.h"
+
+/* Digests used by trusts_master/trusts_slave to find groups that differ
+ * without shipping the whole database.
+ *
+ * A group's digest covers only the fields the master owns; usage counters
+ * (maxusage, lastseen, lastmaxusereset) are tracked locally by every server
+ * and would never agree.  Host lines are combined with XOR so the order a
+ * server happens to keep its host list in doesn't matter. */
+
+static uint64_t digestline(const char *line) {
+  SHA1_CTX s;
+  unsigned char digest[SHA1_DIGESTSIZE];
+  uint64_t v = 0;
+  int i;
+
+  SHA1Init(&s);
+  SHA1Update(&s, (unsigned char *)line, strlen(line));
+  SHA1Final(digest, &s);
+
+  for(i=0;i<8;i++)
+    v = (v << 8) | digest[i];
+
+  return v;
+}
+
+uint64_t tg_digest(trustgroup *tg) {
+  char buf[1024];
+  trusthost *th;
+  uint64_t v;
+
+  snprintf(buf, sizeof(buf), "G %u,%s,%u,%d,%u,%jd,%s,%s,%s", tg->id, tg->name->content, tg->trustedfor, tg->flags, tg->maxperident, (intmax_t)tg->expires, tg->createdby->content, tg->contact->content, tg->comment->content);
+  v = digestline(buf);
+
+  for(th=tg->hosts;th;th=th->next) {
+    snprintf(buf, sizeof(buf), "H %u,%u,%s,%jd,%d,%d", tg->id, th->id, CIDRtostr(th->ip, th->bits), (intmax_t)th->created, th->maxpernode, th->nodebits);
+    v ^= digestline(buf);
+  }
+
+  return v;
+}
+
+unsigned int tg_digestbucket(unsigned int id) {
+  return id % TRUSTS_DIGESTBUCKETS;
+}
+
+void trusts_bucketdigests(uint64_t *digests) {
+  trustgroup *tg;
+
+  memset(digests, 0, sizeof(uint64_t) * TRUSTS_DIGESTBUCKETS);
+
+  for(tg=tglist;tg;tg=tg->next)
+    digests[tg_digestbucket(tg->id)] ^= tg_digest(tg);
+}
@@ -39,6 +39,8 @@
 
 #define DEFAULT_TRUSTPORT 5776
 
+#define TRUSTS_DIGESTBUCKETS 256
+
 #define TRUST_ENFORCE_IDENT 1 /* This must be 1 for compatibility with O. */
 #define TRUST_NO_CLEANUP 2
 #define TRUST_PROTECTED 4
@@ -144,6 +146,11 @@ trusthost *th_getbyid(unsigned int);
 int tg_modify(trustgroup *, trustgroup *);
 int th_modify(trusthost *, trusthost *);
 
+/* replication.c */
+uint64_t tg_digest(trustgroup *);
+unsigned int tg_digestbucket(unsigned int);
+void trusts_bucketdigests(uint64_t *);
+
 /* migration.c */
 typedef void (*TrustMigrationGroup)(void *, trustgroup *);
 typedef void (*TrustMigrationHost)(void *, trusthost *, unsigned int);
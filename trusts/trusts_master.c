@@ -5,6 +5,7 @@
 #include "../core/hooks.h"
 #include "../core/config.h"
 #include "../core/error.h"
+#include "../core/schedule.h"
 #include "../lib/version.h"
 #include "../lib/sha1.h"
 #include "../lib/hmac.h"
@@ -14,7 +15,63 @@
 
 MODULE_VERSION("");
 
-static void broadcast(SHA1_CTX *c, unsigned int replicationid, unsigned int lineno, char *command, char *format, ...) {
+/* Replication.
+ *
+ * Every change is queued as a delta and flushed in batches a second later,
+ * numbered with a sequence number that only ever increases within an
+ * epoch (the time this master loaded its database).  The last
+ * TRUSTS_REPLOGSIZE deltas are kept so a slave that misses some can ask
+ * for "everything since N" (trrequestsince).  If that's too far back the
+ * slave is sent per-bucket digests instead and fetches only the groups
+ * that differ.  A full copy (trinit/trdata/trfini) is only sent to slaves
+ * that have nothing yet, or when forced.
+ *
+ * Delta records are packed into a trdelta message as
+ *   <epoch> <firstseq> <count> <type><len>:<data>...
+ * where type is G (add/modify group), g (delete group), H (add/modify
+ * host) or h (delete host). */
+
+#define TRUSTS_REPLOGSIZE 4096
+#define TRUSTS_BATCHLEN 380
+#define TRUSTS_DIGESTSPERLINE 16
+#define TRUSTS_GROUPSPERLINE 12
+
+typedef struct trdelta {
+  unsigned int seq;
+  char type;
+  unsigned int id;
+  char *data;
+  struct trdelta *next;
+} trdelta;
+
+static unsigned int replepoch, replseq;
+static trdelta *pendinghead, *pendingtail;
+static trdelta *replog[TRUSTS_REPLOGSIZE];
+static void *flushsched;
+
+typedef struct trbatch {
+  nick *target;
+  unsigned int firstseq, count;
+  int len;
+  char buf[TRUSTS_BATCHLEN + 256];
+} trbatch;
+
+static void trsend(nick *target, const char *command, const char *format, ...) __attribute__ ((format (printf, 3, 4)));
+static void trsend(nick *target, const char *command, const char *format, ...) {
+  char buf[512];
+  va_list va;
+
+  va_start(va, format);
+  vsnprintf(buf, sizeof(buf), format, va);
+  va_end(va);
+
+  if(target)
+    xsb_unicast(command, target, "%s", buf);
+  else
+    xsb_broadcast(command, NULL, "%s", buf);
+}
+
+static void broadcast(SHA1_CTX *c, nick *target, unsigned int replicationid, unsigned int lineno, char *command, char *format, ...) {
   char buf[512], buf2[600];
   va_list va;
   int len;
@@ -24,7 +81,7 @@ static void broadcast(SHA1_CTX *c, unsigned int replicationid, unsigned int line
   va_end(va);
 
   len = snprintf(buf2, sizeof(buf2), "%u %u %s", replicationid, lineno, buf);
-  xsb_broadcast(command, NULL, "%s", buf2);
+  trsend(target, command, "%s", buf2);
 
   if(len > (sizeof(buf2) - 1))
     len = sizeof(buf2) - 1;
@@ -36,7 +93,156 @@ static void broadcast(SHA1_CTX *c, unsigned int replicationid, unsigned int line
   SHA1Update(c, (unsigned char *)buf2, len + 1);
 }
 
-static void replicate(int forced) {
+static void batch_flush(trbatch *b) {
+  if(!b->count)
+    return;
+
+  trsend(b->target, "trdelta", "%u %u %u %s", replepoch, b->firstseq, b->count, b->buf);
+  b->count = 0;
+  b->len = 0;
+}
+
+static void batch_add(trbatch *b, trdelta *d) {
+  int len = strlen(d->data);
+  int reclen = snprintf(NULL, 0, "%c%d:", d->type, len) + len;
+
+  if(b->count && (b->len + reclen > TRUSTS_BATCHLEN))
+    batch_flush(b);
+
+  if(!b->count) {
+    b->firstseq = d->seq;
+    b->buf[0] = '\0';
+  }
+
+  /* dumptg()/dumpth() records always fit in buf on their own, so the
+   * length prefix is honest: if the line is then too long for the link
+   * the slave sees a short record and resyncs rather than applying it */
+  if(reclen >= (int)sizeof(b->buf)) {
+    Error("trusts_master", ERR_ERROR, "Delta %u is too long to replicate (%d bytes).", d->seq, reclen);
+    reclen = sizeof(b->buf) - 1;
+  }
+
+  snprintf(b->buf + b->len, sizeof(b->buf) - b->len, "%c%d:%s", d->type, len, d->data);
+  b->len += reclen;
+  b->count++;
+
+  /* anything that didn't fit alongside others goes on its own */
+  if(b->len > TRUSTS_BATCHLEN)
+    batch_flush(b);
+}
+
+static char *copydata(const char *data) {
+  size_t len = strlen(data) + 1;
+  char *p = malloc(len);
+
+  memcpy(p, data, len);
+  return p;
+}
+
+static void freedelta(trdelta *d) {
+  free(d->data);
+  free(d);
+}
+
+static void flushdeltas(void *arg) {
+  trbatch b;
+  trdelta *d, *next;
+
+  flushsched = NULL;
+
+  memset(&b, 0, sizeof(b));
+
+  for(d=pendinghead;d;d=next) {
+    next = d->next;
+    d->next = NULL;
+    d->seq = ++replseq;
+
+    if(replog[d->seq % TRUSTS_REPLOGSIZE])
+      freedelta(replog[d->seq % TRUSTS_REPLOGSIZE]);
+    replog[d->seq % TRUSTS_REPLOGSIZE] = d;
+
+    batch_add(&b, d);
+  }
+
+  batch_flush(&b);
+  pendinghead = pendingtail = NULL;
+}
+
+static void queuedelta(char type, unsigned int id, const char *data) {
+  trdelta *d, **pd;
+  int ishost = (type == 'H' || type == 'h'), upsert = (type == 'G' || type == 'H');
+
+  /* Fold repeated changes to the same object within a batch.  Updates keep
+   * their original place so groups still precede their hosts; deletions
+   * move to the end. */
+  for(pd=&pendinghead;*pd;pd=&((*pd)->next)) {
+    d = *pd;
+    if(d->id != id || ishost != (d->type == 'H' || d->type == 'h'))
+      continue;
+
+    if(upsert) {
+      free(d->data);
+      d->type = type;
+      d->data = copydata(data);
+      return;
+    }
+
+    *pd = d->next;
+    freedelta(d);
+    break;
+  }
+
+  for(pendingtail=NULL,d=pendinghead;d;d=d->next)
+    pendingtail = d;
+
+  d = malloc(sizeof(trdelta));
+  d->type = type;
+  d->id = id;
+  d->seq = 0;
+  d->data = copydata(data);
+  d->next = NULL;
+
+  if(pendingtail)
+    pendingtail->next = d;
+  else
+    pendinghead = d;
+  pendingtail = d;
+
+  if(!flushsched)
+    flushsched = scheduleoneshot(time(NULL) + 1, flushdeltas, NULL);
+}
+
+static void flushpending(void) {
+  if(flushsched)
+    deleteschedule(flushsched, flushdeltas, NULL);
+
+  flushdeltas(NULL);
+}
+
+static void freereplog(void) {
+  trdelta *d, *next;
+  int i;
+
+  if(flushsched) {
+    deleteschedule(flushsched, flushdeltas, NULL);
+    flushsched = NULL;
+  }
+
+  for(d=pendinghead;d;d=next) {
+    next = d->next;
+    freedelta(d);
+  }
+  pendinghead = pendingtail = NULL;
+
+  for(i=0;i<TRUSTS_REPLOGSIZE;i++) {
+    if(replog[i]) {
+      freedelta(replog[i]);
+      replog[i] = NULL;
+    }
+  }
+}
+
+static void replicate(nick *target, int forced) {
   SHA1_CTX s;
   unsigned int lineno, lines;
   unsigned char digest[SHA1_DIGESTSIZE];
@@ -45,6 +251,9 @@ static void replicate(int forced) {
   trustgroup *tg;
   trusthost *th;
 
+  /* the copy must include everything up to the sequence number it claims */
+  flushpending();
+
   if(++replicationid > 10000)
     replicationid = 1;
 
@@ -56,17 +265,17 @@ static void replicate(int forced) {
 
   SHA1Init(&s);
   lineno = 1;
-  broadcast(&s, replicationid, lineno++, "trinit", "%d %u", forced, lines);
+  broadcast(&s, target, replicationid, lineno++, "trinit", "%d %u %u %u", forced, lines, replepoch, replseq);
 
   for(tg=tglist;tg;tg=tg->next) {
-    broadcast(&s, replicationid, lineno++, "trdata", "G %s", dumptg(tg, 0));
+    broadcast(&s, target, replicationid, lineno++, "trdata", "G %s", dumptg(tg, 0));
 
     for(th=tg->hosts;th;th=th->next)
-      broadcast(&s, replicationid, lineno++, "trdata", "H %s", dumpth(th, 0));
+      broadcast(&s, target, replicationid, lineno++, "trdata", "H %s", dumpth(th, 0));
   }
 
   SHA1Final(digest, &s);
-  xsb_broadcast("trfini", NULL, "%u %u %s", replicationid, lineno, hmac_printhex(digest, digestbuf, SHA1_DIGESTSIZE));
+  trsend(target, "trfini", "%u %u %s", replicationid, lineno, hmac_printhex(digest, digestbuf, SHA1_DIGESTSIZE));
 }
 
 static int xsb_tr_requeststart(void *source, int argc, char **argv) {
@@ -76,7 +285,123 @@ static int xsb_tr_requeststart(void *source, int argc, char **argv) {
   if(t - last > 5) {
     last = t;
 
-    replicate(0);
+    replicate(source, 0);
+  }
+
+  return CMD_OK;
+}
+
+static void senddigests(nick *target) {
+  uint64_t digests[TRUSTS_DIGESTBUCKETS];
+  char buf[512];
+  int i, len;
+
+  flushpending();
+  trusts_bucketdigests(digests);
+
+  for(i=0;i<TRUSTS_DIGESTBUCKETS;i+=TRUSTS_DIGESTSPERLINE) {
+    int j;
+
+    for(len=0,j=i;j<i+TRUSTS_DIGESTSPERLINE && j<TRUSTS_DIGESTBUCKETS;j++)
+      len += snprintf(buf + len, sizeof(buf) - len, "%s%016llx", len?" ":"", (unsigned long long)digests[j]);
+
+    trsend(target, "trdigest", "%u %u %d %s", replepoch, replseq, i, buf);
+  }
+
+  trsend(target, "trdigestend", "%u %u %d", replepoch, replseq, TRUSTS_DIGESTBUCKETS);
+}
+
+/* trrequestsince epoch seq */
+static int xsb_tr_requestsince(void *source, int argc, char **argv) {
+  unsigned int epoch, seq, i;
+  trbatch b;
+
+  if(argc < 1)
+    return CMD_ERROR;
+
+  if(sscanf(argv[0], "%u %u", &epoch, &seq) != 2)
+    return CMD_ERROR;
+
+  flushpending();
+
+  if(epoch != replepoch || seq > replseq || (replseq - seq) >= TRUSTS_REPLOGSIZE || (seq < replseq && !replog[(seq + 1) % TRUSTS_REPLOGSIZE])) {
+    senddigests(source);
+    return CMD_OK;
+  }
+
+  memset(&b, 0, sizeof(b));
+  b.target = source;
+
+  for(i=seq+1;i<=replseq;i++)
+    batch_add(&b, replog[i % TRUSTS_REPLOGSIZE]);
+  batch_flush(&b);
+
+  return CMD_OK;
+}
+
+/* trrequestbuckets bucket [bucket ...] */
+static int xsb_tr_requestbuckets(void *source, int argc, char **argv) {
+  char *p, *end, buf[512];
+  unsigned long bucket;
+  trustgroup *tg;
+  int len, count;
+
+  if(argc < 1)
+    return CMD_ERROR;
+
+  for(p=argv[0];*p;p=end) {
+    bucket = strtoul(p, &end, 10);
+    if(end == p || bucket >= TRUSTS_DIGESTBUCKETS)
+      break;
+    while(*end == ' ')
+      end++;
+
+    buf[0] = '\0';
+    for(len=0,count=0,tg=tglist;tg;tg=tg->next) {
+      if(tg_digestbucket(tg->id) != bucket)
+        continue;
+
+      len += snprintf(buf + len, sizeof(buf) - len, "%s%u:%016llx", len?" ":"", tg->id, (unsigned long long)tg_digest(tg));
+      if(++count == TRUSTS_GROUPSPERLINE) {
+        trsend(source, "trbucket", "%lu %s", bucket, buf);
+        buf[0] = '\0';
+        len = count = 0;
+      }
+    }
+
+    if(count)
+      trsend(source, "trbucket", "%lu %s", bucket, buf);
+    trsend(source, "trbucketend", "%lu", bucket);
+  }
+
+  return CMD_OK;
+}
+
+/* trrequestgroups id [id ...] */
+static int xsb_tr_requestgroups(void *source, int argc, char **argv) {
+  char *p, *end;
+  unsigned long id;
+  trustgroup *tg;
+  trusthost *th;
+
+  if(argc < 1)
+    return CMD_ERROR;
+
+  for(p=argv[0];*p;p=end) {
+    id = strtoul(p, &end, 10);
+    if(end == p)
+      break;
+    while(*end == ' ')
+      end++;
+
+    tg = tg_getbyid(id);
+    if(tg) {
+      trsend(source, "trgroup", "G %s", dumptg(tg, 0));
+      for(th=tg->hosts;th;th=th->next)
+        trsend(source, "trgroup", "H %s", dumpth(th, 0));
+    }
+
+    trsend(source, "trgroupend", "%lu", id);
   }
 
   return CMD_OK;
@@ -85,44 +410,48 @@ static int xsb_tr_requeststart(void *source, int argc, char **argv) {
 static void groupadded(int hooknum, void *arg) {
   trustgroup *tg = arg;
 
-  xsb_broadcast("traddgroup", NULL, "%s", dumptg(tg, 0));
+  queuedelta('G', tg->id, dumptg(tg, 0));
 }
 
 static void groupremoved(int hooknum, void *arg) {
   trustgroup *tg = arg;
+  char buf[20];
 
-  xsb_broadcast("trdelgroup", NULL, "%u", tg->id);
+  snprintf(buf, sizeof(buf), "%u", tg->id);
+  queuedelta('g', tg->id, buf);
 }
 
 static void hostadded(int hooknum, void *arg) {
   trusthost *th = arg;
 
-  xsb_broadcast("traddhost", NULL, "%s", dumpth(th, 0));
+  queuedelta('H', th->id, dumpth(th, 0));
 }
 
 static void hostremoved(int hooknum, void *arg) {
   trusthost *th = arg;
+  char buf[20];
 
-  xsb_broadcast("trdelhost", NULL, "%u", th->id);
+  snprintf(buf, sizeof(buf), "%u", th->id);
+  queuedelta('h', th->id, buf);
 }
 
 static void groupmodified(int hooknum, void *arg) {
   trustgroup *tg = arg;
 
-  xsb_broadcast("trmodifygroup", NULL, "%s", dumptg(tg, 0));
+  queuedelta('G', tg->id, dumptg(tg, 0));
 }
 
 static void hostmodified(int hooknum, void *arg) {
   trusthost *th = arg;
 
-  xsb_broadcast("trmodifyhost", NULL, "%s", dumpth(th, 0));
+  queuedelta('H', th->id, dumpth(th, 0));
 }
 
 static int trusts_cmdtrustforceresync(void *source, int argc, char **argv) {
   nick *np = source;
 
   controlreply(np, "Resync in progress. . .");
-  replicate(1);
+  replicate(NULL, 1);
   controlreply(np, "Resync complete.");
 
   return CMD_OK;
@@ -135,7 +464,13 @@ static void __dbloaded(int hooknum, void *arg) {
 
   commandsregistered = 1;
 
+  replepoch = time(NULL);
+  replseq = 0;
+
   xsb_addcommand("trrequeststart", 0, xsb_tr_requeststart);
+  xsb_addcommand("trrequestsince", 1, xsb_tr_requestsince);
+  xsb_addcommand("trrequestbuckets", 1, xsb_tr_requestbuckets);
+  xsb_addcommand("trrequestgroups", 1, xsb_tr_requestgroups);
 
   registerhook(HOOK_TRUSTS_ADDGROUP, groupadded);
   registerhook(HOOK_TRUSTS_DELGROUP, groupremoved);
@@ -147,7 +482,7 @@ static void __dbloaded(int hooknum, void *arg) {
   /* we've just reloaded */
   /* if we're not online, no problem, other nodes will ask us individually */
   if(trusts_fullyonline())
-    replicate(1);
+    replicate(NULL, 1);
 
   registercontrolhelpcmd("trustforceresync", NO_DEVELOPER, 0, trusts_cmdtrustforceresync, "Usage: trustforceresync");
 }
@@ -158,13 +493,18 @@ static void __dbclosed(int hooknum, void *arg) {
   commandsregistered = 0;
 
   xsb_delcommand("trrequeststart", xsb_tr_requeststart);
-
-  registerhook(HOOK_TRUSTS_ADDGROUP, groupadded);
-  registerhook(HOOK_TRUSTS_DELGROUP, groupremoved);
-  registerhook(HOOK_TRUSTS_ADDHOST, hostadded);
-  registerhook(HOOK_TRUSTS_DELGROUP, hostremoved);
-  registerhook(HOOK_TRUSTS_MODIFYGROUP, groupmodified);
-  registerhook(HOOK_TRUSTS_MODIFYHOST, hostmodified);
+  xsb_delcommand("trrequestsince", xsb_tr_requestsince);
+  xsb_delcommand("trrequestbuckets", xsb_tr_requestbuckets);
+  xsb_delcommand("trrequestgroups", xsb_tr_requestgroups);
+
+  deregisterhook(HOOK_TRUSTS_ADDGROUP, groupadded);
+  deregisterhook(HOOK_TRUSTS_DELGROUP, groupremoved);
+  deregisterhook(HOOK_TRUSTS_ADDHOST, hostadded);
+  deregisterhook(HOOK_TRUSTS_DELHOST, hostremoved);
+  deregisterhook(HOOK_TRUSTS_MODIFYGROUP, groupmodified);
+  deregisterhook(HOOK_TRUSTS_MODIFYHOST, hostmodified);
+
+  freereplog();
 
   deregistercontrolcmd("trustforceresync", trusts_cmdtrustforceresync);
 }
@@ -24,6 +24,21 @@ static sstring *smasterserver;
 static unsigned int curlineno, totallines;
 static SHA1_CTX s;
 
+/* Position in the master's replication log; see trusts_master.c. */
+static unsigned int replepoch, replseq, initepoch, initseq;
+static int catchingup;
+static time_t catchupsent;
+
+/* Digest resync state. */
+static int digesting, bucketspending, groupspending;
+static unsigned int digestepoch, digestseq;
+static uint64_t localdigests[TRUSTS_DIGESTBUCKETS];
+static unsigned int diffbuckets[TRUSTS_DIGESTBUCKETS], ndiffbuckets;
+static int curbucket = -1;
+static unsigned int *bucketids, bucketcount, bucketsize;
+static uint64_t *bucketdigests;
+static unsigned int curgroup, *stalehosts, nstalehosts, stalehostssize;
+
 void trusts_replication_createtables(void);
 void trusts_replication_swap(void);
 void trusts_replication_complete(int);
@@ -42,7 +57,7 @@ static void __abandonreplication(const char *fn, int line, char *error, ...) {
 
   Error("trusts_slave", ERR_ERROR, "%s", buf2);
 
-  syncing = synced = 0;
+  syncing = synced = digesting = 0;
 
   controlwall(NO_DEVELOPER, NL_TRUSTS, "Warning: %s", buf2);
 }
@@ -134,7 +149,8 @@ static int xsb_trinit(void *source, int argc, char **argv) {
   if(!buf)
     return CMD_ERROR;
 
-  if((sscanf(buf, "%u %u", &forced, &totallines) != 2)) {
+  initepoch = initseq = 0;
+  if((sscanf(buf, "%u %u %u %u", &forced, &totallines, &initepoch, &initseq) < 2)) {
     abandonreplication("bad number for sscanf result");
     return CMD_ERROR;
   }
@@ -248,223 +264,460 @@ static int xsb_trfini(void *source, int argc, char **argv) {
   trusts_replication_swap();
 
   synced = 1;
-  syncing = 0;
+  syncing = digesting = catchingup = 0;
+  replepoch = initepoch;
+  replseq = initseq;
 
   return CMD_OK;
 }
 
-static int xsb_traddgroup(void *source, int argc, char **argv) {
+static trustgroup *upsertgroup(char *line) {
   trustgroup tg, *otg;
 
-  if(!synced)
-    return CMD_OK;
-
-  if(!masterserver(source))
-    return CMD_ERROR;
-
-  if(argc < 1) {
-    abandonreplication("bad number of arguments");
-    return CMD_ERROR;
-  }
+  if(!parsetg(line, &tg, 0))
+    return NULL;
 
-  if(!parsetg(argv[0], &tg, 0)) {
-    abandonreplication("bad trustgroup line: %s", argv[0]);
-    return CMD_ERROR;
+  otg = tg_getbyid(tg.id);
+  if(otg) {
+    if(tg_modify(otg, &tg))
+      tg_update(otg);
+    else
+      otg = NULL;
+  } else {
+    otg = tg_copy(&tg);
   }
 
-  otg = tg_copy(&tg);
-
   freesstring(tg.name);
   freesstring(tg.createdby);
   freesstring(tg.contact);
   freesstring(tg.comment);
 
-  if(!otg) {
-    abandonreplication("unable to add trustgroup");
-    return CMD_ERROR;
+  return otg;
+}
+
+static trusthost *upserthost(char *line) {
+  unsigned int tgid;
+  trusthost th, *oth;
+
+  if(!parseth(line, &th, &tgid, 0))
+    return NULL;
+
+  th.group = tg_getbyid(tgid);
+  if(!th.group)
+    return NULL;
+
+  oth = th_getbyid(th.id);
+  if(oth && oth->group == th.group) {
+    th_modify(oth, &th);
+    th_update(oth);
+    return oth;
   }
 
-  return CMD_OK;
+  /* the same mask under another id (or group) has been replaced on the master */
+  if(oth)
+    th_delete(oth);
+  oth = th_getbyhostandmask(&th.ip, th.bits);
+  if(oth)
+    th_delete(oth);
+
+  return th_copy(&th);
 }
 
-static int xsb_traddhost(void *source, int argc, char **argv) {
-  unsigned int tgid;
-  trusthost th;
+static void deletegroup(unsigned int id) {
+  trustgroup *tg = tg_getbyid(id);
+
+  if(tg)
+    tg_delete(tg);
+}
+
+static void deletehost(unsigned int id) {
+  trusthost *th = th_getbyid(id);
+
+  if(th)
+    th_delete(th);
+}
+
+/* Asks for every delta after the one we have.  An epoch of 0 never matches,
+ * so the master answers with digests instead. */
+static void requestsince(int digest) {
+  time_t t = time(NULL);
+
+  if(catchingup && (t - catchupsent < 30))
+    return;
+
+  catchingup = 1;
+  catchupsent = t;
+
+  xsb_broadcast("trrequestsince", NULL, "%u %u", digest?0:replepoch, replseq);
+}
+
+static int applydelta(char type, char *data) {
+  switch(type) {
+    case 'G':
+      return upsertgroup(data) != NULL;
+    case 'H':
+      return upserthost(data) != NULL;
+    case 'g':
+      deletegroup(strtoul(data, NULL, 10));
+      return 1;
+    case 'h':
+      deletehost(strtoul(data, NULL, 10));
+      return 1;
+  }
+
+  return 0;
+}
+
+/* trdelta epoch firstseq count <type><len>:<data>... */
+static int xsb_trdelta(void *source, int argc, char **argv) {
+  unsigned int epoch, firstseq, count, i, seq;
+  char *p, *end, *data, type;
+  unsigned long len;
+  int chars = 0;
 
-  if(!synced)
+  if(!synced || digesting)
     return CMD_OK;
 
   if(!masterserver(source))
     return CMD_ERROR;
 
-  if(argc < 1) {
-    abandonreplication("bad number of arguments");
+  if(argc < 1 || sscanf(argv[0], "%u %u %u %n", &epoch, &firstseq, &count, &chars) != 3 || chars <= 0) {
+    abandonreplication("bad delta line");
     return CMD_ERROR;
   }
 
-  if(!parseth(argv[0], &th, &tgid, 0)) {
-    abandonreplication("bad trusthost line: %s", argv[0]);
-    return CMD_ERROR;
+  if(epoch != replepoch) {
+    requestsince(0);
+    return CMD_OK;
   }
 
-  th.group = tg_getbyid(tgid);
-  if(!th.group) {
-    abandonreplication("unable to lookup trustgroup");
-    return CMD_ERROR;
-  }
+  p = &argv[0][chars];
+  for(i=0;i<count;i++) {
+    seq = firstseq + i;
 
-  if(!th_copy(&th)) {
-    abandonreplication("unable to add trusthost");
-    return CMD_ERROR;
+    type = *p;
+    if(!type) {
+      abandonreplication("truncated delta line");
+      return CMD_ERROR;
+    }
+
+    len = strtoul(p + 1, &end, 10);
+    if(end == p + 1 || *end != ':' || strlen(end + 1) < len) {
+      abandonreplication("malformed delta record");
+      return CMD_ERROR;
+    }
+
+    data = end + 1;
+    p = data + len;
+
+    if(seq <= replseq)
+      continue;
+
+    if(seq != replseq + 1) {
+      requestsince(0);
+      return CMD_OK;
+    }
+
+    {
+      char save = *p;
+
+      *p = '\0';
+      if(!applydelta(type, data)) {
+        *p = save;
+        Error("trusts_slave", ERR_WARNING, "Unable to apply delta %u (%c), requesting digest resync.", seq, type);
+        requestsince(1);
+        return CMD_OK;
+      }
+      *p = save;
+    }
+
+    replseq = seq;
+    catchingup = 0;
   }
 
   return CMD_OK;
 }
 
-static int xsb_trdelhost(void *source, int argc, char **argv) {
-  unsigned int id;
-  trusthost *th;
+static void checkdigestdone(void) {
+  if(!digesting || bucketspending || groupspending)
+    return;
+
+  digesting = 0;
+  replepoch = digestepoch;
+  replseq = digestseq;
+  catchingup = 0;
+  synced = 1;
+
+  Error("trusts_slave", ERR_INFO, "Digest resync complete (%u differing buckets).", ndiffbuckets);
+
+  /* pick up anything that changed while we were fetching */
+  requestsince(0);
+}
+
+/* sends space separated ids in lines of at most perline */
+static void requestids(const char *command, unsigned int *ids, unsigned int count, unsigned int perline) {
+  char buf[512];
+  unsigned int i;
+  int len = 0;
+
+  for(i=0;i<count;i++) {
+    len += snprintf(buf + len, sizeof(buf) - len, "%s%u", len?" ":"", ids[i]);
+    if(((i + 1) % perline == 0) || (i + 1 == count)) {
+      xsb_broadcast(command, NULL, "%s", buf);
+      len = 0;
+    }
+  }
+}
+
+/* trdigest epoch seq firstbucket digest... */
+static int xsb_trdigest(void *source, int argc, char **argv) {
+  unsigned int epoch, seq, bucket;
+  unsigned long long digest;
+  char *p, *end;
+  int chars = 0;
 
-  if(!synced)
+  if(!synced && !digesting)
     return CMD_OK;
 
   if(!masterserver(source))
     return CMD_ERROR;
 
-  if(argc < 1) {
-    abandonreplication("bad number of arguments");
+  if(argc < 1 || sscanf(argv[0], "%u %u %u %n", &epoch, &seq, &bucket, &chars) != 3 || chars <= 0) {
+    abandonreplication("bad digest line");
     return CMD_ERROR;
   }
 
-  id = strtoul(argv[0], NULL, 10);
-  if(!id) {
-    abandonreplication("unable to convert id to integer");
-    return CMD_ERROR;
+  if(bucket == 0) {
+    digesting = 1;
+    digestepoch = epoch;
+    digestseq = seq;
+    ndiffbuckets = 0;
+    bucketspending = groupspending = 0;
+    curbucket = -1;
+    trusts_bucketdigests(localdigests);
+    Error("trusts_slave", ERR_INFO, "Digest resync in progress. . .");
+  } else if(!digesting || epoch != digestepoch || seq != digestseq) {
+    return CMD_OK;
   }
 
-  th = th_getbyid(id);
-  if(!th) {
-    abandonreplication("unable to lookup id");
-    return CMD_ERROR;
+  for(p=&argv[0][chars];*p && bucket<TRUSTS_DIGESTBUCKETS;p=end,bucket++) {
+    digest = strtoull(p, &end, 16);
+    if(end == p)
+      break;
+    while(*end == ' ')
+      end++;
+
+    if(digest != localdigests[bucket])
+      diffbuckets[ndiffbuckets++] = bucket;
   }
 
-  th_delete(th);
+  return CMD_OK;
+}
+
+/* trdigestend epoch seq buckets */
+static int xsb_trdigestend(void *source, int argc, char **argv) {
+  if(!digesting)
+    return CMD_OK;
+
+  if(!masterserver(source))
+    return CMD_ERROR;
+
+  bucketspending = ndiffbuckets;
+  requestids("trrequestbuckets", diffbuckets, ndiffbuckets, 40);
+  checkdigestdone();
 
   return CMD_OK;
 }
 
-static int xsb_trdelgroup(void *source, int argc, char **argv) {
-  unsigned int id;
-  trustgroup *tg;
+/* trbucket bucket id:digest... */
+static int xsb_trbucket(void *source, int argc, char **argv) {
+  unsigned long bucket, id;
+  unsigned long long digest;
+  char *p, *end;
 
-  if(!synced)
+  if(!digesting)
     return CMD_OK;
 
   if(!masterserver(source))
     return CMD_ERROR;
 
-  if(argc < 1) {
-    abandonreplication("bad number of arguments");
+  if(argc < 1)
     return CMD_ERROR;
-  }
 
-  id = strtoul(argv[0], NULL, 10);
-  if(!id) {
-    abandonreplication("unable to convert id to integer");
-    return CMD_ERROR;
+  bucket = strtoul(argv[0], &p, 10);
+  if((int)bucket != curbucket) {
+    curbucket = bucket;
+    bucketcount = 0;
   }
 
-  tg = tg_getbyid(id);
-  if(!tg) {
-    abandonreplication("unable to lookup id");
-    return CMD_ERROR;
-  }
+  while(*p) {
+    while(*p == ' ')
+      p++;
+    id = strtoul(p, &end, 10);
+    if(end == p || *end != ':')
+      break;
+    p = end + 1;
+    digest = strtoull(p, &end, 16);
+    if(end == p)
+      break;
+    p = end;
 
-  tg_delete(tg);
+    if(bucketcount == bucketsize) {
+      bucketsize = bucketsize?bucketsize*2:64;
+      bucketids = realloc(bucketids, sizeof(unsigned int) * bucketsize);
+      bucketdigests = realloc(bucketdigests, sizeof(uint64_t) * bucketsize);
+    }
+    bucketids[bucketcount] = id;
+    bucketdigests[bucketcount++] = digest;
+  }
 
   return CMD_OK;
 }
 
-static int xsb_trmodifygroup(void *source, int argc, char **argv) {
-  trustgroup tg, *otg;
+/* trbucketend bucket */
+static int xsb_trbucketend(void *source, int argc, char **argv) {
+  unsigned long bucket;
+  unsigned int i, nwant = 0, ndel = 0, *want, *del;
+  trustgroup *tg;
 
-  if(!synced)
+  if(!digesting)
     return CMD_OK;
 
   if(!masterserver(source))
     return CMD_ERROR;
 
-  if(argc < 1) {
-    abandonreplication("bad number of arguments");
+  if(argc < 1)
     return CMD_ERROR;
-  }
 
-  if(!parsetg(argv[0], &tg, 0)) {
-    abandonreplication("bad trustgroup line: %s", argv[0]);
-    return CMD_ERROR;
+  bucket = strtoul(argv[0], NULL, 10);
+  if((int)bucket != curbucket)
+    bucketcount = 0;
+
+  want = malloc(sizeof(unsigned int) * (bucketcount + 1));
+  for(i=0;i<bucketcount;i++) {
+    tg = tg_getbyid(bucketids[i]);
+    if(!tg || tg_digest(tg) != bucketdigests[i])
+      want[nwant++] = bucketids[i];
   }
 
-  otg = tg_getbyid(tg.id);
+  for(tg=tglist;tg;tg=tg->next)
+    if(tg_digestbucket(tg->id) == bucket)
+      ndel++;
 
-  if(otg && !tg_modify(otg, &tg)) {
-    abandonreplication("unable to modify database");
-    return CMD_ERROR;
-  }
+  del = malloc(sizeof(unsigned int) * (ndel + 1));
+  for(ndel=0,tg=tglist;tg;tg=tg->next) {
+    if(tg_digestbucket(tg->id) != bucket)
+      continue;
 
-  freesstring(tg.name);
-  freesstring(tg.createdby);
-  freesstring(tg.contact);
-  freesstring(tg.comment);
+    for(i=0;i<bucketcount;i++)
+      if(bucketids[i] == tg->id)
+        break;
 
-  if(!otg) {
-    abandonreplication("unable to lookup id");
-    return CMD_ERROR;
+    if(i == bucketcount)
+      del[ndel++] = tg->id;
   }
 
-  tg_update(otg);
+  for(i=0;i<ndel;i++)
+    deletegroup(del[i]);
+
+  groupspending += nwant;
+  requestids("trrequestgroups", want, nwant, 30);
+
+  free(want);
+  free(del);
+
+  curbucket = -1;
+  bucketcount = 0;
+  bucketspending--;
+  checkdigestdone();
 
   return CMD_OK;
 }
 
-static int xsb_trmodifyhost(void *source, int argc, char **argv) {
+/* trgroup G|H data */
+static int xsb_trgroup(void *source, int argc, char **argv) {
   trustgroup *tg;
-  trusthost th, *oth;
-  unsigned int groupid;
+  trusthost *th;
+  unsigned int i;
 
-  if(!synced)
+  if(!digesting)
     return CMD_OK;
 
   if(!masterserver(source))
     return CMD_ERROR;
 
-  if(argc < 1) {
-    abandonreplication("bad number of arguments");
+  if(argc < 1 || !argv[0][0] || argv[0][1] != ' ') {
+    abandonreplication("malformed group line");
     return CMD_ERROR;
   }
 
-  if(!parseth(argv[0], &th, &groupid, 0)) {
-    abandonreplication("bad trusthost line: %s", argv[0]);
+  if(argv[0][0] == 'G') {
+    tg = upsertgroup(&argv[0][2]);
+    if(!tg) {
+      abandonreplication("bad trustgroup line: %s", argv[0]);
+      return CMD_ERROR;
+    }
+
+    /* remember the hosts we have, whatever the master doesn't send goes */
+    curgroup = tg->id;
+    nstalehosts = 0;
+    for(th=tg->hosts;th;th=th->next) {
+      if(nstalehosts == stalehostssize) {
+        stalehostssize = stalehostssize?stalehostssize*2:32;
+        stalehosts = realloc(stalehosts, sizeof(unsigned int) * stalehostssize);
+      }
+      stalehosts[nstalehosts++] = th->id;
+    }
+  } else if(argv[0][0] == 'H') {
+    th = upserthost(&argv[0][2]);
+    if(!th) {
+      abandonreplication("bad trusthost line: %s", argv[0]);
+      return CMD_ERROR;
+    }
+
+    for(i=0;i<nstalehosts;i++) {
+      if(stalehosts[i] == th->id) {
+        stalehosts[i] = stalehosts[--nstalehosts];
+        break;
+      }
+    }
+  } else {
+    abandonreplication("bad trust type: %c", argv[0][0]);
     return CMD_ERROR;
   }
 
-  tg = tg_getbyid(groupid);
+  return CMD_OK;
+}
+
+/* trgroupend id */
+static int xsb_trgroupend(void *source, int argc, char **argv) {
+  unsigned int id, i;
 
-  for(oth=tg->hosts;oth;oth=oth->next) {
-    if(ipmask_check(&oth->ip, &th.ip, th.bits) && th.bits == oth->bits)
-      break;
-  }
+  if(!digesting)
+    return CMD_OK;
 
-  if(oth && !th_modify(oth, &th)) {
-    abandonreplication("unable to modify database");
+  if(!masterserver(source))
     return CMD_ERROR;
-  }
 
-  if(!oth) {
-    abandonreplication("unable to lookup host");
+  if(argc < 1)
     return CMD_ERROR;
+
+  id = strtoul(argv[0], NULL, 10);
+
+  if(curgroup == id) {
+    for(i=0;i<nstalehosts;i++)
+      deletehost(stalehosts[i]);
+  } else {
+    /* no G line, the master doesn't have it any more */
+    deletegroup(id);
   }
 
-  th_update(oth);
+  curgroup = 0;
+  nstalehosts = 0;
+
+  if(groupspending > 0)
+    groupspending--;
+  checkdigestdone();
 
   return CMD_OK;
 }
@@ -490,11 +743,26 @@ static int masterserver(void *source) {
 static void checksynced(void *arg) {
   if(!synced && !syncing)
     xsb_broadcast("trrequeststart", NULL, "%s", "");
+  else if(synced && catchingup && !digesting)
+    requestsince(0);
 }
 
 static int trusts_cmdtrustresync(void *source, int argc, char **argv) {
   nick *np = source;
 
+  if(argc > 0 && !strcasecmp(argv[0], "digest")) {
+    if(!synced) {
+      controlreply(np, "Not synchronised yet, a full resync is needed.");
+      return CMD_ERROR;
+    }
+
+    catchingup = 0;
+    requestsince(1);
+    controlreply(np, "Digest request sent.");
+
+    return CMD_OK;
+  }
+
   syncing = synced = 0;
 
   checksynced(NULL);
@@ -533,17 +801,18 @@ void _init(void) {
 
   loaded = 1;
 
-  registercontrolhelpcmd("trustresync", NO_DEVELOPER, 0, trusts_cmdtrustresync, "Usage: trustresync");
+  registercontrolhelpcmd("trustresync", NO_DEVELOPER, 1, trusts_cmdtrustresync, "Usage: trustresync ?digest?\nRequests a full copy of the trust database from the master, or with digest\nonly the groups that differ.");
 
   xsb_addcommand("trinit", 1, xsb_trinit);
   xsb_addcommand("trdata", 1, xsb_trdata);
   xsb_addcommand("trfini", 1, xsb_trfini);
-  xsb_addcommand("traddhost", 1, xsb_traddhost);
-  xsb_addcommand("traddgroup", 1, xsb_traddgroup);
-  xsb_addcommand("trdelhost", 1, xsb_trdelhost);
-  xsb_addcommand("trdelgroup", 1, xsb_trdelgroup);
-  xsb_addcommand("trmodifygroup", 1, xsb_trmodifygroup);
-  xsb_addcommand("trmodifyhost", 1, xsb_trmodifyhost);
+  xsb_addcommand("trdelta", 1, xsb_trdelta);
+  xsb_addcommand("trdigest", 1, xsb_trdigest);
+  xsb_addcommand("trdigestend", 1, xsb_trdigestend);
+  xsb_addcommand("trbucket", 1, xsb_trbucket);
+  xsb_addcommand("trbucketend", 1, xsb_trbucketend);
+  xsb_addcommand("trgroup", 1, xsb_trgroup);
+  xsb_addcommand("trgroupend", 1, xsb_trgroupend);
 
   registerhook(HOOK_SERVER_LINKED, __serverlinked);
   syncsched = schedulerecurring(time(NULL)+5, 0, 60, checksynced, NULL);
@@ -563,12 +832,17 @@ void _fini(void) {
   xsb_delcommand("trinit", xsb_trinit);
   xsb_delcommand("trdata", xsb_trdata);
   xsb_delcommand("trfini", xsb_trfini);  
-  xsb_delcommand("traddhost", xsb_traddhost);
-  xsb_delcommand("traddgroup", xsb_traddgroup);
-  xsb_delcommand("trdelhost", xsb_trdelhost);
-  xsb_delcommand("trdelgroup", xsb_trdelgroup);
-  xsb_delcommand("trmodifygroup", xsb_trmodifygroup);
-  xsb_delcommand("trmodifyhost", xsb_trmodifyhost);
+  xsb_delcommand("trdelta", xsb_trdelta);
+  xsb_delcommand("trdigest", xsb_trdigest);
+  xsb_delcommand("trdigestend", xsb_trdigestend);
+  xsb_delcommand("trbucket", xsb_trbucket);
+  xsb_delcommand("trbucketend", xsb_trbucketend);
+  xsb_delcommand("trgroup", xsb_trgroup);
+  xsb_delcommand("trgroupend", xsb_trgroupend);
+
+  free(bucketids);
+  free(bucketdigests);
+  free(stalehosts);
 
   deregisterhook(HOOK_SERVER_LINKED, __serverlinked);
 
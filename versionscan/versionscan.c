@@ -6,6 +6,7 @@ MODULE_VERSION("")
 
 CommandTree* versionscan_commands;
 nick* versionscan_nick;
+static deferqueue* versionscan_queue;
 int versionscannext;
 int versionscan_mode;
 vspattern* vspatterns;
@@ -691,7 +692,19 @@ void versionscan_newnick(int hooknum, void* arg) {
   
   /* ignore opers or auth'd users, helps cut down on spam during a burst */
   if (!(IsOper(np) || IsAccount(np)) && (versionscan_mode == VS_SCAN)) {
-    sendmessagetouser(versionscan_nick, np, "\001VERSION\001");
+    defer(versionscan_queue, versionscan_sendversion, np);
+  }
+}
+
+void versionscan_lostnick(int hooknum, void* arg) {
+  canceldeferred(versionscan_queue, versionscan_sendversion, arg);
+}
+
+/* The requests themselves go out from the deferred queue, at a rate that
+ * doesn't hold up the main loop when lots of clients connect at once. */
+void versionscan_sendversion(void* arg) {
+  if (versionscan_nick && (versionscan_mode == VS_SCAN)) {
+    sendmessagetouser(versionscan_nick, (nick*)arg, "\001VERSION\001");
   }
 }
 
@@ -745,7 +758,7 @@ void versionscan_handler(nick* me, int type, void** args) {
       cargc=(cmd->maxparams)+1;
     }
     
-    (cmd->handler)((void*)sender, cargc-1, &(cargv[1]));
+    callcommand(cmd, (void*)sender, cargc-1, &(cargv[1]));
     break;
   case LU_PRIVNOTICE:
     sender=args[0];
@@ -838,7 +851,10 @@ void _init() {
   addcommandtotree(versionscan_commands, "broadcast", VS_AUTHED | VS_OPER | VS_ADMIN, 1, versionscan_broadcast);
   addcommandtotree(versionscan_commands, "whois", VS_AUTHED | VS_STAFF, 1, versionscan_whois);
   
+  versionscan_queue=newdeferqueue("versionscan", DEFER_PRIO_LOW, 0);
+  
   registerhook(HOOK_NICK_NEWNICK, &versionscan_newnick);
+  registerhook(HOOK_NICK_LOSTNICK, &versionscan_lostnick);
   
   vsconnect=scheduleoneshot(time(NULL)+1, &versionscan_createfakeuser, NULL);
 }
@@ -847,6 +863,9 @@ void _fini() {
   void* p, *np;
   
   deregisterhook(HOOK_NICK_NEWNICK, &versionscan_newnick);
+  deregisterhook(HOOK_NICK_LOSTNICK, &versionscan_lostnick);
+  
+  freedeferqueue(versionscan_queue);
   
   if (vsconnect) {
     deleteschedule(vsconnect, &versionscan_createfakeuser, NULL);
@@ -2,6 +2,7 @@
 #include "../localuser/localuserchannel.h"
 #include "../core/hooks.h"
 #include "../core/schedule.h"
+#include "../core/deferred.h"
 #include "../lib/array.h"
 #include "../lib/base64.h"
 #include "../lib/irc_string.h"
@@ -77,5 +78,7 @@ void versionscan_addpattern(char* pattern, char* data, unsigned char action);
 void versionscan_delpattern(char* pattern);
 vspattern* versionscan_getpattern(char* pattern);
 void versionscan_newnick(int hooknum, void* arg);
+void versionscan_lostnick(int hooknum, void* arg);
+void versionscan_sendversion(void* arg);
 void versionscan_handler(nick* me, int type, void** args);
 void versionscan_createfakeuser(void* arg);
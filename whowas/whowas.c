@@ -17,10 +17,191 @@ whowas *whowasrecs;
 int whowasoffset = 0;
 int whowasmax;
 
-whowas *whowas_fromnick(nick *np, int standalone) {
+/* Interned string table: records share identical strings (hosts, realnames,
+ * quit reasons, ...) instead of each keeping their own copy. */
+typedef struct wwstring {
+  sstring *str;
+  unsigned int refcount;
+  struct wwstring *next;
+} wwstring;
+
+static wwstring **wwstringtable;
+static unsigned int wwstringhashsize;
+static unsigned int wwstringcount;
+static size_t wwstringbytes;
+
+/* Secondary indices: each bucket is a doubly linked list of records, newest
+ * first. Records are unlinked when they are evicted from the ring. */
+static whowas **wwindextable[WW_INDEX_COUNT];
+static unsigned int wwindexhashsize;
+
+/* Scratch nicks handed out by whowas_tonick(). */
+typedef struct whowasnick {
+  nick nick;
+  host host;
+  realname realname;
+  authname auth;
+  struct whowasnick *nextfree;
+} whowasnick;
+
+static whowasnick *freewhowasnicks;
+
+#define wwstringhash(x) (irc_crc32(x) & (wwstringhashsize - 1))
+#define wwindexhash(x) (irc_crc32i(x) & (wwindexhashsize - 1))
+
+static unsigned int wwhashsize(int entries) {
+  unsigned int size = 1024;
+
+  while (size < entries / 2)
+    size <<= 1;
+
+  return size;
+}
+
+sstring *whowas_getstring(const char *str, int maxlen) {
+  wwstring *wsp;
+  sstring *ss;
+  unsigned int bucket;
+
+  if (!str)
+    return NULL;
+
+  /* truncate first so the lookup sees the same string we'd store */
+  ss = getsstring(str, maxlen);
+  bucket = wwstringhash(ss->content);
+
+  for (wsp = wwstringtable[bucket]; wsp; wsp = wsp->next) {
+    if (wsp->str->length == ss->length && strcmp(wsp->str->content, ss->content) == 0) {
+      freesstring(ss);
+      wsp->refcount++;
+      return wsp->str;
+    }
+  }
+
+  wsp = malloc(sizeof(wwstring));
+  wsp->str = ss;
+  wsp->refcount = 1;
+  wsp->next = wwstringtable[bucket];
+  wwstringtable[bucket] = wsp;
+
+  wwstringcount++;
+  wwstringbytes += sizeof(wwstring) + sizeof(sstring) + ss->length + 1;
+
+  return ss;
+}
+
+void whowas_releasestring(sstring *ss) {
+  wwstring **wsh, *wsp;
+
+  if (!ss)
+    return;
+
+  for (wsh = &wwstringtable[wwstringhash(ss->content)]; *wsh; wsh = &((*wsh)->next)) {
+    wsp = *wsh;
+
+    if (wsp->str != ss)
+      continue;
+
+    if (--wsp->refcount > 0)
+      return;
+
+    *wsh = wsp->next;
+    wwstringcount--;
+    wwstringbytes -= sizeof(wwstring) + sizeof(sstring) + ss->length + 1;
+    freesstring(ss);
+    free(wsp);
+    return;
+  }
+
+  Error("whowas", ERR_ERROR, "Unable to release interned string %s", ss->content);
+}
+
+void whowas_stringstats(unsigned int *count, size_t *bytes) {
+  *count = wwstringcount;
+  *bytes = wwstringbytes;
+}
+
+static sstring *whowas_indexkey(int index, whowas *ww) {
+  switch (index) {
+    case WW_INDEX_NICK:
+      return ww->nick;
+    case WW_INDEX_HOST:
+      return ww->host;
+    case WW_INDEX_ACCOUNT:
+      return ww->authname;
+    default:
+      return NULL;
+  }
+}
+
+static void whowas_link(whowas *ww) {
+  sstring *key;
+  whowas **bucket;
+  int i;
+
+  for (i = 0; i < WW_INDEX_COUNT; i++) {
+    ww->inext[i] = ww->iprev[i] = NULL;
+
+    key = whowas_indexkey(i, ww);
+
+    if (!key)
+      continue;
+
+    bucket = &wwindextable[i][wwindexhash(key->content)];
+
+    ww->inext[i] = *bucket;
+    if (*bucket)
+      (*bucket)->iprev[i] = ww;
+    *bucket = ww;
+  }
+
+  ww->indexed = 1;
+}
+
+static void whowas_unlink(whowas *ww) {
+  sstring *key;
+  int i;
+
+  if (!ww->indexed)
+    return;
+
+  for (i = 0; i < WW_INDEX_COUNT; i++) {
+    key = whowas_indexkey(i, ww);
+
+    if (!key)
+      continue;
+
+    if (ww->iprev[i])
+      ww->iprev[i]->inext[i] = ww->inext[i];
+    else
+      wwindextable[i][wwindexhash(key->content)] = ww->inext[i];
+
+    if (ww->inext[i])
+      ww->inext[i]->iprev[i] = ww->iprev[i];
+  }
+
+  ww->indexed = 0;
+}
+
+whowas *whowas_indexnext(int index, whowas *ww, const char *key) {
+  sstring *wkey;
+
+  for (; ww; ww = ww->inext[index]) {
+    wkey = whowas_indexkey(index, ww);
+
+    if (ircd_strcmp(wkey->content, key) == 0)
+      return ww;
+  }
+
+  return NULL;
+}
+
+whowas *whowas_indexfirst(int index, const char *key) {
+  return whowas_indexnext(index, wwindextable[index][wwindexhash(key)], key);
+}
+
+static whowas *whowas_newrecord(nick *np, const char *nickname, int standalone) {
   whowas *ww;
-  nick *wnp;
-  struct irc_in_addr ipaddress_canonical;
   void *args[2];
 
   /* Create a new record. */
@@ -34,44 +215,31 @@ whowas *whowas_fromnick(nick *np, int standalone) {
 
   memset(ww, 0, sizeof(whowas));
 
-  wnp = &ww->nick;
-  memset(wnp, 0, sizeof(nick));
-  strncpy(wnp->nick, np->nick, NICKLEN + 1);
-  wnp->numeric = np->numeric;
-  strncpy(wnp->ident, np->ident, USERLEN + 1);
-
-  wnp->host = newhost();
-  memset(wnp->host, 0, sizeof(host));
-  wnp->host->name = getsstring(np->host->name->content, HOSTLEN);
-
-  wnp->realname = newrealname();
-  memset(wnp->realname, 0, sizeof(realname));
-  wnp->realname->name = getsstring(np->realname->name->content, REALLEN);
-  wnp->shident = np->shident ? getsstring(np->shident->content, 512) : NULL;
-  wnp->sethost = np->sethost ? getsstring(np->sethost->content, 512) : NULL;
-  wnp->opername = np->opername ? getsstring(np->opername->content, 512) : NULL;
-  wnp->umodes = np->umodes;
+  ww->nick = whowas_getstring(nickname, NICKLEN);
+  ww->numeric = np->numeric;
+  ww->ident = whowas_getstring(np->ident, USERLEN);
+  ww->host = whowas_getstring(np->host->name->content, HOSTLEN);
+  ww->realname = whowas_getstring(np->realname->name->content, REALLEN);
+  ww->shident = np->shident ? whowas_getstring(np->shident->content, 512) : NULL;
+  ww->sethost = np->sethost ? whowas_getstring(np->sethost->content, 512) : NULL;
+  ww->opername = np->opername ? whowas_getstring(np->opername->content, 512) : NULL;
+  ww->umodes = np->umodes;
   if (np->auth) {
-    wnp->auth = newauthname();
-    memset(wnp->auth, 0, sizeof(authname));
-    wnp->auth->userid = np->auth->userid;
-    strncpy(wnp->auth->name, np->auth->name, ACCOUNTLEN + 1);
-    wnp->authname = wnp->auth->name;
+    ww->userid = np->auth->userid;
+    ww->authname = whowas_getstring(np->auth->name, ACCOUNTLEN);
   }
-  wnp->timestamp = np->timestamp;
-  wnp->accountts = np->accountts;
-  wnp->away = np->away ? getsstring(np->away->content, 512) : NULL;
-
-  memcpy(&wnp->ipaddress, &np->ipaddress, sizeof(struct irc_in_addr));
-
-  ip_canonicalize_tunnel(&ipaddress_canonical, &np->ipaddress);
-  wnp->ipnode = refnode(iptree, &ipaddress_canonical, PATRICIA_MAXBITS);
+  ww->nickts = np->timestamp;
+  ww->accountts = np->accountts;
+  ww->away = np->away ? whowas_getstring(np->away->content, 512) : NULL;
 
-  wnp->next = (nick *)ww; /* Yuck. */
+  memcpy(&ww->ipaddress, &np->ipaddress, sizeof(struct irc_in_addr));
 
   ww->timestamp = getnettime();
   ww->type = WHOWAS_USED;
 
+  if (!standalone)
+    whowas_link(ww);
+
   args[0] = ww;
   args[1] = np;
   triggerhook(HOOK_WHOWAS_NEWRECORD, args);
@@ -79,27 +247,82 @@ whowas *whowas_fromnick(nick *np, int standalone) {
   return ww;
 }
 
-void whowas_clean(whowas *ww) {
+whowas *whowas_fromnick(nick *np, int standalone) {
+  return whowas_newrecord(np, np->nick, standalone);
+}
+
+nick *whowas_tonick(whowas *ww) {
+  whowasnick *wnp;
   nick *np;
 
+  if (freewhowasnicks) {
+    wnp = freewhowasnicks;
+    freewhowasnicks = wnp->nextfree;
+  } else
+    wnp = malloc(sizeof(whowasnick));
+
+  memset(wnp, 0, sizeof(whowasnick));
+
+  np = &wnp->nick;
+  strncpy(np->nick, ww->nick->content, NICKLEN + 1);
+  np->numeric = ww->numeric;
+  strncpy(np->ident, ww->ident->content, USERLEN + 1);
+
+  np->host = &wnp->host;
+  np->host->name = ww->host;
+
+  np->realname = &wnp->realname;
+  np->realname->name = ww->realname;
+
+  np->shident = ww->shident;
+  np->sethost = ww->sethost;
+  np->opername = ww->opername;
+  np->umodes = ww->umodes;
+
+  if (ww->authname) {
+    np->auth = &wnp->auth;
+    np->auth->userid = ww->userid;
+    strncpy(np->auth->name, ww->authname->content, ACCOUNTLEN + 1);
+    np->authname = np->auth->name;
+  }
+
+  np->timestamp = ww->nickts;
+  np->accountts = ww->accountts;
+  np->away = ww->away;
+
+  memcpy(&np->ipaddress, &ww->ipaddress, sizeof(struct irc_in_addr));
+
+  np->next = (nick *)ww; /* Yuck. */
+
+  return np;
+}
+
+void whowas_freenick(nick *np) {
+  whowasnick *wnp = (whowasnick *)np;
+
+  wnp->nextfree = freewhowasnicks;
+  freewhowasnicks = wnp;
+}
+
+void whowas_clean(whowas *ww) {
   if (!ww || ww->type == WHOWAS_UNUSED)
     return;
 
   triggerhook(HOOK_WHOWAS_LOSTRECORD, ww);
 
-  np = &ww->nick;
-  freesstring(np->host->name);
-  freehost(np->host);
-  freesstring(np->realname->name);
-  freerealname(np->realname);
-  freesstring(np->shident);
-  freesstring(np->sethost);
-  freesstring(np->opername);
-  freeauthname(np->auth);
-  freesstring(np->away);
-  derefnode(iptree, np->ipnode);
-  freesstring(ww->reason);
-  freesstring(ww->newnick);
+  whowas_unlink(ww);
+
+  whowas_releasestring(ww->nick);
+  whowas_releasestring(ww->ident);
+  whowas_releasestring(ww->host);
+  whowas_releasestring(ww->realname);
+  whowas_releasestring(ww->authname);
+  whowas_releasestring(ww->shident);
+  whowas_releasestring(ww->sethost);
+  whowas_releasestring(ww->opername);
+  whowas_releasestring(ww->away);
+  whowas_releasestring(ww->reason);
+  whowas_releasestring(ww->newnick);
   ww->type = WHOWAS_UNUSED;
 }
 
@@ -133,7 +356,7 @@ static void whowas_handlequitorkill(int hooknum, void *arg) {
       ww->type = WHOWAS_QUIT;
   }
 
-  ww->reason = getsstring(reason, WW_REASONLEN);
+  ww->reason = whowas_getstring(reason, WW_REASONLEN);
 }
 
 static void whowas_handlerename(int hooknum, void *arg) {
@@ -141,58 +364,40 @@ static void whowas_handlerename(int hooknum, void *arg) {
   nick *np = args[0];
   char *oldnick = args[1];
   whowas *ww;
-  nick *wnp;
 
-  ww = whowas_fromnick(np, 0);
+  ww = whowas_newrecord(np, oldnick, 0);
   ww->type = WHOWAS_RENAME;
-  wnp = &ww->nick;
-  ww->newnick = getsstring(wnp->nick, NICKLEN);
-  strncpy(wnp->nick, oldnick, NICKLEN + 1);
+  ww->newnick = whowas_getstring(np->nick, NICKLEN);
 }
 
 whowas *whowas_chase(const char *target, int maxage) {
   whowas *ww;
-  nick *wnp;
-  time_t now;
-  int i;
 
-  now = getnettime();
+  /* index buckets are in timestamp order, so the first match is the newest */
+  ww = whowas_indexfirst(WW_INDEX_NICK, target);
 
-  for (i = whowasoffset + whowasmax - 1; i >= whowasoffset; i--) {
-    ww = &whowasrecs[i % whowasmax];
-
-    if (ww->type == WHOWAS_UNUSED)
-      continue;
-
-    wnp = &ww->nick;
-
-    if (ww->timestamp < now - maxage)
-      break; /* records are in timestamp order, we're done */
-
-    if (ircd_strcmp(wnp->nick, target) == 0)
-      return ww;
-  }
+  if (!ww || ww->timestamp < getnettime() - maxage)
+    return NULL;
 
-  return NULL;
+  return ww;
 }
 
 const char *whowas_format(whowas *ww) {
-  nick *np = &ww->nick;
   static char buf[512];
   char timebuf[30];
   char hostmask[512];
 
   snprintf(hostmask, sizeof(hostmask), "%s!%s@%s%s%s [%s] (%s)",
-           np->nick, np->ident, np->host->name->content,
-           np->auth ? "/" : "", np->auth ? np->authname : "",
-           IPtostr(np->ipaddress),
-           printflags(np->umodes, umodeflags));
+           ww->nick->content, ww->ident->content, ww->host->content,
+           ww->authname ? "/" : "", ww->authname ? ww->authname->content : "",
+           IPtostr(ww->ipaddress),
+           printflags(ww->umodes, umodeflags));
   strftime(timebuf, sizeof(timebuf), "%d/%m/%y %H:%M:%S", localtime(&(ww->timestamp)));
 
   if (ww->type == WHOWAS_RENAME)
-    snprintf(buf, sizeof(buf), "[%s] NICK %s r(%s) -> %s", timebuf, hostmask, np->realname->name->content, ww->newnick->content);
+    snprintf(buf, sizeof(buf), "[%s] NICK %s r(%s) -> %s", timebuf, hostmask, ww->realname->content, ww->newnick->content);
   else
-    snprintf(buf, sizeof(buf), "[%s] %s %s r(%s): %s", timebuf, (ww->type == WHOWAS_QUIT) ? "QUIT" : "KILL", hostmask, np->realname->name->content, ww->reason->content);
+    snprintf(buf, sizeof(buf), "[%s] %s %s r(%s): %s", timebuf, (ww->type == WHOWAS_QUIT) ? "QUIT" : "KILL", hostmask, ww->realname->content, ww->reason->content);
 
   return buf;
 }
@@ -203,20 +408,17 @@ const char *whowas_formatchannels(whowas *ww) {
 
   strcpy(buf, "Channels: ");
 
-  for (i = 0; i < WW_MAXCHANNELS; i++) {
-    if (!ww->channels[i])
-      break;
-
+  for (i = 0; i < ww->channelcount; i++) {
     if (!first)
-      strncat(buf, ", ", sizeof(buf));
+      strncat(buf, ", ", sizeof(buf) - strlen(buf) - 1);
     else
       first = 0;
 
-    strncat(buf, ww->channels[i]->name->content, sizeof(buf));
+    strncat(buf, ww->channels[i]->name->content, sizeof(buf) - strlen(buf) - 1);
   }
 
-  if (!ww->channels[0])
-    strncat(buf, "(No channels.)", sizeof(buf));
+  if (!ww->channelcount)
+    strncat(buf, "(No channels.)", sizeof(buf) - strlen(buf) - 1);
 
   buf[sizeof(buf) - 1] = '\0';
 
@@ -244,13 +446,26 @@ unsigned int nextwhowasmarker() {
 }
 
 void _init(void) {
+  int i;
+
   {
     sstring *temp = getcopyconfigitem("whowas", "maxentries", XStringify(WW_DEFAULT_MAXENTRIES), 10);
     whowasmax = atoi(temp->content);
     freesstring(temp);
   }
+
+  if (whowasmax < 1)
+    whowasmax = WW_DEFAULT_MAXENTRIES;
+
   whowasrecs = calloc(whowasmax, sizeof(whowas));
 
+  wwstringhashsize = wwhashsize(whowasmax);
+  wwstringtable = calloc(wwstringhashsize, sizeof(wwstring *));
+
+  wwindexhashsize = wwhashsize(whowasmax);
+  for (i = 0; i < WW_INDEX_COUNT; i++)
+    wwindextable[i] = calloc(wwindexhashsize, sizeof(whowas *));
+
   registerhook(HOOK_NICK_QUIT, whowas_handlequitorkill);
   registerhook(HOOK_NICK_KILL, whowas_handlequitorkill);
   registerhook(HOOK_NICK_RENAME, whowas_handlerename);
@@ -259,6 +474,7 @@ void _init(void) {
 void _fini(void) {
   int i;
   whowas *ww;
+  whowasnick *wnp, *nwnp;
 
   deregisterhook(HOOK_NICK_QUIT, whowas_handlequitorkill);
   deregisterhook(HOOK_NICK_KILL, whowas_handlequitorkill);
@@ -270,4 +486,14 @@ void _fini(void) {
   }
 
   free(whowasrecs);
+
+  for (i = 0; i < WW_INDEX_COUNT; i++)
+    free(wwindextable[i]);
+
+  free(wwstringtable);
+
+  for (wnp = freewhowasnicks; wnp; wnp = nwnp) {
+    nwnp = wnp->nextfree;
+    free(wnp);
+  }
 }
@@ -1,16 +1,47 @@
 #ifndef __WHOWAS_H
 #define __WHOWAS_H
 
+#include <stdint.h>
+
 #define WW_MAXCHANNELS 20
 #define WW_DEFAULT_MAXENTRIES 1000
 #define WW_MASKLEN (HOSTLEN + USERLEN + NICKLEN)
 #define WW_REASONLEN 512
 
+/* secondary indices, kept in sync with the ring buffer */
+#define WW_INDEX_NICK 0
+#define WW_INDEX_HOST 1
+#define WW_INDEX_ACCOUNT 2
+#define WW_INDEX_COUNT 3
+
+/* Compact whowas record: all strings are interned (shared between records
+ * and released when the last record referencing them goes away) and the
+ * channel list is sized to fit. Use whowas_tonick() to get a nick view of
+ * a record. */
 typedef struct whowas {
-  int type;
+  unsigned char type;
+  unsigned char indexed;
+  unsigned char channelcount;
   time_t timestamp;
-  nick nick; /* unlinked nick */
-  chanindex *channels[WW_MAXCHANNELS];
+
+  long numeric;
+  flag_t umodes;
+  time_t nickts;
+  time_t accountts;
+  unsigned long userid;
+  struct irc_in_addr ipaddress;
+
+  sstring *nick;
+  sstring *ident;
+  sstring *host;
+  sstring *realname;
+  sstring *authname;
+  sstring *shident;
+  sstring *sethost;
+  sstring *opername;
+  sstring *away;
+
+  chanindex **channels;
 
   /* WHOWAS_QUIT or WHOWAS_KILL */
   sstring *reason;
@@ -20,8 +51,8 @@ typedef struct whowas {
 
   unsigned int marker;
 
-  struct whowas *next;
-  struct whowas *prev;
+  struct whowas *inext[WW_INDEX_COUNT];
+  struct whowas *iprev[WW_INDEX_COUNT];
 } whowas;
 
 extern whowas *whowasrecs;
@@ -38,11 +69,17 @@ whowas *whowas_fromnick(nick *np, int standalone);
 nick *whowas_tonick(whowas *ww);
 void whowas_freenick(nick *np);
 whowas *whowas_chase(const char *target, int maxage);
+whowas *whowas_indexfirst(int index, const char *key);
+whowas *whowas_indexnext(int index, whowas *ww, const char *key);
 const char *whowas_format(whowas *ww);
 const char *whowas_formatchannels(whowas *ww);
 void whowas_clean(whowas *ww);
 void whowas_free(whowas *ww);
 
+sstring *whowas_getstring(const char *str, int maxlen);
+void whowas_releasestring(sstring *ss);
+void whowas_stringstats(unsigned int *count, size_t *bytes);
+
 unsigned int nextwhowasmarker(void);
 
 #endif /* __WHOWAS_H */
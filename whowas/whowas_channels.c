@@ -1,5 +1,6 @@
 #include <string.h>
 #include <assert.h>
+#include <stdint.h>
 #include "../lib/version.h"
 #include "../nick/nick.h"
 #include "../chanindex/chanindex.h"
@@ -65,32 +66,41 @@ static void wwc_hook_newrecord(int hooknum, void *arg) {
   whowas *ww = args[0];
   nick *np = args[1];
   chanindex **wchans = np->exts[wwcnext];
-  int i;
+  int i, count;
 
-  memset(ww->channels, 0, sizeof(ww->channels));
+  ww->channels = NULL;
+  ww->channelcount = 0;
 
   if (!wchans)
     return;
 
-  for (i = 0; i < WW_MAXCHANNELS; i++) {
-    if (!wchans[i])
+  for (count = 0; count < WW_MAXCHANNELS; count++)
+    if (!wchans[count])
       break;
 
+  if (count == 0)
+    return;
+
+  ww->channels = malloc(sizeof(chanindex *) * count);
+
+  for (i = 0; i < count; i++) {
     wwc_refchannel(wchans[i]);
     ww->channels[i] = wchans[i];
   }
+
+  ww->channelcount = count;
 }
 
 static void wwc_hook_lostrecord(int hooknum, void *arg) {
   whowas *ww = arg;
   int i;
 
-  for (i = 0; i < WW_MAXCHANNELS; i++) {
-    if (!ww->channels[i])
-      break;
-
+  for (i = 0; i < ww->channelcount; i++)
     wwc_derefchannel(ww->channels[i]);
-  }
+
+  free(ww->channels);
+  ww->channels = NULL;
+  ww->channelcount = 0;
 }
 
 void _init(void) {
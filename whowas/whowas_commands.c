@@ -9,13 +9,31 @@
 
 MODULE_VERSION("");
 
+static int whowas_haswildcards(const char *str, size_t len) {
+  size_t i;
+
+  for (i = 0; i < len && str[i]; i++)
+    if (str[i] == '*' || str[i] == '?' || str[i] == '\\')
+      return 1;
+
+  return 0;
+}
+
+static void whowas_reportmatch(nick *sender, whowas *ww, int matches, int limit) {
+  if (matches <= limit) {
+    controlreply(sender, "%s", whowas_format(ww));
+    controlreply(sender, "%s", whowas_formatchannels(ww));
+  } else if (matches == limit + 1)
+    controlreply(sender, "--- More than %d matches, skipping the rest", limit);
+}
+
 static int whowas_cmdwhowas(void *source, int cargc, char **cargv) {
   nick *sender = source;
-  char *pattern;
+  char *pattern, *pos;
   whowas *ww;
-  nick *np;
-  int i;
+  int i, index = -1;
   char hostmask[WW_MASKLEN + 1];
+  char key[WW_MASKLEN + 1];
   int matches = 0, limit = 500;
 
   if (cargc < 1)
@@ -26,23 +44,35 @@ static int whowas_cmdwhowas(void *source, int cargc, char **cargv) {
   if (cargc > 1)
     limit = strtol(cargv[1], NULL, 10);
 
-  for (i = whowasoffset; i < whowasoffset + whowasmax; i++) {
-    ww = &whowasrecs[i % whowasmax];
+  /* Use the nick or host index if that part of the mask is a literal. */
+  pos = strchr(pattern, '!');
+  if (pos && pos != pattern && !whowas_haswildcards(pattern, pos - pattern) && pos - pattern <= NICKLEN) {
+    strncpy(key, pattern, pos - pattern);
+    key[pos - pattern] = '\0';
+    index = WW_INDEX_NICK;
+  } else if ((pos = strchr(pattern, '@')) && pos[1] && !whowas_haswildcards(pos + 1, strlen(pos + 1)) && strlen(pos + 1) <= HOSTLEN) {
+    strcpy(key, pos + 1);
+    index = WW_INDEX_HOST;
+  }
 
-    if (ww->type == WHOWAS_UNUSED)
-      continue;
+  if (index != -1) {
+    for (ww = whowas_indexfirst(index, key); ww; ww = whowas_indexnext(index, ww->inext[index], key)) {
+      snprintf(hostmask, sizeof(hostmask), "%s!%s@%s", ww->nick->content, ww->ident->content, ww->host->content);
+
+      if (match2strings(pattern, hostmask))
+        whowas_reportmatch(sender, ww, ++matches, limit);
+    }
+  } else {
+    for (i = whowasoffset; i < whowasoffset + whowasmax; i++) {
+      ww = &whowasrecs[i % whowasmax];
 
-    np = &ww->nick;
-    snprintf(hostmask, sizeof(hostmask), "%s!%s@%s", np->nick, np->ident, np->host->name->content);
+      if (ww->type == WHOWAS_UNUSED)
+        continue;
 
-    if (match2strings(pattern, hostmask)) {
-      matches++;
+      snprintf(hostmask, sizeof(hostmask), "%s!%s@%s", ww->nick->content, ww->ident->content, ww->host->content);
 
-      if (matches <= limit) {
-        controlreply(sender, "%s", whowas_format(ww));
-        controlreply(sender, "%s", whowas_formatchannels(ww));
-      } else if (matches == limit + 1)
-        controlreply(sender, "--- More than %d matches, skipping the rest", limit);
+      if (match2strings(pattern, hostmask))
+        whowas_reportmatch(sender, ww, ++matches, limit);
     }
   }
 
@@ -51,6 +81,53 @@ static int whowas_cmdwhowas(void *source, int cargc, char **cargv) {
   return CMD_OK;
 }
 
+static int whowas_cmdwhowasaccount(void *source, int cargc, char **cargv) {
+  nick *sender = source;
+  whowas *ww;
+  int matches = 0, limit = 500;
+
+  if (cargc < 1)
+    return CMD_USAGE;
+
+  if (cargc > 1)
+    limit = strtol(cargv[1], NULL, 10);
+
+  for (ww = whowas_indexfirst(WW_INDEX_ACCOUNT, cargv[0]); ww; ww = whowas_indexnext(WW_INDEX_ACCOUNT, ww->inext[WW_INDEX_ACCOUNT], cargv[0]))
+    whowas_reportmatch(sender, ww, ++matches, limit);
+
+  controlreply(sender, "--- Found %d entries.", matches);
+
+  return CMD_OK;
+}
+
+static int whowas_cmdwhowasstats(void *source, int cargc, char **cargv) {
+  nick *sender = source;
+  whowas *ww;
+  int i, used = 0;
+  unsigned long channels = 0;
+  unsigned int strings;
+  size_t stringbytes;
+
+  for (i = 0; i < whowasmax; i++) {
+    ww = &whowasrecs[i];
+
+    if (ww->type == WHOWAS_UNUSED)
+      continue;
+
+    used++;
+    channels += ww->channelcount;
+  }
+
+  whowas_stringstats(&strings, &stringbytes);
+
+  controlreply(sender, "Records      : %d/%d (%lu bytes per record)", used, whowasmax, (unsigned long)sizeof(whowas));
+  controlreply(sender, "Channel refs : %lu", channels);
+  controlreply(sender, "Strings      : %u unique (%lu bytes)", strings, (unsigned long)stringbytes);
+  controlreply(sender, "Done.");
+
+  return CMD_OK;
+}
+
 static int whowas_cmdwhowaschase(void *source, int cargc, char **cargv) {
   nick *sender = source;
   whowas *ww;
@@ -75,9 +152,13 @@ static int whowas_cmdwhowaschase(void *source, int cargc, char **cargv) {
 void _init(void) {
   registercontrolhelpcmd("whowas", NO_OPER, 2, &whowas_cmdwhowas, "Usage: whowas <mask> ?limit?\nLooks up information about recently disconnected users.");
   registercontrolhelpcmd("whowaschase", NO_OPER, 2, &whowas_cmdwhowaschase, "Usage: whowaschase <nick>\nFinds most-recent whowas record for a nick.");
+  registercontrolhelpcmd("whowasaccount", NO_OPER, 2, &whowas_cmdwhowasaccount, "Usage: whowasaccount <account> ?limit?\nLooks up whowas records for an account, newest first.");
+  registercontrolhelpcmd("whowasstats", NO_OPER, 0, &whowas_cmdwhowasstats, "Usage: whowasstats\nShows whowas history usage.");
 }
 
 void _fini(void) {
   deregistercontrolcmd("whowas", &whowas_cmdwhowas);
   deregistercontrolcmd("whowaschase", &whowas_cmdwhowaschase);
+  deregistercontrolcmd("whowasaccount", &whowas_cmdwhowasaccount);
+  deregistercontrolcmd("whowasstats", &whowas_cmdwhowasstats);
 }
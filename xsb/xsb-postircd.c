@@ -140,7 +140,7 @@ static void handlemaskprivmsg(int hooknum, void *args) {
     cargc = (cmd->maxparams) + 2;
   }
 
-  (cmd->handler)(source, cargc - 2, &cargv[2]);
+  callcommand(cmd, source, cargc - 2, &cargv[2]);
 }
 
 static void directsend(char *buf) {
@@ -233,7 +233,7 @@ void xsb_unicast(const char *command, nick *np, const char *format, ...) {
   va_end(va);
 
   /* TODO */
-  xsb_send("$%s :XSB1 %s %s", serverlist[homeserver(np->numeric)].name, command, buf);
+  xsb_send("$%s :XSB1 %s %s", serverlist[homeserver(np->numeric)].name->content, command, buf);
   /* xsb_send("%s :XSB1 %s %s", longtonumeric(np->numeric, 5), command, buf);*/
   
 }
@@ -176,7 +176,7 @@ static void handlemaskprivmsg(int hooknum, void *args) {
     cargc = (cmd->maxparams) + 2;
   }
 
-  (cmd->handler)(source, cargc - 2, &cargv[2]);
+  callcommand(cmd, source, cargc - 2, &cargv[2]);
 }
 
 static void directsend(struct messagequeue *q) {